@@ -1,20 +1,50 @@
 #include "log.h"
+#include "types.h"
 #include "6502.h"
 #include "mem.h"
 #include "ppu.h"
+#include "apu.h"
+#include "trace.h"
+#include "stats.h"
+#include "prof.h"
+#include "input.h"
+#include "state.h"
+#include "cheat.h"
+#include "gdb.h"
+#include <string.h>
+#ifdef NES_JIT
+#include "jit.h"
+#endif
 
 /* registers */
-uint8_t acc; // accumulator
-uint8_t x; // index x
-uint8_t y; // index y
-uint16_t pc; // prog counter
-uint8_t sp; // stack ptr
-uint8_t s; // status
-
-uint8_t op; // next op
-uint16_t a; // next op address
-uint16_t v; // next op value
-uint64_t cycles; // total cycles
+NES_TLS uint8_t acc; // accumulator
+NES_TLS uint8_t x; // index x
+NES_TLS uint8_t y; // index y
+NES_TLS uint16_t pc; // prog counter
+NES_TLS uint8_t sp; // stack ptr
+NES_TLS uint8_t s; // status
+
+NES_TLS uint8_t op; // next op
+NES_TLS uint16_t a; // next op address
+NES_TLS uint16_t v; // next op value
+NES_TLS uint64_t cycles; // total cycles
+NES_TLS uint8_t irq_line; // asserted IRQ sources
+
+/* idle loop detection */
+#define IDLE_SPAN 16 // max length of a polling loop, in bytes
+NES_TLS uint64_t idle_deadline; // skip no further than this cycle, 0 = disabled
+NES_TLS uint64_t idle_skipped; // total cycles skipped
+NES_TLS uint8_t idle_dirty; // loop wrote memory or touched a volatile register
+NES_TLS uint16_t idle_pc; // branch of the recorded iteration
+NES_TLS uint64_t idle_cyc; // cycle of the recorded iteration
+NES_TLS uint8_t idle_regs[5]; // acc, x, y, sp, s of the recorded iteration
+
+#define CPU_STATE(X) X(acc) X(x) X(y) X(pc) X(sp) X(s) X(cycles) X(irq_line)
+
+NES_TLS uint8_t lockstep; // compare the cores, halt on divergence
+NES_TLS uint8_t halted; // stopped at a divergence, or killed by the debugger
+NES_TLS uint32_t bad_ops; // unknown opcodes run since power up
+NES_TLS uint8_t *cover = NULL; // COVER_SZ hit counts, see cover_6502()
 
 /* heleprs for get status flag */
 #define S_CARRY (s & (uint8_t) 0b00000001)
@@ -90,6 +120,47 @@ case opcode: {\
     break;\
 }
 
+static uint8_t hooked_read(uint16_t addr);
+static void hooked_wrt(uint16_t addr, uint8_t val);
+
+/**
+ * @brief read from a region of the CPU address space
+ * 
+ * @param addr address
+ * @param region addr >> 13, | CHEAT_HOOK for a hooked page
+ * @return uint8_t value
+ */
+static inline uint8_t bus_read(uint16_t addr, unsigned region) {
+    switch (region) {
+        case 0: return memread(addr & 0x07FF);
+        case 1: {
+            stats_cur.ppu_reads[addr & 7]++;
+            // reading PPUSTATUS twice is the same as reading it once
+            if ((addr & 7) != 2) idle_dirty = 1;
+            prof_sub = PROF_IO_PPU;
+            uint8_t val = ppu_get_reg(addr);
+            prof_sub = PROF_CPU;
+            return val;
+        }
+        case 2: {
+            idle_dirty = 1;
+            if (addr == 0x4016 || addr == 0x4017) return input_read(addr & 1);
+            if (addr == 0x4015) {
+                prof_sub = PROF_IO_APU;
+                uint8_t val = apu_read(addr);
+                prof_sub = PROF_CPU;
+                return val;
+            }
+            // write-only APU registers and nothing mapped up to $5FFF: open
+            // bus, taken as $FF
+            return 255;
+        }
+        case 3: return prgram_read(addr & 0x1FFF);
+        case 4: case 5: case 6: case 7: return memread(addr);
+        default: return hooked_read(addr);
+    }
+}
+
 /**
  * @brief read from CPU address
  * 
@@ -97,41 +168,159 @@ case opcode: {\
  * @return uint8_t value
  */
 static inline uint8_t cpuread(uint16_t addr) {
+    stats_cur.reads[addr >> 13]++;
+    return bus_read(addr, (addr >> 13) | cheat_rpage[addr >> 8]);
+}
+
+/**
+ * @brief read from a page with cheats on it
+ * 
+ * @param addr address
+ * @return uint8_t value
+ */
+static uint8_t hooked_read(uint16_t addr) {
+    return cheat_read(addr, bus_read(addr, addr >> 13));
+}
+
+/**
+ * @brief read from CPU address without side effects, I/O reads as 0
+ * 
+ * @param addr address
+ * @return uint8_t value
+ */
+static inline uint8_t peek(uint16_t addr) {
     switch (addr >> 13) {
         case 0: return memread(addr & 0x07FF);
-        case 1: return ppu_get_reg(addr);
-        case 2: return 255; // TODO
-        case 3: return memread(addr & 0x1FFF);
+        case 1:
+        case 2: return 0;
+        case 3: return prgram_read(addr & 0x1FFF);
         default: return memread(addr);
     }
-    return memread(addr);
 }
 
 /**
- * @brief write to CPU address
+ * @brief OAM DMA from a CPU page
+ * 
+ * @param page source page
+ */
+static void oam_dma(uint8_t page) {
+    int hooked = cheat_rpage[page] != 0;
+    if (page < 0x20 && !hooked) {
+        ppu_oam_dma(memptr((page & 0x07) << 8));
+    } else if (page >= 0x80 && !hooked) {
+        ppu_oam_dma(memptr(page << 8));
+    } else if (page >= 0x60 && !hooked) {
+        ppu_oam_dma(prgram_ptr((page & 0x1F) << 8));
+    } else {
+        // I/O or patched, go through cpuread
+        uint8_t buf[0x100];
+        for (int i = 0; i < 0x100; i++) buf[i] = cpuread((page << 8) + i);
+        ppu_oam_dma(buf);
+    }
+
+    // 1 halt cycle, +1 to align to an even cycle, 256 read/write pairs
+    cycles += 513 + (cycles & 1);
+}
+
+/**
+ * @brief write to a region of the CPU address space
  * 
  * @param addr address
  * @param val value
+ * @param region addr >> 13, | CHEAT_HOOK for a hooked page
  */
-static inline void cpuwrt(uint16_t addr, uint8_t val) {
-    int i;
-    if (addr == 0x4014) {
-        for (i = 0; i < 256; i++) {
-            ppu_sprram_write(cpuread((0x100 * val) + i));
-            //ppu_sprram_write(cpu_ram_read((0x100 * data) + i));
-        }
-        return;
-    }
-    switch (addr >> 13) {
+static inline void bus_wrt(uint16_t addr, uint8_t val, unsigned region) {
+    switch (region) {
         case 0: return memwrt(addr & 0x07FF, val);
-        case 1: return ppu_set_reg(addr, val);
-        case 2: return; // TODO
-        case 3: return memwrt(addr & 0x1FFF, val);
-        default: {
+        case 1: {
+            stats_cur.ppu_writes[addr & 7]++;
+            prof_sub = PROF_IO_PPU;
+            ppu_set_reg(addr, val);
+            prof_sub = PROF_CPU;
+            return;
+        }
+        case 2: {
+            if (addr == 0x4016) input_write(val);
+            if (addr < 0x4018 && addr != 0x4016) {
+                prof_sub = PROF_IO_APU;
+                apu_write(addr, val);
+                prof_sub = PROF_CPU;
+            }
+            return;
+        }
+        case 3: return prgram_wrt(addr & 0x1FFF, val);
+        case 4: case 5: case 6: case 7: {
             log_warn("prg-rom write!\n");
+#ifdef NES_JIT
+            jit_invalidate();
+#endif
             return memwrt(addr, val);
         }
+        default: return hooked_wrt(addr, val);
+    }
+}
+
+/**
+ * @brief write to CPU address
+ * 
+ * @param addr address
+ * @param val value
+ */
+static inline void cpuwrt(uint16_t addr, uint8_t val) {
+    idle_dirty = 1;
+    stats_cur.writes[addr >> 13]++;
+    if (addr == 0x4014) return oam_dma(val);
+    bus_wrt(addr, val, (addr >> 13) | cheat_wpage[addr >> 8]);
+}
+
+/**
+ * @brief write to a page with freezes or watches on it
+ * 
+ * @param addr address
+ * @param val value
+ */
+static void hooked_wrt(uint16_t addr, uint8_t val) {
+    bus_wrt(addr, cheat_write(addr, peek(addr), val), addr >> 13);
+}
+
+/**
+ * @brief check for a side-effect-free polling loop on a taken backward branch
+ * 
+ * an iteration that writes nothing, reads only RAM, ROM or PPUSTATUS and ends
+ * with the same registers as the previous one will repeat until something
+ * outside the CPU changes, so whole iterations can be skipped up to the next
+ * event without changing the outcome or the cycle count.
+ * 
+ * @param from address following the branch
+ */
+static inline void idle_check(uint16_t from) {
+    uint8_t regs[5] = { acc, x, y, sp, s };
+
+    if (idle_pc == from && !idle_dirty && !memcmp(regs, idle_regs, sizeof(regs))) {
+        uint64_t period = cycles - idle_cyc;
+        uint64_t deadline = idle_deadline < apu_irq_cycle ? idle_deadline : apu_irq_cycle;
+        if (period && deadline > cycles) {
+            // stop short of the deadline; the caller runs the rest
+            uint64_t n = (deadline - cycles - 1) / period;
+            cycles += n * period;
+            idle_skipped += n * period;
+        }
+    } else {
+        idle_pc = from;
+        memcpy(idle_regs, regs, sizeof(regs));
     }
+
+    idle_cyc = cycles;
+    idle_dirty = 0;
+}
+
+/* take a branch */
+#define BRANCH(c) \
+{\
+    if (c) {\
+        uint16_t from = pc; pc = a;\
+        if (idle_deadline && a < from && from - a <= IDLE_SPAN) idle_check(from);\
+    }\
 }
 
 /** begin AM_* **/
@@ -312,14 +501,14 @@ static inline void OP_ROLA() {
 #define OP_PLP() s = POP(); SE_R(); CL_B();
 // jmp/branch
 #define OP_JMP() pc = a;
-#define OP_BEQ() if (S_ZERO) pc = a;
-#define OP_BNE() if (!S_ZERO) pc = a;
-#define OP_BCS() if (S_CARRY) pc = a;
-#define OP_BCC() if (!S_CARRY) pc = a;
-#define OP_BMI() if (S_NEG) pc = a;
-#define OP_BPL() if (!S_NEG) pc = a;
-#define OP_BVS() if (S_OVFL) pc = a;
-#define OP_BVC() if (!S_OVFL) pc = a;
+#define OP_BEQ() BRANCH(S_ZERO);
+#define OP_BNE() BRANCH(!S_ZERO);
+#define OP_BCS() BRANCH(S_CARRY);
+#define OP_BCC() BRANCH(!S_CARRY);
+#define OP_BMI() BRANCH(S_NEG);
+#define OP_BPL() BRANCH(!S_NEG);
+#define OP_BVS() BRANCH(S_OVFL);
+#define OP_BVC() BRANCH(!S_OVFL);
 static inline void OP_JSR() {
     uint16_t lp = pc - 1;
     PSH(lp >> 8);
@@ -414,6 +603,89 @@ extern inline void interrupt_6502() {
     pc = ((uint16_t) cpuread(I_NMI) | (uint16_t) ((uint16_t) cpuread(I_NMI + 1) << 8));
 }
 
+/**
+ * @brief set or clear an IRQ source
+ * 
+ * @param src IRQ_* source
+ * @param level 1 to assert, 0 to release
+ */
+void irq_6502(uint8_t src, int level) {
+    if (level) irq_line |= src;
+    else irq_line &= ~src;
+}
+
+/**
+ * @brief CPU IRQ
+ * 
+ */
+static inline void do_irq() {
+    PSH(pc >> 8);
+    PSH(pc);
+    PSH((s & 0b11101111) | 0b00100000);
+    SE_ID();
+    pc = ((uint16_t) cpuread(I_BRK) | (uint16_t) ((uint16_t) cpuread(I_BRK + 1) << 8));
+    cycles += 7;
+}
+
+/**
+ * @brief stall the CPU (DMA)
+ * 
+ * @param n num of cycles
+ */
+void stall_6502(uint32_t n) {
+    cycles += n;
+    idle_dirty = 1;
+}
+
+/**
+ * @brief allow idle loops to be skipped up to the given cycle
+ * 
+ * must be called whenever state outside the CPU (e.g. the PPU) changes, as it
+ * also forgets the recorded loop iteration.
+ * 
+ * @param deadline cycle of the next external event, 0 to disable skipping
+ */
+void idle_6502(uint64_t deadline) {
+    // skipped iterations would run past breakpoints
+    idle_deadline = gdb_armed ? 0 : deadline;
+    idle_dirty = 1;
+}
+
+/**
+ * @brief Save the CPU state.
+ * 
+ * @param p output, NULL to get the size only.
+ * @return size_t size.
+ */
+size_t save_6502(uint8_t *p) {
+    size_t n = 0;
+    CPU_STATE(STATE_SAVE)
+    return n;
+}
+
+/**
+ * @brief Load the CPU state.
+ * 
+ * @param p saved state.
+ * @return size_t size.
+ */
+size_t load_6502(const uint8_t *p) {
+    size_t n = 0;
+    CPU_STATE(STATE_LOAD)
+    // the recorded loop iteration is from another timeline
+    idle_dirty = 1;
+    return n;
+}
+
+/**
+ * @brief Get num of cycles skipped in idle loops.
+ * 
+ * @return uint64_t cycles.
+ */
+uint64_t idle_cycles_6502() {
+    return idle_skipped;
+}
+
 /**
  * @brief init CPU
  * 
@@ -421,10 +693,43 @@ extern inline void interrupt_6502() {
 inline void init_6502() {
     s = 0b00100100;
     sp = 0;
+    irq_line = 0;
+    idle_dirty = 1;
     a = x = y = 0;
+    bad_ops = 0;
     reset_6502();
 }
 
+/**
+ * @brief Get num of unknown opcodes run since power up.
+ * 
+ * @return uint32_t count
+ */
+uint32_t bad_ops_6502() {
+    return bad_ops;
+}
+
+/**
+ * @brief Count the instructions run at each PC, e.g. for a fuzzer.
+ * 
+ * mapper 0 has a single PRG bank, so the PC is the key; a banked mapper
+ * has to fold its bank number in.
+ * 
+ * @param map COVER_SZ saturating counts, NULL to stop counting.
+ */
+void cover_6502(uint8_t *map) {
+    cover = map;
+}
+
+/**
+ * @brief Get the program counter.
+ * 
+ * @return uint16_t pc, the block start while compiled code runs.
+ */
+uint16_t pc_6502() {
+    return pc;
+}
+
 /**
  * @brief Get current CPU cycle count.
  * 
@@ -434,17 +739,109 @@ inline uint64_t cycles_6502() {
     return cycles;
 }
 
+/**
+ * @brief Get the registers.
+ * 
+ * @param r output.
+ */
+void regs_6502(regs_6502_t *r) {
+    r->a = acc;
+    r->x = x;
+    r->y = y;
+    r->p = s;
+    r->sp = sp;
+    r->pc = pc;
+}
+
+/**
+ * @brief Set the registers.
+ * 
+ * @param r registers.
+ */
+void set_regs_6502(const regs_6502_t *r) {
+    acc = r->a;
+    x = r->x;
+    y = r->y;
+    s = r->p;
+    sp = r->sp;
+    pc = r->pc;
+}
+
+/**
+ * @brief Read CPU memory without side effects, I/O reads as 0.
+ * 
+ * @param addr address.
+ * @return uint8_t value.
+ */
+uint8_t peek_6502(uint16_t addr) {
+    return peek(addr);
+}
+
+/**
+ * @brief Write CPU memory without side effects, ROM included.
+ * 
+ * @param addr address.
+ * @param val value.
+ * @return int status
+ * @retval -1 I/O, not written
+ * @retval 0 OK
+ */
+int poke_6502(uint16_t addr, uint8_t val) {
+    switch (addr >> 13) {
+        case 0: memwrt(addr & 0x07FF, val); return 0;
+        case 1:
+        case 2: return -1;
+        case 3: prgram_wrt(addr & 0x1FFF, val); return 0;
+        default: {
+#ifdef NES_JIT
+            jit_invalidate();
+#endif
+            memwrt(addr, val);
+            return 0;
+        }
+    }
+}
+
+/**
+ * @brief record the state before an instruction
+ * 
+ */
+static void trace_insn() {
+    trace_rec_t *r = trace_next();
+    r->cycle = cycles;
+    r->pc = pc;
+    r->op = peek(pc);
+    r->b1 = peek(pc + 1);
+    r->b2 = peek(pc + 2);
+    r->a = acc;
+    r->x = x;
+    r->y = y;
+    r->p = s;
+    r->sp = sp;
+    ppu_position(&r->line, &r->dot);
+}
+
 /**
  * @brief Run one instruction
  * 
  */
 inline void run_6502() {
+    if (cycles >= apu_irq_cycle) {
+        prof_sub = PROF_APU;
+        apu_sync(cycles);
+        prof_sub = PROF_CPU;
+    }
+    if (irq_line && !S_ID) do_irq();
+
+    if (trace_on) trace_insn();
+    if (cover && cover[pc] != 0xFF) cover[pc]++;
+    if (gdb_armed && gdb_insn(pc) < 0) {
+        halted = 1;
+        return;
+    }
+    stats_cur.insns++;
+
     uint8_t op = cpuread(pc++);
-#ifdef DEBUG_6502
-    if (cycles >= DEBUG_CYCLE) {
-        printf("op: %.2x, a: %u, v: %u, acc: %u, x: %u, y: %u, pc: %u, sp: %u, s: %u, cyc: %llu.\n", op, a, v, acc, x, y, pc, sp, s, cycles);
-    } else fprintf(stderr, "op: %.2x, a: %u, v: %u, acc: %u, x: %u, y: %u, pc: %u, sp: %u, s: %u, cyc: %llu.\n", op, a, v, acc, x, y, pc, sp, s, cycles);
-#endif
     switch(op) {
         OP(0x00, IMP, BRK, 7) OP(0x01, INX, ORA, 6) OP(0x03, INX, SLO, 8) OP(0x04, ZPG, NOP, 2) OP(0x05, ZPG, ORA, 3) 
         OP(0x06, ZPG, ASL, 5) OP(0x07, ZPG, SLO, 5) OP(0x08, IMP, PHP, 3) OP(0x09, IMM, ORA, 2) OP(0x0A, IMP, ASLA, 2) 
@@ -496,7 +893,122 @@ inline void run_6502() {
         OP(0xF7, ZPX, ISB, 6) OP(0xF8, IMP, SED, 2) OP(0xF9, ABY, SBC, 4) OP(0xFA, IMP, NOP, 2) OP(0xFB, ABY, ISB, 7) 
         OP(0xFC, ABX, NOP, 4) OP(0xFD, ABX, SBC, 4) OP(0xFE, ABX, INC, 7) OP(0xFF, ABX, ISB, 7)  
         default: {
+            bad_ops++;
             log_error("cpu got bad opcode %.2x\n", op);
         }
     }
-}
\ No newline at end of file
+}
+#ifdef NES_JIT
+/**
+ * @brief run a compiled block, then replay it on the interpreter and compare
+ * 
+ * @param blk block
+ * @param limit cycle limit
+ * @return int status
+ * @retval -1 diverged
+ * @retval 0 OK
+ */
+static int jit_check(void *blk, uint64_t limit) {
+    static uint8_t ram0[0x800], ram1[0x800];
+    uint8_t r0[5] = { acc, x, y, sp, s };
+    uint16_t pc0 = pc;
+    uint64_t c0 = cycles, dl = idle_deadline;
+
+    memcpy(ram0, memptr(0), sizeof(ram0));
+    jit_run(blk, limit);
+    uint8_t r1[5] = { acc, x, y, sp, s };
+    uint16_t pc1 = pc;
+    uint64_t c1 = cycles;
+    memcpy(ram1, memptr(0), sizeof(ram1));
+
+    // blocks only touch the CPU and RAM, so this is a full rewind
+    acc = r0[0]; x = r0[1]; y = r0[2]; sp = r0[3]; s = r0[4];
+    pc = pc0;
+    cycles = c0;
+    mmemcpy(0, ram0, sizeof(ram0));
+    idle_deadline = 0;
+    uint64_t t0 = trace_count();
+    while (cycles < c1) run_6502();
+    idle_deadline = dl;
+
+    uint8_t r2[5] = { acc, x, y, sp, s };
+    if (pc == pc1 && cycles == c1 && !memcmp(r1, r2, sizeof(r1)) && !memcmp(ram1, memptr(0), sizeof(ram1))) return 0;
+
+    log_error("jit: block at %.4x diverged: pc %.4x/%.4x, cycles %llu/%llu, "
+        "a %u/%u, x %u/%u, y %u/%u, sp %u/%u, s %.2x/%.2x.\n", pc0, pc1, pc,
+        (unsigned long long) c1, (unsigned long long) cycles, r1[0], r2[0], r1[1], r2[1],
+        r1[2], r2[2], r1[3], r2[3], r1[4], r2[4]);
+    if (lockstep) {
+        // the interpreter's view of the block
+        trace_print(stderr, t0, trace_count());
+        halted = 1;
+    }
+    jit_reject(pc0);
+    return -1;
+}
+
+/**
+ * @brief run compiled code at pc, if any
+ * 
+ * @param end cycle to stop at
+ * @return int 1 if a block was run
+ */
+static int jit_step(uint64_t end) {
+    // interrupts and APU events are left to the interpreter
+    if (cycles >= apu_irq_cycle || (irq_line && !S_ID)) return 0;
+
+    void *blk = jit_block(pc);
+    if (blk == NULL) return 0;
+
+    uint64_t limit = end < apu_irq_cycle ? end : apu_irq_cycle, c0 = cycles;
+    prof_sub = PROF_JIT;
+    if (lockstep || jit_verifying()) jit_check(blk, limit);
+    else jit_run(blk, limit);
+    prof_sub = PROF_CPU;
+
+    // blocks don't track what they touch
+    idle_dirty = 1;
+    stats_cur.jit_blocks++;
+    stats_cur.jit_cycles += cycles - c0;
+
+    // the first instruction left to the interpreter (e.g. I/O through an index)
+    return cycles != c0;
+}
+#endif
+
+/**
+ * @brief run both cores in lockstep and halt at the first divergence
+ * 
+ * the cores are compared a block at a time; the interpreter's trace of the
+ * diverging block is printed when tracing is on.
+ * 
+ * @param on 1 to enable
+ */
+void lockstep_6502(int on) {
+#ifndef NES_JIT
+    if (on) log_warn("lockstep: no second core, build with JIT=1.\n");
+#endif
+    lockstep = on;
+    halted = 0;
+}
+
+/**
+ * @brief run instructions until the cycle count reaches end
+ * 
+ * @param end cycle
+ * @return int status
+ * @retval -1 halted by lockstep or the debugger
+ * @retval 0 OK
+ */
+int run_until_6502(uint64_t end) {
+    while (cycles < end) {
+        if (halted) return -1;
+#ifdef NES_JIT
+        // compiled blocks don't go through the cheats, the debugger, coverage
+        // or the trace; checked blocks are traced by their replay
+        if (!cheat_active && !gdb_armed && !cover && (!trace_on || lockstep || jit_verifying()) && jit_step(end)) continue;
+#endif
+        run_6502();
+    }
+    return 0;
+}
@@ -1,13 +1,41 @@
 #ifndef NES_6502_H
 #define NES_6502_H
 #include <stdint.h>
+#include <unistd.h>
+
+/* IRQ sources */
+#define IRQ_APU_FRAME 0b00000001
+#define IRQ_APU_DMC   0b00000010
+
+#define COVER_SZ 0x10000 // a count per PC, see cover_6502()
+
+/* registers, e.g. for a debugger */
+typedef struct regs_6502 {
+    uint8_t a, x, y, p, sp;
+    uint16_t pc;
+} regs_6502_t;
 
 void reset_6502();
 void init_6502();
 void reset_6502();
 void run_6502();
+int run_until_6502(uint64_t end);
 uint64_t cycles_6502();
+uint16_t pc_6502();
 void status_6502();
 void interrupt_6502();
+void irq_6502(uint8_t src, int level);
+void stall_6502(uint32_t n);
+void idle_6502(uint64_t deadline);
+uint64_t idle_cycles_6502();
+uint32_t bad_ops_6502();
+void cover_6502(uint8_t *map);
+void regs_6502(regs_6502_t *r);
+void set_regs_6502(const regs_6502_t *r);
+uint8_t peek_6502(uint16_t addr);
+int poke_6502(uint16_t addr, uint8_t val);
+void lockstep_6502(int on);
+size_t save_6502(uint8_t *p);
+size_t load_6502(const uint8_t *p);
 
-#endif // NES_6502_H
\ No newline at end of file
+#endif // NES_6502_H
@@ -0,0 +1,713 @@
+#include <math.h> // before log.h, which defines __log
+#include "apu.h"
+#include "6502.h"
+#include "mem.h"
+#include "log.h"
+#include "types.h"
+#include "state.h"
+#include <pthread.h>
+#include <memory.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* band-limited step synthesis */
+#define BLEP_PHASES 32
+#define BLEP_TAPS   16
+#define BLEP_BUFSZ  4096 // > samples per frame at any sane rate, plus taps
+
+/* linear approximation of the mixer, per unit of channel output */
+#define W_PULSE    0.00752f
+#define W_TRIANGLE 0.00851f
+#define W_NOISE    0.00494f
+#define W_DMC      0.00335f
+
+/* DC blocker pole, ~38Hz at 48kHz */
+#define HP_POLE 0.995f
+
+static const uint8_t len_tab[32] = {
+    10, 254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
+    12,  16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+
+static const uint8_t duty_tab[4][8] = {
+    { 0, 1, 0, 0, 0, 0, 0, 0 },
+    { 0, 1, 1, 0, 0, 0, 0, 0 },
+    { 0, 1, 1, 1, 1, 0, 0, 0 },
+    { 1, 0, 0, 1, 1, 1, 1, 1 }
+};
+
+static const uint8_t tri_tab[32] = {
+    15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15
+};
+
+// in CPU cycles
+static const uint16_t noise_tab[16] = {
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
+};
+
+// in CPU cycles
+static const uint16_t dmc_tab[16] = {
+    428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54
+};
+
+// frame sequencer steps, in CPU cycles from the $4017 write
+static const uint32_t seq4_tab[4] = { 7457, 14913, 22371, 29829 };
+static const uint32_t seq5_tab[5] = { 7457, 14913, 22371, 29829, 37281 };
+#define SEQ4_PERIOD 29830
+#define SEQ5_PERIOD 37282
+
+typedef struct env env_t;
+struct env {
+    uint8_t start, loop, constant, vol, div, decay;
+};
+
+typedef struct pulse pulse_t;
+struct pulse {
+    env_t env;
+    uint8_t duty, phase, len, halt;
+    uint8_t sweep_en, sweep_period, sweep_neg, sweep_shift, sweep_div, sweep_reload;
+    uint8_t ones; // pulse 1 negates with ones' complement
+    uint16_t timer;
+    uint64_t next; // cycle of the next timer clock
+    int amp;
+};
+
+typedef struct triangle triangle_t;
+struct triangle {
+    uint8_t control, lin_load, lin, lin_reload, len, step;
+    uint16_t timer;
+    uint64_t next;
+    int amp;
+};
+
+typedef struct noise noise_t;
+struct noise {
+    env_t env;
+    uint8_t mode, period, len, halt;
+    uint16_t lfsr;
+    uint64_t next;
+    int amp;
+};
+
+typedef struct dmc dmc_t;
+struct dmc {
+    uint8_t irq_en, loop, rate, level;
+    uint16_t addr_load, len_load, addr, remain;
+    uint8_t buf, buf_full, shift, bits, silence;
+    uint64_t next;
+    int amp;
+};
+
+static NES_TLS pulse_t pulse[2];
+static NES_TLS triangle_t tri;
+static NES_TLS noise_t noise;
+static NES_TLS dmc_t dmc;
+
+// frame sequencer
+static NES_TLS uint8_t seq_mode5, seq_irq_inhibit, seq_step;
+static NES_TLS uint64_t seq_t0, seq_next;
+static NES_TLS uint8_t frame_irq, dmc_irq;
+
+// enabled channels ($4015)
+static NES_TLS uint8_t enabled;
+
+// time the APU has been run up to
+static NES_TLS uint64_t apu_time;
+NES_TLS uint64_t apu_irq_cycle = UINT64_MAX;
+
+// DMA cycles to charge to the CPU
+static NES_TLS uint32_t stall;
+
+// BLEP buffer
+static float blep[BLEP_PHASES][BLEP_TAPS];
+static NES_TLS float buf[BLEP_BUFSZ + BLEP_TAPS];
+static NES_TLS uint64_t buf_t0;
+static NES_TLS double buf_frac, spc; // samples per cycle
+static NES_TLS float integ, hp_x, hp_y;
+
+#define APU_STATE(X) X(pulse) X(tri) X(noise) X(dmc) X(seq_mode5) X(seq_irq_inhibit) X(seq_step) \
+    X(seq_t0) X(seq_next) X(frame_irq) X(dmc_irq) X(enabled) X(apu_time) X(apu_irq_cycle) X(stall) \
+    X(buf) X(buf_t0) X(buf_frac) X(spc) X(integ) X(hp_x) X(hp_y)
+
+/**
+ * @brief build the band-limited impulse table
+ *
+ */
+static void blep_init() {
+    const double fc = 0.45; // cutoff, fraction of the output rate
+    for (int p = 0; p < BLEP_PHASES; p++) {
+        double sum = 0, k[BLEP_TAPS];
+        for (int i = 0; i < BLEP_TAPS; i++) {
+            double t = i - (BLEP_TAPS / 2 - 1) - (double) p / BLEP_PHASES;
+            double sinc = t == 0 ? 2 * fc : sin(2 * M_PI * fc * t) / (M_PI * t);
+            // blackman window
+            double w = (t + BLEP_TAPS / 2) / BLEP_TAPS;
+            double win = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+            k[i] = sinc * win;
+            sum += k[i];
+        }
+        for (int i = 0; i < BLEP_TAPS; i++) blep[p][i] = k[i] / sum;
+    }
+}
+
+/**
+ * @brief add a band-limited step to the output
+ *
+ * @param t CPU cycle of the step
+ * @param delta height of the step
+ */
+static inline void blep_add(uint64_t t, float delta) {
+    double pos = (t - buf_t0) * spc + buf_frac;
+    int i = (int) pos;
+    if (i >= BLEP_BUFSZ) return; // frame far too long, drop
+    const float *k = blep[(int) ((pos - i) * BLEP_PHASES)];
+    float *d = buf + i;
+#ifdef __SSE2__
+    __m128 v = _mm_set1_ps(delta);
+    for (int j = 0; j < BLEP_TAPS; j += 4) {
+        _mm_storeu_ps(d + j, _mm_add_ps(_mm_loadu_ps(d + j), _mm_mul_ps(v, _mm_loadu_ps(k + j))));
+    }
+#else
+    for (int j = 0; j < BLEP_TAPS; j++) d[j] += delta * k[j];
+#endif
+}
+
+/** begin channels **/
+static inline void env_clock(env_t *e) {
+    if (e->start) {
+        e->start = 0;
+        e->decay = 15;
+        e->div = e->vol;
+    } else if (e->div == 0) {
+        e->div = e->vol;
+        if (e->decay) e->decay--;
+        else if (e->loop) e->decay = 15;
+    } else e->div--;
+}
+
+static inline uint8_t env_vol(const env_t *e) {
+    return e->constant ? e->vol : e->decay;
+}
+
+static inline uint16_t pulse_target(const pulse_t *p) {
+    uint16_t c = p->timer >> p->sweep_shift;
+    if (!p->sweep_neg) return p->timer + c;
+    return p->timer - c - p->ones;
+}
+
+static inline int pulse_muted(const pulse_t *p) {
+    return p->timer < 8 || (!p->sweep_neg && pulse_target(p) > 0x7FF);
+}
+
+static inline void pulse_update(pulse_t *p, uint64_t t) {
+    int amp = (p->len && !pulse_muted(p) && duty_tab[p->duty][p->phase]) ? env_vol(&p->env) : 0;
+    if (amp != p->amp) {
+        blep_add(t, (amp - p->amp) * W_PULSE);
+        p->amp = amp;
+    }
+}
+
+static void pulse_run(pulse_t *p, uint64_t end) {
+    uint64_t period = (p->timer + 1) * 2;
+    if (p->next >= end) return;
+    if (!p->len || pulse_muted(p) || env_vol(&p->env) == 0) {
+        // silent, just keep the sequencer phase going
+        uint64_t n = (end - p->next + period - 1) / period;
+        p->phase = (p->phase + n) & 7;
+        p->next += n * period;
+        return;
+    }
+    for (; p->next < end; p->next += period) {
+        p->phase = (p->phase + 1) & 7;
+        pulse_update(p, p->next);
+    }
+}
+
+static void pulse_sweep(pulse_t *p) {
+    if (p->sweep_div == 0 && p->sweep_en && p->sweep_shift && !pulse_muted(p)) {
+        p->timer = pulse_target(p);
+    }
+    if (p->sweep_div == 0 || p->sweep_reload) {
+        p->sweep_div = p->sweep_period;
+        p->sweep_reload = 0;
+    } else p->sweep_div--;
+}
+
+static inline void tri_update(uint64_t t) {
+    int amp = tri_tab[tri.step];
+    if (amp != tri.amp) {
+        blep_add(t, (amp - tri.amp) * W_TRIANGLE);
+        tri.amp = amp;
+    }
+}
+
+static void tri_run(uint64_t end) {
+    uint64_t period = tri.timer + 1;
+    if (tri.next >= end) return;
+    if (!tri.len || !tri.lin || tri.timer < 2) {
+        // halted (or ultrasonic): the output holds
+        tri.next += ((end - tri.next + period - 1) / period) * period;
+        return;
+    }
+    for (; tri.next < end; tri.next += period) {
+        tri.step = (tri.step + 1) & 31;
+        tri_update(tri.next);
+    }
+}
+
+static inline void noise_update(uint64_t t) {
+    int amp = (noise.len && !(noise.lfsr & 1)) ? env_vol(&noise.env) : 0;
+    if (amp != noise.amp) {
+        blep_add(t, (amp - noise.amp) * W_NOISE);
+        noise.amp = amp;
+    }
+}
+
+static void noise_run(uint64_t end) {
+    uint64_t period = noise_tab[noise.period];
+    uint8_t tap = noise.mode ? 6 : 1;
+    if (noise.next >= end) return;
+    if (!noise.len || env_vol(&noise.env) == 0) {
+        // silent: the shift register only matters once audible again, so
+        // don't spend a loop iteration per 4 cycles on it
+        noise.next += ((end - noise.next + period - 1) / period) * period;
+        return;
+    }
+    for (; noise.next < end; noise.next += period) {
+        uint16_t fb = (noise.lfsr ^ (noise.lfsr >> tap)) & 1;
+        noise.lfsr = (noise.lfsr >> 1) | (fb << 14);
+        noise_update(noise.next);
+    }
+}
+
+static void dmc_restart() {
+    dmc.addr = dmc.addr_load;
+    dmc.remain = dmc.len_load;
+}
+
+static void dmc_fetch() {
+    if (dmc.buf_full || !dmc.remain) return;
+    dmc.buf = memread(dmc.addr);
+    dmc.buf_full = 1;
+    stall += 4;
+    dmc.addr = dmc.addr == 0xFFFF ? 0x8000 : dmc.addr + 1;
+    if (--dmc.remain == 0) {
+        if (dmc.loop) dmc_restart();
+        else if (dmc.irq_en) {
+            dmc_irq = 1;
+            irq_6502(IRQ_APU_DMC, 1);
+        }
+    }
+}
+
+static inline void dmc_update(uint64_t t) {
+    if (dmc.level != dmc.amp) {
+        blep_add(t, (dmc.level - dmc.amp) * W_DMC);
+        dmc.amp = dmc.level;
+    }
+}
+
+static void dmc_run(uint64_t end) {
+    uint64_t period = dmc_tab[dmc.rate];
+    for (; dmc.next < end; dmc.next += period) {
+        if (!dmc.silence) {
+            if (dmc.shift & 1) {
+                if (dmc.level <= 125) dmc.level += 2;
+            } else if (dmc.level >= 2) dmc.level -= 2;
+            dmc.shift >>= 1;
+            dmc_update(dmc.next);
+        }
+        if (--dmc.bits == 0) {
+            dmc.bits = 8;
+            if (dmc.buf_full) {
+                dmc.silence = 0;
+                dmc.shift = dmc.buf;
+                dmc.buf_full = 0;
+                dmc_fetch();
+            } else dmc.silence = 1;
+        }
+    }
+}
+/** end channels **/
+
+/**
+ * @brief clock envelopes and the triangle linear counter
+ *
+ */
+static void quarter_frame() {
+    env_clock(&pulse[0].env);
+    env_clock(&pulse[1].env);
+    env_clock(&noise.env);
+    if (tri.lin_reload) tri.lin = tri.lin_load;
+    else if (tri.lin) tri.lin--;
+    if (!tri.control) tri.lin_reload = 0;
+}
+
+/**
+ * @brief clock length counters and sweep units
+ *
+ */
+static void half_frame() {
+    for (int i = 0; i < 2; i++) {
+        if (!pulse[i].halt && pulse[i].len) pulse[i].len--;
+        pulse_sweep(&pulse[i]);
+    }
+    if (!tri.control && tri.len) tri.len--;
+    if (!noise.halt && noise.len) noise.len--;
+}
+
+/**
+ * @brief update the outputs after a state change at time t
+ *
+ * @param t CPU cycle
+ */
+static void update_all(uint64_t t) {
+    pulse_update(&pulse[0], t);
+    pulse_update(&pulse[1], t);
+    noise_update(t);
+    dmc_update(t);
+}
+
+/**
+ * @brief schedule the next IRQ check for the CPU
+ *
+ */
+static void schedule_irq() {
+    apu_irq_cycle = UINT64_MAX;
+    if (!seq_mode5 && !seq_irq_inhibit && !frame_irq) {
+        apu_irq_cycle = seq_t0 + seq4_tab[3];
+        if (apu_irq_cycle <= apu_time) apu_irq_cycle = seq_t0 + SEQ4_PERIOD + seq4_tab[3];
+    }
+    if (dmc.irq_en && !dmc.loop && dmc.remain && !dmc_irq) {
+        // the last byte is fetched when the shift register runs dry for the
+        // remain-th time
+        uint64_t t = dmc.next + ((uint64_t) (dmc.bits - 1) + (uint64_t) (dmc.remain - 1) * 8) * dmc_tab[dmc.rate];
+        if (t < apu_irq_cycle) apu_irq_cycle = t;
+    }
+}
+
+static void seq_clock() {
+    const uint32_t *tab = seq_mode5 ? seq5_tab : seq4_tab;
+    uint8_t steps = seq_mode5 ? 5 : 4;
+    uint8_t s = seq_step;
+
+    if (seq_mode5) {
+        if (s != 3) quarter_frame();
+        if (s == 1 || s == 4) half_frame();
+    } else {
+        quarter_frame();
+        if (s == 1 || s == 3) half_frame();
+        if (s == 3 && !seq_irq_inhibit) {
+            frame_irq = 1;
+            irq_6502(IRQ_APU_FRAME, 1);
+        }
+    }
+    update_all(seq_next);
+
+    if (++seq_step == steps) {
+        seq_step = 0;
+        seq_t0 += seq_mode5 ? SEQ5_PERIOD : SEQ4_PERIOD;
+    }
+    seq_next = seq_t0 + tab[seq_step];
+}
+
+/**
+ * @brief run the APU up to a CPU cycle
+ *
+ * @param cycle CPU cycle
+ */
+void apu_sync(uint64_t cycle) {
+    while (apu_time < cycle) {
+        uint64_t end = seq_next < cycle ? seq_next : cycle;
+        pulse_run(&pulse[0], end);
+        pulse_run(&pulse[1], end);
+        tri_run(end);
+        noise_run(end);
+        dmc_run(end);
+        apu_time = end;
+        if (apu_time == seq_next) seq_clock();
+    }
+    schedule_irq();
+    if (stall) {
+        stall_6502(stall);
+        stall = 0;
+    }
+}
+
+/**
+ * @brief set the output sample rate
+ *
+ * @param rate samples per second
+ */
+void apu_set_rate(double rate) {
+    spc = rate / CPU_CLOCK;
+}
+
+/**
+ * @brief init APU
+ *
+ */
+void apu_init() {
+    memset(pulse, 0, sizeof(pulse));
+    memset(&tri, 0, sizeof(tri));
+    memset(&noise, 0, sizeof(noise));
+    memset(&dmc, 0, sizeof(dmc));
+    memset(buf, 0, sizeof(buf));
+    pulse[0].ones = 1;
+    noise.lfsr = 1;
+    dmc.bits = 8;
+    dmc.silence = 1;
+    dmc.len_load = 1;
+    dmc.addr_load = 0xC000;
+    enabled = frame_irq = dmc_irq = stall = 0;
+    seq_mode5 = seq_irq_inhibit = seq_step = 0;
+    apu_time = buf_t0 = seq_t0 = cycles_6502();
+    seq_next = seq_t0 + seq4_tab[0];
+    pulse[0].next = pulse[1].next = tri.next = noise.next = dmc.next = apu_time;
+    buf_frac = 0;
+    integ = hp_x = hp_y = 0;
+    static pthread_once_t blep_once = PTHREAD_ONCE_INIT;
+    pthread_once(&blep_once, blep_init);
+    apu_set_rate(APU_RATE);
+    schedule_irq();
+}
+
+/**
+ * @brief read APU register
+ *
+ * @param addr address
+ * @return uint8_t value
+ */
+uint8_t apu_read(uint16_t addr) {
+    if (addr != 0x4015) return 0xFF;
+    apu_sync(cycles_6502());
+
+    uint8_t val = (pulse[0].len ? 0x01 : 0) | (pulse[1].len ? 0x02 : 0) |
+        (tri.len ? 0x04 : 0) | (noise.len ? 0x08 : 0) | (dmc.remain ? 0x10 : 0) |
+        (frame_irq ? 0x40 : 0) | (dmc_irq ? 0x80 : 0);
+
+    frame_irq = 0;
+    irq_6502(IRQ_APU_FRAME, 0);
+    schedule_irq();
+    return val;
+}
+
+/**
+ * @brief write APU register
+ *
+ * @param addr address
+ * @param val value
+ */
+void apu_write(uint16_t addr, uint8_t val) {
+    apu_sync(cycles_6502());
+    uint64_t t = apu_time;
+
+    switch (addr) {
+        case 0x4000: case 0x4004: {
+            pulse_t *p = &pulse[(addr >> 2) & 1];
+            p->duty = val >> 6;
+            p->halt = p->env.loop = (val >> 5) & 1;
+            p->env.constant = (val >> 4) & 1;
+            p->env.vol = val & 0x0F;
+            pulse_update(p, t);
+            break;
+        }
+        case 0x4001: case 0x4005: {
+            pulse_t *p = &pulse[(addr >> 2) & 1];
+            p->sweep_en = val >> 7;
+            p->sweep_period = (val >> 4) & 7;
+            p->sweep_neg = (val >> 3) & 1;
+            p->sweep_shift = val & 7;
+            p->sweep_reload = 1;
+            pulse_update(p, t);
+            break;
+        }
+        case 0x4002: case 0x4006: {
+            pulse_t *p = &pulse[(addr >> 2) & 1];
+            p->timer = (p->timer & 0x0700) | val;
+            pulse_update(p, t);
+            break;
+        }
+        case 0x4003: case 0x4007: {
+            int n = (addr >> 2) & 1;
+            pulse_t *p = &pulse[n];
+            p->timer = (p->timer & 0x00FF) | ((val & 7) << 8);
+            if (enabled & (1 << n)) p->len = len_tab[val >> 3];
+            p->phase = 0;
+            p->env.start = 1;
+            pulse_update(p, t);
+            break;
+        }
+        case 0x4008: {
+            tri.control = val >> 7;
+            tri.lin_load = val & 0x7F;
+            break;
+        }
+        case 0x400A: {
+            tri.timer = (tri.timer & 0x0700) | val;
+            break;
+        }
+        case 0x400B: {
+            tri.timer = (tri.timer & 0x00FF) | ((val & 7) << 8);
+            if (enabled & 0x04) tri.len = len_tab[val >> 3];
+            tri.lin_reload = 1;
+            break;
+        }
+        case 0x400C: {
+            noise.halt = noise.env.loop = (val >> 5) & 1;
+            noise.env.constant = (val >> 4) & 1;
+            noise.env.vol = val & 0x0F;
+            noise_update(t);
+            break;
+        }
+        case 0x400E: {
+            noise.mode = val >> 7;
+            noise.period = val & 0x0F;
+            break;
+        }
+        case 0x400F: {
+            if (enabled & 0x08) noise.len = len_tab[val >> 3];
+            noise.env.start = 1;
+            noise_update(t);
+            break;
+        }
+        case 0x4010: {
+            dmc.irq_en = val >> 7;
+            dmc.loop = (val >> 6) & 1;
+            dmc.rate = val & 0x0F;
+            if (!dmc.irq_en) {
+                dmc_irq = 0;
+                irq_6502(IRQ_APU_DMC, 0);
+            }
+            break;
+        }
+        case 0x4011: {
+            dmc.level = val & 0x7F;
+            dmc_update(t);
+            break;
+        }
+        case 0x4012: {
+            dmc.addr_load = 0xC000 | (val << 6);
+            break;
+        }
+        case 0x4013: {
+            dmc.len_load = (val << 4) | 1;
+            break;
+        }
+        case 0x4015: {
+            enabled = val & 0x1F;
+            if (!(val & 0x01)) pulse[0].len = 0;
+            if (!(val & 0x02)) pulse[1].len = 0;
+            if (!(val & 0x04)) tri.len = 0;
+            if (!(val & 0x08)) noise.len = 0;
+            if (!(val & 0x10)) dmc.remain = 0;
+            else if (!dmc.remain) {
+                dmc_restart();
+                dmc_fetch();
+            }
+            dmc_irq = 0;
+            irq_6502(IRQ_APU_DMC, 0);
+            update_all(t);
+            break;
+        }
+        case 0x4017: {
+            seq_mode5 = val >> 7;
+            seq_irq_inhibit = (val >> 6) & 1;
+            if (seq_irq_inhibit) {
+                frame_irq = 0;
+                irq_6502(IRQ_APU_FRAME, 0);
+            }
+            seq_t0 = t;
+            seq_step = 0;
+            seq_next = seq_t0 + seq4_tab[0];
+            if (seq_mode5) {
+                quarter_frame();
+                half_frame();
+                update_all(t);
+            }
+            break;
+        }
+        default: break;
+    }
+
+    schedule_irq();
+    if (stall) {
+        stall_6502(stall);
+        stall = 0;
+    }
+}
+
+/**
+ * @brief finish the audio of the current frame
+ *
+ * @param out output buffer, mono signed 16-bit
+ * @param max size of out, in samples
+ * @return int num of samples written
+ */
+int apu_end_frame(int16_t *out, int max) {
+    apu_sync(cycles_6502());
+
+    double end = (apu_time - buf_t0) * spc + buf_frac;
+    int n = (int) end;
+    if (n > BLEP_BUFSZ) n = BLEP_BUFSZ;
+    if (n > max) {
+        log_warn("audio buffer too small, dropping %d samples.\n", n - max);
+    }
+
+    // integrate the steps and block DC; serial, so kept in floats
+    float tmp[BLEP_BUFSZ];
+    for (int i = 0; i < n; i++) {
+        integ += buf[i];
+        hp_y = integ - hp_x + HP_POLE * hp_y;
+        hp_x = integ;
+        tmp[i] = hp_y;
+    }
+
+    int m = n < max ? n : max, i = 0;
+#ifdef __SSE2__
+    const __m128 scale = _mm_set1_ps(32767.0f);
+    for (; i + 8 <= m; i += 8) {
+        __m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(tmp + i), scale));
+        __m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(tmp + i + 4), scale));
+        _mm_storeu_si128((__m128i *) (out + i), _mm_packs_epi32(a, b));
+    }
+#endif
+    for (; i < m; i++) {
+        float s = tmp[i] * 32767.0f;
+        out[i] = s > 32767.0f ? 32767 : s < -32768.0f ? -32768 : (int16_t) lrintf(s);
+    }
+
+    // keep the tails of the steps that run into the next frame
+    memmove(buf, buf + n, (BLEP_BUFSZ + BLEP_TAPS - n) * sizeof(float));
+    memset(buf + BLEP_BUFSZ + BLEP_TAPS - n, 0, n * sizeof(float));
+    buf_frac = end - (int) end;
+    buf_t0 = apu_time;
+
+    return m;
+}
+
+/**
+ * @brief save the APU state
+ * 
+ * @param p output, NULL to get the size only
+ * @return size_t size
+ */
+size_t apu_save(uint8_t *p) {
+    size_t n = 0;
+    APU_STATE(STATE_SAVE)
+    return n;
+}
+
+/**
+ * @brief load the APU state
+ * 
+ * @param p saved state
+ * @return size_t size
+ */
+size_t apu_load(const uint8_t *p) {
+    size_t n = 0;
+    APU_STATE(STATE_LOAD)
+    return n;
+}
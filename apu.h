@@ -0,0 +1,22 @@
+#ifndef NES_APU_H
+#define NES_APU_H
+#include <stdint.h>
+#include "types.h"
+#include <unistd.h>
+#define APU_RATE 48000
+#define CPU_CLOCK 1789773.0 // NTSC
+
+// CPU cycle at which the APU may next raise an IRQ; the CPU syncs the APU
+// once it gets there.
+extern NES_TLS uint64_t apu_irq_cycle;
+
+void apu_init();
+void apu_set_rate(double rate);
+void apu_sync(uint64_t cycle);
+uint8_t apu_read(uint16_t addr);
+void apu_write(uint16_t addr, uint8_t val);
+int apu_end_frame(int16_t *out, int max);
+size_t apu_save(uint8_t *p);
+size_t apu_load(const uint8_t *p);
+
+#endif // NES_APU_H
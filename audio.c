@@ -0,0 +1,217 @@
+#include <math.h> // before log.h, which defines __log
+#include "audio.h"
+#include "apu.h"
+#include "sdl.h"
+#include "log.h"
+#include <stdatomic.h>
+#include <SDL2/SDL.h>
+
+#define RING_SZ 8192 // samples, power of 2
+#define DEV_SAMPLES 512 // device buffer, ~10ms at 48kHz
+
+/* max deviation of the resampling ratio */
+#define DRC_MAX 0.005
+
+#define TONE_HZ 440.0
+
+static int audio_initialized = 0;
+static SDL_AudioDeviceID dev = 0;
+static int rate = APU_RATE;
+
+/* single-producer (emulation) single-consumer (audio callback) ring */
+static int16_t ring[RING_SZ];
+static _Atomic uint32_t head = 0; // written by the producer only
+static _Atomic uint32_t tail = 0; // written by the consumer only
+static _Atomic uint32_t underruns = 0, overruns = 0;
+static int16_t last = 0; // consumer only
+
+// producer side rate control
+static uint32_t target;
+static double ratio = 1.0;
+
+// test tone state
+static uint64_t tone_cycles = 0;
+static double tone_frac = 0, tone_phase = 0;
+
+/**
+ * @brief SDL audio callback, lock-free
+ *
+ * @param p unused
+ * @param stream output
+ * @param len length of output in bytes
+ */
+static void audio_callback(void *p, uint8_t *stream, int len) {
+    (void) p;
+    int16_t *out = (int16_t *) stream;
+    uint32_t want = len / sizeof(int16_t);
+    uint32_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+    uint32_t h = atomic_load_explicit(&head, memory_order_acquire);
+    uint32_t n = h - t;
+    if (n > want) n = want;
+
+    for (uint32_t i = 0; i < n; i++) out[i] = ring[(t + i) & (RING_SZ - 1)];
+    atomic_store_explicit(&tail, t + n, memory_order_release);
+
+    if (n) last = out[n - 1];
+    if (n < want) {
+        // hold the last sample rather than click to zero
+        for (uint32_t i = n; i < want; i++) out[i] = last;
+        atomic_fetch_add_explicit(&underruns, 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief check if audio is ready
+ *
+ * @return int 1 if ready
+ */
+int audio_ready() {
+    return audio_initialized == 1;
+}
+
+/**
+ * @brief init SDL audio output
+ *
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int audio_init() {
+    if (!sdl_ready()) {
+        log_error("SDL is not ready. call sdl_init();\n");
+        return -1;
+    }
+
+    if (audio_initialized == 1) {
+        log_warn("audio already initialized.\n");
+        return 0;
+    } else if (audio_initialized == -1) {
+        log_fatal("audio: end of life cycle.\n");
+        return -1;
+    }
+
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) {
+        log_error("SDL audio subsystem init failed: %s\n", SDL_GetError());
+        return -1;
+    }
+
+    SDL_AudioSpec want, have;
+    memset(&want, 0, sizeof(want));
+    want.freq = APU_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 1;
+    want.samples = DEV_SAMPLES;
+    want.callback = audio_callback;
+
+    dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (dev == 0) {
+        log_error("SDL_OpenAudioDevice: %s\n", SDL_GetError());
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+        return -1;
+    }
+
+    rate = have.freq;
+
+    // keep about one video frame queued on top of the device buffer
+    target = have.samples + rate / 60;
+    if (target > RING_SZ / 2) target = RING_SZ / 2;
+
+    SDL_PauseAudioDevice(dev, 0);
+    audio_initialized = 1;
+
+    return 0;
+}
+
+/**
+ * @brief de-init audio
+ *
+ */
+void audio_deinit() {
+    if (dev != 0) SDL_CloseAudioDevice(dev);
+    dev = 0;
+    SDL_QuitSubSystem(SDL_INIT_AUDIO);
+    audio_initialized = -1;
+}
+
+/**
+ * @brief get the output sample rate
+ *
+ * @return int samples per second
+ */
+int audio_rate() {
+    return rate;
+}
+
+/**
+ * @brief queue samples for output and update the rate control
+ *
+ * @param samples mono signed 16-bit samples
+ * @param n num of samples
+ */
+void audio_push(const int16_t *samples, int n) {
+    uint32_t h = atomic_load_explicit(&head, memory_order_relaxed);
+    uint32_t t = atomic_load_explicit(&tail, memory_order_acquire);
+    uint32_t space = RING_SZ - (h - t);
+
+    if ((uint32_t) n > space) {
+        n = space;
+        atomic_fetch_add_explicit(&overruns, 1, memory_order_relaxed);
+    }
+
+    for (int i = 0; i < n; i++) ring[(h + i) & (RING_SZ - 1)] = samples[i];
+    atomic_store_explicit(&head, h + n, memory_order_release);
+
+    // produce a bit more when below target, a bit less when above
+    double fill = (double) (h + n - t);
+    double d = (target - fill) / target;
+    if (d > 1) d = 1;
+    if (d < -1) d = -1;
+    ratio = 1.0 + DRC_MAX * d;
+}
+
+/**
+ * @brief get the resampling ratio to apply to the producer
+ *
+ * @return double ratio, within 1 +- DRC_MAX
+ */
+double audio_ratio() {
+    return ratio;
+}
+
+/**
+ * @brief get audio counters
+ *
+ * @param stats output
+ */
+void audio_get_stats(audio_stats_t *stats) {
+    uint32_t h = atomic_load_explicit(&head, memory_order_relaxed);
+    uint32_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+    stats->underruns = atomic_load_explicit(&underruns, memory_order_relaxed);
+    stats->overruns = atomic_load_explicit(&overruns, memory_order_relaxed);
+    stats->fill = h - t;
+    stats->ratio = ratio;
+}
+
+/**
+ * @brief generate a test tone for the emulated time since the last call
+ *
+ * @param out output buffer
+ * @param max size of out, in samples
+ * @param cycles current CPU cycle
+ * @return int num of samples written
+ */
+int audio_tone(int16_t *out, int max, uint64_t cycles) {
+    double fs = rate * ratio;
+    double want = (cycles - tone_cycles) * fs / CPU_CLOCK + tone_frac;
+    int n = (int) want;
+    tone_frac = want - n;
+    tone_cycles = cycles;
+    if (n > max) n = max;
+
+    for (int i = 0; i < n; i++) {
+        out[i] = (int16_t) (8192 * sin(tone_phase));
+        tone_phase += 2 * M_PI * TONE_HZ / rate;
+        if (tone_phase > 2 * M_PI) tone_phase -= 2 * M_PI;
+    }
+    return n;
+}
@@ -0,0 +1,33 @@
+#ifndef NES_AUDIO_H
+#define NES_AUDIO_H
+#include <stdint.h>
+
+/**
+ * @brief audio output counters
+ * 
+ */
+typedef struct audio_stats audio_stats_t;
+struct audio_stats {
+    // callback found fewer samples than it needed
+    uint32_t underruns;
+
+    // producer found no room and dropped samples
+    uint32_t overruns;
+
+    // samples queued in the ring
+    uint32_t fill;
+
+    // current resampling ratio
+    double ratio;
+};
+
+int audio_init();
+void audio_deinit();
+int audio_ready();
+int audio_rate();
+void audio_push(const int16_t *samples, int n);
+double audio_ratio();
+void audio_get_stats(audio_stats_t *stats);
+int audio_tone(int16_t *out, int max, uint64_t cycles);
+
+#endif // NES_AUDIO_H
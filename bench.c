@@ -0,0 +1,644 @@
+#include "nes.h"
+#include "6502.h"
+#include "ppu.h"
+#include "apu.h"
+#include "mem.h"
+#include "fb.h"
+#include "log.h"
+#include "trace.h"
+#include "shm.h"
+#include "filter.h"
+#include "romdb.h"
+#include "cheat.h"
+#include "runahead.h"
+#include "stats.h"
+#include "gdb.h"
+#ifdef NES_JIT
+#include "jit.h"
+#endif
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MIN_TIME 0.25 // seconds per measurement
+#define NES_FPS (CPU_CLOCK / NES_FRAME_CYCLES)
+
+/**
+ * @brief a synthetic instruction mix, an endless loop at $8000
+ *
+ */
+typedef struct mix mix_t;
+struct mix {
+    const char *name;
+    uint8_t code[32];
+    uint8_t sz;
+};
+
+static const mix_t cpu_mixes[] = {
+    // lda #1; adc #2; and #$7f; eor #$55; tax; inx; txa; clc; jmp $8000
+    { "alu", { 0xA9, 0x01, 0x69, 0x02, 0x29, 0x7F, 0x49, 0x55, 0xAA, 0xE8, 0x8A, 0x18, 0x4C, 0x00, 0x80 }, 15 },
+    // lda $10; adc $11; sta $12; inc $13; ldx $14; stx $15; jmp $8000
+    { "zeropage", { 0xA5, 0x10, 0x65, 0x11, 0x85, 0x12, 0xE6, 0x13, 0xA6, 0x14, 0x86, 0x15, 0x4C, 0x00, 0x80 }, 15 },
+    // ldx #16; l: dex; bne l; jmp $8000
+    { "branch", { 0xA2, 0x10, 0xCA, 0xD0, 0xFD, 0x4C, 0x00, 0x80 }, 8 },
+    // ldx #0; l: lda $0300,x; sta $0400,x; inx; bne l; jmp $8000
+    { "indexed", { 0xA2, 0x00, 0xBD, 0x00, 0x03, 0x9D, 0x00, 0x04, 0xE8, 0xD0, 0xF7, 0x4C, 0x00, 0x80 }, 14 },
+    // pha; pla; php; plp; jsr $800a; jmp $8000; rts
+    { "stack", { 0x48, 0x68, 0x08, 0x28, 0x20, 0x0A, 0x80, 0x4C, 0x00, 0x80, 0x60 }, 11 },
+};
+
+static const mix_t io_mixes[] = {
+    // lda $0300; sta $0301; jmp $8000
+    { "ram", { 0xAD, 0x00, 0x03, 0x8D, 0x01, 0x03, 0x4C, 0x00, 0x80 }, 9 },
+    // lda $2002; sta $2003; jmp $8000
+    { "ppu", { 0xAD, 0x02, 0x20, 0x8D, 0x03, 0x20, 0x4C, 0x00, 0x80 }, 9 },
+    // lda $4015; sta $4011; jmp $8000
+    { "apu", { 0xAD, 0x15, 0x40, 0x8D, 0x11, 0x40, 0x4C, 0x00, 0x80 }, 9 },
+    // lda $6000; sta $6001; jmp $8000
+    { "sram", { 0xAD, 0x00, 0x60, 0x8D, 0x01, 0x60, 0x4C, 0x00, 0x80 }, 9 },
+    // lda $8000; lda $8001; jmp $8000
+    { "rom", { 0xAD, 0x00, 0x80, 0xAD, 0x01, 0x80, 0x4C, 0x00, 0x80 }, 9 },
+};
+
+/*
+ * built-in test ROM: loads palette, nametable and OAM, plays a tone on
+ * pulse 1 and triangle, then each frame burns ~24k cycles of arithmetic
+ * and spins on a zero-page flag set by its NMI handler (which does OAM DMA
+ * and scrolls).
+ */
+static const uint8_t bench_prg[] = {
+    0x78, 0xD8, 0xA2, 0xFF, 0x9A, 0xA9, 0x40, 0x8D, 0x17, 0x40, 0x2C, 0x02, 0x20, 0x10, 0xFB, 0x2C,
+    0x02, 0x20, 0x10, 0xFB, 0xA9, 0x3F, 0x8D, 0x06, 0x20, 0xA9, 0x00, 0x8D, 0x06, 0x20, 0xA2, 0x00,
+    0xBD, 0xB7, 0x80, 0x8D, 0x07, 0x20, 0xE8, 0xE0, 0x20, 0xD0, 0xF5, 0xA9, 0x20, 0x8D, 0x06, 0x20,
+    0xA9, 0x00, 0x8D, 0x06, 0x20, 0xA0, 0x04, 0xA2, 0x00, 0x8A, 0x8D, 0x07, 0x20, 0xE8, 0xD0, 0xF9,
+    0x88, 0xD0, 0xF4, 0xA2, 0x00, 0x8A, 0x9D, 0x00, 0x02, 0xE8, 0xD0, 0xF9, 0xA9, 0x0F, 0x8D, 0x15,
+    0x40, 0xA9, 0xBF, 0x8D, 0x00, 0x40, 0xA9, 0xFD, 0x8D, 0x02, 0x40, 0xA9, 0x08, 0x8D, 0x03, 0x40,
+    0xA9, 0xFF, 0x8D, 0x08, 0x40, 0xA9, 0x80, 0x8D, 0x0A, 0x40, 0xA9, 0x08, 0x8D, 0x0B, 0x40, 0xA9,
+    0x00, 0x8D, 0x05, 0x20, 0x8D, 0x05, 0x20, 0xA9, 0x1E, 0x8D, 0x01, 0x20, 0xA9, 0x80, 0x8D, 0x00,
+    0x20, 0xA0, 0x04, 0xA2, 0x00, 0x8A, 0x18, 0x65, 0x20, 0x85, 0x20, 0xA5, 0x21, 0x69, 0x00, 0x85,
+    0x21, 0xE8, 0xD0, 0xF1, 0x88, 0xD0, 0xEC, 0xA5, 0x10, 0xC5, 0x10, 0xF0, 0xFC, 0xE6, 0x11, 0x4C,
+    0x81, 0x80, 0x48, 0xE6, 0x10, 0xA9, 0x02, 0x8D, 0x14, 0x40, 0xA5, 0x10, 0x8D, 0x05, 0x20, 0xA9,
+    0x00, 0x8D, 0x05, 0x20, 0x68, 0x40, 0x40, 0x0F, 0x01, 0x21, 0x31, 0x0F, 0x06, 0x16, 0x26, 0x0F,
+    0x09, 0x19, 0x29, 0x0F, 0x0C, 0x1C, 0x2C, 0x0F, 0x01, 0x21, 0x31, 0x0F, 0x06, 0x16, 0x26, 0x0F,
+    0x09, 0x19, 0x29, 0x0F, 0x0C, 0x1C, 0x2C,
+};
+#define BENCH_NMI 0x80A2
+#define BENCH_RST 0x8000
+#define BENCH_IRQ 0x80B6
+
+static uint8_t bench_rom[sizeof(nes_hdr_t) + 0x8000 + 0x2000];
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief deterministic pseudo-random tile data
+ *
+ * @param dst destination
+ * @param sz size
+ */
+static void fill_chr(uint8_t *dst, size_t sz) {
+    for (size_t i = 0; i < sz; i++) dst[i] = (i * 37 + i / 16) & 0xFF;
+}
+
+/**
+ * @brief assemble the built-in test ROM image
+ *
+ */
+static void build_bench_rom() {
+    nes_hdr_t *hdr = (nes_hdr_t *) bench_rom;
+    uint8_t *prg = bench_rom + sizeof(nes_hdr_t);
+
+    memset(bench_rom, 0, sizeof(bench_rom));
+    memcpy(hdr->magic, NES_MAGIC, 4);
+    hdr->prgm_rom_sz_16k = 2;
+    hdr->chr_rom_sz_8k = 1;
+    memcpy(prg, bench_prg, sizeof(bench_prg));
+    prg[0x7FFA] = BENCH_NMI & 0xFF; prg[0x7FFB] = BENCH_NMI >> 8;
+    prg[0x7FFC] = BENCH_RST & 0xFF; prg[0x7FFD] = BENCH_RST >> 8;
+    prg[0x7FFE] = BENCH_IRQ & 0xFF; prg[0x7FFF] = BENCH_IRQ >> 8;
+    fill_chr(prg + 0x8000, 0x2000);
+}
+
+/**
+ * @brief FNV-1a of the current indexed frame
+ *
+ * @return uint64_t hash
+ */
+static uint64_t frame_hash() {
+    const fb_t *f = fb_frame();
+    const uint8_t *p = (const uint8_t *) f;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < sizeof(fb_t); i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * @brief run an instruction mix
+ *
+ * @param m the mix
+ * @param first 1 if this is the first entry of the JSON object
+ */
+static void bench_mix(const mix_t *m, int first) {
+    uint8_t vec[2] = { 0x00, 0x80 };
+    mmemcpy(0x8000, m->code, m->sz);
+    mmemcpy(0xFFFC, vec, 2);
+    init_6502();
+    apu_init(); // so the APU has no backlog to catch up on
+
+    uint64_t n = 0, c0 = cycles_6502();
+    double t0 = now(), t;
+    do {
+        for (int i = 0; i < 100000; i++) run_6502();
+        n += 100000;
+    } while ((t = now() - t0) < MIN_TIME);
+
+    printf("%s\n    \"%s\": { \"ips\": %.0f, \"ns_per_insn\": %.3f, \"emulated_mhz\": %.3f }",
+        first ? "" : ",", m->name, n / t, t * 1e9 / n, (cycles_6502() - c0) / t / 1e6);
+}
+
+static void bench_watch(uint16_t addr, uint8_t old, uint8_t val, void *ctx) {
+    (void) addr; (void) old; (void) val; (void) ctx;
+}
+
+/**
+ * @brief the RAM and ROM mixes with cheats on their pages, and RAM search
+ *
+ */
+static void bench_cheat() {
+    mix_t m = io_mixes[0];
+    // same page as the mix's store, but not the address
+    int id = cheat_watch(0x0380, bench_watch, NULL);
+    m.name = "ram_hooked_page";
+    bench_mix(&m, 1);
+    cheat_remove(id);
+    id = cheat_watch(0x0301, bench_watch, NULL);
+    m.name = "ram_watched";
+    bench_mix(&m, 0);
+    cheat_remove(id);
+    m = io_mixes[4];
+    id = cheat_patch(0x8001, -1, 0xEA);
+    m.name = "rom_patched";
+    bench_mix(&m, 0);
+    cheat_clear();
+
+    uint64_t n = 0;
+    double t0 = now(), t;
+    cheat_search_reset();
+    do {
+        for (int i = 0; i < 10000; i++) cheat_search(i & 1 ? CHEAT_LE : CHEAT_NE, i & 2 ? -1 : 0x40);
+        n += 10000;
+    } while ((t = now() - t0) < MIN_TIME);
+    printf(",\n    \"search\": { \"ns_per_search\": %.1f }", t * 1e9 / n);
+}
+
+/**
+ * @brief time ppu_run over whole frames with fixed VRAM/OAM
+ *
+ * @param name name of the case
+ * @param mask value for PPUMASK
+ * @param first 1 if this is the first entry of the JSON object
+ */
+static void bench_ppu(const char *name, uint8_t mask, int first) {
+    ppu_set_reg(0x2001, mask);
+
+    uint64_t lines = 0;
+    double t0 = now(), t;
+    do {
+        for (int i = 0; i < 262 * 10; i++) ppu_run();
+        lines += 240 * 10;
+    } while ((t = now() - t0) < MIN_TIME);
+
+    printf("%s\n    \"%s\": { \"ns_per_scanline\": %.1f }", first ? "" : ",", name, t * 1e9 / lines);
+}
+
+/**
+ * @brief set up the PPU fixture: tiles, a full nametable, palettes, 64 sprites
+ *
+ */
+static void ppu_fixture() {
+    static uint8_t chr[0x2000];
+    ppu_init();
+    fill_chr(chr, sizeof(chr));
+    ppucpy(0, chr, sizeof(chr));
+
+    ppu_set_reg(0x2000, 0);
+    ppu_set_reg(0x2006, 0x20);
+    ppu_set_reg(0x2006, 0x00);
+    for (int i = 0; i < 0x400; i++) ppu_set_reg(0x2007, i * 7);
+    ppu_set_reg(0x2006, 0x3F);
+    ppu_set_reg(0x2006, 0x00);
+    for (int i = 0; i < 0x20; i++) ppu_set_reg(0x2007, (i * 5) & 0x3F);
+
+    // spread so that most lines have 8 sprites on them
+    ppu_set_reg(0x2003, 0);
+    for (int n = 0; n < 64; n++) {
+        ppu_sprram_write((n * 29) % 232);
+        ppu_sprram_write(n);
+        ppu_sprram_write(n & 0xC3);
+        ppu_sprram_write((n * 53) & 0xFF);
+    }
+    ppu_set_reg(0x2005, 0);
+    ppu_set_reg(0x2005, 0);
+}
+
+/**
+ * @brief time the indexed frame conversions
+ *
+ * @param name name of the case
+ * @param fmt 0: ARGB8888, 1: RGB565, 2: I420
+ * @param first 1 if this is the first entry of the JSON object
+ */
+static void bench_convert(const char *name, int fmt, int first) {
+    static uint32_t out[NES_W * NES_H];
+    uint8_t *o = (uint8_t *) out;
+    int bytes[3] = { NES_W * NES_H * 4, NES_W * NES_H * 2, NES_W * NES_H * 3 / 2 };
+
+    uint64_t n = 0;
+    double t0 = now(), t;
+    do {
+        for (int i = 0; i < 100; i++) {
+            if (fmt == 0) fb_argb8888(fb_frame(), o, NES_W * 4);
+            else if (fmt == 1) fb_rgb565(fb_frame(), o, NES_W * 2);
+            else fb_yuv420(fb_frame(), o, o + NES_W * NES_H, o + NES_W * NES_H * 5 / 4);
+        }
+        n += 100;
+    } while ((t = now() - t0) < MIN_TIME);
+
+    printf("%s\n    \"%s\": { \"us_per_frame\": %.2f, \"out_gbps\": %.2f }",
+        first ? "" : ",", name, t * 1e6 / n, (double) bytes[fmt] * n / t / 1e9);
+}
+
+/**
+ * @brief time the frame hash
+ *
+ */
+static void bench_hash() {
+    volatile uint64_t h;
+    uint64_t n = 0;
+    double t0 = now(), t;
+    do {
+        for (int i = 0; i < 100; i++) h = fb_hash_frame(fb_frame());
+        n += 100;
+    } while ((t = now() - t0) < MIN_TIME);
+
+    printf(",\n    \"hash\": { \"us_per_frame\": %.2f, \"in_gbps\": %.2f }",
+        t * 1e6 / n, (double) sizeof(fb_t) * n / t / 1e9);
+    (void) h;
+}
+
+/**
+ * @brief time publishing a frame to shared memory
+ *
+ */
+static void bench_shm() {
+    char name[64];
+    snprintf(name, sizeof(name), "/nes-bench-%d", (int) getpid());
+    if (shm_init(name) < 0) {
+        printf("null");
+        return;
+    }
+
+    uint64_t n = 0;
+    double t0 = now(), t;
+    do {
+        for (int i = 0; i < 100; i++) shm_publish(fb_frame(), memptr(0), n + i);
+        n += 100;
+    } while ((t = now() - t0) < MIN_TIME);
+    shm_deinit();
+
+    printf("{ \"publish_us\": %.2f }", t * 1e6 / n);
+}
+
+/**
+ * @brief time a post-processing filter on the current frame
+ *
+ * @param kind filter
+ * @param first 1 if this is the first entry of the JSON object
+ */
+static void bench_filter(filter_kind_t kind, int first) {
+    static const char *names[] = { "none", "scale2x", "scale3x", "scale4x", "xbr", "ntsc" };
+    int w, h;
+    if (filter_init(kind, 1) < 0) return;
+    filter_size(&w, &h);
+    uint32_t *out = malloc((size_t) w * h * sizeof(uint32_t));
+    if (out == NULL) {
+        filter_deinit();
+        return;
+    }
+
+    uint64_t n = 0;
+    double t0 = now(), t;
+    do {
+        for (int i = 0; i < 10; i++) filter_run(fb_frame(), out, w * sizeof(uint32_t));
+        n += 10;
+    } while ((t = now() - t0) < MIN_TIME);
+    filter_deinit();
+    free(out);
+
+    printf("%s\n    \"%s\": { \"w\": %d, \"h\": %d, \"us_per_frame\": %.1f }",
+        first ? "" : ",", names[kind], w, h, t * 1e6 / n);
+}
+
+/**
+ * @brief run a ROM headlessly
+ *
+ * @param name name of the ROM
+ * @param rom image
+ * @param sz size of image
+ * @param first 1 if this is the first entry of the JSON object
+ */
+static void bench_rom_run(const char *name, const uint8_t *rom, size_t sz, int first) {
+    static int16_t samples[4096];
+    nes_meta_t meta;
+    printf("%s\n    \"%s\": ", first ? "" : ",", name);
+    if (nes_init(&meta, rom, sz) < 0) {
+        printf("null");
+        return;
+    }
+
+    // warm up, and hash a fixed frame so builds can be compared
+    for (int i = 0; i < 120; i++) {
+        nes_frame();
+        apu_end_frame(samples, 4096);
+    }
+    uint64_t hash = frame_hash(), fbhash = fb_hash();
+
+    uint64_t dups = 0, frames = 0, c0 = cycles_6502(), i0 = idle_cycles_6502();
+    double t0 = now(), t, t_apu = 0;
+    do {
+        for (int i = 0; i < 60; i++) {
+            nes_frame();
+            dups += fb_dup();
+            double ta = now();
+            apu_end_frame(samples, 4096);
+            t_apu += now() - ta;
+        }
+        frames += 60;
+    } while ((t = now() - t0) < MIN_TIME * 4);
+
+    printf("{ \"fps\": %.1f, \"realtime\": %.2f, \"us_per_frame\": %.1f, \"apu_end_frame_us\": %.2f, "
+        "\"cycles_per_frame\": %.0f, \"idle_pct\": %.1f, \"dup_pct\": %.1f, \"frame_120_hash\": \"%016llx\", "
+        "\"frame_120_fb_hash\": \"%016llx\" }",
+        frames / t, frames / t / NES_FPS, t * 1e6 / frames, t_apu * 1e6 / frames,
+        (double) (cycles_6502() - c0) / frames,
+        100.0 * (idle_cycles_6502() - i0) / (cycles_6502() - c0), 100.0 * dups / frames,
+        (unsigned long long) hash, (unsigned long long) fbhash);
+}
+
+/**
+ * @brief time save-states of the running ROM, and check that they replay
+ *
+ */
+static void bench_state() {
+    static int16_t samples[4096];
+    size_t sz = nes_state_size();
+    uint8_t *st = malloc(sz);
+    if (st == NULL) return;
+
+    nes_save(st);
+    for (int i = 0; i < 30; i++) {
+        nes_frame();
+        apu_end_frame(samples, 4096);
+    }
+    uint64_t h0 = frame_hash();
+    nes_load(st, sz);
+    for (int i = 0; i < 30; i++) {
+        nes_frame();
+        apu_end_frame(samples, 4096);
+    }
+    int replay = frame_hash() == h0;
+
+    uint64_t n = 0;
+    double t0 = now(), t, t_save = 0;
+    do {
+        for (int i = 0; i < 100; i++) {
+            double ts = now();
+            nes_save(st);
+            t_save += now() - ts;
+            nes_load(st, sz);
+        }
+        n += 100;
+    } while ((t = now() - t0) < MIN_TIME);
+
+    printf("{ \"bytes\": %zu, \"save_us\": %.2f, \"load_us\": %.2f, \"replay\": %s }",
+        sz, t_save * 1e6 / n, (t - t_save) * 1e6 / n, replay ? "true" : "false");
+    free(st);
+}
+
+/**
+ * @brief time running ahead, and check that it shows the frame n later
+ *
+ * @param name name of the entry
+ * @param n frames ahead
+ * @param thread 1 for a second console
+ * @param first 1 if this is the first entry of the JSON object
+ */
+static void bench_runahead(const char *name, int n, int thread, int first) {
+    static int16_t samples[4096];
+    nes_meta_t meta;
+    printf("%s\n      \"%s\": ", first ? "" : ",", name);
+
+    // the frame 120 + n of a plain run, and the cycles of frame 120
+    if (nes_init(&meta, bench_rom, sizeof(bench_rom)) < 0) {
+        printf("null");
+        return;
+    }
+    uint64_t c0 = cycles_6502(), c120 = 0;
+    for (int i = 0; i < 120 + n; i++) {
+        nes_frame();
+        apu_end_frame(samples, 4096);
+        if (i == 119) c120 = cycles_6502() - c0;
+    }
+    uint64_t want = frame_hash();
+
+    nes_init(&meta, bench_rom, sizeof(bench_rom));
+    c0 = cycles_6502();
+    if (runahead_init(n, thread, bench_rom, sizeof(bench_rom)) < 0) {
+        printf("null");
+        return;
+    }
+    for (int i = 0; i < 120; i++) {
+        runahead_frame();
+        apu_end_frame(samples, 4096);
+    }
+    int ahead = frame_hash() == want && cycles_6502() - c0 == c120;
+
+    uint64_t frames = 0, late = stats_cur.ahead_late;
+    double t0 = now(), t;
+    do {
+        for (int i = 0; i < 60; i++) {
+            runahead_frame();
+            apu_end_frame(samples, 4096);
+        }
+        frames += 60;
+    } while ((t = now() - t0) < MIN_TIME * 2);
+    runahead_deinit();
+
+    printf("{ \"fps\": %.1f, \"us_per_frame\": %.1f, \"late\": %llu, \"shows_ahead\": %s }",
+        frames / t, t * 1e6 / frames, (unsigned long long) (stats_cur.ahead_late - late), ahead ? "true" : "false");
+}
+
+/**
+ * @brief the debugger of bench_gdb(): poke a nametable byte, read its mirror
+ *
+ * @param arg socket path
+ * @return void* non-NULL if the mirror reads back what was written
+ */
+static void *gdb_client(void *arg) {
+    // the stop reply comes first, then one per packet
+    static const char *pkts[] = { NULL, "M12001,1:5a", "m12401,1", "D" };
+    struct sockaddr_un sau = { .sun_family = AF_UNIX };
+    char buf[256], got[256] = { 0 };
+    strcpy(sau.sun_path, arg);
+    int c = socket(AF_UNIX, SOCK_STREAM, 0);
+    // the stub may not be listening yet
+    for (int i = 0; i < 1000 && connect(c, (struct sockaddr *) &sau, sizeof(sau)) < 0; i++) usleep(1000);
+
+    for (size_t i = 0; i < sizeof(pkts) / sizeof(pkts[0]); i++) {
+        if (pkts[i] != NULL) {
+            uint8_t sum = 0;
+            for (const char *p = pkts[i]; *p; p++) sum += (uint8_t) *p;
+            int n = snprintf(buf, sizeof(buf), "$%s#%.2x", pkts[i], sum);
+            if (send(c, buf, n, MSG_NOSIGNAL) != n) break;
+        }
+        // the reply, acks skipped; the one to m is kept
+        size_t k = 0;
+        char ch;
+        int in = 0;
+        while (recv(c, &ch, 1, 0) == 1 && ch != '#') {
+            if (in && i == 2 && k < sizeof(got) - 1) got[k++] = ch;
+            if (ch == '$') in = 1;
+        }
+        recv(c, buf, 2, MSG_WAITALL);
+    }
+    close(c);
+    return strcmp(got, "5a") == 0 ? arg : NULL;
+}
+
+/**
+ * @brief check that a debugger's nametable write lands in both copies
+ *
+ */
+static void bench_gdb() {
+    static int16_t samples[4096];
+    nes_meta_t meta;
+    char path[64];
+    pthread_t t;
+    void *ok = NULL;
+    snprintf(path, sizeof(path), "/tmp/nes-bench-gdb-%d", (int) getpid());
+    if (nes_init(&meta, bench_rom, sizeof(bench_rom)) < 0 ||
+        pthread_create(&t, NULL, gdb_client, path) != 0) {
+        printf("null");
+        return;
+    }
+    // the stub stops the first instruction and serves until detached
+    if (gdb_init(path) == 0) {
+        nes_frame();
+        apu_end_frame(samples, 4096);
+        gdb_deinit();
+    }
+    pthread_join(t, &ok);
+    printf("{ \"poke_mirrored\": %s }", ok != NULL ? "true" : "false");
+}
+
+int main (int argc, char **argv) {
+    int first;
+
+    printf("{\n  \"compiler\": \"%s\",\n  \"cpu\": {", __VERSION__);
+    ppu_init();
+    apu_init();
+    first = 1;
+    for (size_t i = 0; i < sizeof(cpu_mixes) / sizeof(mix_t); i++, first = 0) bench_mix(&cpu_mixes[i], first);
+    printf("\n  },\n  \"dispatch\": {");
+    first = 1;
+    for (size_t i = 0; i < sizeof(io_mixes) / sizeof(mix_t); i++, first = 0) bench_mix(&io_mixes[i], first);
+    printf("\n  },\n  \"cheat\": {");
+    bench_cheat();
+
+    printf("\n  },\n  \"ppu\": {");
+    ppu_fixture();
+    bench_ppu("none", 0x00, 1);
+    bench_ppu("bg", 0x0A, 0);
+    bench_ppu("spr", 0x14, 0);
+    bench_ppu("bg_spr", 0x1E, 0);
+    // the same with the pattern tables decoded ahead, as nes_init does
+    nes_meta_t meta;
+    const uint8_t *dec;
+    build_bench_rom();
+    if (romdb_lookup(&meta, bench_rom, sizeof(bench_rom), &dec) == 0 && dec != NULL) {
+        ppu_set_chr(dec, meta.chr);
+        bench_ppu("bg_dec", 0x0A, 0);
+        bench_ppu("bg_spr_dec", 0x1E, 0);
+    }
+
+    printf("\n  },\n  \"convert\": {");
+    bench_convert("argb8888", 0, 1);
+    bench_convert("rgb565", 1, 0);
+    bench_convert("yuv420", 2, 0);
+    bench_hash();
+
+    printf("\n  },\n  \"shm\": ");
+    bench_shm();
+    printf(",\n  \"filter\": {");
+    for (int k = FILTER_NONE; k <= FILTER_NTSC; k++) bench_filter(k, k == FILTER_NONE);
+    printf("\n  }");
+
+    printf(",\n  \"rom\": {");
+    build_bench_rom();
+    bench_rom_run("builtin", bench_rom, sizeof(bench_rom), 1);
+    nes_set_idle(0);
+    bench_rom_run("builtin_noidle", bench_rom, sizeof(bench_rom), 0);
+    nes_set_idle(1);
+    printf(",\n    \"state\": ");
+    bench_state();
+    printf(",\n    \"runahead\": {");
+    bench_runahead("1", 1, 0, 1);
+    bench_runahead("2", 2, 0, 0);
+    bench_runahead("2_thread", 2, 1, 0);
+    printf("\n    },\n    \"gdb\": ");
+    bench_gdb();
+    if (trace_init(1 << 16) == 0) {
+        trace_enable(1);
+        bench_rom_run("builtin_trace", bench_rom, sizeof(bench_rom), 0);
+        trace_deinit();
+    }
+#ifdef NES_JIT
+    jit_stats_t js;
+    jit_enable(0);
+    bench_rom_run("builtin_interp", bench_rom, sizeof(bench_rom), 0);
+    jit_enable(1);
+    jit_verify(1);
+    bench_rom_run("builtin_verify", bench_rom, sizeof(bench_rom), 0);
+    jit_verify(0);
+    jit_get_stats(&js);
+    printf(",\n    \"jit\": { \"blocks\": %llu, \"code_bytes\": %llu, \"rejected\": %llu }",
+        (unsigned long long) js.blocks, (unsigned long long) js.code_bytes, (unsigned long long) js.rejected);
+#endif
+    for (int i = 1; i < argc; i++) {
+        static uint8_t rom[0xffff];
+        int fd = open(argv[i], O_RDONLY);
+        ssize_t len = fd < 0 ? -1 : read(fd, rom, sizeof(rom));
+        if (fd >= 0) close(fd);
+        if (len < 0) {
+            log_error("can't read '%s'.\n", argv[i]);
+            continue;
+        }
+        bench_rom_run(argv[i], rom, len, 0);
+    }
+    printf("\n  }\n}\n");
+
+    return 0;
+}
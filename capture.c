@@ -0,0 +1,333 @@
+#include "capture.h"
+#include "pal.h"
+#include "log.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOTS 16 // frames queued, power of 2
+#define SLOT_SAMPLES 2048 // audio per frame, ~800 at 48kHz
+#define FILE_BUF (1 << 20)
+
+/* frame rate of the emulated CPU, 236.25MHz / 11 / 12 / NES_FRAME_CYCLES
+ * (263 lines of 113 cycles), as Y4M wants it */
+#define Y4M_HEADER "YUV4MPEG2 W256 H240 F19687500:326909 Ip A8:7 C420jpeg\n"
+#define YUV_SZ (NES_W * NES_H * 3 / 2)
+
+/* a queued frame */
+typedef struct slot slot_t;
+struct slot {
+    fb_t frame;
+    int same; // pixels are the ones of the frame before, not copied
+    uint32_t skipped; // frames dropped right before this one
+    int n; // audio samples
+    int16_t samples[SLOT_SAMPLES];
+};
+
+static int capture_initialized = 0;
+
+/* single-producer (emulation) single-consumer (writer) queue. the
+ * semaphores count filled and free slots, a full queue never blocks the
+ * producer unless asked to */
+static slot_t *slots;
+static _Atomic uint32_t head = 0; // written by the producer only
+static _Atomic uint32_t tail = 0; // written by the consumer only
+static sem_t items, space;
+static atomic_int quit = 0;
+static pthread_t writer;
+
+// producer side
+static int block = 0;
+static uint32_t skipped = 0;
+static uint64_t last_hash;
+static int have_last = 0;
+
+// writer side
+static FILE *vout = NULL, *aout = NULL;
+static uint8_t *yuv; // last converted frame
+static uint64_t wav_samples = 0;
+static int wav_rate;
+static int broken = 0;
+
+static _Atomic uint32_t frames = 0, dropped = 0, same = 0;
+
+/**
+ * @brief write to an output, give up on it at the first error
+ *
+ * @param p data
+ * @param sz size
+ * @param f output
+ */
+static void put(const void *p, size_t sz, FILE *f) {
+    if (f == NULL || broken) return;
+    if (fwrite(p, 1, sz, f) != sz) {
+        log_error("capture: write failed, stopping.\n");
+        broken = 1;
+    }
+}
+
+static void put_le(uint32_t v, int bytes, FILE *f) {
+    uint8_t b[4] = { v, v >> 8, v >> 16, v >> 24 };
+    put(b, bytes, f);
+}
+
+/**
+ * @brief write a WAV header, sizes are patched on close if the file can seek
+ *
+ * @param f output
+ * @param rate sample rate
+ * @param data size of the data, 0xFFFFFFFF if unknown
+ */
+static void wav_header(FILE *f, int rate, uint32_t data) {
+    put("RIFF", 4, f);
+    put_le(data == 0xFFFFFFFF ? data : data + 36, 4, f);
+    put("WAVEfmt ", 8, f);
+    put_le(16, 4, f); // fmt size
+    put_le(1, 2, f); // PCM
+    put_le(1, 2, f); // mono
+    put_le(rate, 4, f);
+    put_le(rate * 2, 4, f); // bytes per second
+    put_le(2, 2, f); // block align
+    put_le(16, 2, f); // bits
+    put("data", 4, f);
+    put_le(data, 4, f);
+}
+
+/**
+ * @brief write the last converted frame
+ *
+ */
+static void put_frame() {
+    put("FRAME\n", 6, vout);
+    put(yuv, YUV_SZ, vout);
+    atomic_fetch_add_explicit(&frames, 1, memory_order_relaxed);
+}
+
+static void put_samples(const int16_t *s, int n) {
+    if (aout == NULL) return;
+    // WAV is little endian, like every host this runs on
+    put(s, n * sizeof(int16_t), aout);
+    wav_samples += n;
+}
+
+/**
+ * @brief writer thread: convert and write queued frames
+ *
+ * @param p unused
+ * @return void* NULL
+ */
+static void *writer_main(void *p) {
+    (void) p;
+    static const int16_t silence[SLOT_SAMPLES];
+
+    for (;;) {
+        while (sem_wait(&items) < 0);
+        uint32_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+        if (t == atomic_load_explicit(&head, memory_order_acquire)) {
+            if (atomic_load(&quit)) break;
+            continue;
+        }
+
+        const slot_t *s = &slots[t & (SLOTS - 1)];
+        // keep the timeline: repeat the last frame and fill silence for
+        // the frames the emulator had to drop
+        for (uint32_t i = 0; i < s->skipped; i++) {
+            put_frame();
+            put_samples(silence, s->n);
+        }
+        if (!s->same) fb_yuv420(&s->frame, yuv, yuv + NES_W * NES_H, yuv + NES_W * NES_H * 5 / 4);
+        put_frame();
+        put_samples(s->samples, s->n);
+
+        atomic_store_explicit(&tail, t + 1, memory_order_release);
+        sem_post(&space);
+    }
+    return NULL;
+}
+
+/**
+ * @brief open an output, "-" for stdout
+ *
+ * @param path path
+ * @return FILE* output, NULL on failure
+ */
+static FILE *open_out(const char *path) {
+    FILE *f;
+    if (strcmp(path, "-") == 0) {
+        f = stdout;
+        signal(SIGPIPE, SIG_IGN); // a closed pipe becomes a write error
+    } else f = fopen(path, "wb");
+    if (f == NULL) {
+        log_error("can't open file: '%s'.\n", path);
+        return NULL;
+    }
+    setvbuf(f, NULL, _IOFBF, FILE_BUF);
+    return f;
+}
+
+/**
+ * @brief start capturing frames to Y4M, and audio to WAV
+ *
+ * @param video Y4M output, "-" for stdout
+ * @param wav WAV output, "-" for stdout, NULL for none
+ * @param rate audio sample rate
+ * @param b 1: wait for the writer when the queue is full, for headless runs;
+ * 0: drop the frame and write the last one again
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int capture_init(const char *video, const char *wav, int rate, int b) {
+    if (capture_initialized) {
+        log_warn("capture already initialized.\n");
+        return 0;
+    }
+    if (wav != NULL && strcmp(video, "-") == 0 && strcmp(wav, "-") == 0) {
+        log_error("capture: video and audio can't both go to stdout.\n");
+        return -1;
+    }
+    pal_init();
+
+    slots = malloc(SLOTS * sizeof(slot_t));
+    yuv = malloc(YUV_SZ);
+    if (slots == NULL || yuv == NULL) {
+        log_error("capture: out of memory.\n");
+        free(slots);
+        free(yuv);
+        return -1;
+    }
+
+    vout = open_out(video);
+    aout = wav != NULL ? open_out(wav) : NULL;
+    if (vout == NULL || (wav != NULL && aout == NULL)) {
+        if (vout != NULL && vout != stdout) fclose(vout);
+        if (aout != NULL && aout != stdout) fclose(aout);
+        free(slots);
+        free(yuv);
+        return -1;
+    }
+    broken = 0;
+    put(Y4M_HEADER, strlen(Y4M_HEADER), vout);
+    wav_rate = rate;
+    if (aout != NULL) wav_header(aout, rate, 0xFFFFFFFF);
+
+    atomic_store(&head, 0);
+    atomic_store(&tail, 0);
+    atomic_store(&quit, 0);
+    sem_init(&items, 0, 0);
+    sem_init(&space, 0, SLOTS);
+    block = b;
+    skipped = 0;
+    have_last = 0;
+    wav_samples = 0;
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        log_error("capture: can't start the writer.\n");
+        sem_destroy(&items);
+        sem_destroy(&space);
+        if (vout != stdout) fclose(vout);
+        if (aout != NULL && aout != stdout) fclose(aout);
+        free(slots);
+        free(yuv);
+        return -1;
+    }
+
+    capture_initialized = 1;
+    log_info("capturing video to '%s'.\n", video);
+    if (wav != NULL) log_info("capturing audio to '%s'.\n", wav);
+    return 0;
+}
+
+/**
+ * @brief write what is queued and close the outputs
+ *
+ */
+void capture_deinit() {
+    if (!capture_initialized) return;
+    atomic_store(&quit, 1);
+    sem_post(&items);
+    pthread_join(writer, NULL);
+    sem_destroy(&items);
+    sem_destroy(&space);
+
+    // a pipe keeps the "unknown" sizes, most readers take that as streaming
+    if (aout != NULL && aout != stdout && !broken && wav_samples * 2 < 0xFFFFFFFF - 36
+        && fseek(aout, 0, SEEK_SET) == 0) {
+        wav_header(aout, wav_rate, wav_samples * 2);
+    }
+    if (aout != NULL) {
+        if (aout != stdout) fclose(aout);
+        else fflush(aout);
+    }
+    if (vout != stdout) fclose(vout);
+    else fflush(vout);
+
+    free(slots);
+    free(yuv);
+    capture_initialized = 0;
+    log_info("capture: %u frames, %u dropped, %u same.\n", atomic_load(&frames), atomic_load(&dropped), atomic_load(&same));
+}
+
+/**
+ * @brief check if a capture is running
+ *
+ * @return int 1 if it is
+ */
+int capture_ready() {
+    return capture_initialized;
+}
+
+/**
+ * @brief queue a finished frame and its audio
+ *
+ * call after nes_frame(), a frame the PPU is still drawing would tear.
+ *
+ * @param f the frame
+ * @param samples audio of the frame
+ * @param n num of samples
+ */
+void capture_frame(const fb_t *f, const int16_t *samples, int n) {
+    if (!capture_initialized) return;
+
+    if (block) {
+        while (sem_wait(&space) < 0);
+    } else if (sem_trywait(&space) < 0) {
+        skipped++;
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    uint32_t h = atomic_load_explicit(&head, memory_order_relaxed);
+    slot_t *s = &slots[h & (SLOTS - 1)];
+    // hash what is copied, a frame identical to the last one is not
+    uint64_t hash = fb_hash_frame(f);
+    s->same = have_last && hash == last_hash;
+    if (s->same) atomic_fetch_add_explicit(&same, 1, memory_order_relaxed);
+    else memcpy(&s->frame, f, sizeof(fb_t));
+    last_hash = hash;
+    have_last = 1;
+
+    if (n > SLOT_SAMPLES) n = SLOT_SAMPLES;
+    if (n < 0) n = 0;
+    memcpy(s->samples, samples, n * sizeof(int16_t));
+    s->n = n;
+    s->skipped = skipped;
+    skipped = 0;
+
+    atomic_store_explicit(&head, h + 1, memory_order_release);
+    sem_post(&items);
+}
+
+/**
+ * @brief get capture counters
+ *
+ * @param stats output
+ */
+void capture_get_stats(capture_stats_t *stats) {
+    stats->frames = atomic_load_explicit(&frames, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&dropped, memory_order_relaxed);
+    stats->same = atomic_load_explicit(&same, memory_order_relaxed);
+}
@@ -0,0 +1,28 @@
+#ifndef NES_CAPTURE_H
+#define NES_CAPTURE_H
+#include <stdint.h>
+#include "fb.h"
+
+/**
+ * @brief capture counters
+ *
+ */
+typedef struct capture_stats capture_stats_t;
+struct capture_stats {
+    // frames written, including repeats
+    uint32_t frames;
+
+    // frames the emulator could not queue, written as repeats of the one before
+    uint32_t dropped;
+
+    // frames identical to the one before, not copied nor converted
+    uint32_t same;
+};
+
+int capture_init(const char *video, const char *wav, int rate, int block);
+void capture_deinit();
+int capture_ready();
+void capture_frame(const fb_t *f, const int16_t *samples, int n);
+void capture_get_stats(capture_stats_t *stats);
+
+#endif // NES_CAPTURE_H
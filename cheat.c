@@ -0,0 +1,462 @@
+#include "cheat.h"
+#include "mem.h"
+#include "log.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+NES_TLS uint8_t cheat_rpage[256];
+NES_TLS uint8_t cheat_wpage[256];
+NES_TLS uint8_t cheat_active = 0;
+
+enum { CHEAT_NONE, CHEAT_PATCH, CHEAT_FREEZE, CHEAT_WATCH, CHEAT_RWATCH };
+
+typedef struct cheat cheat_t;
+struct cheat {
+    uint8_t kind;
+    uint8_t val; // value of a patch or freeze
+    int16_t cmp; // compare byte of a patch, -1 for none
+    uint16_t addr; // folded, see fold()
+    cheat_cb_t cb;
+    void *ctx;
+};
+
+static NES_TLS cheat_t cheats[CHEAT_MAX];
+static NES_TLS uint8_t muted; // watches don't call back, see cheat_mute()
+
+// a bit per address, only looked at on hooked pages
+static NES_TLS uint8_t rmap[0x10000 / 8];
+static NES_TLS uint8_t wmap[0x10000 / 8];
+
+// RAM search: 0xFF for each address still a candidate, and RAM last time
+static NES_TLS uint8_t cand[CHEAT_RAM_SZ] __attribute__((aligned(16)));
+static NES_TLS uint8_t prev[CHEAT_RAM_SZ] __attribute__((aligned(16)));
+
+/**
+ * @brief fold mirrors: RAM to $0000-$07FF, PPU registers to $2000-$2007
+ *
+ * @param addr CPU address
+ * @return uint16_t address of the cheat
+ */
+static inline uint16_t fold(uint16_t addr) {
+    if (addr < 0x2000) return addr & 0x07FF;
+    if (addr < 0x4000) return 0x2000 | (addr & 7);
+    return addr;
+}
+
+/**
+ * @brief hook every page that mirrors a folded address
+ *
+ * @param page cheat_rpage or cheat_wpage
+ * @param addr folded address
+ */
+static void hook(uint8_t *page, uint16_t addr) {
+    if (addr < 0x0800) {
+        for (int m = 0; m < 4; m++) page[(addr >> 8) + m * 8] = CHEAT_HOOK;
+    } else if (addr >= 0x2000 && addr < 0x4000) {
+        memset(page + 0x20, CHEAT_HOOK, 0x20);
+    } else {
+        page[addr >> 8] = CHEAT_HOOK;
+    }
+}
+
+/**
+ * @brief rebuild the page tables and bitmaps from the cheats
+ *
+ */
+static void rebuild() {
+    memset(cheat_rpage, 0, sizeof(cheat_rpage));
+    memset(cheat_wpage, 0, sizeof(cheat_wpage));
+    memset(rmap, 0, sizeof(rmap));
+    memset(wmap, 0, sizeof(wmap));
+    cheat_active = 0;
+
+    for (int i = 0; i < CHEAT_MAX; i++) {
+        const cheat_t *c = &cheats[i];
+        if (c->kind == CHEAT_NONE) continue;
+        if (c->kind == CHEAT_PATCH || c->kind == CHEAT_RWATCH) {
+            hook(cheat_rpage, c->addr);
+            rmap[c->addr >> 3] |= 1 << (c->addr & 7);
+        } else {
+            hook(cheat_wpage, c->addr);
+            wmap[c->addr >> 3] |= 1 << (c->addr & 7);
+        }
+        cheat_active = 1;
+    }
+}
+
+/**
+ * @brief store a frozen value into memory
+ *
+ * @param c the freeze
+ */
+static void store(const cheat_t *c) {
+    if (c->addr < 0x0800) memwrt(c->addr, c->val);
+    else if (c->addr >= 0x6000 && c->addr < 0x8000) prgram_wrt(c->addr & 0x1FFF, c->val);
+}
+
+/**
+ * @brief take a free slot
+ *
+ * @param kind CHEAT_*
+ * @param addr CPU address
+ * @return int id, -1 if all slots are taken
+ */
+static int add(uint8_t kind, uint16_t addr) {
+    for (int i = 0; i < CHEAT_MAX; i++) {
+        if (cheats[i].kind != CHEAT_NONE) continue;
+        memset(&cheats[i], 0, sizeof(cheat_t));
+        cheats[i].kind = kind;
+        cheats[i].addr = fold(addr);
+        cheats[i].cmp = -1;
+        return i;
+    }
+    log_error("cheat: no free slot, at most %d.\n", CHEAT_MAX);
+    return -1;
+}
+
+/**
+ * @brief replace what the CPU reads from an address
+ *
+ * @param addr CPU address, usually ROM
+ * @param cmp only replace when the byte there is this, -1 to always replace
+ * @param val value read instead
+ * @return int id, -1 on error
+ */
+int cheat_patch(uint16_t addr, int cmp, uint8_t val) {
+    int id = add(CHEAT_PATCH, addr);
+    if (id < 0) return -1;
+    cheats[id].cmp = cmp < 0 ? -1 : (cmp & 0xFF);
+    cheats[id].val = val;
+    rebuild();
+    return id;
+}
+
+/**
+ * @brief keep RAM or PRG-RAM at a value, whatever the game writes
+ *
+ * @param addr CPU address
+ * @param val value
+ * @return int id, -1 on error
+ */
+int cheat_freeze(uint16_t addr, uint8_t val) {
+    if (!(addr < 0x2000 || (addr >= 0x6000 && addr < 0x8000))) {
+        log_error("cheat: can't freeze $%.4x, not RAM.\n", addr);
+        return -1;
+    }
+    int id = add(CHEAT_FREEZE, addr);
+    if (id < 0) return -1;
+    cheats[id].val = val;
+    store(&cheats[id]);
+    rebuild();
+    return id;
+}
+
+/**
+ * @brief call back on each CPU write to an address
+ *
+ * @param addr CPU address
+ * @param cb callback
+ * @param ctx passed to cb
+ * @return int id, -1 on error
+ */
+int cheat_watch(uint16_t addr, cheat_cb_t cb, void *ctx) {
+    if (cb == NULL) return -1;
+    int id = add(CHEAT_WATCH, addr);
+    if (id < 0) return -1;
+    cheats[id].cb = cb;
+    cheats[id].ctx = ctx;
+    rebuild();
+    return id;
+}
+
+/**
+ * @brief call back on each CPU read of an address, e.g. for a debugger
+ *
+ * @param addr CPU address
+ * @param cb callback
+ * @param ctx passed to cb
+ * @return int id, -1 on error
+ */
+int cheat_watch_reads(uint16_t addr, cheat_cb_t cb, void *ctx) {
+    if (cb == NULL) return -1;
+    int id = add(CHEAT_RWATCH, addr);
+    if (id < 0) return -1;
+    cheats[id].cb = cb;
+    cheats[id].ctx = ctx;
+    rebuild();
+    return id;
+}
+
+/**
+ * @brief decode a Game Genie code
+ *
+ * @param code 6 or 8 letters
+ * @param addr address patched
+ * @param cmp compare byte, -1 for a 6 letter code
+ * @param val value
+ * @return int status
+ * @retval -1 not a code
+ * @retval 0 OK
+ */
+int cheat_genie_decode(const char *code, uint16_t *addr, int *cmp, uint8_t *val) {
+    static const char letters[] = "APZLGITYEOXUKSVN";
+    uint8_t n[8];
+    size_t len = strlen(code);
+    if (len != 6 && len != 8) return -1;
+    for (size_t i = 0; i < len; i++) {
+        const char *l = strchr(letters, toupper((unsigned char) code[i]));
+        if (l == NULL || *l == '\0') return -1;
+        n[i] = l - letters;
+    }
+
+    *addr = 0x8000 | ((n[3] & 7) << 12) | ((n[5] & 7) << 8) | ((n[4] & 8) << 8) |
+        ((n[2] & 7) << 4) | ((n[1] & 8) << 4) | (n[4] & 7) | (n[3] & 8);
+    *val = ((n[1] & 7) << 4) | ((n[0] & 8) << 4) | (n[0] & 7);
+    if (len == 6) {
+        *val |= n[5] & 8;
+        *cmp = -1;
+    } else {
+        *val |= n[7] & 8;
+        *cmp = ((n[7] & 7) << 4) | ((n[6] & 8) << 4) | (n[6] & 7) | (n[5] & 8);
+    }
+    return 0;
+}
+
+/**
+ * @brief add a Game Genie code
+ *
+ * @param code 6 or 8 letters
+ * @return int id, -1 on error
+ */
+int cheat_genie(const char *code) {
+    uint16_t addr;
+    int cmp;
+    uint8_t val;
+    if (cheat_genie_decode(code, &addr, &cmp, &val) < 0) {
+        log_error("cheat: '%s' is not a game genie code.\n", code);
+        return -1;
+    }
+    return cheat_patch(addr, cmp, val);
+}
+
+/**
+ * @brief add cheats from a list, e.g. from the command line
+ *
+ * items are separated by commas: a Game Genie code, AAAA:VV to freeze
+ * RAM at $AAAA to VV, or AAAA?CC:VV to read VV at $AAAA where CC is.
+ *
+ * @param list the list
+ * @return int cheats added, bad items are skipped
+ */
+int cheat_parse(const char *list) {
+    char item[32];
+    int n = 0;
+    while (*list) {
+        size_t len = strcspn(list, ",");
+        if (len > 0 && len < sizeof(item)) {
+            memcpy(item, list, len);
+            item[len] = '\0';
+            char *end;
+            unsigned long addr = strtoul(item, &end, 16), cmp = 0, val;
+            int ok = end != item && addr <= 0xFFFF;
+            if (ok && *end == '?') cmp = strtoul(end + 1, &end, 16) | 0x100;
+            if (ok && *end == ':') {
+                val = strtoul(end + 1, &end, 16);
+                ok = *end == '\0' && val <= 0xFF && cmp <= 0x1FF;
+                if (ok) ok = (cmp ? cheat_patch(addr, cmp & 0xFF, val) : cheat_freeze(addr, val)) >= 0;
+            } else {
+                ok = cheat_genie(item) >= 0;
+            }
+            if (ok) n++;
+            else log_warn("cheat: skipping '%s'.\n", item);
+        }
+        list += len;
+        if (*list == ',') list++;
+    }
+    return n;
+}
+
+/**
+ * @brief remove a cheat or watch
+ *
+ * @param id from cheat_patch(), cheat_freeze(), cheat_watch() or cheat_genie()
+ */
+void cheat_remove(int id) {
+    if (id < 0 || id >= CHEAT_MAX) return;
+    cheats[id].kind = CHEAT_NONE;
+    rebuild();
+}
+
+/**
+ * @brief remove all cheats and watches
+ *
+ */
+void cheat_clear() {
+    memset(cheats, 0, sizeof(cheats));
+    rebuild();
+}
+
+/**
+ * @brief store frozen values again, e.g. after RAM was loaded from a state
+ *
+ */
+void cheat_refreeze() {
+    for (int i = 0; i < CHEAT_MAX; i++) {
+        if (cheats[i].kind == CHEAT_FREEZE) store(&cheats[i]);
+    }
+}
+
+/**
+ * @brief hold back the callbacks of watches, e.g. for frames thrown away
+ *
+ * @param on 1 to hold them back
+ */
+void cheat_mute(int on) {
+    muted = on != 0;
+}
+
+/**
+ * @brief copy the cheats and watches, e.g. to another console
+ *
+ * watches keep the callbacks and contexts of this thread, mute them where
+ * they are loaded unless those are safe to call there.
+ *
+ * @param p output, NULL to get the size only
+ * @return size_t size
+ */
+size_t cheat_save(uint8_t *p) {
+    if (p) memcpy(p, cheats, sizeof(cheats));
+    return sizeof(cheats);
+}
+
+/**
+ * @brief replace the cheats and watches with a copy
+ *
+ * @param p from cheat_save()
+ * @return size_t size
+ */
+size_t cheat_load(const uint8_t *p) {
+    memcpy(cheats, p, sizeof(cheats));
+    rebuild();
+    return sizeof(cheats);
+}
+
+/**
+ * @brief slow path of a read from a hooked page
+ *
+ * @param addr CPU address
+ * @param val value on the bus
+ * @return uint8_t value the CPU reads
+ */
+uint8_t cheat_read(uint16_t addr, uint8_t val) {
+    addr = fold(addr);
+    if (!(rmap[addr >> 3] & (1 << (addr & 7)))) return val;
+    uint8_t out = val;
+    for (int i = 0; i < CHEAT_MAX; i++) {
+        const cheat_t *c = &cheats[i];
+        if (c->addr != addr) continue;
+        if (c->kind == CHEAT_RWATCH && !muted) c->cb(addr, val, val, c->ctx);
+        else if (c->kind == CHEAT_PATCH && (c->cmp < 0 || c->cmp == val)) out = c->val;
+    }
+    return out;
+}
+
+/**
+ * @brief slow path of a write to a hooked page
+ *
+ * @param addr CPU address
+ * @param old value there, 0 for I/O
+ * @param val value the CPU writes
+ * @return uint8_t value to store
+ */
+uint8_t cheat_write(uint16_t addr, uint8_t old, uint8_t val) {
+    addr = fold(addr);
+    if (!(wmap[addr >> 3] & (1 << (addr & 7)))) return val;
+    uint8_t out = val;
+    for (int i = 0; i < CHEAT_MAX; i++) {
+        const cheat_t *c = &cheats[i];
+        if (c->addr != addr) continue;
+        if (c->kind == CHEAT_WATCH && !muted) c->cb(addr, old, val, c->ctx);
+        else if (c->kind == CHEAT_FREEZE) out = c->val;
+    }
+    return out;
+}
+
+/**
+ * @brief start a RAM search: every address is a candidate
+ *
+ */
+void cheat_search_reset() {
+    memset(cand, 0xFF, sizeof(cand));
+    memcpy(prev, memptr(0), sizeof(prev));
+}
+
+/**
+ * @brief drop the candidates whose RAM does not compare, e.g. once a frame
+ *
+ * @param cmp CHEAT_EQ etc., RAM on the left
+ * @param val value to compare to, -1 to compare to RAM of the last search
+ * @return int candidates left
+ */
+int cheat_search(cheat_cmp_t cmp, int val) {
+    const uint8_t *ram = memptr(0);
+    int n = 0;
+#ifdef __SSE2__
+    __m128i k = _mm_set1_epi8((char) val);
+    for (int i = 0; i < CHEAT_RAM_SZ; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (ram + i));
+        __m128i b = val < 0 ? _mm_load_si128((const __m128i *) (prev + i)) : k;
+        __m128i m = _mm_load_si128((const __m128i *) (cand + i));
+        // unsigned: a <= b iff min(a, b) == a
+        switch (cmp) {
+            case CHEAT_EQ: m = _mm_and_si128(m, _mm_cmpeq_epi8(a, b)); break;
+            case CHEAT_NE: m = _mm_andnot_si128(_mm_cmpeq_epi8(a, b), m); break;
+            case CHEAT_LE: m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(a, b), a)); break;
+            case CHEAT_GT: m = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_min_epu8(a, b), a), m); break;
+            case CHEAT_GE: m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(a, b), a)); break;
+            case CHEAT_LT: m = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_max_epu8(a, b), a), m); break;
+        }
+        _mm_store_si128((__m128i *) (cand + i), m);
+        _mm_store_si128((__m128i *) (prev + i), a);
+        n += __builtin_popcount(_mm_movemask_epi8(m));
+    }
+#else
+    for (int i = 0; i < CHEAT_RAM_SZ; i++) {
+        uint8_t a = ram[i], b = val < 0 ? prev[i] : (uint8_t) val;
+        int ok = 0;
+        switch (cmp) {
+            case CHEAT_EQ: ok = a == b; break;
+            case CHEAT_NE: ok = a != b; break;
+            case CHEAT_LT: ok = a < b; break;
+            case CHEAT_GT: ok = a > b; break;
+            case CHEAT_LE: ok = a <= b; break;
+            case CHEAT_GE: ok = a >= b; break;
+        }
+        if (!ok) cand[i] = 0;
+        prev[i] = a;
+        n += cand[i] != 0;
+    }
+#endif
+    return n;
+}
+
+/**
+ * @brief list the candidates of a RAM search
+ *
+ * @param out addresses
+ * @param max size of out
+ * @return int candidates, may be more than max
+ */
+int cheat_search_results(uint16_t *out, int max) {
+    int n = 0;
+    for (int i = 0; i < CHEAT_RAM_SZ; i++) {
+        if (!cand[i]) continue;
+        if (n < max) out[n] = i;
+        n++;
+    }
+    return n;
+}
@@ -0,0 +1,56 @@
+#ifndef NES_CHEAT_H
+#define NES_CHEAT_H
+#include <stdint.h>
+#include <unistd.h>
+#include "types.h"
+
+#define CHEAT_MAX 64 // cheats and watches at once
+#define CHEAT_HOOK 8 // or'ed into the CPU's region of a hooked page
+#define CHEAT_RAM_SZ 0x800 // what RAM search looks at
+
+/*
+ * the CPU dispatches an access on (addr >> 13) | cheat_?page[addr >> 8],
+ * so with nothing set both tables are zero and no access pays for the
+ * cheats. a hooked page takes the slow path, which checks the address
+ * against a bitmap before looking for the cheat.
+ */
+extern NES_TLS uint8_t cheat_rpage[256]; // pages with ROM patches or read watches
+extern NES_TLS uint8_t cheat_wpage[256]; // pages with freezes or watches
+extern NES_TLS uint8_t cheat_active; // anything is set
+
+/**
+ * @brief called on a write (or read) of a watched address
+ *
+ * @param addr address accessed, RAM mirrors folded to $0000-$07FF
+ * @param old value before the write, 0 for I/O; the value read for reads
+ * @param val value written or read
+ * @param ctx from cheat_watch()
+ */
+typedef void (*cheat_cb_t)(uint16_t addr, uint8_t old, uint8_t val, void *ctx);
+
+/* comparisons of RAM search */
+typedef enum cheat_cmp {
+    CHEAT_EQ, CHEAT_NE, CHEAT_LT, CHEAT_GT, CHEAT_LE, CHEAT_GE,
+} cheat_cmp_t;
+
+int cheat_patch(uint16_t addr, int cmp, uint8_t val);
+int cheat_freeze(uint16_t addr, uint8_t val);
+int cheat_watch(uint16_t addr, cheat_cb_t cb, void *ctx);
+int cheat_watch_reads(uint16_t addr, cheat_cb_t cb, void *ctx);
+int cheat_genie(const char *code);
+int cheat_genie_decode(const char *code, uint16_t *addr, int *cmp, uint8_t *val);
+int cheat_parse(const char *list);
+void cheat_remove(int id);
+void cheat_clear();
+void cheat_refreeze();
+void cheat_mute(int on);
+size_t cheat_save(uint8_t *p);
+size_t cheat_load(const uint8_t *p);
+uint8_t cheat_read(uint16_t addr, uint8_t val);
+uint8_t cheat_write(uint16_t addr, uint8_t old, uint8_t val);
+
+void cheat_search_reset();
+int cheat_search(cheat_cmp_t cmp, int val);
+int cheat_search_results(uint16_t *out, int max);
+
+#endif // NES_CHEAT_H
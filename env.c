@@ -0,0 +1,396 @@
+#include "env.h"
+#include "nes.h"
+#include "apu.h"
+#include "mem.h"
+#include "input.h"
+#include "jit.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef JIT_SINGLE_THREAD
+#error "the env runs an instance per thread, build it without JIT=1"
+#endif
+
+/*
+ * every worker thread has its own console (the emulator state is thread
+ * local) and always runs the same instances, i = id, id + nthreads, ...
+ * with one instance per thread the console is never swapped; with more, an
+ * instance's state is loaded into the console before it runs and saved
+ * when another instance takes its place.
+ */
+
+typedef struct worker worker_t;
+struct worker {
+    env_batch_t *b;
+    pthread_t thread;
+    int id;
+    int live; // instance in this thread's console, -1 for none
+};
+
+struct env_batch {
+    int n, nthreads;
+    uint8_t *rom;
+    size_t rom_sz;
+    size_t state_sz;
+    uint8_t *states; // [n][state_sz], stale while the instance is live
+    uint8_t *boot; // power-on state
+    uint8_t *pending; // [n] state was replaced, load it before running
+    uint8_t *obs; // [n][NES_H][NES_W]
+    uint8_t *ram; // [n][ENV_RAM_SZ]
+    worker_t *workers;
+
+    // the current job, guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t go, done;
+    uint64_t gen; // bumped for each job
+    int busy; // workers still on the job
+    int quit;
+    int failed;
+    const uint8_t *actions;
+    int frames; // 0: only apply pending resets
+    int sync; // write the live states back
+};
+
+static inline uint8_t *state_of(env_batch_t *b, int i) {
+    return b->states + (size_t) i * b->state_sz;
+}
+
+/**
+ * @brief make an instance the live one of a worker
+ *
+ * @param w the worker
+ * @param i instance
+ * @return int status
+ * @retval -1 bad state
+ * @retval 0 OK
+ */
+static int activate(worker_t *w, int i) {
+    env_batch_t *b = w->b;
+    if (w->live == i && !b->pending[i]) return 0;
+
+    // a pending reset already replaced the saved state of the live one
+    if (w->live >= 0 && w->live != i && !b->pending[w->live]) nes_save(state_of(b, w->live));
+    b->pending[i] = 0;
+    w->live = i;
+    return nes_load(state_of(b, i), b->state_sz);
+}
+
+/**
+ * @brief copy out the observation of the live instance
+ *
+ * @param w the worker
+ */
+static void publish(worker_t *w) {
+    env_batch_t *b = w->b;
+    memcpy(b->obs + (size_t) w->live * ENV_OBS_SZ, fb_frame()->idx, ENV_OBS_SZ);
+    memcpy(b->ram + (size_t) w->live * ENV_RAM_SZ, memptr(0), ENV_RAM_SZ);
+}
+
+/**
+ * @brief power up this thread's console and seed the instances it owns
+ *
+ * @param w the worker
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+static int worker_boot(worker_t *w) {
+    env_batch_t *b = w->b;
+    nes_meta_t meta;
+    if (nes_init(&meta, b->rom, b->rom_sz) < 0) return -1;
+
+    for (int i = w->id; i < b->n; i += b->nthreads) nes_save(state_of(b, i));
+    w->live = w->id;
+    publish(w);
+    for (int i = w->id + b->nthreads; i < b->n; i += b->nthreads) {
+        memcpy(b->obs + (size_t) i * ENV_OBS_SZ, b->obs + (size_t) w->id * ENV_OBS_SZ, ENV_OBS_SZ);
+        memcpy(b->ram + (size_t) i * ENV_RAM_SZ, b->ram + (size_t) w->id * ENV_RAM_SZ, ENV_RAM_SZ);
+    }
+    return 0;
+}
+
+/**
+ * @brief run the current job on the instances of a worker
+ *
+ * @param w the worker
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+static int worker_run(worker_t *w) {
+    env_batch_t *b = w->b;
+    int16_t samples[4096];
+    int ret = 0;
+
+    for (int i = w->id; i < b->n; i += b->nthreads) {
+        if (b->frames == 0 && !b->pending[i]) continue;
+        if (activate(w, i) < 0) {
+            ret = -1;
+            continue;
+        }
+
+        input_set(0, b->actions ? b->actions[i] : 0);
+        for (int f = 0; f < b->frames; f++) {
+            if (nes_frame() < 0) ret = -1;
+            // nothing listens, but the APU buffer must be drained each frame
+            apu_end_frame(samples, sizeof(samples) / sizeof(int16_t));
+        }
+        publish(w);
+    }
+
+    if (b->sync && w->live >= 0) nes_save(state_of(b, w->live));
+    return ret;
+}
+
+/**
+ * @brief worker thread body
+ *
+ * @param p the worker
+ * @return void* NULL
+ */
+static void *worker_main(void *p) {
+    worker_t *w = (worker_t *) p;
+    env_batch_t *b = w->b;
+    int r = worker_boot(w);
+
+    pthread_mutex_lock(&b->lock);
+    if (r < 0) b->failed = 1;
+    uint64_t seen = b->gen;
+    if (--b->busy == 0) pthread_cond_signal(&b->done);
+    for (;;) {
+        while (b->gen == seen && !b->quit) pthread_cond_wait(&b->go, &b->lock);
+        if (b->quit) break;
+        seen = b->gen;
+        pthread_mutex_unlock(&b->lock);
+
+        r = worker_run(w);
+
+        pthread_mutex_lock(&b->lock);
+        if (r < 0) b->failed = 1;
+        if (--b->busy == 0) pthread_cond_signal(&b->done);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+/**
+ * @brief hand a job to all workers and wait for it
+ *
+ * @param b the batch
+ * @param actions buttons per instance, NULL for none
+ * @param frames frames to run
+ * @param sync write the live states back
+ * @return int status
+ * @retval -1 an instance failed
+ * @retval 0 OK
+ */
+static int run_job(env_batch_t *b, const uint8_t *actions, int frames, int sync) {
+    pthread_mutex_lock(&b->lock);
+    b->actions = actions;
+    b->frames = frames;
+    b->sync = sync;
+    b->failed = 0;
+    b->busy = b->nthreads;
+    b->gen++;
+    pthread_cond_broadcast(&b->go);
+    while (b->busy) pthread_cond_wait(&b->done, &b->lock);
+    int ret = b->failed ? -1 : 0;
+    pthread_mutex_unlock(&b->lock);
+    return ret;
+}
+
+/**
+ * @brief stop the workers and free the batch
+ *
+ * @param b the batch
+ */
+void env_destroy(env_batch_t *b) {
+    if (b == NULL) return;
+    pthread_mutex_lock(&b->lock);
+    b->quit = 1;
+    pthread_cond_broadcast(&b->go);
+    pthread_mutex_unlock(&b->lock);
+    for (int i = 0; i < b->nthreads; i++) {
+        if (b->workers[i].b != NULL) pthread_join(b->workers[i].thread, NULL);
+    }
+
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->go);
+    pthread_cond_destroy(&b->done);
+    free(b->workers);
+    free(b->ram);
+    free(b->obs);
+    free(b->pending);
+    free(b->boot);
+    free(b->states);
+    free(b->rom);
+    free(b);
+}
+
+/**
+ * @brief create a batch of consoles, all powered up with the same ROM
+ *
+ * @param rom rom image, copied
+ * @param sz size of rom
+ * @param n num of instances
+ * @param threads num of worker threads, 0 for one per CPU
+ * @return env_batch_t* the batch, NULL on failure
+ */
+env_batch_t *env_create(const uint8_t *rom, size_t sz, int n, int threads) {
+    if (n <= 0) {
+        log_error("env: need at least one instance.\n");
+        return NULL;
+    }
+    if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+    if (threads > n) threads = n;
+
+    env_batch_t *b = calloc(1, sizeof(env_batch_t));
+    if (b == NULL) return NULL;
+    b->n = n;
+    b->nthreads = threads;
+    b->rom_sz = sz;
+    b->state_sz = nes_state_size();
+    b->rom = malloc(sz);
+    b->states = malloc(b->state_sz * n);
+    b->boot = malloc(b->state_sz);
+    b->pending = calloc(n, 1);
+    b->obs = malloc((size_t) n * ENV_OBS_SZ);
+    b->ram = malloc((size_t) n * ENV_RAM_SZ);
+    b->workers = calloc(threads, sizeof(worker_t));
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->go, NULL);
+    pthread_cond_init(&b->done, NULL);
+    if (!b->rom || !b->states || !b->boot || !b->pending || !b->obs || !b->ram || !b->workers) {
+        log_error("env: out of memory.\n");
+        b->nthreads = 0;
+        env_destroy(b);
+        return NULL;
+    }
+    memcpy(b->rom, rom, sz);
+
+    b->busy = threads;
+    for (int i = 0; i < threads; i++) {
+        worker_t *w = &b->workers[i];
+        w->b = b;
+        w->id = i;
+        w->live = -1;
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            log_error("env: can't start worker %d.\n", i);
+            w->b = NULL;
+            pthread_mutex_lock(&b->lock);
+            b->busy -= threads - i;
+            b->failed = 1;
+            pthread_mutex_unlock(&b->lock);
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&b->lock);
+    while (b->busy) pthread_cond_wait(&b->done, &b->lock);
+    int failed = b->failed;
+    pthread_mutex_unlock(&b->lock);
+    if (failed) {
+        env_destroy(b);
+        return NULL;
+    }
+
+    memcpy(b->boot, state_of(b, 0), b->state_sz);
+    return b;
+}
+
+/**
+ * @brief run every instance for some frames
+ *
+ * @param b the batch
+ * @param actions BTN_* mask of controller 1 per instance, held for all
+ * frames, NULL for none
+ * @param frames num of frames
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int env_step(env_batch_t *b, const uint8_t *actions, int frames) {
+    if (frames <= 0) {
+        log_error("env: bad num of frames: %d.\n", frames);
+        return -1;
+    }
+    return run_job(b, actions, frames, 0);
+}
+
+/**
+ * @brief get the last frame of every instance
+ *
+ * @param b the batch
+ * @return const uint8_t* [n][NES_H][NES_W] palette indices
+ */
+const uint8_t *env_obs(const env_batch_t *b) {
+    return b->obs;
+}
+
+/**
+ * @brief get the RAM of every instance, as of the last frame
+ *
+ * @param b the batch
+ * @return const uint8_t* [n][ENV_RAM_SZ]
+ */
+const uint8_t *env_ram(const env_batch_t *b) {
+    return b->ram;
+}
+
+/**
+ * @brief get the size of a state for env_save/env_reset
+ *
+ * @param b the batch
+ * @return size_t size
+ */
+size_t env_state_size(const env_batch_t *b) {
+    return b->state_sz;
+}
+
+/**
+ * @brief save an instance
+ *
+ * @param b the batch
+ * @param i instance
+ * @param state output of env_state_size() bytes
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int env_save(env_batch_t *b, int i, uint8_t *state) {
+    if (i < 0 || i >= b->n) return -1;
+    if (run_job(b, NULL, 0, 1) < 0) return -1;
+    memcpy(state, state_of(b, i), b->state_sz);
+    return 0;
+}
+
+/**
+ * @brief reset an instance to a saved state, its observation is updated
+ *
+ * @param b the batch
+ * @param i instance
+ * @param state from env_save, NULL for power-on
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int env_reset(env_batch_t *b, int i, const uint8_t *state) {
+    if (i < 0 || i >= b->n) return -1;
+    if (state == NULL) state = b->boot;
+
+    nes_state_hdr_t hdr;
+    memcpy(&hdr, state, sizeof(hdr));
+    // checked here as nes_load() does, a failure in the worker is not seen
+    if (memcmp(hdr.magic, NES_STATE_MAGIC, 4) != 0 || hdr.version != NES_STATE_VERSION ||
+        hdr.size != b->state_sz) {
+        log_error("env: bad state for instance %d.\n", i);
+        return -1;
+    }
+
+    memcpy(state_of(b, i), state, b->state_sz);
+    b->pending[i] = 1;
+    return run_job(b, NULL, 0, 0);
+}
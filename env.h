@@ -0,0 +1,25 @@
+#ifndef NES_ENV_H
+#define NES_ENV_H
+#include <stdint.h>
+#include <unistd.h>
+#include "fb.h"
+
+#define ENV_OBS_SZ (NES_H * NES_W) // palette indices per instance
+#define ENV_RAM_SZ 0x800
+
+/**
+ * @brief a batch of consoles running the same ROM, stepped together
+ *
+ */
+typedef struct env_batch env_batch_t;
+
+env_batch_t *env_create(const uint8_t *rom, size_t sz, int n, int threads);
+void env_destroy(env_batch_t *b);
+int env_step(env_batch_t *b, const uint8_t *actions, int frames);
+const uint8_t *env_obs(const env_batch_t *b);
+const uint8_t *env_ram(const env_batch_t *b);
+size_t env_state_size(const env_batch_t *b);
+int env_save(env_batch_t *b, int i, uint8_t *state);
+int env_reset(env_batch_t *b, int i, const uint8_t *state);
+
+#endif // NES_ENV_H
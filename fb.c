@@ -0,0 +1,243 @@
+#include "fb.h"
+#include "pal.h"
+#include "types.h"
+#include "stats.h"
+#include <memory.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * frame hash: 8 lanes of 64 bits eat 64-byte stripes, xxh3 style (a
+ * 32x32->64 multiply of the keyed input, plus the input itself added to the
+ * neighbour lane), scrambled every block and merged with 128-bit multiplies.
+ * the SSE2 and the scalar paths give the same hash.
+ */
+#define HASH_STRIPE 64
+#define HASH_BLOCK 16 // stripes between scrambles
+#define PRIME32_1 0x9E3779B1U
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+
+static const uint64_t hash_key[8] = {
+    0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL, 0xDB979083E96DD4DEULL, 0x1F67B3B7A4A44072ULL,
+    0x78E5C0CC4EE679CBULL, 0x2172FFCC7DD05A82ULL, 0x8E2443F7744608B8ULL, 0x4C263A81E69035E0ULL,
+};
+
+static NES_TLS fb_t frame;
+static NES_TLS fb_sink_t sink;
+static NES_TLS uint64_t hash, prev_hash; // of the last two completed frames
+
+/**
+ * @brief store a finished row of the current frame
+ * 
+ * @param y row
+ * @param line NES_W palette indices
+ * @param emph color emphasis bits
+ */
+void fb_put_line(int y, const uint8_t *line, uint8_t emph) {
+    if ((unsigned) y >= NES_H) return;
+    memcpy(frame.idx[y], line, NES_W);
+    frame.emph[y] = emph;
+    if (sink.line) sink.line(y, line, emph);
+}
+
+/**
+ * @brief feed one stripe into the lanes
+ *
+ * @param acc lanes
+ * @param p HASH_STRIPE bytes
+ */
+static inline void hash_stripe(uint64_t *acc, const uint8_t *p) {
+#ifdef __SSE2__
+    for (int j = 0; j < 8; j += 2) {
+        __m128i d = _mm_loadu_si128((const __m128i *) (p + j * 8));
+        __m128i dk = _mm_xor_si128(d, _mm_loadu_si128((const __m128i *) &hash_key[j]));
+        __m128i m = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(3, 3, 1, 1)));
+        __m128i a = _mm_loadu_si128((const __m128i *) &acc[j]);
+        a = _mm_add_epi64(a, _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+        _mm_storeu_si128((__m128i *) &acc[j], _mm_add_epi64(a, m));
+    }
+#else
+    for (int j = 0; j < 8; j++) {
+        uint64_t d, dk;
+        memcpy(&d, p + j * 8, 8);
+        dk = d ^ hash_key[j];
+        acc[j ^ 1] += d;
+        acc[j] += (dk & 0xFFFFFFFF) * (dk >> 32);
+    }
+#endif
+}
+
+/**
+ * @brief scramble the lanes, so that the multiplies don't lose entropy
+ *
+ * @param acc lanes
+ */
+static inline void hash_scramble(uint64_t *acc) {
+    for (int j = 0; j < 8; j++) {
+        uint64_t a = acc[j];
+        a ^= a >> 47;
+        a ^= hash_key[7 - j];
+        acc[j] = a * PRIME32_1;
+    }
+}
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    __uint128_t m = (__uint128_t) a * b;
+    return (uint64_t) m ^ (uint64_t) (m >> 64);
+}
+
+/**
+ * @brief 64-bit hash of a frame, pixels and emphasis bits
+ *
+ * @param f the frame
+ * @return uint64_t hash
+ */
+uint64_t fb_hash_frame(const fb_t *f) {
+    const uint8_t *p = (const uint8_t *) f;
+    const size_t len = sizeof(fb_t);
+    uint64_t acc[8] = {
+        PRIME32_1, PRIME64_1, PRIME64_2, ~PRIME64_1, PRIME64_2 >> 1, PRIME64_1 >> 3, ~PRIME32_1, PRIME64_1 ^ PRIME64_2,
+    };
+
+    size_t i = 0, n = 0;
+    for (; i + HASH_STRIPE <= len; i += HASH_STRIPE) {
+        hash_stripe(acc, p + i);
+        if (++n % HASH_BLOCK == 0) hash_scramble(acc);
+    }
+    if (i < len) {
+        uint8_t tail[HASH_STRIPE] = { 0 };
+        memcpy(tail, p + i, len - i);
+        hash_stripe(acc, tail);
+    }
+
+    uint64_t h = len * PRIME64_1;
+    for (int j = 0; j < 8; j += 2) h += hash_mix(acc[j] ^ hash_key[j], acc[j + 1] ^ hash_key[j + 1]);
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ (h >> 32);
+}
+
+/**
+ * @brief mark the current frame as complete
+ * 
+ */
+void fb_end_frame() {
+    prev_hash = hash;
+    hash = fb_hash_frame(&frame);
+    if (hash == prev_hash) stats_cur.dup_frames++;
+    if (sink.frame) sink.frame(&frame);
+}
+
+/**
+ * @brief output a whole frame made elsewhere, e.g. by another console
+ *
+ * @param f the frame
+ */
+void fb_put_frame(const fb_t *f) {
+    for (int y = 0; y < NES_H; y++) fb_put_line(y, f->idx[y], f->emph[y]);
+    fb_end_frame();
+}
+
+/**
+ * @brief get the hash of the last completed frame
+ *
+ * @return uint64_t hash
+ */
+uint64_t fb_hash() {
+    return hash;
+}
+
+/**
+ * @brief check if the last completed frame is the same as the one before
+ *
+ * @return int 1 if it is a duplicate
+ */
+int fb_dup() {
+    return hash == prev_hash;
+}
+
+/**
+ * @brief get the current frame
+ * 
+ * @return const fb_t* the frame
+ */
+const fb_t* fb_frame() {
+    return &frame;
+}
+
+/**
+ * @brief set the consumer of the PPU output
+ * 
+ * @param s the sink, NULL to remove
+ */
+void fb_set_sink(const fb_sink_t *s) {
+    if (s) sink = *s;
+    else memset(&sink, 0, sizeof(sink));
+}
+
+/**
+ * @brief save the current frame
+ * 
+ * @param p output, NULL to get the size only
+ * @return size_t size
+ */
+size_t fb_save(uint8_t *p) {
+    if (p) memcpy(p, &frame, sizeof(frame));
+    return sizeof(frame);
+}
+
+/**
+ * @brief load the current frame
+ * 
+ * @param p saved state
+ * @return size_t size
+ */
+size_t fb_load(const uint8_t *p) {
+    memcpy(&frame, p, sizeof(frame));
+    hash = fb_hash_frame(&frame);
+    prev_hash = ~hash; // nothing was shown before it
+    return sizeof(frame);
+}
+
+/**
+ * @brief convert a frame to ARGB8888
+ * 
+ * @param f the frame
+ * @param dst destination
+ * @param pitch bytes per row of dst
+ */
+void fb_argb8888(const fb_t *f, void *dst, int pitch) {
+    for (int y = 0; y < NES_H; y++) {
+        pal_argb8888((uint32_t *) ((uint8_t *) dst + y * pitch), f->idx[y], f->emph[y], NES_W);
+    }
+}
+
+/**
+ * @brief convert a frame to RGB565
+ * 
+ * @param f the frame
+ * @param dst destination
+ * @param pitch bytes per row of dst
+ */
+void fb_rgb565(const fb_t *f, void *dst, int pitch) {
+    for (int y = 0; y < NES_H; y++) {
+        pal_rgb565((uint16_t *) ((uint8_t *) dst + y * pitch), f->idx[y], f->emph[y], NES_W);
+    }
+}
+
+/**
+ * @brief convert a frame to planar YUV 4:2:0 (I420)
+ * 
+ * @param f the frame
+ * @param y luma plane, NES_W * NES_H bytes
+ * @param u cb plane, NES_W/2 * NES_H/2 bytes
+ * @param v cr plane, NES_W/2 * NES_H/2 bytes
+ */
+void fb_yuv420(const fb_t *f, uint8_t *y, uint8_t *u, uint8_t *v) {
+    for (int r = 0; r < NES_H; r += 2) {
+        pal_yuv420(y + r * NES_W, u + (r / 2) * (NES_W / 2), v + (r / 2) * (NES_W / 2),
+            f->idx[r], f->emph[r], f->idx[r + 1], f->emph[r + 1], NES_W);
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef NES_FB_H
+#define NES_FB_H
+#include <stdint.h>
+#include <unistd.h>
+#define NES_W 256
+#define NES_H 240
+
+/**
+ * @brief palette-indexed frame as produced by the PPU
+ * 
+ */
+typedef struct fb fb_t;
+struct fb {
+    // 6-bit palette index of every pixel
+    uint8_t idx[NES_H][NES_W];
+
+    // color emphasis bits (ppumask >> 5) of every row
+    uint8_t emph[NES_H];
+};
+
+/**
+ * @brief consumer of the PPU output, both callbacks are optional
+ * 
+ */
+typedef struct fb_sink fb_sink_t;
+struct fb_sink {
+    // called with each finished row, while it is still hot in cache
+    void (*line)(int y, const uint8_t *line, uint8_t emph);
+
+    // called once the frame is complete
+    void (*frame)(const fb_t *frame);
+};
+
+void fb_put_line(int y, const uint8_t *line, uint8_t emph);
+void fb_end_frame();
+void fb_put_frame(const fb_t *f);
+const fb_t* fb_frame();
+void fb_set_sink(const fb_sink_t *sink);
+uint64_t fb_hash_frame(const fb_t *f);
+uint64_t fb_hash();
+int fb_dup();
+size_t fb_save(uint8_t *p);
+size_t fb_load(const uint8_t *p);
+
+void fb_argb8888(const fb_t *f, void *dst, int pitch);
+void fb_rgb565(const fb_t *f, void *dst, int pitch);
+void fb_yuv420(const fb_t *f, uint8_t *y, uint8_t *u, uint8_t *v);
+
+#endif // NES_FB_H
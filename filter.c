@@ -0,0 +1,642 @@
+#include <math.h> // before log.h, which defines __log
+#include "filter.h"
+#include "pal.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#define FILTER_AVX2
+#include <immintrin.h>
+#endif
+
+/*
+ * the filters work on 9-bit keys, emphasis << 6 | palette index, so two
+ * pixels are equal iff their keys are. keys are turned into ARGB at the
+ * very end, or blended through the palette where a filter mixes colors.
+ */
+#define KEYS 512
+#define PAD 16 // keys left and right of a row, replicating the edge
+#define PADY 2 // rows above and below, xBR looks 2 away
+#define SRC_STRIDE (NES_W + 2 * PAD)
+#define MID_W (NES_W * 2)
+#define MID_H (NES_H * 2)
+#define MID_STRIDE (MID_W + 2 * PAD)
+#define MAX_W (NES_W * 4)
+#define MAX_THREADS 16
+
+#define SRC(y) (src + ((y) + PADY) * SRC_STRIDE + PAD)
+#define MID(y) (mid + ((y) + 1) * MID_STRIDE + PAD)
+
+/* composite signal, from the nesdev wiki's NTSC video article */
+#define NTSC_BLACK 0.518
+#define NTSC_WHITE 1.962
+#define NTSC_ATTN 0.746
+#define NTSC_HUE 3.8 // in samples, fitted to the RGB palette
+#define NTSC_SAT 0.9
+
+static const double ntsc_levels[8] = {
+    0.350, 0.518, 0.962, 1.550, // low
+    1.094, 1.506, 1.962, 1.962, // high
+};
+
+static int filter_initialized = 0;
+static filter_kind_t kind = FILTER_NONE;
+
+static uint16_t src[(NES_H + 2 * PADY) * SRC_STRIDE] __attribute__((aligned(32)));
+static uint16_t *mid; // Scale4x first pass, one row above and below
+static uint32_t lut[KEYS];
+static uint16_t dist_tab[64][64]; // weighted YUV distance of palette entries
+
+// contributions to an output pixel, in 1/16, B G R A: first half, second
+// half and all of an input pixel, for each of the 3 subcarrier phases it
+// can start at
+static int16_t ntsc_tab[3][KEYS][3][4] __attribute__((aligned(8)));
+static uint64_t frames = 0;
+
+// the frame being filtered
+static uint8_t *out;
+static int out_pitch;
+
+// band workers, the caller runs band 0
+static int nthreads = 1;
+static pthread_t pool[MAX_THREADS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t go = PTHREAD_COND_INITIALIZER, done = PTHREAD_COND_INITIALIZER;
+static uint64_t gen, gen0;
+static int busy, quit;
+static int stage, rows; // the job: what to run, over how many rows
+
+static void scale2x_row_c(const uint16_t *b, const uint16_t *e, const uint16_t *h, uint16_t *o0, uint16_t *o1, int w);
+static void scale3x_row_c(const uint16_t *b, const uint16_t *e, const uint16_t *h, uint16_t *o0, uint16_t *o1, uint16_t *o2, int w);
+static void ntsc_row_c(uint32_t *d, const uint16_t *k, int cls);
+
+static void (*do_scale2x_row)(const uint16_t *, const uint16_t *, const uint16_t *, uint16_t *, uint16_t *, int) = scale2x_row_c;
+static void (*do_scale3x_row)(const uint16_t *, const uint16_t *, const uint16_t *, uint16_t *, uint16_t *, uint16_t *, int) = scale3x_row_c;
+static void (*do_ntsc_row)(uint32_t *, const uint16_t *, int) = ntsc_row_c;
+
+static inline void pad_row(uint16_t *r, int w) {
+    for (int i = 1; i <= PAD; i++) {
+        r[-i] = r[0];
+        r[w - 1 + i] = r[w - 1];
+    }
+}
+
+static inline void lut_row(uint32_t *d, const uint16_t *k, int n) {
+    for (int i = 0; i < n; i++) d[i] = lut[k[i]];
+}
+
+static inline uint32_t *out_row(int y) {
+    return (uint32_t *) (out + (size_t) y * out_pitch);
+}
+
+/** begin generic implementations **/
+static void scale2x_row_c(const uint16_t *b, const uint16_t *e, const uint16_t *h, uint16_t *o0, uint16_t *o1, int w) {
+    for (int x = 0; x < w; x++) {
+        uint16_t B = b[x], D = e[x - 1], E = e[x], F = e[x + 1], H = h[x];
+        if (B != H && D != F) {
+            o0[2 * x] = D == B ? D : E;
+            o0[2 * x + 1] = B == F ? F : E;
+            o1[2 * x] = D == H ? D : E;
+            o1[2 * x + 1] = H == F ? F : E;
+        } else {
+            o0[2 * x] = o0[2 * x + 1] = o1[2 * x] = o1[2 * x + 1] = E;
+        }
+    }
+}
+
+static void scale3x_row_c(const uint16_t *b, const uint16_t *e, const uint16_t *h, uint16_t *o0, uint16_t *o1, uint16_t *o2, int w) {
+    for (int x = 0; x < w; x++) {
+        uint16_t A = b[x - 1], B = b[x], C = b[x + 1];
+        uint16_t D = e[x - 1], E = e[x], F = e[x + 1];
+        uint16_t G = h[x - 1], H = h[x], I = h[x + 1];
+        uint16_t *r0 = o0 + 3 * x, *r1 = o1 + 3 * x, *r2 = o2 + 3 * x;
+        if (B != H && D != F) {
+            r0[0] = D == B ? D : E;
+            r0[1] = (D == B && E != C) || (B == F && E != A) ? B : E;
+            r0[2] = B == F ? F : E;
+            r1[0] = (D == B && E != G) || (D == H && E != A) ? D : E;
+            r1[1] = E;
+            r1[2] = (B == F && E != I) || (H == F && E != C) ? F : E;
+            r2[0] = D == H ? D : E;
+            r2[1] = (D == H && E != I) || (H == F && E != G) ? H : E;
+            r2[2] = H == F ? F : E;
+        } else {
+            r0[0] = r0[1] = r0[2] = r1[0] = r1[1] = r1[2] = r2[0] = r2[1] = r2[2] = E;
+        }
+    }
+}
+
+static void ntsc_row_c(uint32_t *d, const uint16_t *k, int cls) {
+    int c = cls;
+    for (int x = 0; x < NES_W; x++, c = c == 0 ? 2 : c - 1) {
+        const int16_t *f = ntsc_tab[c][k[x]][2];
+        const int16_t *l = ntsc_tab[c == 2 ? 0 : c + 1][k[x - 1]][1];
+        const int16_t *r = ntsc_tab[c == 0 ? 2 : c - 1][k[x + 1]][0];
+        uint32_t p0 = 0, p1 = 0;
+        for (int ch = 0; ch < 4; ch++) {
+            int v0 = (f[ch] + l[ch]) >> 4, v1 = (f[ch] + r[ch]) >> 4;
+            p0 |= (uint32_t) (v0 < 0 ? 0 : v0 > 255 ? 255 : v0) << (8 * ch);
+            p1 |= (uint32_t) (v1 < 0 ? 0 : v1 > 255 ? 255 : v1) << (8 * ch);
+        }
+        d[2 * x] = p0;
+        d[2 * x + 1] = p1;
+    }
+}
+/** end generic implementations **/
+
+#ifdef __SSE2__
+/** begin SSE2 implementations **/
+static inline __m128i sel128(__m128i m, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+static void scale2x_row_sse2(const uint16_t *b, const uint16_t *e, const uint16_t *h, uint16_t *o0, uint16_t *o1, int w) {
+    for (int x = 0; x < w; x += 8) {
+        __m128i B = _mm_loadu_si128((const __m128i *) (b + x));
+        __m128i H = _mm_loadu_si128((const __m128i *) (h + x));
+        __m128i D = _mm_loadu_si128((const __m128i *) (e + x - 1));
+        __m128i E = _mm_loadu_si128((const __m128i *) (e + x));
+        __m128i F = _mm_loadu_si128((const __m128i *) (e + x + 1));
+        __m128i c = _mm_or_si128(_mm_cmpeq_epi16(B, H), _mm_cmpeq_epi16(D, F)); // inverted
+        __m128i e0 = sel128(_mm_andnot_si128(c, _mm_cmpeq_epi16(D, B)), D, E);
+        __m128i e1 = sel128(_mm_andnot_si128(c, _mm_cmpeq_epi16(B, F)), F, E);
+        __m128i e2 = sel128(_mm_andnot_si128(c, _mm_cmpeq_epi16(D, H)), D, E);
+        __m128i e3 = sel128(_mm_andnot_si128(c, _mm_cmpeq_epi16(H, F)), F, E);
+        _mm_storeu_si128((__m128i *) (o0 + 2 * x), _mm_unpacklo_epi16(e0, e1));
+        _mm_storeu_si128((__m128i *) (o0 + 2 * x + 8), _mm_unpackhi_epi16(e0, e1));
+        _mm_storeu_si128((__m128i *) (o1 + 2 * x), _mm_unpacklo_epi16(e2, e3));
+        _mm_storeu_si128((__m128i *) (o1 + 2 * x + 8), _mm_unpackhi_epi16(e2, e3));
+    }
+}
+
+static void scale3x_row_sse2(const uint16_t *b, const uint16_t *e, const uint16_t *h, uint16_t *o0, uint16_t *o1, uint16_t *o2, int w) {
+    uint16_t t[9][8] __attribute__((aligned(16)));
+    for (int x = 0; x < w; x += 8) {
+        __m128i A = _mm_loadu_si128((const __m128i *) (b + x - 1));
+        __m128i B = _mm_loadu_si128((const __m128i *) (b + x));
+        __m128i C = _mm_loadu_si128((const __m128i *) (b + x + 1));
+        __m128i D = _mm_loadu_si128((const __m128i *) (e + x - 1));
+        __m128i E = _mm_loadu_si128((const __m128i *) (e + x));
+        __m128i F = _mm_loadu_si128((const __m128i *) (e + x + 1));
+        __m128i G = _mm_loadu_si128((const __m128i *) (h + x - 1));
+        __m128i H = _mm_loadu_si128((const __m128i *) (h + x));
+        __m128i I = _mm_loadu_si128((const __m128i *) (h + x + 1));
+        __m128i c = _mm_or_si128(_mm_cmpeq_epi16(B, H), _mm_cmpeq_epi16(D, F)); // inverted
+        __m128i db = _mm_andnot_si128(c, _mm_cmpeq_epi16(D, B)), bf = _mm_andnot_si128(c, _mm_cmpeq_epi16(B, F));
+        __m128i dh = _mm_andnot_si128(c, _mm_cmpeq_epi16(D, H)), hf = _mm_andnot_si128(c, _mm_cmpeq_epi16(H, F));
+        // E != X, as masks to and-not with
+        __m128i ea = _mm_cmpeq_epi16(E, A), ec = _mm_cmpeq_epi16(E, C);
+        __m128i eg = _mm_cmpeq_epi16(E, G), ei = _mm_cmpeq_epi16(E, I);
+
+        _mm_store_si128((__m128i *) t[0], sel128(db, D, E));
+        _mm_store_si128((__m128i *) t[1], sel128(_mm_or_si128(_mm_andnot_si128(ec, db), _mm_andnot_si128(ea, bf)), B, E));
+        _mm_store_si128((__m128i *) t[2], sel128(bf, F, E));
+        _mm_store_si128((__m128i *) t[3], sel128(_mm_or_si128(_mm_andnot_si128(eg, db), _mm_andnot_si128(ea, dh)), D, E));
+        _mm_store_si128((__m128i *) t[4], E);
+        _mm_store_si128((__m128i *) t[5], sel128(_mm_or_si128(_mm_andnot_si128(ei, bf), _mm_andnot_si128(ec, hf)), F, E));
+        _mm_store_si128((__m128i *) t[6], sel128(dh, D, E));
+        _mm_store_si128((__m128i *) t[7], sel128(_mm_or_si128(_mm_andnot_si128(ei, dh), _mm_andnot_si128(eg, hf)), H, E));
+        _mm_store_si128((__m128i *) t[8], sel128(hf, F, E));
+
+        for (int i = 0; i < 8; i++) {
+            uint16_t *r0 = o0 + 3 * (x + i), *r1 = o1 + 3 * (x + i), *r2 = o2 + 3 * (x + i);
+            r0[0] = t[0][i]; r0[1] = t[1][i]; r0[2] = t[2][i];
+            r1[0] = t[3][i]; r1[1] = t[4][i]; r1[2] = t[5][i];
+            r2[0] = t[6][i]; r2[1] = t[7][i]; r2[2] = t[8][i];
+        }
+    }
+}
+
+static void ntsc_row_sse2(uint32_t *d, const uint16_t *k, int cls) {
+    static const uint8_t next[3] = { 2, 0, 1 }, prev[3] = { 1, 2, 0 };
+    int c = cls;
+    for (int x = 0; x < NES_W; x++, c = next[c]) {
+        __m128i f = _mm_loadl_epi64((const __m128i *) ntsc_tab[c][k[x]][2]);
+        __m128i l = _mm_loadl_epi64((const __m128i *) ntsc_tab[prev[c]][k[x - 1]][1]);
+        __m128i r = _mm_loadl_epi64((const __m128i *) ntsc_tab[next[c]][k[x + 1]][0]);
+        __m128i s = _mm_adds_epi16(_mm_unpacklo_epi64(f, f), _mm_unpacklo_epi64(l, r));
+        s = _mm_srai_epi16(s, 4);
+        _mm_storel_epi64((__m128i *) (d + 2 * x), _mm_packus_epi16(s, s));
+    }
+}
+/** end SSE2 implementations **/
+#endif
+
+#ifdef FILTER_AVX2
+/** begin AVX2 implementations **/
+__attribute__((target("avx2")))
+static inline __m256i sel256(__m256i m, __m256i a, __m256i b) {
+    return _mm256_blendv_epi8(b, a, m);
+}
+
+__attribute__((target("avx2")))
+static void scale2x_row_avx2(const uint16_t *b, const uint16_t *e, const uint16_t *h, uint16_t *o0, uint16_t *o1, int w) {
+    for (int x = 0; x < w; x += 16) {
+        __m256i B = _mm256_loadu_si256((const __m256i *) (b + x));
+        __m256i H = _mm256_loadu_si256((const __m256i *) (h + x));
+        __m256i D = _mm256_loadu_si256((const __m256i *) (e + x - 1));
+        __m256i E = _mm256_loadu_si256((const __m256i *) (e + x));
+        __m256i F = _mm256_loadu_si256((const __m256i *) (e + x + 1));
+        __m256i c = _mm256_or_si256(_mm256_cmpeq_epi16(B, H), _mm256_cmpeq_epi16(D, F)); // inverted
+        __m256i e0 = sel256(_mm256_andnot_si256(c, _mm256_cmpeq_epi16(D, B)), D, E);
+        __m256i e1 = sel256(_mm256_andnot_si256(c, _mm256_cmpeq_epi16(B, F)), F, E);
+        __m256i e2 = sel256(_mm256_andnot_si256(c, _mm256_cmpeq_epi16(D, H)), D, E);
+        __m256i e3 = sel256(_mm256_andnot_si256(c, _mm256_cmpeq_epi16(H, F)), F, E);
+        // unpack works within 128-bit lanes, put the quarters back in order
+        __m256i lo = _mm256_unpacklo_epi16(e0, e1), hi = _mm256_unpackhi_epi16(e0, e1);
+        _mm256_storeu_si256((__m256i *) (o0 + 2 * x), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *) (o0 + 2 * x + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+        lo = _mm256_unpacklo_epi16(e2, e3);
+        hi = _mm256_unpackhi_epi16(e2, e3);
+        _mm256_storeu_si256((__m256i *) (o1 + 2 * x), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *) (o1 + 2 * x + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+}
+/** end AVX2 implementations **/
+#endif
+
+/**
+ * @brief color distance of two keys, emphasis aside, so the table stays in L1
+ *
+ */
+static inline int dist(uint16_t a, uint16_t b) {
+    return dist_tab[a & 0x3F][b & 0x3F];
+}
+
+/**
+ * @brief 2xBR rule for one corner of a pixel
+ *
+ * written for the bottom right corner; sx, sy mirror it to the others.
+ *
+ * @param e the pixel, in a padded key image
+ * @param sx 1 or -1
+ * @param sy stride, or -stride
+ * @return int key to blend into the corner, -1 for none
+ */
+static inline int xbr_corner(const uint16_t *e, int sx, int sy) {
+    #define N(dx, dy) e[(dy) * sy + (dx) * sx]
+    uint16_t E = e[0], F = N(1, 0), H = N(0, 1);
+    if (E == F || E == H) return -1;
+
+    uint16_t B = N(0, -1), C = N(1, -1), D = N(-1, 0), G = N(-1, 1), I = N(1, 1);
+    uint16_t F4 = N(2, 0), I4 = N(2, 1), H5 = N(0, 2), I5 = N(1, 2);
+    #undef N
+    int edge = dist(E, C) + dist(E, G) + dist(I, F4) + dist(I, H5) + 4 * dist(H, F);
+    int across = dist(H, D) + dist(H, I5) + dist(F, I4) + dist(F, B) + 4 * dist(E, I);
+    if (edge >= across) return -1;
+    return dist(E, F) <= dist(E, H) ? F : H;
+}
+
+static inline uint32_t blend(uint32_t a, uint32_t b) {
+    return 0xFF000000 | (((a & 0xFEFEFE) >> 1) + ((b & 0xFEFEFE) >> 1));
+}
+
+/**
+ * @brief xBR "lite": 2xBR edge detection, corners blended half way
+ *
+ */
+static void xbr_row(const uint16_t *e, uint32_t *o0, uint32_t *o1) {
+    for (int x = 0; x < NES_W; x++, e++) {
+        uint32_t c = lut[e[0]];
+        uint32_t p[4] = { c, c, c, c };
+        // flat areas, most of a frame, have no corner to look at
+        if (e[-1] != e[0] || e[1] != e[0] || e[-SRC_STRIDE] != e[0] || e[SRC_STRIDE] != e[0]) {
+            int k;
+            if ((k = xbr_corner(e, -1, -SRC_STRIDE)) >= 0) p[0] = blend(c, lut[k]);
+            if ((k = xbr_corner(e, 1, -SRC_STRIDE)) >= 0) p[1] = blend(c, lut[k]);
+            if ((k = xbr_corner(e, -1, SRC_STRIDE)) >= 0) p[2] = blend(c, lut[k]);
+            if ((k = xbr_corner(e, 1, SRC_STRIDE)) >= 0) p[3] = blend(c, lut[k]);
+        }
+        o0[2 * x] = p[0];
+        o0[2 * x + 1] = p[1];
+        o1[2 * x] = p[2];
+        o1[2 * x + 1] = p[3];
+    }
+}
+
+/**
+ * @brief build the composite signal tables
+ *
+ * each sample contributes linearly to the YIQ, hence to the RGB, of the
+ * output pixel whose 12-sample (one subcarrier cycle) window holds it. an
+ * input pixel is 8 samples and an output pixel starts every 4, so every
+ * output pixel is made of 3 half input pixels.
+ */
+static void ntsc_build() {
+    const double span = NTSC_WHITE - NTSC_BLACK, scale = 255 * 16;
+    for (int c = 0; c < 3; c++) {
+        for (int k = 0; k < KEYS; k++) {
+            int color = k & 0x0F, level = (k >> 4) & 3, emph = k >> 6;
+            if (color > 13) level = 1;
+            double lo = ntsc_levels[level], hi = ntsc_levels[4 + level];
+            if (color == 0) lo = hi;
+            if (color > 12) hi = lo;
+
+            double rgb[2][3] = { { 0 } };
+            for (int p = 0; p < 8; p++) {
+                int phase = (4 * c + p) % 12;
+                #define IN_PHASE(h) (((h) + phase) % 12 < 6)
+                double s = IN_PHASE(color) ? hi : lo;
+                if (((emph & 1) && IN_PHASE(0)) || ((emph & 2) && IN_PHASE(4)) || ((emph & 4) && IN_PHASE(8))) s *= NTSC_ATTN;
+                #undef IN_PHASE
+
+                double a = 2 * M_PI * (phase + NTSC_HUE) / 12;
+                double y = s / 12 / span, i = s * cos(a) / 6 / span * NTSC_SAT, q = s * sin(a) / 6 / span * NTSC_SAT;
+                double *h = rgb[p >= 4];
+                h[0] += y - 1.106 * i + 1.703 * q; // B
+                h[1] += y - 0.272 * i - 0.647 * q; // G
+                h[2] += y + 0.956 * i + 0.621 * q; // R
+            }
+            for (int ch = 0; ch < 3; ch++) {
+                ntsc_tab[c][k][0][ch] = lrint(rgb[0][ch] * scale);
+                ntsc_tab[c][k][1][ch] = lrint(rgb[1][ch] * scale);
+                // every output pixel has one whole input pixel, it carries
+                // the black level and the alpha
+                ntsc_tab[c][k][2][ch] = lrint((rgb[0][ch] + rgb[1][ch] - NTSC_BLACK / span) * scale);
+            }
+            ntsc_tab[c][k][0][3] = ntsc_tab[c][k][1][3] = 0;
+            ntsc_tab[c][k][2][3] = 255 * 16;
+        }
+    }
+}
+
+/**
+ * @brief build the key tables and pick the row routines
+ *
+ */
+static void filter_build() {
+    pal_init();
+    uint8_t idx[64];
+    for (int i = 0; i < 64; i++) idx[i] = i;
+    for (int e = 0; e < 8; e++) pal_argb8888(lut + e * 64, idx, e, 64);
+    int yuv[64][3];
+    for (int i = 0; i < 64; i++) {
+        int r = (lut[i] >> 16) & 0xFF, g = (lut[i] >> 8) & 0xFF, b = lut[i] & 0xFF;
+        yuv[i][0] = (299 * r + 587 * g + 114 * b) / 1000;
+        yuv[i][1] = (-169 * r - 331 * g + 500 * b) / 1000;
+        yuv[i][2] = (500 * r - 419 * g - 81 * b) / 1000;
+    }
+    // fits 16 bits: 48 * 255 + 7 * 255 + 6 * 255
+    for (int a = 0; a < 64; a++) {
+        for (int b = 0; b < 64; b++) {
+            dist_tab[a][b] = 48 * abs(yuv[a][0] - yuv[b][0]) + 7 * abs(yuv[a][1] - yuv[b][1]) + 6 * abs(yuv[a][2] - yuv[b][2]);
+        }
+    }
+    ntsc_build();
+
+#ifdef __SSE2__
+    do_scale2x_row = scale2x_row_sse2;
+    do_scale3x_row = scale3x_row_sse2;
+    do_ntsc_row = ntsc_row_sse2;
+#endif
+#ifdef FILTER_AVX2
+    if (__builtin_cpu_supports("avx2")) do_scale2x_row = scale2x_row_avx2;
+#endif
+}
+
+/**
+ * @brief turn a frame into padded keys
+ *
+ * @param f the frame
+ */
+static void build_keys(const fb_t *f) {
+    for (int y = 0; y < NES_H; y++) {
+        uint16_t *d = SRC(y);
+        uint16_t e = (f->emph[y] & 7) << 6;
+        const uint8_t *s = f->idx[y];
+        int x = 0;
+#ifdef __SSE2__
+        const __m128i m = _mm_set1_epi8(0x3F), z = _mm_setzero_si128(), ve = _mm_set1_epi16(e);
+        for (; x < NES_W; x += 16) {
+            __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *) (s + x)), m);
+            _mm_storeu_si128((__m128i *) (d + x), _mm_or_si128(_mm_unpacklo_epi8(v, z), ve));
+            _mm_storeu_si128((__m128i *) (d + x + 8), _mm_or_si128(_mm_unpackhi_epi8(v, z), ve));
+        }
+#endif
+        for (; x < NES_W; x++) d[x] = e | (s[x] & 0x3F);
+        pad_row(d, NES_W);
+    }
+    for (int k = 1; k <= PADY; k++) {
+        memcpy(SRC(-k) - PAD, SRC(0) - PAD, SRC_STRIDE * sizeof(uint16_t));
+        memcpy(SRC(NES_H - 1 + k) - PAD, SRC(NES_H - 1) - PAD, SRC_STRIDE * sizeof(uint16_t));
+    }
+}
+
+/**
+ * @brief run a stage of the current filter over some rows
+ *
+ * @param s stage
+ * @param y0 first row
+ * @param y1 end row
+ */
+static void run_rows(int s, int y0, int y1) {
+    uint16_t t[3][MAX_W] __attribute__((aligned(32)));
+
+    for (int y = y0; y < y1; y++) {
+        switch (kind) {
+            case FILTER_SCALE2X:
+                do_scale2x_row(SRC(y - 1), SRC(y), SRC(y + 1), t[0], t[1], NES_W);
+                lut_row(out_row(2 * y), t[0], MID_W);
+                lut_row(out_row(2 * y + 1), t[1], MID_W);
+                break;
+            case FILTER_SCALE3X:
+                do_scale3x_row(SRC(y - 1), SRC(y), SRC(y + 1), t[0], t[1], t[2], NES_W);
+                for (int i = 0; i < 3; i++) lut_row(out_row(3 * y + i), t[i], NES_W * 3);
+                break;
+            case FILTER_SCALE4X:
+                if (s == 0) {
+                    do_scale2x_row(SRC(y - 1), SRC(y), SRC(y + 1), MID(2 * y), MID(2 * y + 1), NES_W);
+                    pad_row(MID(2 * y), MID_W);
+                    pad_row(MID(2 * y + 1), MID_W);
+                } else {
+                    do_scale2x_row(MID(y - 1), MID(y), MID(y + 1), t[0], t[1], MID_W);
+                    lut_row(out_row(2 * y), t[0], MAX_W);
+                    lut_row(out_row(2 * y + 1), t[1], MAX_W);
+                }
+                break;
+            case FILTER_XBR:
+                xbr_row(SRC(y), out_row(2 * y), out_row(2 * y + 1));
+                break;
+            case FILTER_NTSC:
+                // a line is 341 * 8 samples, 4 more than a multiple of 12,
+                // so the phase moves on by a third of a cycle every line
+                do_ntsc_row(out_row(y), SRC(y), (y + (frames & 1)) % 3);
+                break;
+            default:
+                lut_row(out_row(y), SRC(y), NES_W);
+        }
+    }
+}
+
+static void run_band(int i) {
+    run_rows(stage, rows * i / nthreads, rows * (i + 1) / nthreads);
+}
+
+/**
+ * @brief band worker
+ *
+ * @param p band number
+ * @return void* NULL
+ */
+static void *worker_main(void *p) {
+    int id = (int) (intptr_t) p;
+    uint64_t seen = gen0;
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (gen == seen && !quit) pthread_cond_wait(&go, &lock);
+        if (quit) break;
+        seen = gen;
+        pthread_mutex_unlock(&lock);
+
+        run_band(id);
+
+        pthread_mutex_lock(&lock);
+        if (--busy == 0) pthread_cond_signal(&done);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/**
+ * @brief run a stage over all rows, split in bands across the workers
+ *
+ * @param s stage
+ * @param n num of rows
+ */
+static void run_stage(int s, int n) {
+    stage = s;
+    rows = n;
+    if (nthreads == 1) {
+        run_band(0);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    busy = nthreads - 1;
+    gen++;
+    pthread_cond_broadcast(&go);
+    pthread_mutex_unlock(&lock);
+
+    run_band(0);
+
+    pthread_mutex_lock(&lock);
+    while (busy) pthread_cond_wait(&done, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief pick a filter
+ *
+ * @param k filter
+ * @param threads threads to split frames across, 1 to run on the caller only
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int filter_init(filter_kind_t k, int threads) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, filter_build);
+    if (filter_initialized) filter_deinit();
+
+    if (k == FILTER_SCALE4X) {
+        mid = calloc((MID_H + 2) * MID_STRIDE, sizeof(uint16_t));
+        if (mid == NULL) return -1;
+    }
+    kind = k;
+    frames = 0;
+
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    nthreads = 1;
+    quit = 0;
+    gen0 = gen;
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&pool[i], NULL, worker_main, (void *) (intptr_t) i) != 0) {
+            log_warn("filter: can't start worker %d, using %d.\n", i, nthreads);
+            break;
+        }
+        nthreads++;
+    }
+
+    filter_initialized = 1;
+    return 0;
+}
+
+/**
+ * @brief stop the workers
+ *
+ */
+void filter_deinit() {
+    if (!filter_initialized) return;
+    pthread_mutex_lock(&lock);
+    quit = 1;
+    pthread_cond_broadcast(&go);
+    pthread_mutex_unlock(&lock);
+    for (int i = 1; i < nthreads; i++) pthread_join(pool[i], NULL);
+    nthreads = 1;
+
+    free(mid);
+    mid = NULL;
+    kind = FILTER_NONE;
+    filter_initialized = 0;
+}
+
+/**
+ * @brief get a filter by name
+ *
+ * @param name none, scale2x, scale3x, scale4x, xbr or ntsc
+ * @return int filter_kind_t, -1 if unknown
+ */
+int filter_parse(const char *name) {
+    static const char *names[] = { "none", "scale2x", "scale3x", "scale4x", "xbr", "ntsc" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(name, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief get the output size of the current filter
+ *
+ * @param w width
+ * @param h height
+ */
+void filter_size(int *w, int *h) {
+    static const int sz[][2] = {
+        { NES_W, NES_H }, { NES_W * 2, NES_H * 2 }, { NES_W * 3, NES_H * 3 },
+        { NES_W * 4, NES_H * 4 }, { NES_W * 2, NES_H * 2 }, { NES_W * 2, NES_H },
+    };
+    *w = sz[kind][0];
+    *h = sz[kind][1];
+}
+
+/**
+ * @brief filter a frame
+ *
+ * @param f the frame
+ * @param dst ARGB8888 output of filter_size()
+ * @param pitch bytes per row of dst
+ */
+void filter_run(const fb_t *f, void *dst, int pitch) {
+    if (kind == FILTER_NONE) {
+        fb_argb8888(f, dst, pitch);
+        return;
+    }
+
+    out = (uint8_t *) dst;
+    out_pitch = pitch;
+    build_keys(f);
+    run_stage(0, NES_H);
+    if (kind == FILTER_SCALE4X) {
+        memcpy(MID(-1) - PAD, MID(0) - PAD, MID_STRIDE * sizeof(uint16_t));
+        memcpy(MID(MID_H) - PAD, MID(MID_H - 1) - PAD, MID_STRIDE * sizeof(uint16_t));
+        run_stage(1, MID_H);
+    }
+    frames++;
+}
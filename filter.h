@@ -0,0 +1,25 @@
+#ifndef NES_FILTER_H
+#define NES_FILTER_H
+#include <stdint.h>
+#include "fb.h"
+
+/**
+ * @brief post-processing of a frame on its way to the screen
+ *
+ */
+typedef enum filter_kind {
+    FILTER_NONE, // 256x240, plain palette lookup
+    FILTER_SCALE2X, // 512x480
+    FILTER_SCALE3X, // 768x720
+    FILTER_SCALE4X, // 1024x960, Scale2x twice
+    FILTER_XBR, // 512x480, 2xBR edge blending
+    FILTER_NTSC, // 512x240, composite signal with its color artifacts
+} filter_kind_t;
+
+int filter_init(filter_kind_t kind, int threads);
+void filter_deinit();
+int filter_parse(const char *name);
+void filter_size(int *w, int *h);
+void filter_run(const fb_t *f, void *dst, int pitch);
+
+#endif // NES_FILTER_H
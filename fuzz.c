@@ -0,0 +1,370 @@
+#include "nes.h"
+#include "6502.h"
+#include "input.h"
+#include "mem.h"
+#include "movie.h"
+#include "romdb.h"
+#include "jit.h"
+#include "log.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef JIT_SINGLE_THREAD
+#error "the fuzzer runs a console per thread, build it without JIT=1"
+#endif
+
+/*
+ * coverage-guided input fuzzer. every corpus entry is a save-state and the
+ * input that led to it from power on. a candidate loads an entry, plays a
+ * few frames of mutated input and is kept if it ran code, or ran it a
+ * number of times, not seen before. runs that hit a bad opcode or halt the
+ * CPU are crashes, runs where RAM stops changing for long are hangs; both
+ * are saved as movies, as is each new entry.
+ */
+
+#define MAX_ROM (1 << 20)
+#define MAX_THREADS 256
+
+typedef struct entry entry_t;
+struct entry {
+    uint8_t *state; // at the end of in
+    uint8_t *in; // from power on
+    uint32_t frames;
+    uint32_t still; // frames at the end without a change to RAM
+};
+
+static uint8_t *rom;
+static size_t rom_sz, state_sz;
+static uint32_t crc;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static entry_t *corpus;
+static int ncorpus = 0, max_corpus = 512;
+// AFL-style: the buckets of hit counts seen so far at each PC
+static uint8_t virgin[COVER_SZ], virgin_crash[COVER_SZ], virgin_hang[COVER_SZ];
+static int pcs = 0;
+
+static atomic_ullong execs = 0;
+static atomic_int crashes = 0, hangs = 0, saved = 0;
+static volatile sig_atomic_t quit = 0;
+
+static int step = 1, hang_frames = 600;
+static const char *outdir = "fuzz-out";
+static uint64_t seed;
+
+static void on_signal(int sig) {
+    (void) sig;
+    quit = 1;
+}
+
+static inline uint64_t next_rand(uint64_t *s) {
+    // xorshift64*
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * @brief AFL's hit count classes
+ *
+ * @param n hit count
+ * @return uint8_t a bit per class
+ */
+static inline uint8_t bucket(uint8_t n) {
+    if (n < 4) return n == 3 ? 4 : n;
+    if (n < 8) return 8;
+    if (n < 16) return 16;
+    if (n < 32) return 32;
+    if (n < 128) return 64;
+    return 128;
+}
+
+/**
+ * @brief merge a run's coverage into what was seen, hold the lock
+ *
+ * @param map hit counts of the run
+ * @param seen virgin, virgin_crash or virgin_hang
+ * @return int 1 if anything was new
+ */
+static int novel(const uint8_t *map, uint8_t *seen) {
+    int ret = 0;
+    for (size_t i = 0; i < COVER_SZ; i += 8) {
+        uint64_t w;
+        memcpy(&w, map + i, 8);
+        if (w == 0) continue;
+        for (size_t j = i; j < i + 8; j++) {
+            uint8_t b = bucket(map[j]);
+            if (!(b & ~seen[j])) continue;
+            if (seen == virgin && seen[j] == 0) pcs++;
+            seen[j] |= b;
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief save the input of a run as a movie
+ *
+ * @param kind "cov", "crash" or "hang"
+ * @param in input from power on
+ * @param frames number of frames
+ */
+static void save(const char *kind, const uint8_t *in, uint32_t frames) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s-%06d.nmv", outdir, kind, atomic_fetch_add(&saved, 1));
+    movie_save(path, crc, in, frames);
+}
+
+/**
+ * @brief add an entry, replacing a random one (not power on) when full
+ *
+ * hold the lock.
+ *
+ * @param state save-state at the end of in
+ * @param in input
+ * @param frames frames of input
+ * @param still frames at the end without a change to RAM
+ * @param r random number
+ */
+static void add(const uint8_t *state, const uint8_t *in, uint32_t frames, uint32_t still, uint64_t r) {
+    entry_t *e;
+    if (ncorpus < max_corpus) {
+        e = &corpus[ncorpus];
+        e->state = malloc(state_sz);
+        e->in = NULL;
+        if (e->state == NULL) return;
+        ncorpus++;
+    } else {
+        e = &corpus[1 + r % (ncorpus - 1)];
+    }
+    uint8_t *n = realloc(e->in, frames ? frames : 1);
+    if (n == NULL) return;
+    e->in = n;
+    memcpy(e->state, state, state_sz);
+    memcpy(e->in, in, frames);
+    e->frames = frames;
+    e->still = still;
+}
+
+/**
+ * @brief next input, mostly what was held before
+ *
+ * @param b input of the last frame
+ * @param s random state
+ * @return uint8_t BTN_* mask
+ */
+static uint8_t mutate(uint8_t b, uint64_t *s) {
+    uint64_t r = next_rand(s);
+    if (r & 3) return b;
+    switch ((r >> 2) & 3) {
+        case 0: b ^= 1 << ((r >> 4) & 7); break;
+        case 1: b = r >> 8; break;
+        case 2: b = 0; break;
+        case 3: b = 1 << ((r >> 4) & 7); break;
+    }
+    // a pad can't press opposite directions
+    if ((b & BTN_UP) && (b & BTN_DOWN)) b &= ~BTN_DOWN;
+    if ((b & BTN_LEFT) && (b & BTN_RIGHT)) b &= ~BTN_RIGHT;
+    return b;
+}
+
+/**
+ * @brief worker: run candidates on its own console until told to quit
+ *
+ * @param p thread number
+ * @return void* NULL
+ */
+static void *worker(void *p) {
+    uint64_t rng = seed ^ ((uintptr_t) p + 1) * 0x9E3779B97F4A7C15ULL;
+    nes_meta_t meta;
+    uint8_t *map = malloc(COVER_SZ), *state = malloc(state_sz), *in = NULL, ram[0x800];
+    size_t cap = 0;
+    if (map == NULL || state == NULL || nes_init(&meta, rom, rom_sz) < 0) goto out;
+    cover_6502(map);
+
+    while (!quit) {
+        pthread_mutex_lock(&lock);
+        const entry_t *e = &corpus[next_rand(&rng) % ncorpus];
+        uint32_t frames = e->frames, still = e->still;
+        if (frames + step + hang_frames > cap) {
+            uint8_t *n = realloc(in, cap = (frames + step + hang_frames) * 2);
+            if (n == NULL) {
+                pthread_mutex_unlock(&lock);
+                break;
+            }
+            in = n;
+        }
+        memcpy(in, e->in, frames);
+        memcpy(state, e->state, state_sz);
+        pthread_mutex_unlock(&lock);
+
+        nes_load(state, state_sz);
+        memset(map, 0, COVER_SZ);
+        memcpy(ram, memptr(0), sizeof(ram));
+        uint32_t bad = bad_ops_6502();
+        uint8_t b = frames ? in[frames - 1] : 0;
+        int crashed = 0;
+        // a run that hasn't touched RAM goes on with the same input until
+        // it does or is a hang, it would never get there a step at a time
+        for (uint32_t f = 0; f < (uint32_t) step || (still >= f && still < (uint32_t) hang_frames); f++) {
+            if (f < (uint32_t) step) b = mutate(b, &rng);
+            in[frames++] = b;
+            input_set(0, b);
+            if (nes_frame() < 0 || bad_ops_6502() != bad) {
+                crashed = 1;
+                break;
+            }
+            if (memcmp(ram, memptr(0), sizeof(ram)) == 0) {
+                still++;
+            } else {
+                still = 0;
+                memcpy(ram, memptr(0), sizeof(ram));
+            }
+        }
+        atomic_fetch_add_explicit(&execs, 1, memory_order_relaxed);
+
+        int hung = !crashed && still >= (uint32_t) hang_frames, keep;
+        if (!crashed && !hung) nes_save(state);
+        pthread_mutex_lock(&lock);
+        if (crashed) keep = novel(map, virgin_crash);
+        else if (hung) keep = novel(map, virgin_hang);
+        else if ((keep = novel(map, virgin))) add(state, in, frames, still, next_rand(&rng));
+        pthread_mutex_unlock(&lock);
+
+        if (crashed) atomic_fetch_add(&crashes, 1);
+        if (hung) atomic_fetch_add(&hangs, 1);
+        if (keep) save(crashed ? "crash" : hung ? "hang" : "cov", in, frames);
+    }
+
+out:
+    cover_6502(NULL);
+    free(map);
+    free(state);
+    free(in);
+    return NULL;
+}
+
+int main (int argc, char **argv) {
+    int threads = sysconf(_SC_NPROCESSORS_ONLN), boot = 0, secs = 0, opt;
+    seed = time(NULL);
+
+    while ((opt = getopt(argc, argv, "b:c:H:j:n:o:s:t:")) != -1) {
+        if (opt == 'b') boot = atoi(optarg);
+        else if (opt == 'c') max_corpus = atoi(optarg);
+        else if (opt == 'H') hang_frames = atoi(optarg);
+        else if (opt == 'j') threads = atoi(optarg);
+        else if (opt == 'n') step = atoi(optarg);
+        else if (opt == 'o') outdir = optarg;
+        else if (opt == 's') seed = strtoull(optarg, NULL, 0);
+        else if (opt == 't') secs = atoi(optarg);
+        else optind = argc + 1;
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-b frames] [-c entries] [-H frames] [-j threads] [-n frames] [-o dir] [-s seed] [-t secs] rom\n", argv[0]);
+        fprintf(stderr, "  -b  frames to run without input before fuzzing, 0 by default\n");
+        fprintf(stderr, "  -c  corpus size, 512 by default\n");
+        fprintf(stderr, "  -H  frames without a change to RAM that make a hang, 600 by default\n");
+        fprintf(stderr, "  -n  frames of input each candidate adds, 1 by default\n");
+        fprintf(stderr, "  -o  where movies go, fuzz-out by default\n");
+        fprintf(stderr, "  -t  seconds to run, until ^C by default\n");
+        return 1;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    if (step < 1) step = 1;
+    if (hang_frames < 1) hang_frames = 1;
+    if (max_corpus < 2) max_corpus = 2;
+    if (boot < 0) boot = 0;
+
+    log_init();
+    int fd = open(argv[optind], O_RDONLY);
+    rom = malloc(MAX_ROM);
+    ssize_t len = fd >= 0 && rom != NULL ? read(fd, rom, MAX_ROM) : -1;
+    if (fd >= 0) close(fd);
+    if (len <= 0) {
+        log_fatal("can't read rom: '%s'.\n", argv[optind]);
+        return 1;
+    }
+    rom_sz = len;
+    if (mkdir(outdir, 0755) < 0 && access(outdir, W_OK) < 0) {
+        log_fatal("can't use '%s' for output.\n", outdir);
+        return 1;
+    }
+
+    // power on and boot once, the first entry
+    nes_meta_t meta;
+    uint8_t *map = calloc(1, COVER_SZ), *in = calloc(1, boot ? boot : 1);
+    corpus = calloc(max_corpus, sizeof(entry_t));
+    if (map == NULL || in == NULL || corpus == NULL || nes_init(&meta, rom, rom_sz) < 0) return 1;
+    crc = movie_crc(&meta);
+    state_sz = nes_state_size();
+    cover_6502(map);
+    for (int f = 0; f < boot; f++) {
+        if (nes_frame() < 0) {
+            log_fatal("cpu halted while booting.\n");
+            return 1;
+        }
+    }
+    cover_6502(NULL);
+    uint8_t *state = malloc(state_sz);
+    if (state == NULL) return 1;
+    nes_save(state);
+    novel(map, virgin);
+    add(state, in, boot, 0, 0);
+    free(state);
+    free(map);
+    free(in);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_t pool[MAX_THREADS];
+    int started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&pool[started], NULL, worker, (void *) (uintptr_t) started) != 0) break;
+    }
+    if (started == 0) {
+        log_fatal("can't start a thread.\n");
+        return 1;
+    }
+
+    double t = 0;
+    unsigned long long last = 0;
+    while (!quit && (secs == 0 || t < secs)) {
+        struct timespec nap = { 1, 0 };
+        nanosleep(&nap, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double now = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        unsigned long long n = atomic_load(&execs);
+        pthread_mutex_lock(&lock);
+        fprintf(stderr, "\r\033[K%.0fs: %llu execs (%.0f/s), corpus %d, pcs %d, crashes %d, hangs %d",
+            now, n, (n - last) / (now - t), ncorpus, pcs, atomic_load(&crashes), atomic_load(&hangs));
+        pthread_mutex_unlock(&lock);
+        last = n;
+        t = now;
+    }
+    quit = 1;
+    for (int i = 0; i < started; i++) pthread_join(pool[i], NULL);
+    fprintf(stderr, "\n%d movies in '%s', seed %llu.\n", atomic_load(&saved), outdir, (unsigned long long) seed);
+
+    for (int i = 0; i < ncorpus; i++) {
+        free(corpus[i].state);
+        free(corpus[i].in);
+    }
+    free(corpus);
+    free(rom);
+    romdb_close();
+    log_deinit();
+    return 0;
+}
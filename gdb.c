@@ -0,0 +1,539 @@
+#include "gdb.h"
+#include "6502.h"
+#include "ppu.h"
+#include "cheat.h"
+#include "log.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// GDB's signal numbers
+#define SIG_INT 2
+#define SIG_TRAP 5
+
+NES_TLS uint8_t gdb_armed = 0;
+
+static int gdb_initialized = 0;
+static int lfd = -1; // listening socket
+static int fd = -1; // the debugger, -1 if none
+static char upath[sizeof(((struct sockaddr_un *) 0)->sun_path)]; // to unlink, empty for TCP
+static int noack = 0;
+
+static uint8_t bp[0x10000 / 8]; // a bit per breakpoint
+static int nbp = 0;
+
+/* a watched byte, through the cheat engine's read and write hooks */
+typedef struct watch watch_t;
+struct watch {
+    uint8_t type; // 2 write, 3 read, 4 access, 0 free
+    uint16_t addr;
+    int wid, rid; // cheat ids
+};
+static watch_t watches[GDB_WATCH_MAX];
+static int nwatch = 0;
+
+static int stepping = 0;
+static int stop_sig = 0; // stop before the next instruction
+static int last_sig = SIG_TRAP;
+static const watch_t *hit = NULL; // watchpoint that caused the stop
+
+static char rbuf[GDB_PACKET_SZ]; // received, not yet parsed
+static size_t rlen = 0, rpos = 0;
+static char pkt[GDB_PACKET_SZ + 1];
+static char out[GDB_PACKET_SZ + 1];
+
+/**
+ * @brief arm the CPU hook if anything can stop it
+ *
+ */
+static void arm() {
+    gdb_armed = fd >= 0 && (nbp || nwatch || stepping || stop_sig);
+    if (gdb_armed) idle_6502(0);
+}
+
+/**
+ * @brief get a byte from the debugger
+ *
+ * @param wait 0 to return -2 instead of waiting
+ * @return int byte, -1 on a closed connection
+ */
+static int getbyte(int wait) {
+    if (rpos == rlen) {
+        ssize_t n = recv(fd, rbuf, sizeof(rbuf), wait ? 0 : MSG_DONTWAIT);
+        if (n < 0 && !wait) return -2;
+        if (n <= 0) return -1;
+        rlen = n;
+        rpos = 0;
+    }
+    return (uint8_t) rbuf[rpos++];
+}
+
+/**
+ * @brief send all of a buffer
+ *
+ * @param p data
+ * @param sz size
+ */
+static void sendall(const char *p, size_t sz) {
+    while (sz > 0) {
+        ssize_t n = send(fd, p, sz, MSG_NOSIGNAL);
+        if (n <= 0) return;
+        p += n;
+        sz -= n;
+    }
+}
+
+/**
+ * @brief send a packet
+ *
+ * @param data payload
+ */
+static void reply(const char *data) {
+    static char buf[GDB_PACKET_SZ + 8];
+    size_t n = strlen(data);
+    uint8_t sum = 0;
+    for (size_t i = 0; i < n; i++) sum += (uint8_t) data[i];
+    buf[0] = '$';
+    memcpy(buf + 1, data, n);
+    snprintf(buf + 1 + n, 4, "#%.2x", sum);
+    sendall(buf, n + 4);
+}
+
+/**
+ * @brief receive a packet, acks and stray bytes are skipped
+ *
+ * @return int length, -1 on a closed connection
+ */
+static int receive() {
+    for (;;) {
+        int c;
+        do {
+            if ((c = getbyte(1)) < 0) return -1;
+        } while (c != '$');
+
+        size_t n = 0;
+        uint8_t sum = 0;
+        while ((c = getbyte(1)) >= 0 && c != '#') {
+            sum += c;
+            if (n < GDB_PACKET_SZ) pkt[n++] = c;
+        }
+        int h = c < 0 ? -1 : getbyte(1), l = h < 0 ? -1 : getbyte(1);
+        if (l < 0) return -1;
+        pkt[n] = '\0';
+
+        char ck[3] = { h, l, '\0' };
+        if (strtoul(ck, NULL, 16) == sum) {
+            if (!noack) sendall("+", 1);
+            return n;
+        }
+        if (!noack) sendall("-", 1);
+    }
+}
+
+static inline int hexval(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * @brief parse hex bytes
+ *
+ * @param p hex digits
+ * @param dst output
+ * @param n bytes
+ * @return int status
+ * @retval -1 short or not hex
+ * @retval 0 OK
+ */
+static int unhex(const char *p, uint8_t *dst, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int h = hexval(p[2 * i]), l = h < 0 ? -1 : hexval(p[2 * i + 1]);
+        if (l < 0) return -1;
+        dst[i] = h << 4 | l;
+    }
+    return 0;
+}
+
+/**
+ * @brief read CPU or PPU memory
+ *
+ * @param addr address, see GDB_PPU
+ * @param val output
+ * @return int -1 if nothing is there
+ */
+static int mem_get(uint32_t addr, uint8_t *val) {
+    if (addr < GDB_PPU) *val = peek_6502(addr);
+    else if (addr - GDB_PPU < 0x4000) *val = ppuread(addr - GDB_PPU);
+    else return -1;
+    return 0;
+}
+
+/**
+ * @brief write CPU or PPU memory
+ *
+ * @param addr address, see GDB_PPU
+ * @param val value
+ * @return int -1 if it can't be written
+ */
+static int mem_put(uint32_t addr, uint8_t val) {
+    if (addr < GDB_PPU) return poke_6502(addr, val);
+    if (addr - GDB_PPU < 0x4000) {
+        ppu_poke(addr - GDB_PPU, val);
+        return 0;
+    }
+    return -1;
+}
+
+static void on_access(uint16_t addr, uint8_t old, uint8_t val, void *ctx) {
+    (void) addr; (void) old; (void) val;
+    hit = ctx;
+    stop_sig = SIG_TRAP;
+}
+
+/**
+ * @brief drop a watchpoint
+ *
+ * @param w the watchpoint
+ */
+static void watch_free(watch_t *w) {
+    if (w->wid >= 0) cheat_remove(w->wid);
+    if (w->rid >= 0) cheat_remove(w->rid);
+    w->type = 0;
+    nwatch--;
+}
+
+/**
+ * @brief set or clear a breakpoint or watchpoint, for Z and z
+ *
+ * @param set 1 to set
+ * @param type 0, 1 breakpoint, 2 write, 3 read, 4 access watchpoint
+ * @param addr address
+ * @param len bytes watched
+ * @return int -1 on error
+ */
+static int point(int set, int type, uint32_t addr, uint32_t len) {
+    if (addr >= 0x10000 || type > 4) return -1;
+    if (type < 2) {
+        uint8_t bit = 1 << (addr & 7);
+        if (set && !(bp[addr >> 3] & bit)) nbp++;
+        if (!set && (bp[addr >> 3] & bit)) nbp--;
+        bp[addr >> 3] = set ? (bp[addr >> 3] | bit) : (bp[addr >> 3] & ~bit);
+        return 0;
+    }
+
+    for (uint32_t a = addr; a < addr + len && a < 0x10000; a++) {
+        if (!set) {
+            for (int i = 0; i < GDB_WATCH_MAX; i++) {
+                if (watches[i].type == type && watches[i].addr == a) watch_free(&watches[i]);
+            }
+            continue;
+        }
+        watch_t *w = NULL;
+        for (int i = 0; i < GDB_WATCH_MAX && w == NULL; i++) {
+            if (watches[i].type == 0) w = &watches[i];
+        }
+        if (w == NULL) return -1;
+        w->type = type;
+        w->addr = a;
+        w->wid = type != 3 ? cheat_watch(a, on_access, w) : -1;
+        w->rid = type != 2 ? cheat_watch_reads(a, on_access, w) : -1;
+        nwatch++;
+        if ((type != 3 && w->wid < 0) || (type != 2 && w->rid < 0)) {
+            watch_free(w);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief forget the debugger and everything it set
+ *
+ */
+static void detach() {
+    for (int i = 0; i < GDB_WATCH_MAX; i++) {
+        if (watches[i].type) watch_free(&watches[i]);
+    }
+    memset(bp, 0, sizeof(bp));
+    nbp = 0;
+    stepping = 0;
+    stop_sig = 0;
+    hit = NULL;
+    if (fd >= 0) close(fd);
+    fd = -1;
+    noack = 0;
+    rlen = rpos = 0;
+    arm();
+}
+
+/**
+ * @brief take a new connection
+ *
+ * @param c socket
+ */
+static void attach(int c) {
+    int one = 1;
+    setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fd = c;
+    // halt on the next instruction, as gdbserver does
+    stop_sig = SIG_TRAP;
+    arm();
+    log_info("gdb: debugger attached.\n");
+}
+
+/**
+ * @brief answer packets while halted
+ *
+ * @param stop stop reply
+ * @return int status
+ * @retval -1 killed
+ * @retval 0 resume
+ */
+static int serve(const char *stop) {
+    regs_6502_t r;
+    reply(stop);
+    for (;;) {
+        if (receive() < 0) {
+            log_info("gdb: debugger went away.\n");
+            detach();
+            return 0;
+        }
+
+        char *p = pkt + 1, *end;
+        uint32_t addr, len;
+        out[0] = '\0';
+        switch (pkt[0]) {
+            case '?':
+                snprintf(out, sizeof(out), "S%.2x", last_sig);
+                break;
+            case 'g':
+                regs_6502(&r);
+                snprintf(out, sizeof(out), "%.2x%.2x%.2x%.2x%.2x%.2x%.2x",
+                    r.a, r.x, r.y, r.p, r.sp, r.pc & 0xFF, r.pc >> 8);
+                break;
+            case 'G': {
+                uint8_t b[7];
+                if (unhex(p, b, sizeof(b)) < 0) {
+                    strcpy(out, "E01");
+                    break;
+                }
+                r = (regs_6502_t) { b[0], b[1], b[2], b[3], b[4], b[5] | b[6] << 8 };
+                set_regs_6502(&r);
+                strcpy(out, "OK");
+                break;
+            }
+            case 'p':
+            case 'P': {
+                unsigned n = strtoul(p, &end, 16);
+                regs_6502(&r);
+                uint8_t *reg[] = { &r.a, &r.x, &r.y, &r.p, &r.sp };
+                uint8_t b[2];
+                if (n > 5 || (pkt[0] == 'P' && (*end != '=' || unhex(end + 1, b, n == 5 ? 2 : 1) < 0))) {
+                    strcpy(out, "E01");
+                } else if (pkt[0] == 'p') {
+                    if (n < 5) snprintf(out, sizeof(out), "%.2x", *reg[n]);
+                    else snprintf(out, sizeof(out), "%.2x%.2x", r.pc & 0xFF, r.pc >> 8);
+                } else {
+                    if (n < 5) *reg[n] = b[0];
+                    else r.pc = b[0] | b[1] << 8;
+                    set_regs_6502(&r);
+                    strcpy(out, "OK");
+                }
+                break;
+            }
+            case 'm':
+                addr = strtoul(p, &end, 16);
+                len = *end == ',' ? strtoul(end + 1, NULL, 16) : 0;
+                if (len > GDB_PACKET_SZ / 2) len = GDB_PACKET_SZ / 2;
+                for (uint32_t i = 0; i < len; i++) {
+                    uint8_t v;
+                    // a short read stops at the first byte that isn't there
+                    if (mem_get(addr + i, &v) < 0) break;
+                    snprintf(out + 2 * i, 3, "%.2x", v);
+                }
+                if (len && out[0] == '\0') strcpy(out, "E01");
+                break;
+            case 'M': {
+                addr = strtoul(p, &end, 16);
+                len = *end == ',' ? strtoul(end + 1, &end, 16) : 0;
+                uint8_t v;
+                strcpy(out, *end == ':' ? "OK" : "E01");
+                for (uint32_t i = 0; *end == ':' && i < len; i++) {
+                    if (unhex(end + 1 + 2 * i, &v, 1) < 0 || mem_put(addr + i, v) < 0) {
+                        strcpy(out, "E01");
+                        break;
+                    }
+                }
+                break;
+            }
+            case 'Z':
+            case 'z': {
+                int type = strtoul(p, &end, 10);
+                addr = *end == ',' ? strtoul(end + 1, &end, 16) : 0x10000;
+                len = *end == ',' ? strtoul(end + 1, NULL, 16) : 1;
+                strcpy(out, point(pkt[0] == 'Z', type, addr, len) < 0 ? "E01" : "OK");
+                arm();
+                break;
+            }
+            case 'c':
+            case 's':
+                if (*p) {
+                    regs_6502(&r);
+                    r.pc = strtoul(p, NULL, 16);
+                    set_regs_6502(&r);
+                }
+                stepping = pkt[0] == 's';
+                arm();
+                return 0;
+            case 'D':
+                reply("OK");
+                log_info("gdb: debugger detached.\n");
+                detach();
+                return 0;
+            case 'k':
+                log_info("gdb: killed by the debugger.\n");
+                detach();
+                return -1;
+            case 'H':
+            case 'T':
+                strcpy(out, "OK");
+                break;
+            case 'q':
+                if (!strncmp(pkt, "qSupported", 10)) snprintf(out, sizeof(out), "PacketSize=%x;QStartNoAckMode+", GDB_PACKET_SZ);
+                else if (!strcmp(pkt, "qAttached")) strcpy(out, "1");
+                else if (!strcmp(pkt, "qC")) strcpy(out, "QC1");
+                else if (!strcmp(pkt, "qfThreadInfo")) strcpy(out, "m1");
+                else if (!strcmp(pkt, "qsThreadInfo")) strcpy(out, "l");
+                break;
+            case 'Q':
+                if (!strcmp(pkt, "QStartNoAckMode")) {
+                    reply("OK");
+                    noack = 1;
+                    continue;
+                }
+                break;
+        }
+        // unknown packets get an empty reply
+        reply(out);
+    }
+}
+
+/**
+ * @brief stop before an instruction if there's a reason to
+ *
+ * called from the CPU while gdb_armed is set.
+ *
+ * @param pc address of the instruction
+ * @return int status
+ * @retval -1 killed, halt the CPU
+ * @retval 0 run the instruction
+ */
+int gdb_insn(uint16_t pc) {
+    if (!stop_sig && !stepping && !(bp[pc >> 3] & (1 << (pc & 7)))) return 0;
+
+    static const char *kinds[] = { "", "", "watch", "rwatch", "awatch" };
+    char stop[32];
+    last_sig = stop_sig ? stop_sig : SIG_TRAP;
+    if (hit != NULL) snprintf(stop, sizeof(stop), "T%.2x%s:%x;", last_sig, kinds[hit->type], hit->addr);
+    else snprintf(stop, sizeof(stop), "S%.2x", last_sig);
+    stop_sig = 0;
+    stepping = 0;
+    hit = NULL;
+    return serve(stop);
+}
+
+/**
+ * @brief look for ^C from the debugger, or a new one, e.g. once a frame
+ *
+ */
+void gdb_poll() {
+    if (!gdb_initialized) return;
+    if (fd < 0) {
+        int c = accept(lfd, NULL, NULL);
+        if (c >= 0) attach(c);
+        return;
+    }
+
+    int c;
+    while ((c = getbyte(0)) >= 0) {
+        if (c == 0x03) {
+            stop_sig = SIG_INT;
+            arm();
+        }
+    }
+    if (c == -1) {
+        log_info("gdb: debugger went away.\n");
+        detach();
+    }
+}
+
+/**
+ * @brief listen for a debugger, then wait for it to attach
+ *
+ * @param addr TCP port on localhost, or a path for a UNIX socket
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int gdb_init(const char *addr) {
+    if (gdb_initialized) gdb_deinit();
+
+    char *end;
+    unsigned long port = strtoul(addr, &end, 10);
+    if (*addr != '\0' && *end == '\0') {
+        struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = htons(port) };
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int one = 1;
+        lfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (lfd >= 0) setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (lfd < 0 || port > 0xFFFF || bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) < 0) goto fail;
+        upath[0] = '\0';
+    } else {
+        struct sockaddr_un sau = { .sun_family = AF_UNIX };
+        if (strlen(addr) >= sizeof(sau.sun_path)) goto fail;
+        strcpy(sau.sun_path, addr);
+        unlink(addr);
+        lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (lfd < 0 || bind(lfd, (struct sockaddr *) &sau, sizeof(sau)) < 0) goto fail;
+        strcpy(upath, addr);
+    }
+    if (listen(lfd, 1) < 0) goto fail;
+
+    log_info("gdb: waiting for a debugger on '%s'.\n", addr);
+    int c = accept(lfd, NULL, NULL);
+    if (c < 0) goto fail;
+    // later debuggers are picked up by gdb_poll()
+    fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK);
+    gdb_initialized = 1;
+    attach(c);
+    return 0;
+
+fail:
+    log_error("gdb: can't listen on '%s'.\n", addr);
+    if (lfd >= 0) close(lfd);
+    lfd = -1;
+    return -1;
+}
+
+/**
+ * @brief tell the debugger the program exited, and stop listening
+ *
+ */
+void gdb_deinit() {
+    if (!gdb_initialized) return;
+    if (fd >= 0) reply("W00");
+    detach();
+    close(lfd);
+    lfd = -1;
+    if (upath[0]) unlink(upath);
+    gdb_initialized = 0;
+}
@@ -0,0 +1,24 @@
+#ifndef NES_GDB_H
+#define NES_GDB_H
+#include <stdint.h>
+#include "types.h"
+
+/*
+ * GDB remote serial protocol stub. registers go in the order of
+ * regs_6502_t: a, x, y, p, sp as bytes, then pc little endian. addresses
+ * below GDB_PPU are the CPU's, PPU memory is at GDB_PPU + $0000-$3FFF.
+ */
+#define GDB_PPU 0x10000
+#define GDB_PACKET_SZ 0x1000
+#define GDB_WATCH_MAX 32 // bytes watched at once
+
+/* the CPU calls gdb_insn() before each instruction while this is set:
+ * breakpoints, watchpoints, a step or a stop are pending */
+extern NES_TLS uint8_t gdb_armed;
+
+int gdb_init(const char *addr);
+void gdb_deinit();
+void gdb_poll();
+int gdb_insn(uint16_t pc);
+
+#endif // NES_GDB_H
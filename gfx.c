@@ -1,48 +1,140 @@
 #include "gfx.h"
 #include "sdl.h"
 #include "log.h"
+#include "fb.h"
+#include "pal.h"
+#include "stats.h"
+#include "prof.h"
+#include "filter.h"
 #include <SDL2/SDL.h>
-#define NES_W 256
-#define NES_H 240
 
 static int gfx_initialized = 0;
 static SDL_Texture *texture = NULL;
 static SDL_Renderer *rndr = NULL;
 static SDL_Window *window = NULL;
-static uint32_t pixbuf[NES_W * NES_H];
+static gfx_mode_t mode = GFX_DIRECT;
+static filter_kind_t filter = FILTER_NONE;
+
+// duplicate frames are not presented, but at least every MAX_SKIP frames
+// so that the window still repaints after being exposed or resized
+#define MAX_SKIP 30
+static int skip_dups = 1;
+static int skipped = 0;
+
+// locked texture of the current frame, direct mode only
+static uint8_t *fb = NULL;
+static int fb_pitch = 0; // in bytes
+
 /**
  * @brief start a new frame
  * 
+ * there is no clear here: the PPU delivers every visible row, so the frame 
+ * is written exactly once.
  */
 void gfx_new_frame() {
-    memset(pixbuf, 0, sizeof(pixbuf));
+    if (mode != GFX_DIRECT || gfx_initialized != 1 || fb != NULL) return;
+
+    void *pixels;
+    if (SDL_LockTexture(texture, NULL, &pixels, &fb_pitch) < 0) {
+        log_error("failed to lock texture: %s.\n", SDL_GetError());
+        return;
+    }
+    fb = (uint8_t *) pixels;
 }
 
 /**
- * @brief set a pixel of the current frame
+ * @brief fb sink: convert a finished row into the locked texture
  * 
- * @param x num of pixels from top of the window
- * @param y num of pixels from left of thw window
- * @param r red channel
- * @param g green channel
- * @param b blue channel
+ * @param y row
+ * @param line palette indices
+ * @param emph color emphasis bits
  */
-inline void gfx_set_pixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
-    if (x >= NES_W || y >= NES_H) {
-        //log_warn("pixel (%d, %d) out of bound.\n", x, y);
-        return;
+static void gfx_line(int y, const uint8_t *line, uint8_t emph) {
+    if (fb == NULL) return; // lock failed, gfx_render converts the whole frame
+    pal_argb8888((uint32_t *) (fb + y * fb_pitch), line, emph, NES_W);
+}
+
+/**
+ * @brief fb sink: present the finished frame
+ * 
+ * @param frame the frame
+ */
+static void gfx_frame(const fb_t *frame) {
+    (void) frame;
+    // the texture keeps the last frame, so a duplicate needs no upload
+    if (skip_dups && fb_dup() && ++skipped < MAX_SKIP) return;
+    skipped = 0;
+
+    uint64_t t0 = stats_clock();
+    prof_sub = PROF_PRESENT;
+    gfx_render();
+    gfx_new_frame();
+    prof_sub = PROF_PPU;
+    stats_cur.t_present += stats_clock() - t0;
+}
+
+/**
+ * @brief set if frames identical to the last one are presented
+ *
+ * @param on 1 to skip them
+ */
+void gfx_skip_dups(int on) {
+    skip_dups = on;
+}
+
+/**
+ * @brief post-process frames on render, the texture takes the filter's size
+ *
+ * filters look at neighbouring rows, so the indexed mode is forced.
+ *
+ * @param kind filter
+ * @param threads threads to split the frame on, 1 for none
+ * @return int status
+ * @retval -1 failed, frames are shown unfiltered
+ * @retval 0 OK
+ */
+int gfx_set_filter(filter_kind_t kind, int threads) {
+    if (gfx_initialized != 1) {
+        log_error("GFX is not ready. call gfx_init();\n");
+        return -1;
+    }
+    if (fb != NULL) SDL_UnlockTexture(texture);
+    fb = NULL;
+    filter_deinit();
+    filter = FILTER_NONE;
+
+    int w = NES_W, h = NES_H;
+    if (kind != FILTER_NONE) {
+        if (filter_init(kind, threads) < 0) return -1;
+        filter_size(&w, &h);
     }
-    pixbuf[y * NES_W + x] = (0xff000000 | (r << 16) | (g << 8)| b);
+
+    SDL_Texture *t = SDL_CreateTexture(rndr, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, w, h);
+    if (t == NULL) {
+        log_error("SDL_CreateTexture: %s\n", SDL_GetError());
+        filter_deinit();
+        return -1;
+    }
+    SDL_DestroyTexture(texture);
+    texture = t;
+    filter = kind;
+    if (kind != FILTER_NONE) mode = GFX_INDEXED;
+
+    fb_sink_t sink = { mode == GFX_DIRECT ? gfx_line : NULL, gfx_frame };
+    fb_set_sink(&sink);
+    gfx_new_frame();
+    return 0;
 }
 
 /**
  * @brief init SDL gfx
  * 
+ * @param m frame output mode
  * @return int status
  * @retval -1 failed
  * @retval 0 OK
  */
-int gfx_init() {
+int gfx_init(gfx_mode_t m) {
     if (!sdl_ready()) {
         log_error("SDL is not ready. call sdl_init();\n");
         return -1;
@@ -84,6 +176,9 @@ int gfx_init() {
         return -1;
     }
 
+    mode = m;
+    fb_sink_t sink = { mode == GFX_DIRECT ? gfx_line : NULL, gfx_frame };
+    fb_set_sink(&sink);
     gfx_initialized = 1;
     
     return 0;
@@ -94,6 +189,11 @@ int gfx_init() {
  * 
  */
 void gfx_deinit() {
+    fb_set_sink(NULL);
+    if (fb != NULL) SDL_UnlockTexture(texture);
+    fb = NULL;
+    filter_deinit();
+    filter = FILTER_NONE;
     SDL_DestroyTexture(texture);
     SDL_DestroyRenderer(rndr);
     SDL_DestroyWindow(window);
@@ -110,14 +210,18 @@ inline void gfx_render() {
         log_error("render requested in bad state.\n");
         return;
     }
-    void *pixels;
-    int pitch;
-    if (SDL_LockTexture(texture, NULL, &pixels, &pitch) < 0) {
-        log_error("failed to lock texture: %s.\n", SDL_GetError());
-        return;
+    if (fb == NULL) {
+        // indexed mode (or failed lock): convert, or filter, the whole frame now
+        void *pixels;
+        if (SDL_LockTexture(texture, NULL, &pixels, &fb_pitch) < 0) {
+            log_error("failed to lock texture: %s.\n", SDL_GetError());
+            return;
+        }
+        if (filter != FILTER_NONE) filter_run(fb_frame(), pixels, fb_pitch);
+        else fb_argb8888(fb_frame(), pixels, fb_pitch);
     }
-    memcpy(pixels, pixbuf, sizeof(pixbuf));
     SDL_UnlockTexture(texture);
+    fb = NULL;
     SDL_RenderClear(rndr);
     SDL_RenderCopy(rndr, texture, NULL, NULL);
     SDL_RenderPresent(rndr);
@@ -1,9 +1,24 @@
 #ifndef NES_GFX_H
 #define NES_GFX_H
 #include <stdint.h>
+#include "filter.h"
+
+/**
+ * @brief frame output mode
+ * 
+ */
+typedef enum gfx_mode {
+    // PPU rows are converted straight into the locked streaming texture
+    GFX_DIRECT,
+
+    // only the indexed frame is kept, converted once on render
+    GFX_INDEXED
+} gfx_mode_t;
+
 void gfx_new_frame();
-void gfx_set_pixel(int x, int y, uint8_t r, uint8_t g, uint8_t b);
 void gfx_deinit();
 void gfx_render();
-int gfx_init();
-#endif // NES_GFX_H
\ No newline at end of file
+int gfx_init(gfx_mode_t mode);
+void gfx_skip_dups(int on);
+int gfx_set_filter(filter_kind_t kind, int threads);
+#endif // NES_GFX_H
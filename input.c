@@ -0,0 +1,81 @@
+#include "input.h"
+#include "types.h"
+#include "state.h"
+
+static NES_TLS uint8_t pads[2]; // buttons held, set by the host
+static NES_TLS uint8_t shift[2]; // latched buttons being read out
+static NES_TLS uint8_t strobe;
+
+#define INPUT_STATE(X) X(shift) X(strobe)
+
+/**
+ * @brief set the buttons held on a controller
+ *
+ * @param port 0 or 1
+ * @param buttons BTN_* mask
+ */
+void input_set(int port, uint8_t buttons) {
+    pads[port & 1] = buttons;
+}
+
+/**
+ * @brief get the buttons held on a port
+ *
+ * @param port 0 or 1
+ * @return uint8_t BTN_* mask
+ */
+uint8_t input_get(int port) {
+    return pads[port & 1];
+}
+
+/**
+ * @brief write to $4016, bit 0 latches the buttons while set
+ *
+ * @param val value
+ */
+void input_write(uint8_t val) {
+    strobe = val & 1;
+    if (strobe) {
+        shift[0] = pads[0];
+        shift[1] = pads[1];
+    }
+}
+
+/**
+ * @brief read $4016 or $4017, one button per read
+ *
+ * @param port 0 or 1
+ * @return uint8_t button in bit 0, open bus in the upper bits
+ */
+uint8_t input_read(int port) {
+    port &= 1;
+    if (strobe) shift[port] = pads[port];
+    uint8_t bit = shift[port] & 1;
+    // official controllers return 1 once all 8 buttons are out
+    shift[port] = (shift[port] >> 1) | 0x80;
+    return 0x40 | bit;
+}
+
+/**
+ * @brief save the controller port state
+ *
+ * @param p output, NULL to get the size only
+ * @return size_t size
+ */
+size_t input_save(uint8_t *p) {
+    size_t n = 0;
+    INPUT_STATE(STATE_SAVE)
+    return n;
+}
+
+/**
+ * @brief load the controller port state
+ *
+ * @param p saved state
+ * @return size_t size
+ */
+size_t input_load(const uint8_t *p) {
+    size_t n = 0;
+    INPUT_STATE(STATE_LOAD)
+    return n;
+}
@@ -0,0 +1,23 @@
+#ifndef NES_INPUT_H
+#define NES_INPUT_H
+#include <stdint.h>
+#include <unistd.h>
+
+/* standard controller buttons, in the order they are shifted out */
+#define BTN_A      0b00000001
+#define BTN_B      0b00000010
+#define BTN_SELECT 0b00000100
+#define BTN_START  0b00001000
+#define BTN_UP     0b00010000
+#define BTN_DOWN   0b00100000
+#define BTN_LEFT   0b01000000
+#define BTN_RIGHT  0b10000000
+
+void input_set(int port, uint8_t buttons);
+uint8_t input_get(int port);
+void input_write(uint8_t val);
+uint8_t input_read(int port);
+size_t input_save(uint8_t *p);
+size_t input_load(const uint8_t *p);
+
+#endif // NES_INPUT_H
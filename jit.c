@@ -0,0 +1,784 @@
+#include "jit.h"
+#include "mem.h"
+#include "log.h"
+#include "types.h"
+#include <string.h>
+#include <sys/mman.h>
+
+static int enabled = 1, verify = 0;
+static jit_stats_t stats;
+
+#if defined(__x86_64__)
+
+#define CODE_SZ (4 << 20) // code cache
+#define CODE_MIN 4096 // room needed to start a block
+#define MAX_INSNS 64 // per block
+#define JIT_HOT 4 // executions before a block is compiled
+#define NOCOMPILE ((void *) 1)
+
+/* CPU state, owned by 6502.c */
+extern NES_TLS uint8_t acc, x, y, sp, s;
+extern NES_TLS uint16_t pc;
+extern NES_TLS uint64_t cycles;
+
+/* host registers */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+#define R_A   RBX
+#define R_X   R12
+#define R_Y   R13
+#define R_SP  R8
+#define R_P   R14 // P, except N and Z
+#define R_NZ  R15 // lazy N/Z: Z if low byte is 0, N if any of 0x8080 is set
+#define R_MEM RBP // vCPU memory
+#define R_CYC RSI // cycle counter
+#define R_LIM RDI // cycle limit
+#define R_PEN R10 // page crossing penalty of the current instruction
+
+/* x86 condition codes */
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+
+/* addressing modes and operations, named after the interpreter's AM_* and OP_* */
+enum { M_IMP, M_IMM, M_ZPG, M_ZPX, M_ZPY, M_ABS, M_ABX, M_ABY, M_INX, M_INY, M_REL };
+enum {
+    O_NOP, O_LDA, O_LDX, O_LDY, O_STA, O_STX, O_STY, O_ADC, O_SBC, O_AND, O_ORA, O_EOR,
+    O_CMP, O_CPX, O_CPY, O_BIT, O_INC, O_DEC, O_ASL, O_LSR, O_ROL, O_ROR, O_ASLA, O_LSRA,
+    O_ROLA, O_RORA, O_INX, O_DEX, O_INY, O_DEY, O_TAX, O_TXA, O_TAY, O_TYA, O_TSX, O_TXS,
+    O_CLC, O_SEC, O_CLD, O_SED, O_CLV, O_SEI, O_PHA, O_PLA, O_PHP, O_JMP, O_JSR, O_RTS,
+    O_BPL, O_BMI, O_BVC, O_BVS, O_BCC, O_BCS, O_BNE, O_BEQ
+};
+
+typedef struct jit_op {
+    uint8_t am;
+    uint8_t op;
+    uint8_t cycles; // 0 if not compiled
+} jit_op_t;
+
+/* the subset of the interpreter's opcode table that is compiled, same cycles */
+static const jit_op_t ops[0x100] = {
+    [0x01] = { M_INX, O_ORA, 6 }, [0x05] = { M_ZPG, O_ORA, 3 }, [0x06] = { M_ZPG, O_ASL, 5 },
+    [0x08] = { M_IMP, O_PHP, 3 }, [0x09] = { M_IMM, O_ORA, 2 }, [0x0A] = { M_IMP, O_ASLA, 2 },
+    [0x0D] = { M_ABS, O_ORA, 4 }, [0x0E] = { M_ABS, O_ASL, 6 }, [0x10] = { M_REL, O_BPL, 2 },
+    [0x11] = { M_INY, O_ORA, 5 }, [0x15] = { M_ZPX, O_ORA, 4 }, [0x16] = { M_ZPX, O_ASL, 6 },
+    [0x18] = { M_IMP, O_CLC, 2 }, [0x19] = { M_ABY, O_ORA, 4 }, [0x1D] = { M_ABX, O_ORA, 4 },
+    [0x1E] = { M_ABX, O_ASL, 7 }, [0x20] = { M_ABS, O_JSR, 6 }, [0x21] = { M_INX, O_AND, 6 },
+    [0x24] = { M_ZPG, O_BIT, 3 }, [0x25] = { M_ZPG, O_AND, 3 }, [0x26] = { M_ZPG, O_ROL, 5 },
+    [0x29] = { M_IMM, O_AND, 2 }, [0x2A] = { M_IMP, O_ROLA, 2 }, [0x2C] = { M_ABS, O_BIT, 4 },
+    [0x2D] = { M_ABS, O_AND, 2 }, [0x2E] = { M_ABS, O_ROL, 6 }, [0x30] = { M_REL, O_BMI, 2 },
+    [0x31] = { M_INY, O_AND, 5 }, [0x35] = { M_ZPX, O_AND, 4 }, [0x36] = { M_ZPX, O_ROL, 6 },
+    [0x38] = { M_IMP, O_SEC, 2 }, [0x39] = { M_ABY, O_AND, 4 }, [0x3D] = { M_ABX, O_AND, 4 },
+    [0x3E] = { M_ABX, O_ROL, 7 }, [0x41] = { M_INX, O_EOR, 6 }, [0x45] = { M_ZPG, O_EOR, 3 },
+    [0x46] = { M_ZPG, O_LSR, 5 }, [0x48] = { M_IMP, O_PHA, 3 }, [0x49] = { M_IMM, O_EOR, 2 },
+    [0x4A] = { M_IMP, O_LSRA, 2 }, [0x4C] = { M_ABS, O_JMP, 3 }, [0x4D] = { M_ABS, O_EOR, 4 },
+    [0x4E] = { M_ABS, O_LSR, 6 }, [0x50] = { M_REL, O_BVC, 2 }, [0x51] = { M_INY, O_EOR, 5 },
+    [0x55] = { M_ZPX, O_EOR, 4 }, [0x56] = { M_ZPX, O_LSR, 6 }, [0x59] = { M_ABY, O_EOR, 4 },
+    [0x5D] = { M_ABX, O_EOR, 4 }, [0x5E] = { M_ABX, O_LSR, 7 }, [0x60] = { M_IMP, O_RTS, 6 },
+    [0x61] = { M_INX, O_ADC, 6 }, [0x65] = { M_ZPG, O_ADC, 3 }, [0x66] = { M_ZPG, O_ROR, 5 },
+    [0x68] = { M_IMP, O_PLA, 4 }, [0x69] = { M_IMM, O_ADC, 2 }, [0x6A] = { M_IMP, O_RORA, 2 },
+    [0x6D] = { M_ABS, O_ADC, 4 }, [0x6E] = { M_ABS, O_ROR, 6 }, [0x70] = { M_REL, O_BVS, 2 },
+    [0x71] = { M_INY, O_ADC, 5 }, [0x75] = { M_ZPX, O_ADC, 4 }, [0x76] = { M_ZPX, O_ROR, 6 },
+    [0x78] = { M_IMP, O_SEI, 2 }, [0x79] = { M_ABY, O_ADC, 4 }, [0x7D] = { M_ABX, O_ADC, 4 },
+    [0x7E] = { M_ABX, O_ROR, 7 }, [0x81] = { M_INX, O_STA, 6 }, [0x84] = { M_ZPG, O_STY, 3 },
+    [0x85] = { M_ZPG, O_STA, 3 }, [0x86] = { M_ZPG, O_STX, 3 }, [0x88] = { M_IMP, O_DEY, 2 },
+    [0x8A] = { M_IMP, O_TXA, 2 }, [0x8C] = { M_ABS, O_STY, 4 }, [0x8D] = { M_ABS, O_STA, 4 },
+    [0x8E] = { M_ABS, O_STX, 4 }, [0x90] = { M_REL, O_BCC, 2 }, [0x91] = { M_INY, O_STA, 6 },
+    [0x94] = { M_ZPX, O_STY, 4 }, [0x95] = { M_ZPX, O_STA, 4 }, [0x96] = { M_ZPY, O_STX, 4 },
+    [0x98] = { M_IMP, O_TYA, 2 }, [0x99] = { M_ABY, O_STA, 5 }, [0x9A] = { M_IMP, O_TXS, 2 },
+    [0x9D] = { M_ABX, O_STA, 5 }, [0xA0] = { M_IMM, O_LDY, 2 }, [0xA1] = { M_INX, O_LDA, 6 },
+    [0xA2] = { M_IMM, O_LDX, 2 }, [0xA4] = { M_ZPG, O_LDY, 3 }, [0xA5] = { M_ZPG, O_LDA, 3 },
+    [0xA6] = { M_ZPG, O_LDX, 3 }, [0xA8] = { M_IMP, O_TAY, 2 }, [0xA9] = { M_IMM, O_LDA, 2 },
+    [0xAA] = { M_IMP, O_TAX, 2 }, [0xAC] = { M_ABS, O_LDY, 4 }, [0xAD] = { M_ABS, O_LDA, 4 },
+    [0xAE] = { M_ABS, O_LDX, 4 }, [0xB0] = { M_REL, O_BCS, 2 }, [0xB1] = { M_INY, O_LDA, 5 },
+    [0xB4] = { M_ZPX, O_LDY, 4 }, [0xB5] = { M_ZPX, O_LDA, 4 }, [0xB6] = { M_ZPY, O_LDX, 4 },
+    [0xB8] = { M_IMP, O_CLV, 2 }, [0xB9] = { M_ABY, O_LDA, 4 }, [0xBA] = { M_IMP, O_TSX, 2 },
+    [0xBC] = { M_ABX, O_LDY, 4 }, [0xBD] = { M_ABX, O_LDA, 4 }, [0xBE] = { M_ABY, O_LDX, 4 },
+    [0xC0] = { M_IMM, O_CPY, 2 }, [0xC1] = { M_INX, O_CMP, 6 }, [0xC4] = { M_ZPG, O_CPY, 3 },
+    [0xC5] = { M_ZPG, O_CMP, 3 }, [0xC6] = { M_ZPG, O_DEC, 5 }, [0xC8] = { M_IMP, O_INY, 2 },
+    [0xC9] = { M_IMM, O_CMP, 2 }, [0xCA] = { M_IMP, O_DEX, 2 }, [0xCC] = { M_ABS, O_CPY, 4 },
+    [0xCD] = { M_ABS, O_CMP, 4 }, [0xCE] = { M_ABS, O_DEC, 6 }, [0xD0] = { M_REL, O_BNE, 2 },
+    [0xD1] = { M_INY, O_CMP, 5 }, [0xD5] = { M_ZPX, O_CMP, 4 }, [0xD6] = { M_ZPX, O_DEC, 6 },
+    [0xD8] = { M_IMP, O_CLD, 2 }, [0xD9] = { M_ABY, O_CMP, 4 }, [0xDD] = { M_ABX, O_CMP, 4 },
+    [0xDE] = { M_ABX, O_DEC, 7 }, [0xE0] = { M_IMM, O_CPX, 2 }, [0xE1] = { M_INX, O_SBC, 6 },
+    [0xE4] = { M_ZPG, O_CPX, 3 }, [0xE5] = { M_ZPG, O_SBC, 3 }, [0xE6] = { M_ZPG, O_INC, 5 },
+    [0xE8] = { M_IMP, O_INX, 2 }, [0xE9] = { M_IMM, O_SBC, 2 }, [0xEA] = { M_IMP, O_NOP, 2 },
+    [0xEB] = { M_IMM, O_SBC, 2 }, [0xEC] = { M_ABS, O_CPX, 4 }, [0xED] = { M_ABS, O_SBC, 4 },
+    [0xEE] = { M_ABS, O_INC, 6 }, [0xF0] = { M_REL, O_BEQ, 2 }, [0xF1] = { M_INY, O_SBC, 5 },
+    [0xF5] = { M_ZPX, O_SBC, 4 }, [0xF6] = { M_ZPX, O_INC, 6 }, [0xF8] = { M_IMP, O_SED, 2 },
+    [0xF9] = { M_ABY, O_SBC, 4 }, [0xFD] = { M_ABX, O_SBC, 4 }, [0xFE] = { M_ABX, O_INC, 7 },
+};
+
+static const uint8_t am_len[] = {
+    [M_IMP] = 1, [M_IMM] = 2, [M_ZPG] = 2, [M_ZPX] = 2, [M_ZPY] = 2, [M_ABS] = 3,
+    [M_ABX] = 3, [M_ABY] = 3, [M_INX] = 2, [M_INY] = 2, [M_REL] = 2
+};
+
+static int jit_initialized = 0;
+static uint8_t *code, *cp, *code_start; // cache, emit ptr, first block
+static void (*enter)(uint64_t limit, void *block);
+static uint8_t *leave; // common exit, next pc in edx
+static void *blocks[0x8000]; // by pc - 0x8000
+static uint8_t hits[0x8000];
+
+/** begin emitters **/
+static inline void b(uint8_t v) { *cp++ = v; }
+static inline void d32(uint32_t v) { memcpy(cp, &v, 4); cp += 4; }
+static inline void d64(uint64_t v) { memcpy(cp, &v, 8); cp += 8; }
+
+// always emitted, so byte operands are the low 8 bits of the register
+static inline void rex(int w, int r, int i, int m) {
+    b(0x40 | w << 3 | (r >> 3) << 2 | (i >> 3) << 1 | m >> 3);
+}
+static inline void modrm(int mod, int reg, int rm) {
+    b(mod << 6 | (reg & 7) << 3 | (rm & 7));
+}
+// op r/m32, r32: add 01, or 09, and 21, sub 29, xor 31, cmp 39, test 85, mov 89
+static void rr(uint8_t op, int dst, int src) {
+    rex(0, src, 0, dst); b(op); modrm(3, src, dst);
+}
+// op r/m64, r64
+static void rr64(uint8_t op, int dst, int src) {
+    rex(1, src, 0, dst); b(op); modrm(3, src, dst);
+}
+// op r/m32, imm32: add 0, or 1, and 4, sub 5, xor 6, cmp 7
+static void ri(int ext, int dst, uint32_t imm) {
+    rex(0, 0, 0, dst); b(0x81); modrm(3, ext, dst); d32(imm);
+}
+// shl 4, shr 5
+static void shift(int ext, int dst, uint8_t n) {
+    rex(0, 0, 0, dst); b(0xC1); modrm(3, ext, dst); b(n);
+}
+// inc 0, dec 1, not 2 (F7)
+static void unary(uint8_t op, int ext, int dst) {
+    rex(0, 0, 0, dst); b(op); modrm(3, ext, dst);
+}
+#define INC(r) unary(0xFF, 0, r)
+#define DEC(r) unary(0xFF, 1, r)
+#define NOT(r) unary(0xF7, 2, r)
+static void movzx8(int dst, int src) {
+    rex(0, dst, 0, src); b(0x0F); b(0xB6); modrm(3, dst, src);
+}
+static void movzx16(int dst, int src) {
+    rex(0, dst, 0, src); b(0x0F); b(0xB7); modrm(3, dst, src);
+}
+static void mov_ri(int dst, uint32_t imm) {
+    rex(0, 0, 0, dst); b(0xB8 + (dst & 7)); d32(imm);
+}
+static void mov_ri64(int dst, uint64_t imm) {
+    rex(1, 0, 0, dst); b(0xB8 + (dst & 7)); d64(imm);
+}
+// test r/m32, imm32
+static void test_i(int dst, uint32_t imm) {
+    rex(0, 0, 0, dst); b(0xF7); modrm(3, 0, dst); d32(imm);
+}
+// test r/m8, r8
+static void test8(int dst, int src) {
+    rex(0, src, 0, dst); b(0x84); modrm(3, src, dst);
+}
+static void setcc(uint8_t cc, int dst) {
+    rex(0, 0, 0, dst); b(0x0F); b(0x90 | cc); modrm(3, 0, dst);
+}
+// movzx r32, byte [mem + idx + disp], or [mem + disp] if idx < 0
+static void ld(int dst, int idx, int32_t disp) {
+    rex(0, dst, idx < 0 ? 0 : idx, R_MEM); b(0x0F); b(0xB6);
+    if (idx < 0) modrm(2, dst, R_MEM);
+    else { modrm(2, dst, 4); b((idx & 7) << 3 | (R_MEM & 7)); }
+    d32(disp);
+}
+// mov byte [mem + idx + disp], r8
+static void st(int src, int idx, int32_t disp) {
+    rex(0, src, idx < 0 ? 0 : idx, R_MEM); b(0x88);
+    if (idx < 0) modrm(2, src, R_MEM);
+    else { modrm(2, src, 4); b((idx & 7) << 3 | (R_MEM & 7)); }
+    d32(disp);
+}
+// movzx r32, byte [rax] / mov byte [rax], r8
+static void ld_rax(int dst) { rex(0, dst, 0, RAX); b(0x0F); b(0xB6); modrm(0, dst, RAX); }
+static void st_rax(int src) { rex(0, src, 0, RAX); b(0x88); modrm(0, src, RAX); }
+// jcc rel32 with the target patched in by here()
+static uint8_t *jcc(uint8_t cc) { b(0x0F); b(0x80 | cc); d32(0); return cp; }
+static void here(uint8_t *j) { int32_t r = cp - j; memcpy(j - 4, &r, 4); }
+static void jmp_to(uint8_t *t) { b(0xE9); d32(t - (cp + 4)); }
+/** end emitters **/
+
+/**
+ * @brief leave the block, continuing at npc
+ * 
+ * @param npc next pc
+ */
+static void exit_to(uint16_t npc) {
+    mov_ri(RDX, npc);
+    jmp_to(leave);
+}
+
+/**
+ * @brief materialize P into dst (not rcx)
+ * 
+ * @param dst register
+ */
+static void emit_flags(int dst) {
+    rr(0x89, dst, R_P);
+    ri(4, dst, 0x7D);
+    rr(0x31, RCX, RCX);
+    test_i(R_NZ, 0x8080);
+    setcc(CC_NE, RCX);
+    shift(4, RCX, 7);
+    rr(0x09, dst, RCX);
+    rr(0x31, RCX, RCX);
+    test8(R_NZ, R_NZ);
+    setcc(CC_E, RCX);
+    shift(4, RCX, 1);
+    rr(0x09, dst, RCX);
+}
+
+/**
+ * @brief emit the common entry and exit
+ * 
+ */
+static void emit_stubs() {
+    static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+
+    // void enter(uint64_t limit /* rdi */, void *block /* rsi */)
+    enter = (void (*)(uint64_t, void *)) cp;
+    for (int i = 0; i < 6; i++) { if (saved[i] >= 8) b(0x41); b(0x50 + (saved[i] & 7)); }
+    rr64(0x89, R11, RSI);
+    mov_ri64(RAX, (uintptr_t) &acc); ld_rax(R_A);
+    mov_ri64(RAX, (uintptr_t) &x); ld_rax(R_X);
+    mov_ri64(RAX, (uintptr_t) &y); ld_rax(R_Y);
+    mov_ri64(RAX, (uintptr_t) &sp); ld_rax(R_SP);
+    mov_ri64(RAX, (uintptr_t) &s); ld_rax(R_P);
+    mov_ri64(RAX, (uintptr_t) &cycles);
+    rex(1, R_CYC, 0, RAX); b(0x8B); modrm(0, R_CYC, RAX);
+    mov_ri64(R_MEM, (uintptr_t) memptr(0));
+    rr(0x89, R_NZ, R_P);
+    ri(4, R_NZ, 0x80);
+    shift(4, R_NZ, 8);
+    rr(0x31, RCX, RCX);
+    test_i(R_P, 0x02);
+    setcc(CC_E, RCX);
+    rr(0x09, R_NZ, RCX);
+    rex(0, 0, 0, R11); b(0xFF); modrm(3, 4, R11); // jmp r11
+
+    // next pc in edx
+    leave = cp;
+    emit_flags(R9);
+    mov_ri64(RAX, (uintptr_t) &s); st_rax(R9);
+    mov_ri64(RAX, (uintptr_t) &acc); st_rax(R_A);
+    mov_ri64(RAX, (uintptr_t) &x); st_rax(R_X);
+    mov_ri64(RAX, (uintptr_t) &y); st_rax(R_Y);
+    mov_ri64(RAX, (uintptr_t) &sp); st_rax(R_SP);
+    mov_ri64(RAX, (uintptr_t) &pc);
+    b(0x66); rex(0, RDX, 0, RAX); b(0x89); modrm(0, RDX, RAX);
+    mov_ri64(RAX, (uintptr_t) &cycles);
+    rex(1, R_CYC, 0, RAX); b(0x89); modrm(0, R_CYC, RAX);
+    for (int i = 5; i >= 0; i--) { if (saved[i] >= 8) b(0x41); b(0x58 + (saved[i] & 7)); }
+    b(0xC3);
+
+    code_start = cp;
+}
+
+/**
+ * @brief check a dynamic address in eax, leave to the interpreter if it is not RAM (or ROM)
+ * 
+ * @param ipc pc of the instruction
+ * @param write 1 for a store, which must hit RAM
+ */
+static void emit_range(uint16_t ipc, int write) {
+    uint8_t *ram, *rom = NULL;
+    ri(7, RAX, 0x2000);
+    ram = jcc(CC_B);
+    if (!write) {
+        ri(7, RAX, 0x8000);
+        rom = jcc(CC_AE);
+    }
+    exit_to(ipc);
+    here(ram);
+    ri(4, RAX, 0x07FF);
+    if (rom) here(rom);
+}
+
+/**
+ * @brief set R_PEN if the high byte of eax differs from page
+ * 
+ * @param page page the interpreter compares against
+ */
+static void emit_penalty(uint8_t page) {
+    rr(0x31, R_PEN, R_PEN);
+    rr(0x89, RDX, RAX);
+    shift(5, RDX, 8);
+    ri(7, RDX, page);
+    setcc(CC_NE, R_PEN);
+}
+
+/**
+ * @brief emit the effective address of an operand
+ * 
+ * @param am addressing mode
+ * @param ipc pc of the instruction
+ * @param write 1 for a store
+ * @param disp output, static address
+ * @param pen output, 1 if R_PEN is set
+ * @return int -1 if not compiled, 0 for [mem + disp], 1 for [mem + rax]
+ */
+static int emit_ea(uint8_t am, uint16_t ipc, int write, int32_t *disp, int *pen) {
+    uint8_t lo = memread(ipc + 1);
+    uint16_t w = lo | (uint16_t) memread(ipc + 2) << 8;
+    *pen = 0;
+    switch (am) {
+        case M_ZPG: *disp = lo; return 0;
+        case M_ZPX:
+        case M_ZPY: {
+            rr(0x89, RAX, am == M_ZPX ? R_X : R_Y);
+            ri(0, RAX, lo);
+            movzx8(RAX, RAX);
+            return 1;
+        }
+        case M_ABS: {
+            // the interpreter reads the operand even for stores, keep off I/O
+            if (w < 0x2000) *disp = w & 0x07FF;
+            else if (w >= 0x8000 && !write) *disp = w;
+            else return -1;
+            return 0;
+        }
+        case M_ABX:
+        case M_ABY: {
+            rr(0x89, RAX, am == M_ABX ? R_X : R_Y);
+            ri(0, RAX, w);
+            movzx16(RAX, RAX);
+            // like the interpreter, compare with the operand's page
+            emit_penalty((ipc + 1) >> 8);
+            *pen = 1;
+            emit_range(ipc, write);
+            return 1;
+        }
+        case M_INX: {
+            rr(0x89, RCX, R_X);
+            ri(0, RCX, lo);
+            movzx8(RCX, RCX);
+            ld(RAX, RCX, 0);
+            ld(RDX, RCX, 1); // no zero page wrap, as in the interpreter
+            shift(4, RDX, 8);
+            rr(0x09, RAX, RDX);
+            emit_range(ipc, write);
+            return 1;
+        }
+        case M_INY: {
+            ld(RAX, -1, lo);
+            ld(RDX, -1, (lo + 1) & 0xFF);
+            shift(4, RDX, 8);
+            rr(0x09, RAX, RDX);
+            rr(0x01, RAX, R_Y);
+            movzx16(RAX, RAX);
+            emit_penalty((ipc + 2) >> 8);
+            *pen = 1;
+            emit_range(ipc, write);
+            return 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief set carry from bit 0 of edx
+ * 
+ */
+static void emit_carry() {
+    ri(4, R_P, 0xFE);
+    rr(0x09, R_P, RDX);
+}
+
+/**
+ * @brief shifts and rotates of reg
+ * 
+ * @param op O_ASL, O_LSR, O_ROL or O_ROR
+ * @param reg register
+ */
+static void emit_shift(uint8_t op, int reg) {
+    if (op == O_ROL || op == O_ROR) {
+        rr(0x89, R9, R_P);
+        ri(4, R9, 1);
+        if (op == O_ROR) shift(4, R9, 7);
+    }
+    rr(0x89, RDX, reg);
+    if (op == O_ASL || op == O_ROL) shift(5, RDX, 7);
+    else ri(4, RDX, 1);
+    emit_carry();
+    if (op == O_ASL || op == O_ROL) shift(4, reg, 1);
+    else shift(5, reg, 1);
+    if (op == O_ROL || op == O_ROR) rr(0x09, reg, R9);
+    movzx8(reg, reg);
+    rr(0x89, R_NZ, reg);
+}
+
+/**
+ * @brief compare reg with ecx
+ * 
+ * @param reg register
+ */
+static void emit_cmp(int reg) {
+    rr(0x89, RAX, reg);
+    rr(0x29, RAX, RCX);
+    rr(0x89, RDX, RAX);
+    shift(5, RDX, 31);
+    ri(6, RDX, 1);
+    emit_carry();
+    movzx8(R_NZ, RAX);
+}
+
+/**
+ * @brief push r8
+ * 
+ * @param reg register
+ */
+static void emit_push(int reg) {
+    st(reg, R_SP, 0x100);
+    DEC(R_SP);
+    movzx8(R_SP, R_SP);
+}
+
+/**
+ * @brief compile a block
+ * 
+ * @param start pc
+ * @return void* code, NULL if the first instruction can't be compiled
+ */
+static void *compile(uint16_t start) {
+    uint8_t *blk = cp;
+    uint16_t p = start;
+    int n;
+
+    for (n = 0; n < MAX_INSNS; n++) {
+        // the whole instruction must be in ROM
+        if (p < 0x8000 || p > 0xFFFD) break;
+        const jit_op_t *o = &ops[memread(p)];
+        if (o->cycles == 0) break;
+
+        uint16_t next = p + am_len[o->am];
+        int32_t disp = 0;
+        int dyn = 0, pen = 0;
+        int store = o->op == O_STA || o->op == O_STX || o->op == O_STY;
+        int rmw = o->am != M_IMP && (o->op == O_INC || o->op == O_DEC || o->op == O_ASL ||
+            o->op == O_LSR || o->op == O_ROL || o->op == O_ROR);
+
+        // control flow
+        if (o->op == O_JMP || o->op == O_JSR) {
+            uint16_t t = memread(p + 1) | (uint16_t) memread(p + 2) << 8;
+            if (t >= 0x2000 && t < 0x8000) break;
+            if (o->op == O_JSR) {
+                mov_ri(RCX, (uint16_t) (next - 1) >> 8);
+                emit_push(RCX);
+                mov_ri(RCX, (uint8_t) (next - 1));
+                emit_push(RCX);
+            }
+            rex(1, 0, 0, R_CYC); b(0x83); modrm(3, 0, R_CYC); b(o->cycles);
+            exit_to(t);
+            return blk;
+        }
+        if (o->op == O_RTS) {
+            INC(R_SP); movzx8(R_SP, R_SP);
+            ld(RDX, R_SP, 0x100);
+            INC(R_SP); movzx8(R_SP, R_SP);
+            ld(RCX, R_SP, 0x100);
+            shift(4, RCX, 8);
+            rr(0x09, RDX, RCX);
+            INC(RDX);
+            movzx16(RDX, RDX);
+            rex(1, 0, 0, R_CYC); b(0x83); modrm(3, 0, R_CYC); b(o->cycles);
+            jmp_to(leave);
+            return blk;
+        }
+        if (o->am == M_REL) {
+            uint16_t t = next + (int8_t) memread(p + 1);
+            uint8_t *skip = NULL;
+            int c = o->cycles + ((t >> 8) != (next >> 8));
+            rex(1, 0, 0, R_CYC); b(0x83); modrm(3, 0, R_CYC); b(c);
+            switch (o->op) {
+                case O_BPL: test_i(R_NZ, 0x8080); skip = jcc(CC_NE); break;
+                case O_BMI: test_i(R_NZ, 0x8080); skip = jcc(CC_E); break;
+                case O_BNE: test8(R_NZ, R_NZ); skip = jcc(CC_E); break;
+                case O_BEQ: test8(R_NZ, R_NZ); skip = jcc(CC_NE); break;
+                case O_BCC: test_i(R_P, 0x01); skip = jcc(CC_NE); break;
+                case O_BCS: test_i(R_P, 0x01); skip = jcc(CC_E); break;
+                case O_BVC: test_i(R_P, 0x40); skip = jcc(CC_NE); break;
+                case O_BVS: test_i(R_P, 0x40); skip = jcc(CC_E); break;
+            }
+            exit_to(t);
+            here(skip);
+            goto next_insn;
+        }
+
+        // operand
+        if (o->am == M_IMM) {
+            mov_ri(RCX, memread(p + 1));
+        } else if (o->am != M_IMP) {
+            uint8_t *mark = cp;
+            dyn = emit_ea(o->am, p, store || rmw, &disp, &pen);
+            if (dyn < 0) { cp = mark; break; }
+            if (!store) ld(RCX, dyn ? RAX : -1, disp);
+        }
+
+        switch (o->op) {
+            case O_NOP: break;
+            case O_LDA: rr(0x89, R_A, RCX); rr(0x89, R_NZ, RCX); break;
+            case O_LDX: rr(0x89, R_X, RCX); rr(0x89, R_NZ, RCX); break;
+            case O_LDY: rr(0x89, R_Y, RCX); rr(0x89, R_NZ, RCX); break;
+            case O_STA: st(R_A, dyn ? RAX : -1, disp); break;
+            case O_STX: st(R_X, dyn ? RAX : -1, disp); break;
+            case O_STY: st(R_Y, dyn ? RAX : -1, disp); break;
+            case O_AND: rr(0x21, R_A, RCX); rr(0x89, R_NZ, R_A); break;
+            case O_ORA: rr(0x09, R_A, RCX); rr(0x89, R_NZ, R_A); break;
+            case O_EOR: rr(0x31, R_A, RCX); rr(0x89, R_NZ, R_A); break;
+            case O_ADC: {
+                // r = acc + v + c
+                rr(0x89, RAX, R_P); ri(4, RAX, 1);
+                rr(0x89, RDX, R_A); rr(0x01, RDX, RCX); rr(0x01, RDX, RAX);
+                // v = !((acc ^ v) & 0x80) && ((acc ^ r) & 0x80)
+                rr(0x89, RAX, R_A); rr(0x31, RAX, RCX); NOT(RAX);
+                rr(0x89, R9, R_A); rr(0x31, R9, RDX); rr(0x21, RAX, R9);
+                ri(4, RAX, 0x80); shift(5, RAX, 1);
+                ri(4, R_P, 0xBE); rr(0x09, R_P, RAX);
+                movzx8(R_A, RDX);
+                shift(5, RDX, 8);
+                rr(0x09, R_P, RDX);
+                rr(0x89, R_NZ, R_A);
+                break;
+            }
+            case O_SBC: {
+                // r = acc - v - !c
+                rr(0x89, RAX, R_P); ri(4, RAX, 1); ri(6, RAX, 1);
+                rr(0x89, RDX, R_A); rr(0x29, RDX, RCX); rr(0x29, RDX, RAX);
+                // v = ((acc ^ v) & 0x80) && ((acc ^ r) & 0x80)
+                rr(0x89, RAX, R_A); rr(0x31, RAX, RCX);
+                rr(0x89, R9, R_A); rr(0x31, R9, RDX); rr(0x21, RAX, R9);
+                ri(4, RAX, 0x80); shift(5, RAX, 1);
+                ri(4, R_P, 0xBE); rr(0x09, R_P, RAX);
+                movzx8(R_A, RDX);
+                // c = no borrow
+                shift(5, RDX, 31); ri(6, RDX, 1);
+                rr(0x09, R_P, RDX);
+                rr(0x89, R_NZ, R_A);
+                break;
+            }
+            case O_CMP: emit_cmp(R_A); break;
+            case O_CPX: emit_cmp(R_X); break;
+            case O_CPY: emit_cmp(R_Y); break;
+            case O_BIT: {
+                ri(4, R_P, 0xBF);
+                rr(0x89, RAX, RCX); ri(4, RAX, 0x40); rr(0x09, R_P, RAX);
+                // N from bit 7 of v, Z from acc & v
+                rr(0x89, RAX, R_A); rr(0x21, RAX, RCX);
+                rr(0x89, RDX, RCX); ri(4, RDX, 0x80); shift(4, RDX, 8);
+                rr(0x09, RAX, RDX);
+                rr(0x89, R_NZ, RAX);
+                break;
+            }
+            case O_INC:
+            case O_DEC: {
+                if (o->op == O_INC) INC(RCX); else DEC(RCX);
+                movzx8(RCX, RCX);
+                rr(0x89, R_NZ, RCX);
+                st(RCX, dyn ? RAX : -1, disp);
+                break;
+            }
+            case O_ASL:
+            case O_LSR:
+            case O_ROL:
+            case O_ROR: {
+                emit_shift(o->op, RCX);
+                st(RCX, dyn ? RAX : -1, disp);
+                break;
+            }
+            case O_ASLA: emit_shift(O_ASL, R_A); break;
+            case O_LSRA: emit_shift(O_LSR, R_A); break;
+            case O_ROLA: emit_shift(O_ROL, R_A); break;
+            case O_RORA: emit_shift(O_ROR, R_A); break;
+            case O_INX: INC(R_X); movzx8(R_X, R_X); rr(0x89, R_NZ, R_X); break;
+            case O_DEX: DEC(R_X); movzx8(R_X, R_X); rr(0x89, R_NZ, R_X); break;
+            case O_INY: INC(R_Y); movzx8(R_Y, R_Y); rr(0x89, R_NZ, R_Y); break;
+            case O_DEY: DEC(R_Y); movzx8(R_Y, R_Y); rr(0x89, R_NZ, R_Y); break;
+            case O_TAX: rr(0x89, R_X, R_A); rr(0x89, R_NZ, R_A); break;
+            case O_TXA: rr(0x89, R_A, R_X); rr(0x89, R_NZ, R_X); break;
+            case O_TAY: rr(0x89, R_Y, R_A); rr(0x89, R_NZ, R_A); break;
+            case O_TYA: rr(0x89, R_A, R_Y); rr(0x89, R_NZ, R_Y); break;
+            case O_TSX: rr(0x89, R_X, R_SP); rr(0x89, R_NZ, R_SP); break;
+            case O_TXS: rr(0x89, R_SP, R_X); break;
+            case O_CLC: ri(4, R_P, 0xFE); break;
+            case O_SEC: ri(1, R_P, 0x01); break;
+            case O_CLD: ri(4, R_P, 0xF7); break;
+            case O_SED: ri(1, R_P, 0x08); break;
+            case O_CLV: ri(4, R_P, 0xBF); break;
+            case O_SEI: ri(1, R_P, 0x04); break;
+            case O_PHA: emit_push(R_A); break;
+            case O_PHP: emit_flags(R9); ri(1, R9, 0x30); emit_push(R9); break;
+            case O_PLA: {
+                INC(R_SP); movzx8(R_SP, R_SP);
+                ld(R_A, R_SP, 0x100);
+                rr(0x89, R_NZ, R_A);
+                break;
+            }
+        }
+
+        rex(1, 0, 0, R_CYC); b(0x83); modrm(3, 0, R_CYC); b(o->cycles);
+        if (pen) rr64(0x01, R_CYC, R_PEN);
+
+    next_insn:
+        // stop where the interpreter's caller would
+        p = next;
+        rr64(0x39, R_CYC, R_LIM);
+        uint8_t *cont = jcc(CC_B);
+        exit_to(p);
+        here(cont);
+    }
+
+    if (n == 0) {
+        cp = blk;
+        return NULL;
+    }
+    exit_to(p);
+    return blk;
+}
+
+/**
+ * @brief init the code cache
+ * 
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int jit_init() {
+    if (jit_initialized == 1) {
+        jit_invalidate();
+        return 0;
+    }
+
+    code = mmap(NULL, CODE_SZ, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        log_error("jit: can't map code cache.\n");
+        code = NULL;
+        return -1;
+    }
+
+    cp = code;
+    emit_stubs();
+    jit_initialized = 1;
+    jit_invalidate();
+
+    return 0;
+}
+
+/**
+ * @brief release the code cache
+ * 
+ */
+void jit_deinit() {
+    if (code != NULL) munmap(code, CODE_SZ);
+    code = NULL;
+    jit_initialized = 0;
+}
+
+/**
+ * @brief drop all compiled code, e.g. when ROM changes
+ * 
+ */
+void jit_invalidate() {
+    if (jit_initialized != 1) return;
+    memset(blocks, 0, sizeof(blocks));
+    memset(hits, 0, sizeof(hits));
+    cp = code_start;
+    stats.flushes++;
+}
+
+/**
+ * @brief get the compiled block at pc, compiling it once it is hot
+ * 
+ * @param addr pc
+ * @return void* block, NULL to use the interpreter
+ */
+void *jit_block(uint16_t addr) {
+    if (jit_initialized != 1 || !enabled || addr < 0x8000) return NULL;
+
+    void *blk = blocks[addr - 0x8000];
+    if (blk == NOCOMPILE) return NULL;
+    if (blk != NULL) return blk;
+    if (++hits[addr - 0x8000] < JIT_HOT) return NULL;
+
+    if (code + CODE_SZ - cp < CODE_MIN) jit_invalidate();
+    blk = compile(addr);
+    blocks[addr - 0x8000] = blk == NULL ? NOCOMPILE : blk;
+    if (blk != NULL) stats.blocks++;
+    stats.code_bytes = cp - code_start;
+
+    return blk;
+}
+
+/**
+ * @brief run a block, at least one instruction and until cycles reach limit
+ * 
+ * @param blk block
+ * @param limit cycle limit
+ */
+void jit_run(void *blk, uint64_t limit) {
+    enter(limit, blk);
+}
+
+/**
+ * @brief stop compiling the block at pc (it diverged from the interpreter)
+ * 
+ * @param addr pc
+ */
+void jit_reject(uint16_t addr) {
+    if (addr < 0x8000) return;
+    blocks[addr - 0x8000] = NOCOMPILE;
+    stats.rejected++;
+}
+
+#else
+
+int jit_init() {
+    log_warn("jit: only x86-64 is supported.\n");
+    return -1;
+}
+void jit_deinit() {}
+void jit_invalidate() {}
+void *jit_block(uint16_t addr) { (void) addr; return NULL; }
+void jit_run(void *blk, uint64_t limit) { (void) blk; (void) limit; }
+void jit_reject(uint16_t addr) { (void) addr; }
+
+#endif // __x86_64__
+
+/**
+ * @brief enable or disable compiled code at runtime
+ * 
+ * @param on 1 to enable
+ */
+void jit_enable(int on) {
+    enabled = on;
+}
+
+/**
+ * @brief replay every block on the interpreter and compare
+ * 
+ * @param on 1 to enable
+ */
+void jit_verify(int on) {
+    verify = on;
+}
+
+/**
+ * @brief check if blocks are verified
+ * 
+ * @return int 1 if verifying
+ */
+int jit_verifying() {
+    return verify;
+}
+
+/**
+ * @brief get JIT counters
+ * 
+ * @param out output
+ */
+void jit_get_stats(jit_stats_t *out) {
+    *out = stats;
+}
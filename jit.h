@@ -0,0 +1,32 @@
+#ifndef NES_JIT_H
+#define NES_JIT_H
+#include <stdint.h>
+
+/*
+ * the code cache and the blocks in it are one per process, not per thread,
+ * so with the recompiler only one console can run at a time. tools that run
+ * a console per thread test this and refuse to build, or stay on one.
+ */
+#ifdef NES_JIT
+#define JIT_SINGLE_THREAD
+#endif
+
+typedef struct jit_stats {
+    uint64_t blocks; // compiled in total
+    uint64_t code_bytes;
+    uint64_t flushes;
+    uint64_t rejected; // blocks that diverged from the interpreter
+} jit_stats_t;
+
+int jit_init();
+void jit_deinit();
+void jit_enable(int on);
+void jit_verify(int on);
+int jit_verifying();
+void jit_invalidate();
+void *jit_block(uint16_t addr);
+void jit_run(void *blk, uint64_t limit);
+void jit_reject(uint16_t addr);
+void jit_get_stats(jit_stats_t *out);
+
+#endif // NES_JIT_H
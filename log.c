@@ -0,0 +1,179 @@
+#include "log.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RING_SLOTS 1024 // power of 2
+#define MSG_SZ 256 // longer messages are truncated
+#define DRAIN_NS 2000000 // drain thread poll interval
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define LOG_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define LOG_CLOCK CLOCK_MONOTONIC
+#endif
+
+/* bounded multi-producer queue slot, seq tells whose turn it is */
+typedef struct log_slot {
+    _Atomic uint64_t seq;
+    uint32_t len;
+    char msg[MSG_SZ];
+} log_slot_t;
+
+static int log_initialized = 0;
+static log_slot_t ring[RING_SLOTS];
+static _Atomic uint64_t head; // next slot to claim, producers
+static uint64_t tail; // next slot to print, drain thread
+static _Atomic uint64_t dropped; // messages that found the ring full
+static _Atomic int running;
+static pthread_t drainer;
+
+/**
+ * @brief print everything queued so far, drain thread only
+ *
+ */
+static void drain() {
+    for (;;) {
+        log_slot_t *s = &ring[tail & (RING_SLOTS - 1)];
+        if (atomic_load_explicit(&s->seq, memory_order_acquire) != tail + 1) break;
+        fwrite(s->msg, 1, s->len, stderr);
+        atomic_store_explicit(&s->seq, tail + RING_SLOTS, memory_order_release);
+        tail++;
+    }
+
+    uint64_t d = atomic_exchange_explicit(&dropped, 0, memory_order_relaxed);
+    if (d) fprintf(stderr, "[\033[1;33mWARN\033[0m ] log: ring full, %llu messages dropped.\n", (unsigned long long) d);
+}
+
+/**
+ * @brief drain thread body
+ *
+ * @param p unused
+ * @return void* NULL
+ */
+static void *drain_thread(void *p) {
+    (void) p;
+    struct timespec ts = { 0, DRAIN_NS };
+    while (atomic_load_explicit(&running, memory_order_acquire)) {
+        drain();
+        nanosleep(&ts, NULL);
+    }
+    drain();
+    return NULL;
+}
+
+/**
+ * @brief queue a message, never blocks
+ *
+ * @param msg message
+ * @param len length of msg
+ */
+static void push(const char *msg, size_t len) {
+    uint64_t pos = atomic_load_explicit(&head, memory_order_relaxed);
+    log_slot_t *s;
+    for (;;) {
+        s = &ring[pos & (RING_SLOTS - 1)];
+        int64_t d = (int64_t) (atomic_load_explicit(&s->seq, memory_order_acquire) - pos);
+        if (d == 0) {
+            if (atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (d < 0) {
+            // full: the drain thread is behind, don't wait for it
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        } else pos = atomic_load_explicit(&head, memory_order_relaxed);
+    }
+
+    memcpy(s->msg, msg, len);
+    s->len = len;
+    atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+}
+
+/**
+ * @brief start the asynchronous sink, before it logs go straight to stderr
+ *
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int log_init() {
+    if (log_initialized == 1) return 0;
+
+    for (uint64_t i = 0; i < RING_SLOTS; i++) atomic_store(&ring[i].seq, i);
+    atomic_store(&head, 0);
+    tail = 0;
+    atomic_store(&running, 1);
+    if (pthread_create(&drainer, NULL, drain_thread, NULL) != 0) {
+        log_error("can't start the log thread, logging synchronously.\n");
+        return -1;
+    }
+
+    // flush on any exit path
+    if (log_initialized == 0) atexit(log_deinit);
+    log_initialized = 1;
+    return 0;
+}
+
+/**
+ * @brief flush and stop the asynchronous sink
+ *
+ */
+void log_deinit() {
+    if (log_initialized != 1) return;
+    log_initialized = -1;
+    atomic_store_explicit(&running, 0, memory_order_release);
+    pthread_join(drainer, NULL);
+}
+
+/**
+ * @brief rate limit a call site
+ *
+ * @param site the call site
+ * @return int 1 if the message should be printed
+ */
+int log_pass(log_site_t *site) {
+    struct timespec ts;
+    clock_gettime(LOG_CLOCK, &ts);
+    if ((uint64_t) ts.tv_sec != site->window) {
+        site->window = ts.tv_sec;
+        site->n = 0;
+    }
+    if (site->n < LOG_BURST) {
+        site->n++;
+        return 1;
+    }
+    site->suppressed++;
+    return 0;
+}
+
+/**
+ * @brief format a message and queue it, or print it if there is no sink
+ *
+ * @param prefix level tag
+ * @param site call site, for the count of suppressed messages
+ * @param fmt format
+ * @param ... arguments
+ */
+void log_write(const char *prefix, log_site_t *site, const char *fmt, ...) {
+    char buf[MSG_SZ];
+    int n = snprintf(buf, sizeof(buf), "%s", prefix);
+    if (site->suppressed) {
+        n += snprintf(buf + n, sizeof(buf) - n, "(%u similar suppressed) ", site->suppressed);
+        site->suppressed = 0;
+    }
+    if ((size_t) n < sizeof(buf)) {
+        va_list ap;
+        va_start(ap, fmt);
+        n += vsnprintf(buf + n, sizeof(buf) - n, fmt, ap);
+        va_end(ap);
+    }
+    if ((size_t) n >= sizeof(buf)) {
+        n = sizeof(buf) - 1;
+        buf[n - 1] = '\n';
+    }
+
+    if (log_initialized == 1) push(buf, n);
+    else fwrite(buf, 1, n, stderr);
+}
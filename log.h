@@ -1,10 +1,59 @@
 #ifndef NES_LOG_H
 #define NES_LOG_H
 #include <stdio.h>
+#include <stdint.h>
+#include "types.h"
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_FATAL 4
+
+/* calls below this level are compiled out, e.g. make LOG_LEVEL=1 */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+/* messages per call site per second and thread, the rest are counted and dropped */
+#define LOG_BURST 5
+
+/* rate limiting state of a call site, one per thread so workers don't race on it */
+typedef struct log_site {
+    uint64_t window; // second of the current window
+    uint32_t n; // messages in the window
+    uint32_t suppressed; // dropped since the last one printed
+} log_site_t;
+
+int log_init();
+void log_deinit();
+int log_pass(log_site_t *site);
+void log_write(const char *prefix, log_site_t *site, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
 #define log_debug(fmt, ...) __log("DEBUG", fmt, ## __VA_ARGS__)
+#else
+#define log_debug(fmt, ...) ((void) 0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_INFO
 #define log_info(fmt, ...) __log("\033[1mINFO\033[0m ", fmt, ## __VA_ARGS__)
+#else
+#define log_info(fmt, ...) ((void) 0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_WARN
 #define log_warn(fmt, ...) __log("\033[1;33mWARN\033[0m ", fmt, ## __VA_ARGS__)
+#else
+#define log_warn(fmt, ...) ((void) 0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
 #define log_error(fmt, ...) __log("\033[1;31mERROR\033[0m", fmt, ## __VA_ARGS__)
+#else
+#define log_error(fmt, ...) ((void) 0)
+#endif
 #define log_fatal(fmt, ...) __log("\033[1;31mFATAL\033[0m", fmt, ## __VA_ARGS__)
-#define __log(log_level, fmt, ...) fprintf(stderr, "[" log_level "] %s:%d %s: " fmt, __FILE__, __LINE__, __FUNCTION__, ## __VA_ARGS__)
-#endif // NES_LOG_H
\ No newline at end of file
+
+#define __log(log_level, fmt, ...) do {\
+    static NES_TLS log_site_t __site;\
+    if (log_pass(&__site)) log_write("[" log_level "] ", &__site, "%s:%d %s: " fmt, __FILE__, __LINE__, __FUNCTION__, ## __VA_ARGS__);\
+} while (0)
+#endif // NES_LOG_H
@@ -1,15 +1,70 @@
-#include "rom.h"
+#include "nes.h"
 #include "log.h"
 #include "gfx.h"
 #include "sdl.h"
 #include "6502.h"
 #include "ppu.h"
+#include "apu.h"
+#include "audio.h"
+#include "trace.h"
+#include "stats.h"
+#include "prof.h"
+#include "input.h"
+#include "shm.h"
+#include "capture.h"
+#include "sav.h"
+#include "romdb.h"
+#include "fb.h"
+#include "mem.h"
+#include "cheat.h"
+#include "gdb.h"
+#include "movie.h"
+#include "runahead.h"
+#ifdef NES_JIT
+#include "jit.h"
+#endif
 #include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
 #include <SDL2/SDL.h>
 
+#define TRACE_RECS (1 << 20) // ~1s of instructions
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig) {
+    (void) sig;
+    stop = 1;
+}
+
+static void on_watch(uint16_t addr, uint8_t old, uint8_t val, void *ctx) {
+    (void) ctx;
+    log_info("watch: $%.4x %.2x -> %.2x at pc $%.4x.\n", addr, old, val, pc_6502());
+}
+
+/**
+ * @brief read controller 1 from the keyboard
+ *
+ * @return uint8_t BTN_* mask
+ */
+static uint8_t pad_keys() {
+    const Uint8 *k = SDL_GetKeyboardState(NULL);
+    uint8_t b = 0;
+    if (k[SDL_SCANCODE_X]) b |= BTN_A;
+    if (k[SDL_SCANCODE_Z]) b |= BTN_B;
+    if (k[SDL_SCANCODE_RSHIFT]) b |= BTN_SELECT;
+    if (k[SDL_SCANCODE_RETURN]) b |= BTN_START;
+    if (k[SDL_SCANCODE_UP]) b |= BTN_UP;
+    if (k[SDL_SCANCODE_DOWN]) b |= BTN_DOWN;
+    if (k[SDL_SCANCODE_LEFT]) b |= BTN_LEFT;
+    if (k[SDL_SCANCODE_RIGHT]) b |= BTN_RIGHT;
+    return b;
+}
+
 int main (int argc, char **argv) {
     const char *romfile = argv[1];
     uint8_t rom[0xffff];
+    log_init();
     int romfd = open(romfile, O_RDONLY);
 
     if (romfd < 0) {
@@ -23,57 +78,181 @@ int main (int argc, char **argv) {
         return -1;
     }
 
+    // known ROMs start from the cache, see romdb.h
+    const char *cachedir = getenv("NES_ROMCACHE");
+    if (cachedir != NULL) romdb_open(cachedir);
     nes_meta_t meta;
-    ssize_t parsed_sz = rom_parse(&meta, rom, (size_t) read_len);
-    
-    if (parsed_sz == read_len) {
-        rom_load(&meta);
-        log_debug("has_trainer: %s.\n", meta.trainer ? "yes" : "no");
-        log_debug("prgm_sz: %d bytes.\n", meta.prgm_sz);
-        log_debug("chr_sz: %d bytes.\n", meta.chr_sz);
-        log_debug("mirror: %s.\n", meta.mirror ? "horizontal/mapper" : "vertical");
-        log_debug("has_bat_ram: %s.\n", meta.bat_ram ? "yes" : "no");
-        log_debug("fourscreen: %s.\n", meta.fourscreen ? "yes" : "no");
-        log_debug("mapper: %d.\n", meta.mapper);
-        log_debug("console_type: %d.\n", meta.console_type);
-        log_debug("nes2.0: %s.\n", meta.nes20 ? "yes" : "no");
+    if (nes_init(&meta, rom, (size_t) read_len) < 0) return -1;
+#ifdef NES_JIT
+    jit_enable(getenv("NES_NO_JIT") == NULL);
+    jit_verify(getenv("NES_JIT_VERIFY") != NULL);
+#endif
+    const char *tracefile = getenv("NES_TRACE");
+    if (tracefile != NULL && trace_init(TRACE_RECS) == 0) trace_enable(1);
+    lockstep_6502(getenv("NES_LOCKSTEP") != NULL);
+    nes_set_idle(getenv("NES_NO_IDLE") == NULL);
+    const char *statsdst = getenv("NES_STATS"), *every = getenv("NES_STATS_EVERY");
+    if (statsdst != NULL) stats_open(statsdst, every != NULL ? atoi(every) : 0);
+    const char *proffile = getenv("NES_PROF"), *syms = getenv("NES_PROF_SYMS"), *hz = getenv("NES_PROF_HZ");
+    if (syms != NULL) prof_load_symbols(syms);
+    // NES_MOVIE=file.nmv plays controller 1 from a movie, e.g. one nes-fuzz saved
+    const char *moviefile = getenv("NES_MOVIE");
+    uint32_t movie_frames = 0, played = 0;
+    uint8_t *movie = moviefile != NULL ? movie_load(moviefile, movie_crc(&meta), &movie_frames) : NULL;
+    // battery-backed PRG-RAM goes to <rom>.sav, or NES_SAV. a movie starts
+    // from blank PRG-RAM, so it only gets the one asked for
+    const char *savfile = getenv("NES_SAV"), *savsync = getenv("NES_SAV_SYNC_MS");
+    char savbuf[4096];
+    if (savfile == NULL && movie == NULL && meta.bat_ram && sav_path(savbuf, sizeof(savbuf), romfile) == 0)
+        savfile = savbuf;
+    if (savfile != NULL) sav_init(savfile, savsync != NULL ? atoi(savsync) : 0);
+    // NES_CHEATS=SXIOPO,0075:03 (see cheat_parse), NES_WATCH=0075,0300 logs writes
+    const char *cheats = getenv("NES_CHEATS"), *watch = getenv("NES_WATCH");
+    if (cheats != NULL) log_info("%d cheats on.\n", cheat_parse(cheats));
+    for (char *w = (char *) watch; w != NULL && *w; ) {
+        unsigned long addr = strtoul(w, &w, 16);
+        if ((*w != ',' && *w != '\0') || addr > 0xFFFF) {
+            log_warn("bad NES_WATCH: '%s'.\n", watch);
+            break;
+        }
+        cheat_watch(addr, on_watch, NULL);
+        if (*w == ',') w++;
+    }
+    // NES_GDB=port or a socket path: wait for gdb, halted at the first instruction
+    const char *gdbaddr = getenv("NES_GDB");
+    if (gdbaddr != NULL) gdb_init(gdbaddr);
+    // NES_RUNAHEAD=n shows each frame n frames early, NES_RUNAHEAD_THREAD on a second console
+    const char *ahead = getenv("NES_RUNAHEAD");
+    if (ahead != NULL) runahead_init(atoi(ahead), getenv("NES_RUNAHEAD_THREAD") != NULL, rom, read_len);
+    const char *shmname = getenv("NES_SHM");
+    if (shmname != NULL) shm_init(shmname);
+    log_debug("has_trainer: %s.\n", meta.trainer ? "yes" : "no");
+    log_debug("prgm_sz: %d bytes.\n", meta.prgm_sz);
+    log_debug("chr_sz: %d bytes.\n", meta.chr_sz);
+    log_debug("mirror: %s.\n", meta.mirror ? "horizontal/mapper" : "vertical");
+    log_debug("has_bat_ram: %s.\n", meta.bat_ram ? "yes" : "no");
+    log_debug("fourscreen: %s.\n", meta.fourscreen ? "yes" : "no");
+    log_debug("mapper: %d.\n", meta.mapper);
+    log_debug("console_type: %d.\n", meta.console_type);
+    log_debug("nes2.0: %s.\n", meta.nes20 ? "yes" : "no");
+    log_debug("header fixes: %d.\n", meta.fixes);
+
+    SDL_Event e;
+    uint64_t ct = 0, dt, freq = 0, period = 0, next = 0, done = 0;
+    int16_t samples[4096];
+    audio_stats_t as;
+    int quit = 0, tone = getenv("NES_AUDIO_TONE") != NULL;
+    // headless: no window nor audio device, as fast as possible
+    int headless = getenv("NES_HEADLESS") != NULL;
+    const char *nframes = getenv("NES_FRAMES");
+    uint64_t max_frames = nframes != NULL ? strtoull(nframes, NULL, 10) : 0;
+    const char *capfile = getenv("NES_CAPTURE"), *capwav = getenv("NES_CAPTURE_WAV");
+
+    if (headless) {
+        signal(SIGINT, on_signal);
+        signal(SIGTERM, on_signal);
+        apu_set_rate(APU_RATE);
     } else {
-        log_error("rom not fully pasred/unsupported rom.\n");
-        return -1;
+        sdl_init();
+        gfx_init(GFX_DIRECT);
+        gfx_skip_dups(getenv("NES_PRESENT_ALL") == NULL);
+        const char *flt = getenv("NES_FILTER"), *fthreads = getenv("NES_FILTER_THREADS");
+        if (flt != NULL) {
+            int k = filter_parse(flt);
+            if (k < 0) log_warn("unknown filter: '%s'.\n", flt);
+            else gfx_set_filter(k, fthreads != NULL ? atoi(fthreads) : 1);
+        }
+        if (audio_init() < 0) log_warn("no audio output.\n");
+        gfx_new_frame();
+        apu_set_rate(audio_rate());
     }
+    // a live run drops frames rather than wait for the writer
+    if (capfile != NULL) capture_init(capfile, capwav, headless ? APU_RATE : audio_rate(), headless);
+    if (proffile != NULL) prof_init(hz != NULL ? atoi(hz) : 0);
 
+    if (!headless) {
+        freq = SDL_GetPerformanceFrequency();
+        period = freq * NES_FRAME_CYCLES / CPU_CLOCK; // ~60.2Hz
+        next = SDL_GetPerformanceCounter();
+    }
+    while (!quit && !stop) {
+        if (!headless) {
+            while (SDL_PollEvent(&e)) {
+                if (e.type == SDL_QUIT) quit = 1;
+            }
 
-    SDL_Event e;
-    uint32_t ct, dt, t_ppu;
-    uint64_t ll, ld;
-    sdl_init();
-    gfx_init();
-    gfx_new_frame();
-
-    init_6502();
-    ppu_init();
-    ppu_set_mirroring(meta.mirror & 1);
-    while (1) {
-        SDL_PollEvent(&e);
-        if (e.type == SDL_QUIT) break;
-        if (e.type == SDL_USEREVENT) {
-            ct = SDL_GetTicks();
-            ll = cycles_6502();
-            ld = 0;
-            ppu_run();
-            t_ppu = SDL_GetTicks();
-            for (; ld < 1364 / 12; ld = cycles_6502() - ll) {
-                run_6502();
+            ct = SDL_GetPerformanceCounter();
+            if (ct < next) {
+                SDL_Delay(1);
+                continue;
+            }
+            next = (ct - next > 4 * period) ? ct + period : next + period;
+
+            input_set(0, pad_keys());
+        }
+        // a byte per nes_frame(), as nes-fuzz recorded it
+        if (movie != NULL && played < movie_frames) {
+            input_set(0, movie[played]);
+            if (++played == movie_frames) log_info("movie ended after %u frames.\n", played);
+        }
+        if (ahead != NULL) {
+            if (runahead_frame() < 0) {
+                log_error("cpu halted.\n");
+                quit = 1;
             }
-            dt = SDL_GetTicks() - ct;
-            if (dt > 16) {
-                log_warn("can't keep up! frame time is %ums. (ppu: %ums, cpu: %ums)\n", dt, t_ppu - ct, dt - (t_ppu - ct));
-            } 
+        } else if (nes_frame() < 0) {
+            log_error("cpu halted.\n");
+            quit = 1;
         }
+        // the pass ends right after a frame is completed, so it is whole
+        shm_publish(fb_frame(), memptr(0), ppu_frames());
+        gdb_poll();
+
+        int n = apu_end_frame(samples, sizeof(samples) / sizeof(int16_t));
+        if (tone) n = audio_tone(samples, sizeof(samples) / sizeof(int16_t), cycles_6502());
+        capture_frame(fb_frame(), samples, n);
+        if (audio_ready()) {
+            audio_push(samples, n);
+            apu_set_rate(audio_rate() * audio_ratio());
+            audio_get_stats(&as);
+            stats_cur.audio_fill = as.fill;
+            stats_cur.audio_underruns = as.underruns;
+            stats_cur.audio_overruns = as.overruns;
+        }
+        stats_end_frame();
+        if (max_frames && ++done >= max_frames) quit = 1;
+        if (headless) continue;
+
+        dt = SDL_GetPerformanceCounter() - ct;
+        if (dt > period) {
+            log_warn("can't keep up! frame time is %lums. (cpu: %.1fms, render: %.1fms, present: %.1fms, ahead: %.1fms)\n",
+                dt * 1000 / freq, stats_last()->t_cpu / 1e6, stats_last()->t_render / 1e6, stats_last()->t_present / 1e6,
+                stats_last()->t_ahead / 1e6);
+        } 
     }
 
-    gfx_deinit();
-    sdl_deinit();
+    runahead_deinit();
+    capture_deinit();
+    if (!headless) {
+        if (audio_ready()) audio_deinit();
+        gfx_deinit();
+        sdl_deinit();
+    }
+    stats_close();
+    free(movie);
+    gdb_deinit();
+    shm_deinit();
+    sav_deinit();
+    romdb_close();
+    if (proffile != NULL) {
+        prof_deinit();
+        prof_save(proffile);
+    }
+    if (tracefile != NULL) {
+        trace_save(tracefile);
+        trace_deinit();
+    }
+    log_deinit();
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,7 +1,13 @@
 #include "mem.h"
+#include "types.h"
 #include <memory.h>
 
-static uint8_t mem[0x10000];
+static NES_TLS uint8_t mem[0x10000];
+
+// cartridge PRG-RAM at $6000-$7FFF, either our own or backed by a file
+static NES_TLS uint8_t prg_ram_own[PRG_RAM_SZ];
+static NES_TLS uint8_t *prg_ram = NULL;
+static NES_TLS atomic_uint *prg_dirty = NULL; // a bit per PRG_RAM_BLOCK bytes
 
 /**
  * @brief Read from vCPU memory
@@ -32,4 +38,108 @@ inline void memwrt (uint16_t dst, uint8_t val) {
  */
 inline void mmemcpy (uint16_t dst, const uint8_t *src, size_t sz) {
     memcpy(mem + dst, src, sz);
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Get a pointer into vCPU memory
+ * 
+ * @param addr vaddress
+ * @return const uint8_t* host address
+ */
+inline const uint8_t *memptr (uint16_t addr) {
+    return mem + addr;
+}
+
+/**
+ * @brief Get PRG-RAM
+ * 
+ * @return uint8_t* PRG_RAM_SZ bytes
+ */
+static inline uint8_t *prgram() {
+    return prg_ram != NULL ? prg_ram : prg_ram_own;
+}
+
+/**
+ * @brief Read from PRG-RAM
+ * 
+ * @param addr offset from $6000
+ * @return uint8_t byte
+ */
+inline uint8_t prgram_read (uint16_t addr) {
+    return prgram()[addr & (PRG_RAM_SZ - 1)];
+}
+
+/**
+ * @brief Write to PRG-RAM, a changed byte marks its block dirty
+ * 
+ * @param addr offset from $6000
+ * @param val value
+ */
+inline void prgram_wrt (uint16_t addr, uint8_t val) {
+    addr &= PRG_RAM_SZ - 1;
+    uint8_t *ram = prgram();
+    if (ram[addr] == val) return;
+    ram[addr] = val;
+    if (prg_dirty == NULL) return;
+    unsigned bit = 1u << (addr / PRG_RAM_BLOCK);
+    if (!(atomic_load_explicit(prg_dirty, memory_order_relaxed) & bit))
+        atomic_fetch_or_explicit(prg_dirty, bit, memory_order_release);
+}
+
+/**
+ * @brief Get a pointer into PRG-RAM
+ * 
+ * @param addr offset from $6000
+ * @return const uint8_t* host address
+ */
+inline const uint8_t *prgram_ptr (uint16_t addr) {
+    return prgram() + (addr & (PRG_RAM_SZ - 1));
+}
+
+/**
+ * @brief Put PRG-RAM in memory of the caller, e.g. a mapped save file
+ * 
+ * @param ram PRG_RAM_SZ bytes, NULL to go back to the internal PRG-RAM
+ * @param dirty bits of the blocks written to are set here, can be NULL
+ */
+void prgram_map (uint8_t *ram, atomic_uint *dirty) {
+    prg_ram = ram;
+    prg_dirty = ram != NULL ? dirty : NULL;
+}
+
+/**
+ * @brief Clear PRG-RAM on power up, unless it is battery backed
+ * 
+ */
+void prgram_reset () {
+    if (prg_ram == NULL) memset(prg_ram_own, 0, PRG_RAM_SZ);
+}
+
+/**
+ * @brief Save RAM and PRG-RAM, ROM is not part of the state
+ * 
+ * @param p output, NULL to get the size only
+ * @return size_t size
+ */
+size_t mem_save (uint8_t *p) {
+    if (p) {
+        memcpy(p, mem, 0x800);
+        memcpy(p + 0x800, prgram(), PRG_RAM_SZ);
+    }
+    return 0x800 + PRG_RAM_SZ;
+}
+
+/**
+ * @brief Load RAM and PRG-RAM
+ * 
+ * @param p saved state
+ * @return size_t size
+ */
+size_t mem_load (const uint8_t *p) {
+    memcpy(mem, p, 0x800);
+    uint8_t *ram = prgram();
+    int changed = memcmp(ram, p + 0x800, PRG_RAM_SZ) != 0;
+    memcpy(ram, p + 0x800, PRG_RAM_SZ);
+    if (changed && prg_dirty != NULL) atomic_fetch_or_explicit(prg_dirty, ~0u, memory_order_release);
+    return 0x800 + PRG_RAM_SZ;
+}
@@ -2,9 +2,21 @@
 #define NES_MEN_H
 #include <stdint.h>
 #include <unistd.h>
+#include <stdatomic.h>
+
+#define PRG_RAM_SZ 0x2000 // $6000-$7FFF
+#define PRG_RAM_BLOCK 0x100 // dirty tracking granularity
 
 uint8_t memread (uint16_t addr);
 void memwrt (uint16_t dst, uint8_t val);
 void mmemcpy (uint16_t dst, const uint8_t *src, size_t sz);
+const uint8_t *memptr (uint16_t addr);
+uint8_t prgram_read (uint16_t addr);
+void prgram_wrt (uint16_t dst, uint8_t val);
+const uint8_t *prgram_ptr (uint16_t addr);
+void prgram_map (uint8_t *ram, atomic_uint *dirty);
+void prgram_reset ();
+size_t mem_save (uint8_t *p);
+size_t mem_load (const uint8_t *p);
 
 #endif // NES_MEN_H
\ No newline at end of file
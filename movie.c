@@ -0,0 +1,78 @@
+#include "movie.h"
+#include "romdb.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief the ROM a movie is for, as game databases list it
+ *
+ * @param meta parsed ROM
+ * @return uint32_t CRC32 of PRG + CHR
+ */
+uint32_t movie_crc(const nes_meta_t *meta) {
+    return romdb_crc32(romdb_crc32(0, meta->prgm, meta->prgm_sz), meta->chr, meta->chr_sz);
+}
+
+/**
+ * @brief write a movie
+ *
+ * @param path file, written to path.tmp first and renamed
+ * @param crc from movie_crc()
+ * @param in BTN_* masks
+ * @param frames number of masks
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int movie_save(const char *path, uint32_t crc, const uint8_t *in, uint32_t frames) {
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) return -1;
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) {
+        log_error("can't write movie '%s'.\n", tmp);
+        return -1;
+    }
+
+    movie_hdr_t hdr = { MOVIE_MAGIC, MOVIE_VERSION, crc, frames };
+    int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && (frames == 0 || fwrite(in, frames, 1, f) == 1);
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, path) < 0) {
+        log_error("can't write movie '%s'.\n", path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief read a movie
+ *
+ * @param path file
+ * @param crc from movie_crc(), a movie of another ROM only gets a warning
+ * @param frames output, number of masks
+ * @return uint8_t* BTN_* masks, to free(), NULL on error
+ */
+uint8_t *movie_load(const char *path, uint32_t crc, uint32_t *frames) {
+    FILE *f = fopen(path, "rb");
+    movie_hdr_t hdr;
+    if (f == NULL || fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, MOVIE_MAGIC, 4) != 0 ||
+        hdr.version != MOVIE_VERSION) {
+        log_error("bad movie: '%s'.\n", path);
+        if (f != NULL) fclose(f);
+        return NULL;
+    }
+    if (hdr.crc32 != crc) log_warn("movie '%s' is of another ROM (crc32 %08x).\n", path, hdr.crc32);
+
+    uint8_t *in = malloc(hdr.frames ? hdr.frames : 1);
+    if (in == NULL || (hdr.frames && fread(in, hdr.frames, 1, f) != 1)) {
+        log_error("short movie: '%s'.\n", path);
+        free(in);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    *frames = hdr.frames;
+    return in;
+}
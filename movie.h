@@ -0,0 +1,26 @@
+#ifndef NES_MOVIE_H
+#define NES_MOVIE_H
+#include <stdint.h>
+#include <unistd.h>
+#include "types.h"
+
+/*
+ * a movie is the input of controller 1 for each frame from power on: a
+ * movie_hdr_t, then frames BTN_* masks. input for frame i is set before
+ * the i-th nes_frame() after nes_init(), with PRG-RAM blank.
+ */
+#define MOVIE_MAGIC "NMOV"
+#define MOVIE_VERSION 1
+
+typedef struct movie_hdr {
+    char magic[4];
+    uint32_t version;
+    uint32_t crc32; // of PRG + CHR of the ROM played
+    uint32_t frames;
+} movie_hdr_t;
+
+uint32_t movie_crc(const nes_meta_t *meta);
+int movie_save(const char *path, uint32_t crc, const uint8_t *in, uint32_t frames);
+uint8_t *movie_load(const char *path, uint32_t crc, uint32_t *frames);
+
+#endif // NES_MOVIE_H
@@ -0,0 +1,199 @@
+#include "nes.h"
+#include "rom.h"
+#include "romdb.h"
+#include "6502.h"
+#include "ppu.h"
+#include "apu.h"
+#include "mem.h"
+#include "fb.h"
+#include "input.h"
+#include "log.h"
+#include "stats.h"
+#include "prof.h"
+#include "cheat.h"
+#ifdef NES_JIT
+#include "jit.h"
+#endif
+#include <string.h>
+
+static NES_TLS int idle_skip = 1;
+static NES_TLS uint64_t line_end; // CPU cycle the current scanline ends at
+
+/**
+ * @brief parse and load a rom, then power up the console
+ * 
+ * @param meta parsed rom
+ * @param rom rom image, must outlive meta
+ * @param sz size of the rom image
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int nes_init(nes_meta_t *meta, const uint8_t *rom, size_t sz) {
+    const uint8_t *chr;
+    if (romdb_lookup(meta, rom, sz, &chr) < 0) {
+        log_error("rom not fully pasred/unsupported rom.\n");
+        return -1;
+    }
+
+    if (rom_load(meta) < 0) return -1;
+#ifdef NES_JIT
+    if (jit_init() < 0) log_warn("no jit, using the interpreter.\n");
+#endif
+
+    // power up with cleared RAM so runs are reproducible
+    static const uint8_t zero[0x800];
+    mmemcpy(0, zero, sizeof(zero));
+    prgram_reset();
+
+    init_6502();
+    ppu_init();
+    if (chr != NULL) ppu_set_chr(chr, meta->chr);
+    apu_init();
+    ppu_set_mirroring(meta->mirror & 1);
+    line_end = cycles_6502();
+
+    return 0;
+}
+
+/**
+ * @brief enable or disable skipping of idle loops
+ * 
+ * @param on 1 to enable
+ */
+void nes_set_idle(int on) {
+    idle_skip = on;
+}
+
+/**
+ * @brief run one scanline
+ * 
+ * @return int status
+ * @retval -1 CPU halted
+ * @retval 0 OK
+ */
+inline int nes_scanline() {
+    uint64_t t0 = stats_clock();
+    prof_sub = PROF_PPU;
+    ppu_run();
+    prof_sub = PROF_CPU;
+    uint64_t t1 = stats_clock();
+    // overshoot (e.g. a DMA stall) carries into the next line
+    line_end += NES_LINE_CYCLES;
+    // the PPU only changes between scanlines
+    idle_6502(idle_skip ? line_end : 0);
+    int ret = run_until_6502(line_end);
+    prof_sub = PROF_HOST;
+    stats_cur.t_render += t1 - t0;
+    stats_cur.t_cpu += stats_clock() - t1;
+    return ret;
+}
+
+/**
+ * @brief run until the PPU finishes the current frame
+ * 
+ * @return int status
+ * @retval -1 CPU halted
+ * @retval 0 OK
+ */
+int nes_frame() {
+    uint64_t f = ppu_frames();
+    while (ppu_frames() == f) {
+        if (nes_scanline() < 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief save the whole console, e.g. to reset to it later
+ * 
+ * @param p output of nes_state_size() bytes, NULL to get the size only
+ * @return size_t size
+ */
+size_t nes_save(uint8_t *p) {
+    size_t n = sizeof(nes_state_hdr_t);
+    n += save_6502(p ? p + n : NULL);
+    n += ppu_save(p ? p + n : NULL);
+    n += apu_save(p ? p + n : NULL);
+    n += mem_save(p ? p + n : NULL);
+    n += fb_save(p ? p + n : NULL);
+    n += input_save(p ? p + n : NULL);
+    if (p) memcpy(p + n, &line_end, sizeof(line_end));
+    n += sizeof(line_end);
+
+    if (p) {
+        nes_state_hdr_t hdr = { NES_STATE_MAGIC, NES_STATE_VERSION, n };
+        memcpy(p, &hdr, sizeof(hdr));
+    }
+    return n;
+}
+
+/**
+ * @brief get the size of a save-state
+ * 
+ * @return size_t size
+ */
+size_t nes_state_size() {
+    return nes_save(NULL);
+}
+
+/**
+ * @brief load a save-state
+ *
+ * @param p saved state
+ * @param sz size of p
+ * @param frame 0 to keep the current frame
+ * @return int status
+ * @retval -1 not a state of this build
+ * @retval 0 OK
+ */
+static int load(const uint8_t *p, size_t sz, int frame) {
+    nes_state_hdr_t hdr;
+    if (sz < sizeof(hdr)) return -1;
+    memcpy(&hdr, p, sizeof(hdr));
+    if (memcmp(hdr.magic, NES_STATE_MAGIC, 4) != 0 || hdr.version != NES_STATE_VERSION ||
+        hdr.size != sz || sz != nes_state_size()) {
+        log_error("bad save-state.\n");
+        return -1;
+    }
+
+    size_t n = sizeof(hdr);
+    n += load_6502(p + n);
+    n += ppu_load(p + n);
+    n += apu_load(p + n);
+    n += mem_load(p + n);
+    n += frame ? fb_load(p + n) : fb_save(NULL);
+    n += input_load(p + n);
+    memcpy(&line_end, p + n, sizeof(line_end));
+    // frozen RAM stays frozen
+    if (cheat_active) cheat_refreeze();
+    return 0;
+}
+
+/**
+ * @brief load a save-state of the same ROM
+ * 
+ * @param p saved state
+ * @param sz size of p
+ * @return int status
+ * @retval -1 not a state of this build
+ * @retval 0 OK
+ */
+int nes_load(const uint8_t *p, size_t sz) {
+    return load(p, sz, 1);
+}
+
+/**
+ * @brief load a save-state but keep the frame last completed
+ *
+ * for frames run ahead: what they showed stays up after going back.
+ *
+ * @param p saved state
+ * @param sz size of p
+ * @return int status
+ * @retval -1 not a state of this build
+ * @retval 0 OK
+ */
+int nes_restore(const uint8_t *p, size_t sz) {
+    return load(p, sz, 0);
+}
@@ -0,0 +1,30 @@
+#ifndef NES_NES_H
+#define NES_NES_H
+#include <stdint.h>
+#include <unistd.h>
+#include "types.h"
+
+/* CPU cycles per scanline, and per nes_frame(): 263 lines, pre-render included */
+#define NES_LINE_CYCLES (1364 / 12)
+#define NES_FRAME_CYCLES (263 * NES_LINE_CYCLES)
+
+#define NES_STATE_MAGIC "NSTA"
+#define NES_STATE_VERSION 2
+
+/* save-state header, followed by the state of each module */
+typedef struct nes_state_hdr {
+    char magic[4];
+    uint32_t version;
+    uint64_t size; // including the header
+} nes_state_hdr_t;
+
+int nes_init(nes_meta_t *meta, const uint8_t *rom, size_t sz);
+void nes_set_idle(int on);
+int nes_scanline();
+int nes_frame();
+size_t nes_state_size();
+size_t nes_save(uint8_t *p);
+int nes_load(const uint8_t *p, size_t sz);
+int nes_restore(const uint8_t *p, size_t sz);
+
+#endif // NES_NES_H
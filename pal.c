@@ -0,0 +1,274 @@
+#include "pal.h"
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define PAL_SSSE3
+#include <tmmintrin.h>
+#endif
+
+typedef struct pal pal_t;
+struct pal {
+	uint8_t r;
+	uint8_t g;
+	uint8_t b;
+};
+
+static const pal_t palette[64] = {
+    { 0x80, 0x80, 0x80 },{ 0x00, 0x00, 0xBB },{ 0x37, 0x00, 0xBF },{ 0x84, 0x00, 0xA6 },
+    { 0xBB, 0x00, 0x6A },{ 0xB7, 0x00, 0x1E },{ 0xB3, 0x00, 0x00 },{ 0x91, 0x26, 0x00 },
+    { 0x7B, 0x2B, 0x00 },{ 0x00, 0x3E, 0x00 },{ 0x00, 0x48, 0x0D },{ 0x00, 0x3C, 0x22 },
+    { 0x00, 0x2F, 0x66 },{ 0x00, 0x00, 0x00 },{ 0x05, 0x05, 0x05 },{ 0x05, 0x05, 0x05 },
+    { 0xC8, 0xC8, 0xC8 },{ 0x00, 0x59, 0xFF },{ 0x44, 0x3C, 0xFF },{ 0xB7, 0x33, 0xCC },
+    { 0xFF, 0x33, 0xAA },{ 0xFF, 0x37, 0x5E },{ 0xFF, 0x37, 0x1A },{ 0xD5, 0x4B, 0x00 },
+    { 0xC4, 0x62, 0x00 },{ 0x3C, 0x7B, 0x00 },{ 0x1E, 0x84, 0x15 },{ 0x00, 0x95, 0x66 },
+    { 0x00, 0x84, 0xC4 },{ 0x11, 0x11, 0x11 },{ 0x09, 0x09, 0x09 },{ 0x09, 0x09, 0x09 },
+    { 0xFF, 0xFF, 0xFF },{ 0x00, 0x95, 0xFF },{ 0x6F, 0x84, 0xFF },{ 0xD5, 0x6F, 0xFF },
+    { 0xFF, 0x77, 0xCC },{ 0xFF, 0x6F, 0x99 },{ 0xFF, 0x7B, 0x59 },{ 0xFF, 0x91, 0x5F },
+    { 0xFF, 0xA2, 0x33 },{ 0xA6, 0xBF, 0x00 },{ 0x51, 0xD9, 0x6A },{ 0x4D, 0xD5, 0xAE },
+    { 0x00, 0xD9, 0xFF },{ 0x66, 0x66, 0x66 },{ 0x0D, 0x0D, 0x0D },{ 0x0D, 0x0D, 0x0D },
+    { 0xFF, 0xFF, 0xFF },{ 0x84, 0xBF, 0xFF },{ 0xBB, 0xBB, 0xFF },{ 0xD0, 0xBB, 0xFF },
+    { 0xFF, 0xBF, 0xEA },{ 0xFF, 0xBF, 0xCC },{ 0xFF, 0xC4, 0xB7 },{ 0xFF, 0xCC, 0xAE },
+    { 0xFF, 0xD9, 0xA2 },{ 0xCC, 0xE1, 0x99 },{ 0xAE, 0xEE, 0xB7 },{ 0xAA, 0xF7, 0xEE },
+    { 0xB3, 0xEE, 0xFF },{ 0xDD, 0xDD, 0xDD },{ 0x11, 0x11, 0x11 },{ 0x11, 0x11, 0x11 }
+};
+
+// attenuation of the non-emphasized channels
+#define EMPH_ATTN 0.75
+
+// per emphasis (0-7) lookup tables, built by pal_init
+static uint8_t lut_r[8][64], lut_g[8][64], lut_b[8][64];
+static uint8_t lut_y[8][64], lut_u[8][64], lut_v[8][64];
+static uint8_t lut_565l[8][64], lut_565h[8][64];
+static uint32_t lut_argb[8][64];
+static uint16_t lut_565[8][64];
+
+static void argb8888_c(uint32_t *dst, const uint8_t *src, uint8_t emph, int n);
+static void rgb565_c(uint16_t *dst, const uint8_t *src, uint8_t emph, int n);
+static void yuv420_c(uint8_t *y, uint8_t *u, uint8_t *v, const uint8_t *src0, uint8_t emph0, const uint8_t *src1, uint8_t emph1, int n);
+
+static void (*do_argb8888)(uint32_t *, const uint8_t *, uint8_t, int) = argb8888_c;
+static void (*do_rgb565)(uint16_t *, const uint8_t *, uint8_t, int) = rgb565_c;
+static void (*do_yuv420)(uint8_t *, uint8_t *, uint8_t *, const uint8_t *, uint8_t, const uint8_t *, uint8_t, int) = yuv420_c;
+
+static inline uint8_t clamp8(double v) {
+    if (v < 0) return 0;
+    if (v > 255) return 255;
+    return (uint8_t) (v + 0.5);
+}
+
+/** begin generic implementations **/
+static void argb8888_c(uint32_t *dst, const uint8_t *src, uint8_t emph, int n) {
+    const uint32_t *lut = lut_argb[emph & 7];
+    for (int i = 0; i < n; i++) dst[i] = lut[src[i] & 0x3F];
+}
+
+static void rgb565_c(uint16_t *dst, const uint8_t *src, uint8_t emph, int n) {
+    const uint16_t *lut = lut_565[emph & 7];
+    for (int i = 0; i < n; i++) dst[i] = lut[src[i] & 0x3F];
+}
+
+static void yuv420_c(uint8_t *y, uint8_t *u, uint8_t *v, const uint8_t *src0, uint8_t emph0, const uint8_t *src1, uint8_t emph1, int n) {
+    emph0 &= 7; emph1 &= 7;
+    for (int i = 0; i < n; i++) {
+        y[i] = lut_y[emph0][src0[i] & 0x3F];
+        y[i + n] = lut_y[emph1][src1[i] & 0x3F];
+    }
+    // same rounding as pavgb/pavgw: rows first, then column pairs
+    for (int i = 0; i < n; i += 2) {
+        uint8_t a0 = src0[i] & 0x3F, a1 = src0[i + 1] & 0x3F;
+        uint8_t b0 = src1[i] & 0x3F, b1 = src1[i + 1] & 0x3F;
+        int u0 = (lut_u[emph0][a0] + lut_u[emph1][b0] + 1) >> 1;
+        int u1 = (lut_u[emph0][a1] + lut_u[emph1][b1] + 1) >> 1;
+        int v0 = (lut_v[emph0][a0] + lut_v[emph1][b0] + 1) >> 1;
+        int v1 = (lut_v[emph0][a1] + lut_v[emph1][b1] + 1) >> 1;
+        u[i >> 1] = (u0 + u1 + 1) >> 1;
+        v[i >> 1] = (v0 + v1 + 1) >> 1;
+    }
+}
+/** end generic implementations **/
+
+#ifdef PAL_SSSE3
+/** begin SSSE3 implementations **/
+
+/* look up 16 6-bit indices in a 64-entry byte table, 16 entries per pshufb */
+__attribute__((target("ssse3")))
+static inline __m128i lut64(__m128i idx, const uint8_t *tab) {
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(idx, 4), _mm_set1_epi8(0x03));
+    __m128i r = _mm_setzero_si128();
+    for (int k = 0; k < 4; k++) {
+        __m128i t = _mm_loadu_si128((const __m128i *) (tab + 16 * k));
+        __m128i sel = _mm_cmpeq_epi8(hi, _mm_set1_epi8(k));
+        r = _mm_or_si128(r, _mm_and_si128(sel, _mm_shuffle_epi8(t, idx)));
+    }
+    return r;
+}
+
+__attribute__((target("ssse3")))
+static void argb8888_ssse3(uint32_t *dst, const uint8_t *src, uint8_t emph, int n) {
+    const __m128i m = _mm_set1_epi8(0x3F), ff = _mm_set1_epi8((char) 0xFF);
+    emph &= 7;
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i idx = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src + i)), m);
+        __m128i b = lut64(idx, lut_b[emph]), g = lut64(idx, lut_g[emph]), r = lut64(idx, lut_r[emph]);
+        __m128i bg_l = _mm_unpacklo_epi8(b, g), bg_h = _mm_unpackhi_epi8(b, g);
+        __m128i ra_l = _mm_unpacklo_epi8(r, ff), ra_h = _mm_unpackhi_epi8(r, ff);
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_unpacklo_epi16(bg_l, ra_l));
+        _mm_storeu_si128((__m128i *) (dst + i + 4), _mm_unpackhi_epi16(bg_l, ra_l));
+        _mm_storeu_si128((__m128i *) (dst + i + 8), _mm_unpacklo_epi16(bg_h, ra_h));
+        _mm_storeu_si128((__m128i *) (dst + i + 12), _mm_unpackhi_epi16(bg_h, ra_h));
+    }
+    argb8888_c(dst + i, src + i, emph, n - i);
+}
+
+__attribute__((target("ssse3")))
+static void rgb565_ssse3(uint16_t *dst, const uint8_t *src, uint8_t emph, int n) {
+    const __m128i m = _mm_set1_epi8(0x3F);
+    emph &= 7;
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i idx = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src + i)), m);
+        __m128i l = lut64(idx, lut_565l[emph]), h = lut64(idx, lut_565h[emph]);
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_unpacklo_epi8(l, h));
+        _mm_storeu_si128((__m128i *) (dst + i + 8), _mm_unpackhi_epi8(l, h));
+    }
+    rgb565_c(dst + i, src + i, emph, n - i);
+}
+
+/* average 16 bytes of two rows, then each column pair: 8 chroma samples */
+__attribute__((target("ssse3")))
+static inline __m128i chroma8(__m128i a, __m128i b) {
+    __m128i r = _mm_avg_epu8(a, b);
+    __m128i even = _mm_and_si128(r, _mm_set1_epi16(0x00FF));
+    __m128i odd = _mm_srli_epi16(r, 8);
+    __m128i h = _mm_avg_epu16(even, odd);
+    return _mm_packus_epi16(h, h);
+}
+
+__attribute__((target("ssse3")))
+static void yuv420_ssse3(uint8_t *y, uint8_t *u, uint8_t *v, const uint8_t *src0, uint8_t emph0, const uint8_t *src1, uint8_t emph1, int n) {
+    const __m128i m = _mm_set1_epi8(0x3F);
+    emph0 &= 7; emph1 &= 7;
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i i0 = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src0 + i)), m);
+        __m128i i1 = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src1 + i)), m);
+        _mm_storeu_si128((__m128i *) (y + i), lut64(i0, lut_y[emph0]));
+        _mm_storeu_si128((__m128i *) (y + n + i), lut64(i1, lut_y[emph1]));
+        _mm_storel_epi64((__m128i *) (u + (i >> 1)), chroma8(lut64(i0, lut_u[emph0]), lut64(i1, lut_u[emph1])));
+        _mm_storel_epi64((__m128i *) (v + (i >> 1)), chroma8(lut64(i0, lut_v[emph0]), lut64(i1, lut_v[emph1])));
+    }
+    if (i < n) {
+        // tail goes through the generic path, which writes y rows n apart
+        uint8_t ty[2][16];
+        yuv420_c(ty[0], u + (i >> 1), v + (i >> 1), src0 + i, emph0, src1 + i, emph1, n - i);
+        for (int k = 0; k < n - i; k++) {
+            y[i + k] = ty[0][k];
+            y[n + i + k] = ty[0][n - i + k];
+        }
+    }
+}
+/** end SSSE3 implementations **/
+#endif
+
+/**
+ * @brief build the conversion tables and pick the conversion routines
+ * 
+ */
+static void pal_build() {
+    for (int e = 0; e < 8; e++) {
+        for (int i = 0; i < 64; i++) {
+            // emphasizing a channel darkens the other two
+            double r = palette[i].r, g = palette[i].g, b = palette[i].b;
+            if (e) {
+                if (!(e & 1)) r *= EMPH_ATTN;
+                if (!(e & 2)) g *= EMPH_ATTN;
+                if (!(e & 4)) b *= EMPH_ATTN;
+            }
+            uint8_t r8 = clamp8(r), g8 = clamp8(g), b8 = clamp8(b);
+            lut_r[e][i] = r8;
+            lut_g[e][i] = g8;
+            lut_b[e][i] = b8;
+            lut_argb[e][i] = 0xff000000 | (r8 << 16) | (g8 << 8) | b8;
+            lut_565[e][i] = ((r8 >> 3) << 11) | ((g8 >> 2) << 5) | (b8 >> 3);
+            lut_565l[e][i] = lut_565[e][i] & 0xff;
+            lut_565h[e][i] = lut_565[e][i] >> 8;
+
+            // BT.601, limited range
+            lut_y[e][i] = clamp8(16 + (65.481 * r8 + 128.553 * g8 + 24.966 * b8) / 255);
+            lut_u[e][i] = clamp8(128 + (-37.797 * r8 - 74.203 * g8 + 112.0 * b8) / 255);
+            lut_v[e][i] = clamp8(128 + (112.0 * r8 - 93.786 * g8 - 18.214 * b8) / 255);
+        }
+    }
+
+#ifdef PAL_SSSE3
+    if (__builtin_cpu_supports("ssse3")) {
+        do_argb8888 = argb8888_ssse3;
+        do_rgb565 = rgb565_ssse3;
+        do_yuv420 = yuv420_ssse3;
+    }
+#endif
+}
+
+/**
+ * @brief build the conversion tables and pick the conversion routines, once
+ * 
+ */
+void pal_init() {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, pal_build);
+}
+
+/**
+ * @brief get the color of a palette entry
+ * 
+ * @param idx palette index
+ * @param emph color emphasis bits
+ * @param r red channel
+ * @param g green channel
+ * @param b blue channel
+ */
+void pal_rgb(uint8_t idx, uint8_t emph, uint8_t *r, uint8_t *g, uint8_t *b) {
+    *r = lut_r[emph & 7][idx & 0x3F];
+    *g = lut_g[emph & 7][idx & 0x3F];
+    *b = lut_b[emph & 7][idx & 0x3F];
+}
+
+/**
+ * @brief convert palette indices to ARGB8888
+ * 
+ * @param dst destination
+ * @param src palette indices
+ * @param emph color emphasis bits
+ * @param n num of pixels
+ */
+void pal_argb8888(uint32_t *dst, const uint8_t *src, uint8_t emph, int n) {
+    do_argb8888(dst, src, emph, n);
+}
+
+/**
+ * @brief convert palette indices to RGB565
+ * 
+ * @param dst destination
+ * @param src palette indices
+ * @param emph color emphasis bits
+ * @param n num of pixels
+ */
+void pal_rgb565(uint16_t *dst, const uint8_t *src, uint8_t emph, int n) {
+    do_rgb565(dst, src, emph, n);
+}
+
+/**
+ * @brief convert two rows of palette indices to I420
+ * 
+ * @param y two luma rows, n bytes apart
+ * @param u n/2 cb samples
+ * @param v n/2 cr samples
+ * @param src0 palette indices of the upper row
+ * @param emph0 color emphasis bits of the upper row
+ * @param src1 palette indices of the lower row
+ * @param emph1 color emphasis bits of the lower row
+ * @param n num of pixels per row, must be even
+ */
+void pal_yuv420(uint8_t *y, uint8_t *u, uint8_t *v, const uint8_t *src0, uint8_t emph0, const uint8_t *src1, uint8_t emph1, int n) {
+    do_yuv420(y, u, v, src0, emph0, src1, emph1, n);
+}
@@ -0,0 +1,11 @@
+#ifndef NES_PAL_H
+#define NES_PAL_H
+#include <stdint.h>
+
+void pal_init();
+void pal_rgb(uint8_t idx, uint8_t emph, uint8_t *r, uint8_t *g, uint8_t *b);
+void pal_argb8888(uint32_t *dst, const uint8_t *src, uint8_t emph, int n);
+void pal_rgb565(uint16_t *dst, const uint8_t *src, uint8_t emph, int n);
+void pal_yuv420(uint8_t *y, uint8_t *u, uint8_t *v, const uint8_t *src0, uint8_t emph0, const uint8_t *src1, uint8_t emph1, int n);
+
+#endif // NES_PAL_H
@@ -1,8 +1,13 @@
 #include "ppu.h"
 #include "6502.h"
 #include "log.h"
-#include "gfx.h"
+#include "fb.h"
+#include "pal.h"
+#include "stats.h"
+#include "types.h"
+#include "state.h"
 #include <memory.h>
+#include <pthread.h>
 #define PPU_WARNUP 29658
 
 #define CTRL_NMI  ppuctrl & 0b10000000 // do NMI in vblank?
@@ -49,54 +54,55 @@
 #define SSTAT_SO(x)  if (x) ppustatus |= 0b00100000; else ppustatus &= 0b11011111
 #define SSTAT_LSB(x) ppustatus = (ppustatus & 0b11100000) | ((x) & 0b00011111)
 
-static const uint16_t bnta[4] = { 0x2000, 0x2400, 0x2800, 0x2C00 };
-
 // mem
-static uint8_t smem[0x100];
-static uint8_t mem[0x4000];
+static NES_TLS uint8_t smem[0x100];
+static NES_TLS uint8_t mem[0x4000];
 
 // registers & status
-uint8_t ppuctrl, ppumask, ppustatus, oamaddr, oamdata, xscroll, yscroll, wpos, ppudata, oamdma;
-uint16_t ppuaddr, mirror_xor, mirror, scanline;
-
-uint8_t xscroll_wrt_count;
-uint8_t ppuaddr_rh;
-uint8_t ppur7r;
-uint8_t tmpaddr;
+NES_TLS uint8_t ppuctrl, ppumask, ppustatus, oamaddr, oamdata, ppudata, oamdma;
+NES_TLS uint16_t mirror_xor, mirror, scanline;
+static NES_TLS uint64_t line_cycle; // CPU cycle the current scanline started at
+
+// internal scroll registers, see nesdev "PPU scrolling"
+static NES_TLS uint16_t vaddr; // v: current VRAM address, yyy NN YYYYY XXXXX while rendering
+static NES_TLS uint16_t taddr; // t: address the next frame/line starts at
+static NES_TLS uint8_t fine_x; // x: fine X scroll
+static NES_TLS uint8_t wlatch; // w: first/second write toggle of $2005/$2006
+
+/* lines are drawn whole, as late as possible: when the CPU first touches a
+ * register that affects rendering, or when the line ends. the increment of
+ * v at dot 256 and the copy from t at dot 257 are done separately, so that
+ * writes to t before them still count for the next line. */
+#define LINE_DRAWN 1 // pixels of the current line are out
+#define LINE_VDONE 2 // end of line updates of v are done
+static NES_TLS uint8_t line_state = LINE_DRAWN | LINE_VDONE;
 
 // hittest
-uint8_t bg[264][248];
-uint8_t hit;
+static NES_TLS uint8_t opaque[NES_W]; // background pixels of the drawn line
+NES_TLS uint8_t hit; // sprite 0 hit once this frame
+static NES_TLS int16_t hit_dot = -1; // dot the hit shows at in the current line
+
+// num of completed frames
+static NES_TLS uint64_t frames;
+
+// current scanline, as palette indices
+static NES_TLS uint8_t line[NES_W];
 
-// l-h uint8_ts pair
+// 0 while frames are run ahead and thrown away, see ppu_set_draw()
+static NES_TLS uint8_t draw = 1;
+
+#define PPU_STATE(X) X(smem) X(mem) X(ppuctrl) X(ppumask) X(ppustatus) X(oamaddr) X(oamdata) \
+    X(ppudata) X(oamdma) X(mirror_xor) X(mirror) X(scanline) X(line_cycle) X(vaddr) X(taddr) \
+    X(fine_x) X(wlatch) X(line_state) X(hit) X(hit_dot) X(frames)
+
+// l-h uint8_ts pair, shared by all threads, built on first use
 uint8_t ppu_lhtab[256][256][8];
 uint8_t ppu_lhtabf[256][256][8];
+static pthread_once_t lhtab_once = PTHREAD_ONCE_INIT;
 
-typedef struct pal pal_t;
-struct pal {
-	uint8_t r;
-	uint8_t g;
-	uint8_t b;
-};
-
-static const pal_t palette[64] = {
-    { 0x80, 0x80, 0x80 },{ 0x00, 0x00, 0xBB },{ 0x37, 0x00, 0xBF },{ 0x84, 0x00, 0xA6 },
-    { 0xBB, 0x00, 0x6A },{ 0xB7, 0x00, 0x1E },{ 0xB3, 0x00, 0x00 },{ 0x91, 0x26, 0x00 },
-    { 0x7B, 0x2B, 0x00 },{ 0x00, 0x3E, 0x00 },{ 0x00, 0x48, 0x0D },{ 0x00, 0x3C, 0x22 },
-    { 0x00, 0x2F, 0x66 },{ 0x00, 0x00, 0x00 },{ 0x05, 0x05, 0x05 },{ 0x05, 0x05, 0x05 },
-    { 0xC8, 0xC8, 0xC8 },{ 0x00, 0x59, 0xFF },{ 0x44, 0x3C, 0xFF },{ 0xB7, 0x33, 0xCC },
-    { 0xFF, 0x33, 0xAA },{ 0xFF, 0x37, 0x5E },{ 0xFF, 0x37, 0x1A },{ 0xD5, 0x4B, 0x00 },
-    { 0xC4, 0x62, 0x00 },{ 0x3C, 0x7B, 0x00 },{ 0x1E, 0x84, 0x15 },{ 0x00, 0x95, 0x66 },
-    { 0x00, 0x84, 0xC4 },{ 0x11, 0x11, 0x11 },{ 0x09, 0x09, 0x09 },{ 0x09, 0x09, 0x09 },
-    { 0xFF, 0xFF, 0xFF },{ 0x00, 0x95, 0xFF },{ 0x6F, 0x84, 0xFF },{ 0xD5, 0x6F, 0xFF },
-    { 0xFF, 0x77, 0xCC },{ 0xFF, 0x6F, 0x99 },{ 0xFF, 0x7B, 0x59 },{ 0xFF, 0x91, 0x5F },
-    { 0xFF, 0xA2, 0x33 },{ 0xA6, 0xBF, 0x00 },{ 0x51, 0xD9, 0x6A },{ 0x4D, 0xD5, 0xAE },
-    { 0x00, 0xD9, 0xFF },{ 0x66, 0x66, 0x66 },{ 0x0D, 0x0D, 0x0D },{ 0x0D, 0x0D, 0x0D },
-    { 0xFF, 0xFF, 0xFF },{ 0x84, 0xBF, 0xFF },{ 0xBB, 0xBB, 0xFF },{ 0xD0, 0xBB, 0xFF },
-    { 0xFF, 0xBF, 0xEA },{ 0xFF, 0xBF, 0xCC },{ 0xFF, 0xC4, 0xB7 },{ 0xFF, 0xCC, 0xAE },
-    { 0xFF, 0xD9, 0xA2 },{ 0xCC, 0xE1, 0x99 },{ 0xAE, 0xEE, 0xB7 },{ 0xAA, 0xF7, 0xEE },
-    { 0xB3, 0xEE, 0xFF },{ 0xDD, 0xDD, 0xDD },{ 0x11, 0x11, 0x11 },{ 0x11, 0x11, 0x11 }
-};
+// pattern tables as pixels, [tile][row][x], when they are those of the ROM
+static NES_TLS const uint8_t (*chr_dec)[8][8] = NULL;
+static NES_TLS const uint8_t *chr_raw = NULL; // what chr_dec was decoded from
 
 /**
  * @brief convert addr
@@ -134,9 +140,22 @@ inline uint8_t ppuread (uint16_t addr) {
  * @param val uint8_t on the address
  */
 inline void ppuwrt (uint16_t dst, uint8_t val) {
+    if (dst < 0x2000) chr_dec = NULL;
     mem[to_ppu_addr(dst)] = val;
 }
 
+/**
+ * @brief Write to PPU memory as $2007 does, nametables to both copies
+ * 
+ * @param dst vaddress
+ * @param val uint8_t on the address
+ */
+inline void ppu_poke (uint16_t dst, uint8_t val) {
+    // nametables are stored twice, palettes are not
+    if (dst >= 0x2000 && dst < 0x3F00) ppuwrt(dst ^ mirror_xor, val);
+    ppuwrt(dst, val);
+}
+
 /**
  * @brief Copy to PPU memory
  * 
@@ -145,9 +164,21 @@ inline void ppuwrt (uint16_t dst, uint8_t val) {
  * @param sz num of uint8_ts to copy
  */
 inline void ppucpy (uint16_t dst, const uint8_t *src, size_t sz) {
+    if (dst < 0x2000) chr_dec = NULL;
     memcpy(mem + dst, src, sz);
 }
 
+static void ppu_sync();
+
+/**
+ * @brief Get the dot the PPU is at on the current scanline
+ * 
+ * @return int dot
+ */
+static inline int line_dot() {
+    return (cycles_6502() - line_cycle) * 3;
+}
+
 /**
  * @brief Get PPU register
  * 
@@ -155,7 +186,6 @@ inline void ppucpy (uint16_t dst, const uint8_t *src, size_t sz) {
  * @return uint8_t value of the register
  */
 inline uint8_t ppu_get_reg(uint16_t address) {
-    ppuaddr &= 0x3FFF;
     switch (address & 7) {
         case 0:
         case 1:
@@ -166,27 +196,31 @@ inline uint8_t ppu_get_reg(uint16_t address) {
             return (uint8_t) -1;
         }
         case 2: {
+            // sprite 0 may hit on this line, draw it to know where
+            if (!hit && MASK_SBG && MASK_SSP) ppu_sync();
+            if (hit_dot >= 0) {
+                if (line_dot() >= hit_dot) {
+                    SSTAT_SH(1);
+                    hit_dot = -1;
+                } else idle_6502(0); // the flag changes later on this line, don't skip polls
+            }
             uint8_t value = ppustatus;
             SSTAT_VB(0);
-            SSTAT_SH(0);
-            ppuaddr_rh = 0;
-            tmpaddr = 0;
-            ppur7r = 1;
+            wlatch = 0;
             return value;
         }
         case 4: return smem[oamaddr];
         case 7: {
-            uint8_t data;
-            
-            if (ppuaddr < 0x3F00) {
-                data = ppuread(ppuaddr);
-            }
+            ppu_sync();
+            uint16_t addr = vaddr & 0x3FFF;
+            uint8_t data = ppudata;
+            if (addr < 0x3F00) ppudata = ppuread(addr);
             else {
-                data = ppuread(ppuaddr);
+                // palette reads are not delayed, the buffer gets the nametable underneath
+                data = ppuread(addr);
+                ppudata = ppuread(addr - 0x1000);
             }
-            
-            if (ppur7r) ppur7r = 0;
-            else ppuaddr += (CTRL_RAI) ? 32 : 1;
+            vaddr = (vaddr + ((CTRL_RAI) ? 32 : 1)) & 0x7FFF;
             return data;
         }
         default: return (uint8_t) -1;
@@ -201,13 +235,15 @@ inline uint8_t ppu_get_reg(uint16_t address) {
  */  
 inline void ppu_set_reg(uint16_t addr, uint8_t val) {
     addr &= 7;
-    ppuaddr &= 0x3FFF;
     switch(addr) {
         case 0: {
+            ppu_sync();
             ppuctrl = val;
+            taddr = (taddr & 0x73FF) | ((val & 3) << 10);
             return;
         }
         case 1: {
+            ppu_sync();
             ppumask = val; 
             return;
         }
@@ -224,46 +260,38 @@ inline void ppu_set_reg(uint16_t addr, uint8_t val) {
             return;
         }
         case 5: {
-            if (xscroll_wrt_count) {
-                yscroll = val;
+            ppu_sync();
+            if (wlatch) taddr = (taddr & 0x0C1F) | ((val & 7) << 12) | ((val & 0xF8) << 2);
+            else {
+                taddr = (taddr & 0x7FE0) | (val >> 3);
+                fine_x = val & 7;
             }
-            else xscroll = val;
-
-            xscroll_wrt_count = !xscroll_wrt_count;
+            wlatch ^= 1;
             return;
         }
         case 6: {
-            if (ppuaddr_rh)
-                ppuaddr = (tmpaddr << 8) + val;
-            else
-                tmpaddr = val;
-
-            ppuaddr_rh ^= 1;
-            ppur7r = 1;
-            break;
+            ppu_sync();
+            if (wlatch) {
+                taddr = (taddr & 0x7F00) | val;
+                vaddr = taddr;
+            } else taddr = (taddr & 0x00FF) | ((val & 0x3F) << 8);
+            wlatch ^= 1;
+            return;
         }
         case 7: {
-            if (ppuaddr > 0x1fff || ppuaddr < 0x4000) {
-                ppuwrt(ppuaddr ^ mirror_xor, val);
-                ppuwrt(ppuaddr, val);
-            }
-            else ppuwrt(ppuaddr, val);
+            ppu_sync();
+            ppu_poke(vaddr & 0x3FFF, val);
+            vaddr = (vaddr + ((CTRL_RAI) ? 32 : 1)) & 0x7FFF;
+            return;
         }
     }
-    // unreached
 }
 
 /**
- * @brief init ppu
+ * @brief build the bit-plane pair lookup tables
  * 
  */
-inline void ppu_init() {
-    ppuctrl = ppumask = oamaddr = xscroll = yscroll = wpos = ppudata = 0;
-    xscroll_wrt_count = ppuaddr_rh = ppur7r = tmpaddr = 0;
-    ppuaddr = mirror = mirror_xor = 0;
-    ppustatus = 0b10100000;
-    scanline = 0;
-
+static void lhtab_init() {
     // from NJU-ProjectN/LiteNES
     for (int h = 0; h < 0x100; h++) {
         for (int l = 0; l < 0x100; l++) {
@@ -276,46 +304,63 @@ inline void ppu_init() {
 }
 
 /**
- * @brief render background
+ * @brief init ppu
  * 
- * @param mirror mirror
  */
-static inline void rndr_bg(uint8_t mirror) {
-    for (uint8_t tile_x = MASK_SBG8 ? 0 : 1; tile_x < 32; tile_x++) {
-        if (((tile_x << 3) - xscroll + (mirror ? 256 : 0)) > 256) continue;
-        int tile_y = scanline >> 3;
-        int tile_index = ppuread(bnta[CTRL_BNTA] + tile_x + (tile_y << 5) + (mirror ? 0x400 : 0));
-        uint16_t tile_address = ((CTRL_BGTB) ? 0x1000 : 0) + 16 * tile_index;
-
-        int y_in_tile = scanline & 0x7;
-        uint8_t l = ppuread(tile_address + y_in_tile);
-        uint8_t h = ppuread(tile_address + y_in_tile + 8);
-
-        for (int x = 0; x < 8; x++) {
-            uint8_t color = ppu_lhtab[l][h][x];
-
-            if (color != 0) { 
-                uint16_t attribute_address = (bnta[CTRL_BNTA] + (mirror ? 0x400 : 0) + 0x3C0 + (tile_x >> 2) + (scanline >> 5) * 8);
-                uint8_t top = (scanline % 32) < 16;
-                uint8_t left = (tile_x % 4 < 2);
-                uint8_t palette_attribute = ppuread(attribute_address);
-
-                if (!top) {
-                    palette_attribute >>= 4;
-                }
-                if (!left) {
-                    palette_attribute >>= 2;
-                }
-                palette_attribute &= 3;
+inline void ppu_init() {
+    ppuctrl = ppumask = oamaddr = ppudata = 0;
+    vaddr = taddr = fine_x = wlatch = 0;
+    mirror = mirror_xor = 0;
+    ppustatus = 0b10100000;
+    scanline = 0;
+    line_state = LINE_DRAWN | LINE_VDONE;
+    hit = 0;
+    hit_dot = -1;
+    chr_dec = NULL;
+    chr_raw = NULL;
+    pal_init();
+}
 
-                uint16_t palette_address = 0x3F00 + (palette_attribute << 2);
-                int idx = ppuread(palette_address + color);
+/**
+ * @brief draw tiles from pattern tables decoded ahead of time
+ * 
+ * they are dropped as soon as the pattern tables are written to.
+ * 
+ * @param dec 512 tiles of 8 rows of 8 pixels (0-3), e.g. from the ROM cache
+ * @param raw the 8k of CHR that dec was decoded from, must be in PPU memory
+ */
+void ppu_set_chr(const uint8_t *dec, const uint8_t *raw) {
+    if (dec != NULL && memcmp(mem, raw, 0x2000) != 0) dec = NULL;
+    chr_dec = (const uint8_t (*)[8][8]) dec;
+    chr_raw = dec != NULL ? raw : NULL;
+}
 
-                bg[(tile_x << 3) + x][scanline] = color;
-                
-                gfx_set_pixel((tile_x << 3) + x - xscroll + (mirror ? 256 : 0), scanline + 1, palette[idx].r, palette[idx].g,  palette[idx].b);
-            }
+/**
+ * @brief render background from v and fine x
+ * 
+ */
+static inline void rndr_bg() {
+    uint16_t v = vaddr;
+    uint16_t pattern = ((CTRL_BGTB) ? 0x1000 : 0) + (v >> 12); // fine Y
+    int left = MASK_SBG8 ? 0 : 8;
+
+    // 33 tiles cover the line when it does not start on a tile boundary
+    for (int tile = 0, sx = -fine_x; tile < 33; tile++) {
+        uint8_t index = mem[0x2000 | (v & 0x0FFF)];
+        uint8_t attr = mem[0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07)];
+        const uint8_t *palette = mem + 0x3F00 + (((attr >> (((v >> 4) & 4) | (v & 2))) & 3) << 2);
+        const uint8_t *px = chr_dec != NULL ? chr_dec[(pattern >> 4) + index][pattern & 7]
+            : ppu_lhtab[mem[pattern + 16 * index]][mem[pattern + 16 * index + 8]];
+
+        for (int x = 0; x < 8; x++, sx++) {
+            if (px[x] == 0 || sx < left || sx >= NES_W) continue;
+            opaque[sx] = 1;
+            line[sx] = palette[px[x]] & 0x3F;
         }
+
+        // coarse X, wrapping into the next nametable
+        if ((v & 0x1F) == 31) v = (v & ~0x1F) ^ 0x400;
+        else v++;
     }
 }
 
@@ -325,13 +370,16 @@ static inline void rndr_bg(uint8_t mirror) {
  */
 static inline void rndr_spr() {
     int scanline_sprite_count = 0;
+    int left = MASK_SSP8 ? 0 : 8;
     int n;
     for (n = 0; n < 0x100; n += 4) {
         uint8_t sprite_x = smem[n + 3];
-        uint8_t sprite_y = smem[n];
+        // sprites show one line below their Y
+        int y_in_sprite = scanline - smem[n] - 1;
 
         // Skip if sprite not on scanline
-        if (sprite_y > scanline || sprite_y + (CTRL_SPSZ ? 16 : 8) < scanline)
+        int sprite_h = CTRL_SPSZ ? 16 : 8;
+        if (y_in_sprite < 0 || y_in_sprite >= sprite_h)
            continue;
 
         scanline_sprite_count++;
@@ -345,68 +393,235 @@ static inline void rndr_spr() {
         uint8_t vflip = smem[n + 2] & 0x80;
         uint8_t hflip = smem[n + 2] & 0x40;
 
-        uint16_t tile_address = (CTRL_STB ? 0x1000 : 0x0000) + 16 * smem[n + 1];
-        int y_in_tile = scanline & 0x7;
-        uint8_t l = ppuread(tile_address + (vflip ? (7 - y_in_tile) : y_in_tile));
-        uint8_t h = ppuread(tile_address + (vflip ? (7 - y_in_tile) : y_in_tile) + 8);
+        if (vflip) y_in_sprite = sprite_h - 1 - y_in_sprite;
+
+        uint16_t tile_address;
+        if (CTRL_SPSZ) { // 8*16: bit 0 of the index selects the table
+            uint8_t tile = smem[n + 1];
+            tile_address = ((tile & 1) ? 0x1000 : 0x0000) + 16 * (tile & 0xFE) + (y_in_sprite & 8 ? 16 : 0);
+        } else tile_address = (CTRL_STB ? 0x1000 : 0x0000) + 16 * smem[n + 1];
+        int y_in_tile = y_in_sprite & 0x7;
+        const uint8_t *px;
+        int flip = 0; // decoded rows are read backwards
+        if (chr_dec != NULL) {
+            px = chr_dec[tile_address >> 4][y_in_tile];
+            flip = hflip ? 7 : 0;
+        } else {
+            uint8_t l = ppuread(tile_address + y_in_tile);
+            uint8_t h = ppuread(tile_address + y_in_tile + 8);
+            px = hflip ? ppu_lhtabf[l][h] : ppu_lhtab[l][h];
+        }
 
         uint8_t palette_attribute = smem[n + 2] & 0x3;
         uint16_t palette_address = 0x3F10 + (palette_attribute << 2);
         int x;
         for (x = 0; x < 8; x++) {
-            int color = hflip ? ppu_lhtabf[l][h][x] : ppu_lhtab[l][h][x];
+            int color = px[x ^ flip];
+            int screen_x = sprite_x + x;
 
-            if (color != 0) {
-                int screen_x = sprite_x + x;
+            if (color != 0 && screen_x >= left) {
                 int idx = ppuread(palette_address + color);
                 
-                if (smem[n + 2] & 0x20) {
-                    gfx_set_pixel(screen_x, sprite_y + y_in_tile + 1, palette[idx].r, palette[idx].g,  palette[idx].b); // FIXME: bbg
-                }
-                else {
-                    gfx_set_pixel(screen_x, sprite_y + y_in_tile + 1, palette[idx].r, palette[idx].g,  palette[idx].b); // FIXME: bbg
-                }
+                // FIXME: behind-background priority (smem[n + 2] & 0x20)
+                if (screen_x < NES_W) line[screen_x] = idx & 0x3F;
 
-                if (MASK_SBG && !hit && n == 0 && bg[screen_x][sprite_y + y_in_tile] == color) {
-                    SSTAT_SH(1);
+                // no hit on the last pixel, reported once the PPU gets there
+                if (n == 0 && !hit && screen_x < NES_W - 1 && opaque[screen_x]) {
                     hit = 1;
+                    hit_dot = screen_x + 1;
                 }
             }
         }
     }
 }
 
-extern inline void ppu_run() {
-    ++scanline;
+/**
+ * @brief draw the current scanline into the frame
+ * 
+ */
+static void draw_line() {
+    if (chr_dec == NULL) pthread_once(&lhtab_once, lhtab_init);
+
+    memset(opaque, 0, NES_W);
+    if (MASK_SBG || MASK_SSP) stats_cur.lines_rendered++;
+    else stats_cur.lines_blank++;
+
+    if (!draw) {
+        // only what the CPU sees: the background matters to a sprite 0 hit
+        // alone, sprites are still evaluated for the overflow flag
+        int y = scanline - smem[0] - 1;
+        if (MASK_SBG && MASK_SSP && !hit && y >= 0 && y < (CTRL_SPSZ ? 16 : 8)) rndr_bg();
+        if (MASK_SSP) rndr_spr();
+        line_state |= LINE_DRAWN;
+        return;
+    }
+
+    // every visible row starts as the backdrop color
+    memset(line, ppuread(0x3F00) & 0x3F, NES_W);
 
     if (MASK_SBG) {
-        rndr_bg(0);
-        //rndr_bg(1);
+        rndr_bg();
     }
 
     if (MASK_SSP) {
         rndr_spr();
     }
 
+    if (MASK_GS) {
+        for (int i = 0; i < NES_W; i++) line[i] &= 0x30;
+    }
+
+    fb_put_line(scanline, line, ppumask >> 5);
+    line_state |= LINE_DRAWN;
+}
+
+/**
+ * @brief the updates of v at the end of a rendered line
+ * 
+ * dot 256 moves v one row down, dot 257 takes X back from t. the pre-render
+ * line also takes Y from t, during dots 280 to 304.
+ */
+static void end_line() {
+    line_state |= LINE_VDONE;
+    if (!(MASK_SBG || MASK_SSP)) return;
+
+    if (scanline == (uint16_t) -1) {
+        vaddr = taddr;
+        return;
+    }
+    if ((vaddr & 0x7000) != 0x7000) vaddr += 0x1000; // fine Y
+    else {
+        vaddr &= ~0x7000;
+        int y = (vaddr >> 5) & 0x1F;
+        if (y == 29) { // last row of tiles, the next one is in the other nametable
+            y = 0;
+            vaddr ^= 0x0800;
+        } else if (y == 31) y = 0; // attribute rows, no nametable switch
+        else y++;
+        vaddr = (vaddr & ~0x03E0) | (y << 5);
+    }
+    vaddr = (vaddr & ~0x041F) | (taddr & 0x041F);
+}
+
+/**
+ * @brief catch up with the current scanline before a register changes
+ * 
+ * the line is drawn whole with what was set before the access. updates of
+ * v are done only if the PPU is already past them.
+ */
+static void ppu_sync() {
+    if (line_state == (LINE_DRAWN | LINE_VDONE)) return;
+    if (!(line_state & LINE_DRAWN)) draw_line();
+    if (!(line_state & LINE_VDONE) && line_dot() >= (scanline == (uint16_t) -1 ? 304 : 257)) end_line();
+}
+
+extern inline void ppu_run() {
+    // finish the line that ends here
+    if (!(line_state & LINE_DRAWN)) draw_line();
+    if (!(line_state & LINE_VDONE)) end_line();
+    if (hit_dot >= 0) {
+        SSTAT_SH(1);
+        hit_dot = -1;
+    }
+
+    ++scanline;
+    line_cycle = cycles_6502();
+    line_state = LINE_DRAWN | LINE_VDONE;
+
+    if (scanline < 240) line_state = 0;
+
     if (scanline == 241) {
         SSTAT_VB(1);
         SSTAT_SH(0);
         if (CTRL_NMI) interrupt_6502();
     } else if (scanline == 262) {
         scanline = -1;
+        line_state = LINE_DRAWN;
         hit = 0;
         SSTAT_VB(0);
-        gfx_render();
-        gfx_new_frame();
+        frames++;
+        if (draw) fb_end_frame();
     }
     
 }
 
+/**
+ * @brief Get num of completed frames
+ * 
+ * @return uint64_t frames
+ */
+uint64_t ppu_frames() {
+    return frames;
+}
+
+/**
+ * @brief Turn the output of pixels on or off
+ * 
+ * without output, lines are only rendered as far as the sprite 0 hit and
+ * the sprite overflow need, and completed frames don't reach the fb.
+ * 
+ * @param on 0 for frames that are thrown away, e.g. run ahead
+ */
+void ppu_set_draw(int on) {
+    draw = on != 0;
+}
+
+/**
+ * @brief Get the current scanline and dot
+ * 
+ * the PPU renders whole scanlines, so the dot is derived from the CPU cycles
+ * spent on the current one.
+ * 
+ * @param line output, scanline (261 for pre-render)
+ * @param dot output, dot
+ */
+void ppu_position(uint16_t *line, uint16_t *dot) {
+    *line = scanline == (uint16_t) -1 ? 261 : scanline;
+    *dot = (cycles_6502() - line_cycle) * 3;
+}
+
 inline void ppu_sprram_write(uint8_t val) {
     smem[oamaddr++] = val;
 }
 
+/**
+ * @brief OAM DMA, copy a page into sprite memory starting at OAMADDR
+ * 
+ * @param src 256 bytes
+ */
+void ppu_oam_dma(const uint8_t *src) {
+    // 256 writes wrap around to leave oamaddr unchanged
+    memcpy(smem + oamaddr, src, 0x100 - oamaddr);
+    memcpy(smem, src + 0x100 - oamaddr, oamaddr);
+}
+
 void ppu_set_mirroring(uint8_t mir) {
     mirror = mir;
     mirror_xor = 0x400 << mir;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief save the PPU state
+ * 
+ * @param p output, NULL to get the size only
+ * @return size_t size
+ */
+size_t ppu_save(uint8_t *p) {
+    size_t n = 0;
+    PPU_STATE(STATE_SAVE)
+    return n;
+}
+
+/**
+ * @brief load the PPU state
+ * 
+ * @param p saved state
+ * @return size_t size
+ */
+size_t ppu_load(const uint8_t *p) {
+    size_t n = 0;
+    PPU_STATE(STATE_LOAD)
+    // the state may come with pattern tables other than the ROM's
+    if (chr_dec != NULL) ppu_set_chr((const uint8_t *) chr_dec, chr_raw);
+    return n;
+}
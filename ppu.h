@@ -5,6 +5,7 @@
 
 uint8_t ppuread (uint16_t addr);
 void ppuwrt (uint16_t dst, uint8_t val);
+void ppu_poke (uint16_t dst, uint8_t val);
 void ppucpy (uint16_t dst, const uint8_t *src, size_t sz);
 
 void ppu_io_write(uint16_t address, uint8_t data);
@@ -13,7 +14,14 @@ uint8_t ppu_get_reg(uint16_t addr);
 void ppu_set_reg(uint16_t addr, uint8_t val);
 void ppu_set_mirroring(uint8_t mir);
 void ppu_sprram_write(uint8_t val);
+void ppu_oam_dma(const uint8_t *src);
 void ppu_init();
+void ppu_set_chr(const uint8_t *dec, const uint8_t *raw);
 void ppu_run();
+uint64_t ppu_frames();
+void ppu_set_draw(int on);
+void ppu_position(uint16_t *line, uint16_t *dot);
+size_t ppu_save(uint8_t *p);
+size_t ppu_load(const uint8_t *p);
 
 #endif // NES_PPH_H
\ No newline at end of file
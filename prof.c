@@ -0,0 +1,258 @@
+#define _GNU_SOURCE // SIGEV_THREAD_ID
+#include "prof.h"
+#include "6502.h"
+#include "rom.h"
+#include "log.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+
+#define SLOTS (1 << 16) // distinct (subsystem, bank, pc), power of 2
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+NES_TLS volatile uint8_t prof_sub = PROF_HOST;
+NES_TLS volatile uint8_t prof_ahead = 0;
+
+/* sample counts, filled by the signal handler only */
+typedef struct slot {
+    uint32_t key; // sub << 24 | (bank + 1) << 16 | pc, 0 = empty
+    uint32_t n;
+} slot_t;
+
+/* a label from a symbol file */
+typedef struct sym {
+    int bank; // -1: any
+    uint16_t addr;
+    char name[64];
+} sym_t;
+
+static int prof_initialized = 0;
+static slot_t slots[SLOTS];
+static volatile uint64_t samples, lost;
+static sym_t *syms;
+static size_t nsyms;
+#ifdef __linux__
+static timer_t timer;
+#endif
+
+static const char *sub_names[] = {
+    [PROF_HOST] = "host", [PROF_CPU] = "cpu", [PROF_JIT] = "jit", [PROF_IO_PPU] = "io_ppu",
+    [PROF_IO_APU] = "io_apu", [PROF_APU] = "apu", [PROF_PPU] = "ppu", [PROF_PRESENT] = "present",
+    [PROF_AHEAD] = "ahead",
+};
+
+/**
+ * @brief sampler, runs on the emulation thread
+ *
+ * @param sig unused
+ */
+static void prof_tick(int sig) {
+    (void) sig;
+    uint8_t sub = prof_ahead ? PROF_AHEAD : prof_sub;
+    uint16_t pc = pc_6502();
+    uint32_t key = (uint32_t) sub << 24 | (uint32_t) (rom_bank(pc) + 1) << 16 | pc;
+
+    samples++;
+    uint32_t h = (key * 2654435761u) >> 16;
+    for (int i = 0; i < 64; i++, h++) {
+        slot_t *s = &slots[h & (SLOTS - 1)];
+        if (s->key == key || s->key == 0) {
+            s->key = key;
+            s->n++;
+            return;
+        }
+    }
+    lost++;
+}
+
+/**
+ * @brief start sampling the calling thread
+ *
+ * @param hz samples per second of CPU time
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int prof_init(int hz) {
+    if (prof_initialized == 1) {
+        log_warn("profiler already initialized.\n");
+        return 0;
+    }
+    if (hz <= 0) hz = 1000;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = prof_tick;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) < 0) {
+        log_error("profiler: sigaction failed.\n");
+        return -1;
+    }
+
+    long ns = 1000000000L / hz;
+#ifdef __linux__
+    // on this thread's CPU clock, so the audio thread doesn't take samples
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    struct itimerspec its = { { ns / 1000000000L, ns % 1000000000L }, { ns / 1000000000L, ns % 1000000000L } };
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timer) < 0 || timer_settime(timer, 0, &its, NULL) < 0) {
+        log_error("profiler: can't create timer.\n");
+        return -1;
+    }
+#else
+    struct itimerval it = { { ns / 1000000000L, ns % 1000000000L / 1000 }, { ns / 1000000000L, ns % 1000000000L / 1000 } };
+    if (setitimer(ITIMER_PROF, &it, NULL) < 0) {
+        log_error("profiler: can't set timer.\n");
+        return -1;
+    }
+#endif
+
+    prof_initialized = 1;
+    return 0;
+}
+
+/**
+ * @brief stop sampling, samples are kept for prof_save
+ *
+ */
+void prof_deinit() {
+    if (prof_initialized != 1) return;
+#ifdef __linux__
+    timer_delete(timer);
+#else
+    struct itimerval it;
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_PROF, &it, NULL);
+#endif
+    signal(SIGPROF, SIG_IGN);
+    prof_initialized = -1;
+}
+
+static int sym_cmp(const void *a, const void *b) {
+    return (int) ((const sym_t *) a)->addr - (int) ((const sym_t *) b)->addr;
+}
+
+/**
+ * @brief load labels for ROM routines
+ *
+ * accepted line formats: ld65 -Ln ("al 00C123 .name"), FCEUX .nl
+ * ("$C123#name#comment"), and "[bank:]C123 name".
+ *
+ * @param path symbol file
+ * @return int num of labels loaded, -1 on error
+ */
+int prof_load_symbols(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        log_error("profiler: can't open '%s'.\n", path);
+        return -1;
+    }
+
+    char line[256];
+    size_t cap = nsyms;
+    int n = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        sym_t s = { -1, 0, "" };
+        unsigned a, b;
+        if (sscanf(line, "al %x .%63s", &a, s.name) == 2) s.addr = a;
+        else if (sscanf(line, "$%x#%63[^#\n]", &a, s.name) == 2) s.addr = a;
+        else if (sscanf(line, "%x:%x %63s", &b, &a, s.name) == 3) { s.bank = b; s.addr = a; }
+        else if (sscanf(line, "%x %63s", &a, s.name) == 2) s.addr = a;
+        else continue;
+
+        if (nsyms == cap) {
+            cap = cap ? cap * 2 : 256;
+            sym_t *p = realloc(syms, cap * sizeof(sym_t));
+            if (p == NULL) break;
+            syms = p;
+        }
+        syms[nsyms++] = s;
+        n++;
+    }
+    fclose(f);
+
+    qsort(syms, nsyms, sizeof(sym_t), sym_cmp);
+    return n;
+}
+
+/**
+ * @brief find the routine containing pc: the closest label at or below it
+ *
+ * @param bank PRG bank, -1 for RAM
+ * @param pc address
+ * @return const char* name, NULL if none
+ */
+static const char *sym_find(int bank, uint16_t pc) {
+    size_t lo = 0, hi = nsyms;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (syms[mid].addr <= pc) lo = mid + 1;
+        else hi = mid;
+    }
+    while (lo-- > 0) {
+        const sym_t *s = &syms[lo];
+        // don't let a ROM routine swallow RAM code or the other way round
+        if ((s->addr >= 0x8000) != (pc >= 0x8000)) return NULL;
+        if (s->bank < 0 || s->bank == bank) return s->name;
+    }
+    return NULL;
+}
+
+/**
+ * @brief write the samples as collapsed stacks, for flamegraph.pl
+ *
+ * stacks are "bank;routine;$pc;subsystem", or "host;subsystem" for time
+ * spent outside the console.
+ *
+ * @param path output
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int prof_save(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        log_error("profiler: can't create '%s'.\n", path);
+        return -1;
+    }
+
+    uint64_t host[PROF_AHEAD + 1] = { 0 };
+    for (size_t i = 0; i < SLOTS; i++) {
+        const slot_t *s = &slots[i];
+        if (s->key == 0) continue;
+        uint8_t sub = s->key >> 24;
+        int bank = (int) ((s->key >> 16) & 0xFF) - 1;
+        uint16_t pc = s->key & 0xFFFF;
+        const char *name = sub < sizeof(sub_names) / sizeof(char *) && sub_names[sub] ? sub_names[sub] : "?";
+
+        if (sub == PROF_HOST || sub == PROF_PRESENT || sub == PROF_AHEAD) {
+            // pc means nothing here
+            host[sub] += s->n;
+            continue;
+        }
+        if (bank < 0) fprintf(f, "ram;");
+        else fprintf(f, "bank%d;", bank);
+        const char *routine = sym_find(bank, pc);
+        if (routine != NULL) fprintf(f, "%s;", routine);
+        fprintf(f, "$%04X;%s %u\n", pc, name, s->n);
+    }
+    for (int i = 0; i <= PROF_AHEAD; i++) {
+        if (host[i]) fprintf(f, "host;%s %llu\n", sub_names[i], (unsigned long long) host[i]);
+    }
+    fclose(f);
+
+    log_info("profiler: %llu samples, %llu lost.\n", (unsigned long long) samples, (unsigned long long) lost);
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef NES_PROF_H
+#define NES_PROF_H
+#include <stdint.h>
+#include "types.h"
+
+/* what the emulator is doing, for attributing samples */
+enum prof_sub {
+    PROF_HOST = 1, // main loop, audio, anything outside the console
+    PROF_CPU, // interpreter dispatch
+    PROF_JIT, // compiled blocks
+    PROF_IO_PPU, // ppu_get_reg/ppu_set_reg on behalf of the CPU
+    PROF_IO_APU, // apu_read/apu_write on behalf of the CPU
+    PROF_APU, // APU catch-up
+    PROF_PPU, // scanline rendering
+    PROF_PRESENT, // frame output
+    PROF_AHEAD, // frames run ahead and thrown away, whatever they do
+};
+
+/* updated at every subsystem transition, read by the sampler */
+extern NES_TLS volatile uint8_t prof_sub;
+
+/* set while frames are run ahead, their samples don't go to their PCs */
+extern NES_TLS volatile uint8_t prof_ahead;
+
+int prof_init(int hz);
+void prof_deinit();
+int prof_load_symbols(const char *path);
+int prof_save(const char *path);
+
+#endif // NES_PROF_H
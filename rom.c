@@ -5,6 +5,8 @@
 #include <memory.h>
 #include <unistd.h>
 
+static NES_TLS uint32_t prg_sz; // of the loaded rom
+
 ssize_t rom_parse(nes_meta_t *meta, const uint8_t *rom, size_t sz) {
     #define WANT_SZ(n) if (sz < n) { log_fatal("unexpected end of file.\n"); return -1; } else sz -= n;
     const uint8_t *ptr = rom;
@@ -18,15 +20,26 @@ ssize_t rom_parse(nes_meta_t *meta, const uint8_t *rom, size_t sz) {
     };
     
     
+    // old dumpers signed the unused bytes, e.g. "DiskDude!" from byte 7 on.
+    // unless it is NES 2.0, junk at the end means byte 7 is junk too.
+    uint8_t flag7 = hdr->flag7;
+    meta->fixes = 0;
+    if ((flag7 & 0b00001100) != 0b00001000 &&
+        (hdr->padding[4] | hdr->padding[5] | hdr->padding[6] | hdr->padding[7])) {
+        log_warn("junk in rom header, ignoring byte 7.\n");
+        flag7 = 0;
+        meta->fixes |= NES_FIX_PADDING;
+    }
+
     meta->chr_sz = hdr->chr_rom_sz_8k * 8 * 1024;
     meta->prgm_sz = hdr->prgm_rom_sz_16k * 16 * 1024;
-    meta->mapper = (hdr->flag6 >> 4) | ((hdr->flag7) & 0b11110000);
+    meta->mapper = (hdr->flag6 >> 4) | (flag7 & 0b11110000);
     meta->mirror       = (hdr->flag6 & 0b00000001) != 0;
     meta->bat_ram      = (hdr->flag6 & 0b00000010) != 0;
     int has_trainer    = (hdr->flag6 & 0b00000100) != 0;
     meta->fourscreen   = (hdr->flag6 & 0b00001000) != 0;
-    meta->console_type = (hdr->flag7 & 0b00000011);
-    meta->nes20        = (hdr->flag7 & 0b00000100) != 0;
+    meta->console_type = (flag7 & 0b00000011);
+    meta->nes20        = (flag7 & 0b00001100) == 0b00001000;
 
     if (has_trainer) {
         WANT_SZ(512);
@@ -38,7 +51,6 @@ ssize_t rom_parse(nes_meta_t *meta, const uint8_t *rom, size_t sz) {
     meta->prgm = ptr;
     ptr += meta->prgm_sz;
 
-    // TODO: CHR-RAM
     WANT_SZ(meta->chr_sz);
     meta->chr = ptr;
     ptr += meta->chr_sz;
@@ -74,6 +86,23 @@ int rom_load(const nes_meta_t *meta) {
         return -1;
     }
 
-    ppucpy(0, meta->chr, 0x2000);    
+    // without CHR-ROM the pattern tables are CHR-RAM, blank on power up
+    static const uint8_t blank[0x2000];
+    size_t chr = meta->chr_sz < 0x2000 ? meta->chr_sz : 0x2000;
+    ppucpy(0, meta->chr, chr);
+    ppucpy(chr, blank, 0x2000 - chr);
+    prg_sz = meta->prgm_sz;
     return 0;
+}
+
+/**
+ * @brief Get the 16k PRG-ROM bank mapped at a CPU address
+ * 
+ * @param addr CPU address
+ * @return int bank, -1 if addr is not in PRG-ROM
+ */
+int rom_bank(uint16_t addr) {
+    if (addr < 0x8000 || prg_sz == 0) return -1;
+    // NROM: fixed, a 16k rom is mirrored
+    return ((addr - 0x8000) >> 14) % (prg_sz >> 14);
 }
\ No newline at end of file
@@ -6,5 +6,6 @@
 
 ssize_t rom_parse(nes_meta_t *meta, const uint8_t *rom, size_t sz);
 int rom_load(const nes_meta_t *meta);
+int rom_bank(uint16_t addr);
 
 #endif // NES_ROM_H
\ No newline at end of file
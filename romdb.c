@@ -0,0 +1,386 @@
+#include "romdb.h"
+#include "rom.h"
+#include "log.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MEMO_SZ 16 // decoded CHR kept per process
+
+/* game database: headers known to be wrong, by the CRC32 of PRG + CHR.
+ * -1 keeps what the header says. a seed, the index is filled from use or
+ * nes-romscan -c, see romdb.h. */
+typedef struct game game_t;
+struct game {
+    uint32_t crc32;
+    int16_t mapper;
+    int8_t mirror; // 1: vertical
+    int8_t bat_ram;
+    const char *name;
+};
+
+static const game_t games[] = {
+    { 0x3337EC46, 0, 1, 0, "Super Mario Bros." },
+};
+
+static int romdb_initialized = 0;
+static char dir[1024];
+static int fd = -1;
+static romdb_hdr_t *index_hdr; // the mapped index
+static romdb_entry_t *slots;
+
+/* decoded CHR of the ROMs started in this process, shared by all threads.
+ * entries stay until romdb_close(), consoles may still point at them. */
+typedef struct memo memo_t;
+struct memo {
+    uint64_t key;
+    uint8_t *chr;
+    int mapped; // 1: mmap of the cache file, 0: malloc
+};
+static memo_t memo[MEMO_SZ];
+static int nmemo = 0;
+static pthread_mutex_t memo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t crc_tab[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (c & 1 ? 0xEDB88320 : 0);
+        crc_tab[i] = c;
+    }
+}
+
+/**
+ * @brief CRC32 (zlib's), as ROM databases use
+ *
+ * @param crc 0, or the CRC of what comes before
+ * @param p data
+ * @param sz size
+ * @return uint32_t CRC
+ */
+uint32_t romdb_crc32(uint32_t crc, const uint8_t *p, size_t sz) {
+    pthread_once(&crc_once, crc_init);
+    crc = ~crc;
+    while (sz--) crc = crc_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+/**
+ * @brief content hash of a ROM image, the key of the cache
+ *
+ * @param p image
+ * @param sz size
+ * @return uint64_t hash, never 0
+ */
+uint64_t romdb_hash(const uint8_t *p, size_t sz) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ sz, w;
+    size_t i = 0;
+    for (; i + 8 <= sz; i += 8) {
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+    }
+    for (; i < sz; i++) h = (h ^ p[i]) * 0x100000001B3ULL;
+    h ^= h >> 29;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 32;
+    return h ? h : 1;
+}
+
+/**
+ * @brief decode 8k of pattern tables to pixels
+ *
+ * @param dst ROMDB_CHR_SZ bytes, [tile][row][x]
+ * @param chr 8k of CHR
+ */
+static void chr_decode(uint8_t *dst, const uint8_t *chr) {
+    for (int t = 0; t < 512; t++) {
+        for (int y = 0; y < 8; y++) {
+            uint8_t l = chr[t * 16 + y], h = chr[t * 16 + y + 8];
+            for (int x = 0; x < 8; x++) *dst++ = ((h >> (7 - x)) & 1) << 1 | ((l >> (7 - x)) & 1);
+        }
+    }
+}
+
+/**
+ * @brief open the cache in a directory, creating it if needed
+ *
+ * the index is mapped shared, so any number of processes can use it at the
+ * same time.
+ *
+ * @param path directory
+ * @return int status
+ * @retval -1 failed, ROMs are parsed every time
+ * @retval 0 OK
+ */
+int romdb_open(const char *path) {
+    if (romdb_initialized) {
+        log_warn("romdb already initialized.\n");
+        return 0;
+    }
+    if (strlen(path) >= sizeof(dir)) {
+        log_error("romdb: path too long.\n");
+        return -1;
+    }
+    strcpy(dir, path);
+    mkdir(dir, 0755);
+
+    char name[sizeof(dir) + 32];
+    snprintf(name, sizeof(name), "%s/index", dir);
+    size_t sz = sizeof(romdb_hdr_t) + ROMDB_SLOTS * sizeof(romdb_entry_t);
+    fd = open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        log_error("can't open rom cache: '%s'.\n", name);
+        return -1;
+    }
+
+    // the first process sizes it, an index of zeros is empty
+    struct stat st;
+    flock(fd, LOCK_EX);
+    int ok = fstat(fd, &st) == 0 && (st.st_size == (off_t) sz || (st.st_size == 0 && ftruncate(fd, sz) == 0));
+    void *p = ok ? mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (p != MAP_FAILED && st.st_size == 0) {
+        romdb_hdr_t *h = (romdb_hdr_t *) p;
+        h->version = ROMDB_VERSION;
+        h->nslots = ROMDB_SLOTS;
+        h->entry_sz = sizeof(romdb_entry_t);
+        memcpy(h->magic, ROMDB_MAGIC, 4);
+    }
+    flock(fd, LOCK_UN);
+    if (p == MAP_FAILED) {
+        log_error("can't map rom cache: '%s'.\n", name);
+        close(fd);
+        return -1;
+    }
+
+    index_hdr = (romdb_hdr_t *) p;
+    if (memcmp(index_hdr->magic, ROMDB_MAGIC, 4) != 0 || index_hdr->version != ROMDB_VERSION ||
+        index_hdr->nslots != ROMDB_SLOTS || index_hdr->entry_sz != sizeof(romdb_entry_t)) {
+        log_error("rom cache '%s' is of another version, remove it.\n", name);
+        munmap(p, sz);
+        close(fd);
+        return -1;
+    }
+    slots = (romdb_entry_t *) (index_hdr + 1);
+    romdb_initialized = 1;
+    log_debug("rom cache: '%s'.\n", dir);
+    return 0;
+}
+
+/**
+ * @brief close the cache and drop the decoded CHR, no console may run
+ *
+ */
+void romdb_close() {
+    pthread_mutex_lock(&memo_lock);
+    for (int i = 0; i < nmemo; i++) {
+        if (memo[i].mapped) munmap(memo[i].chr, ROMDB_CHR_SZ);
+        else free(memo[i].chr);
+    }
+    nmemo = 0;
+    pthread_mutex_unlock(&memo_lock);
+
+    if (!romdb_initialized) return;
+    munmap(index_hdr, sizeof(romdb_hdr_t) + ROMDB_SLOTS * sizeof(romdb_entry_t));
+    close(fd);
+    fd = -1;
+    romdb_initialized = 0;
+}
+
+/**
+ * @brief find the slot of a key, or the free slot it would go to
+ *
+ * @param key key
+ * @return romdb_entry_t* slot, NULL if the index is full
+ */
+static romdb_entry_t *probe(uint64_t key) {
+    for (int i = 0; i < ROMDB_SLOTS; i++) {
+        romdb_entry_t *e = &slots[(key + i) % ROMDB_SLOTS];
+        uint64_t k = atomic_load_explicit(&e->key, memory_order_acquire);
+        if (k == key || k == 0) return e;
+    }
+    return NULL;
+}
+
+/**
+ * @brief parse a ROM the slow way: header, fixes and the game database
+ *
+ * @param e output
+ * @param meta output
+ * @param rom image
+ * @param sz size
+ * @return int status
+ * @retval -1 bad ROM
+ * @retval 0 OK
+ */
+static int examine(romdb_entry_t *e, nes_meta_t *meta, const uint8_t *rom, size_t sz) {
+    ssize_t parsed_sz = rom_parse(meta, rom, sz);
+    if (parsed_sz < 0 || (size_t) parsed_sz != sz) return -1;
+
+    memset(e, 0, sizeof(romdb_entry_t));
+    e->crc32 = romdb_crc32(0, meta->prgm, meta->prgm_sz);
+    e->crc32 = romdb_crc32(e->crc32, meta->chr, meta->chr_sz);
+    for (size_t i = 0; i < sizeof(games) / sizeof(games[0]); i++) {
+        const game_t *g = &games[i];
+        if (g->crc32 != e->crc32) continue;
+        if ((g->mapper >= 0 && g->mapper != meta->mapper) || (g->mirror >= 0 && g->mirror != meta->mirror) ||
+            (g->bat_ram >= 0 && g->bat_ram != meta->bat_ram)) {
+            log_warn("fixing the header of '%s' from the game database.\n", g->name);
+            meta->fixes |= NES_FIX_GAMEDB;
+        }
+        if (g->mapper >= 0) meta->mapper = g->mapper;
+        if (g->mirror >= 0) meta->mirror = g->mirror;
+        if (g->bat_ram >= 0) meta->bat_ram = g->bat_ram;
+        snprintf(e->name, sizeof(e->name), "%s", g->name);
+        break;
+    }
+
+    e->size = sz;
+    e->prgm_sz = meta->prgm_sz;
+    e->chr_sz = meta->chr_sz;
+    e->mapper = meta->mapper;
+    e->mirror = meta->mirror;
+    e->bat_ram = meta->bat_ram;
+    e->fourscreen = meta->fourscreen;
+    e->console_type = meta->console_type;
+    e->nes20 = meta->nes20;
+    e->trainer = meta->trainer != NULL;
+    e->fixes = meta->fixes;
+    return 0;
+}
+
+/**
+ * @brief fill meta from a cached entry, without parsing
+ *
+ * @param meta output
+ * @param e the entry
+ * @param rom image
+ */
+static void from_entry(nes_meta_t *meta, const romdb_entry_t *e, const uint8_t *rom) {
+    const uint8_t *p = rom + sizeof(nes_hdr_t);
+    meta->trainer = e->trainer ? p : NULL;
+    if (e->trainer) p += 512;
+    meta->prgm = p;
+    meta->chr = p + e->prgm_sz;
+    meta->prgm_sz = e->prgm_sz;
+    meta->chr_sz = e->chr_sz;
+    meta->mapper = e->mapper;
+    meta->mirror = e->mirror;
+    meta->bat_ram = e->bat_ram;
+    meta->fourscreen = e->fourscreen;
+    meta->console_type = e->console_type;
+    meta->nes20 = e->nes20;
+    meta->fixes = e->fixes;
+}
+
+/**
+ * @brief get the decoded CHR of a ROM: from this process, from the cache
+ * directory, or decoded now
+ *
+ * @param key content hash
+ * @param chr 8k of CHR
+ * @return const uint8_t* ROMDB_CHR_SZ bytes, NULL if there is no room
+ */
+static const uint8_t *decoded_chr(uint64_t key, const uint8_t *chr) {
+    const uint8_t *ret = NULL;
+    pthread_mutex_lock(&memo_lock);
+    for (int i = 0; i < nmemo; i++) {
+        if (memo[i].key == key) {
+            ret = memo[i].chr;
+            goto out;
+        }
+    }
+    if (nmemo == MEMO_SZ) goto out;
+
+    memo_t *m = &memo[nmemo];
+    m->key = key;
+    m->mapped = 0;
+    if (romdb_initialized) {
+        char name[sizeof(dir) + 32], tmp[sizeof(dir) + 64];
+        snprintf(name, sizeof(name), "%s/%016" PRIx64 ".chr", dir, key);
+        int cfd = open(name, O_RDONLY);
+        if (cfd < 0) {
+            // write it aside and rename, others never see a partial file
+            uint8_t *buf = malloc(ROMDB_CHR_SZ);
+            snprintf(tmp, sizeof(tmp), "%s.%d", name, (int) getpid());
+            int tfd = buf != NULL ? open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+            if (tfd >= 0) {
+                chr_decode(buf, chr);
+                int ok = write(tfd, buf, ROMDB_CHR_SZ) == ROMDB_CHR_SZ;
+                close(tfd);
+                if (ok && rename(tmp, name) == 0) cfd = open(name, O_RDONLY);
+                else unlink(tmp);
+            }
+            free(buf);
+        }
+        if (cfd >= 0) {
+            struct stat st;
+            void *p = fstat(cfd, &st) == 0 && st.st_size == ROMDB_CHR_SZ
+                ? mmap(NULL, ROMDB_CHR_SZ, PROT_READ, MAP_SHARED, cfd, 0) : MAP_FAILED;
+            close(cfd);
+            if (p != MAP_FAILED) {
+                m->chr = p;
+                m->mapped = 1;
+            }
+        }
+    }
+    if (!m->mapped) {
+        m->chr = malloc(ROMDB_CHR_SZ);
+        if (m->chr == NULL) goto out;
+        chr_decode(m->chr, chr);
+    }
+    ret = m->chr;
+    nmemo++;
+out:
+    pthread_mutex_unlock(&memo_lock);
+    return ret;
+}
+
+/**
+ * @brief parse a ROM, or look it up in the cache
+ *
+ * a known ROM is a hash and a lookup; an unknown one is parsed, its header
+ * fixed, checked against the game database and added to the cache.
+ *
+ * @param meta output
+ * @param rom image, must outlive meta
+ * @param sz size of the image
+ * @param chr output, the 8k of CHR the ROM starts with as pixels, for
+ * ppu_set_chr(); NULL if there is none
+ * @return int status
+ * @retval -1 bad ROM
+ * @retval 0 OK
+ */
+int romdb_lookup(nes_meta_t *meta, const uint8_t *rom, size_t sz, const uint8_t **chr) {
+    uint64_t key = romdb_hash(rom, sz);
+    romdb_entry_t *e = romdb_initialized ? probe(key) : NULL;
+    romdb_entry_t ent;
+
+    if (e != NULL && atomic_load_explicit(&e->key, memory_order_acquire) == key && e->size == sz &&
+        sizeof(nes_hdr_t) + (e->trainer ? 512 : 0) + (size_t) e->prgm_sz + e->chr_sz == sz) {
+        from_entry(meta, e, rom);
+    } else {
+        if (examine(&ent, meta, rom, sz) < 0) return -1;
+        if (romdb_initialized) {
+            flock(fd, LOCK_EX);
+            // someone may have taken the slot meanwhile
+            e = probe(key);
+            if (e != NULL && atomic_load_explicit(&e->key, memory_order_relaxed) == 0) {
+                memcpy((uint8_t *) e + sizeof(e->key), (uint8_t *) &ent + sizeof(ent.key), sizeof(ent) - sizeof(ent.key));
+                atomic_store_explicit(&e->key, key, memory_order_release);
+            } else if (e == NULL) log_debug("rom cache is full.\n");
+            flock(fd, LOCK_UN);
+        }
+    }
+
+    *chr = meta->chr_sz >= 0x2000 ? decoded_chr(key, meta->chr) : NULL;
+    return 0;
+}
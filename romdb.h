@@ -0,0 +1,54 @@
+#ifndef NES_ROMDB_H
+#define NES_ROMDB_H
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "types.h"
+
+#define ROMDB_MAGIC "NRDB"
+#define ROMDB_VERSION 1
+#define ROMDB_SLOTS 4096 // ROMs the index holds
+#define ROMDB_CHR_SZ (512 * 8 * 8) // 8k of CHR as pixels
+
+/*
+ * the index in the cache directory is the database: every ROM started with
+ * it open gets a slot, and nes-romscan -c fills it for a whole library at
+ * once. the game table in romdb.c is only a seed of headers known to be
+ * wrong, applied when a ROM is first added.
+ *
+ * what is known of a ROM, one slot of the index. the index is a file of
+ * ROMDB_SLOTS of these after a romdb_hdr_t, open addressed on the key.
+ * writers hold a lock on the file and store the key last; readers only
+ * take slots whose key they see.
+ */
+typedef struct romdb_entry {
+    _Atomic uint64_t key; // content hash of the image, 0 for a free slot
+    uint32_t size; // of the image
+    uint32_t crc32; // of PRG + CHR, as game databases list them
+    uint32_t prgm_sz;
+    uint32_t chr_sz;
+    uint8_t mapper;
+    uint8_t mirror;
+    uint8_t bat_ram;
+    uint8_t fourscreen;
+    uint8_t console_type;
+    uint8_t nes20;
+    uint8_t trainer;
+    uint8_t fixes; // NES_FIX_*
+    char name[32]; // from the game database, empty if unknown
+} romdb_entry_t;
+
+typedef struct romdb_hdr {
+    char magic[4];
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t entry_sz; // sizeof(romdb_entry_t)
+} romdb_hdr_t;
+
+int romdb_open(const char *dir);
+void romdb_close();
+int romdb_lookup(nes_meta_t *meta, const uint8_t *rom, size_t sz, const uint8_t **chr);
+uint32_t romdb_crc32(uint32_t crc, const uint8_t *p, size_t sz);
+uint64_t romdb_hash(const uint8_t *p, size_t sz);
+
+#endif // NES_ROMDB_H
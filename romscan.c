@@ -0,0 +1,323 @@
+#define _GNU_SOURCE // nftw
+#include "romscan.h"
+#include "nes.h"
+#include "rom.h"
+#include "romdb.h"
+#include "6502.h"
+#include "fb.h"
+#include "jit.h"
+#include "log.h"
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef JIT_SINGLE_THREAD
+#error "the scanner runs a ROM per thread, build it without JIT=1"
+#endif
+
+/* indexes a ROM library: parses and boots every image on a thread pool */
+
+#define MAX_ROM (16 << 20) // bigger files are not images
+#define MAX_THREADS 256
+
+static char **paths = NULL;
+static size_t npaths = 0, cap = 0;
+static romscan_rec_t *recs;
+static _Atomic size_t next = 0, done = 0;
+static int frames = 30;
+
+static const char *status_names[] = { "ok", "blank", "bad_opcode", "halted", "unsupported", "bad_rom" };
+
+/**
+ * @brief SHA-1
+ *
+ * @param p data
+ * @param sz size
+ * @param out 20 bytes
+ */
+static void sha1(const uint8_t *p, size_t sz, uint8_t out[20]) {
+    #define ROL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    uint8_t tail[128] = { 0 };
+    size_t full = sz & ~(size_t) 63, rest = sz - full;
+    memcpy(tail, p + full, rest);
+    tail[rest] = 0x80;
+    size_t ntail = rest < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t) sz * 8;
+    for (int i = 0; i < 8; i++) tail[ntail - 1 - i] = bits >> (i * 8);
+
+    for (size_t off = 0; off < full + ntail; off += 64) {
+        const uint8_t *blk = off < full ? p + off : tail + (off - full);
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) w[i] = (uint32_t) blk[i * 4] << 24 | blk[i * 4 + 1] << 16 | blk[i * 4 + 2] << 8 | blk[i * 4 + 3];
+        for (int i = 16; i < 80; i++) w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+            else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+            uint32_t t = ROL(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = ROL(b, 30); b = a; a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+    for (int i = 0; i < 20; i++) out[i] = h[i / 4] >> (24 - (i % 4) * 8);
+    #undef ROL
+}
+
+/**
+ * @brief check if every pixel of the frame is the same
+ *
+ * @param f the frame
+ * @return int 1 if it is
+ */
+static int blank(const fb_t *f) {
+    const uint8_t *p = &f->idx[0][0];
+    for (size_t i = 1; i < sizeof(f->idx); i++) {
+        if (p[i] != p[0]) return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief parse, hash and boot an image
+ *
+ * @param path file
+ * @param r output
+ */
+static void scan(const char *path, romscan_rec_t *r) {
+    memset(r, 0, sizeof(romscan_rec_t));
+    r->status = ROMSCAN_BAD_ROM;
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0 || st.st_size > MAX_ROM) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    r->size = st.st_size;
+    const uint8_t *rom = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (rom == MAP_FAILED) return;
+
+    nes_meta_t meta;
+    ssize_t parsed = rom_parse(&meta, rom, r->size);
+    if (parsed < 0 || (size_t) parsed != r->size) {
+        r->crc32 = romdb_crc32(0, rom, r->size);
+        sha1(rom, r->size, r->sha1);
+        munmap((void *) rom, r->size);
+        return;
+    }
+
+    // PRG and CHR follow each other, the hashes are those of the databases
+    r->crc32 = romdb_crc32(0, meta.prgm, meta.prgm_sz + meta.chr_sz);
+    sha1(meta.prgm, meta.prgm_sz + meta.chr_sz, r->sha1);
+    r->prgm_sz = meta.prgm_sz;
+    r->chr_sz = meta.chr_sz;
+    r->mapper = meta.mapper;
+    r->fixes = meta.fixes;
+    r->flags = (meta.nes20 ? ROMSCAN_NES20 : 0) | (meta.trainer ? ROMSCAN_TRAINER : 0) |
+        (meta.bat_ram ? ROMSCAN_BATTERY : 0) | (meta.fourscreen ? ROMSCAN_FOURSCREEN : 0) |
+        (meta.mirror ? ROMSCAN_VERTICAL : 0);
+
+    r->status = ROMSCAN_UNSUPPORTED;
+    if (nes_init(&meta, rom, r->size) == 0) {
+        r->status = ROMSCAN_OK;
+        for (r->frames = 0; r->frames < frames; r->frames++) {
+            if (nes_frame() < 0) {
+                r->status = ROMSCAN_HALTED;
+                break;
+            }
+        }
+        r->bad_ops = bad_ops_6502();
+        r->fb_hash = fb_hash();
+        if (r->status == ROMSCAN_OK && r->bad_ops) r->status = ROMSCAN_BAD_OPCODE;
+        if (r->status == ROMSCAN_OK && blank(fb_frame())) r->status = ROMSCAN_BLANK;
+    }
+    munmap((void *) rom, r->size);
+}
+
+/**
+ * @brief worker: take images until there are none left
+ *
+ * @param p unused
+ * @return void* NULL
+ */
+static void *worker(void *p) {
+    (void) p;
+    size_t i;
+    while ((i = atomic_fetch_add(&next, 1)) < npaths) {
+        scan(paths[i], &recs[i]);
+        atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+static int add_path(const char *path) {
+    if (npaths == cap) {
+        cap = cap ? cap * 2 : 1024;
+        char **n = realloc(paths, cap * sizeof(char *));
+        if (n == NULL) return -1;
+        paths = n;
+    }
+    if ((paths[npaths] = strdup(path)) == NULL) return -1;
+    npaths++;
+    return 0;
+}
+
+static int visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void) st;
+    (void) ftw;
+    if (type != FTW_F) return 0;
+    const char *ext = strrchr(path, '.');
+    if (ext == NULL || strcasecmp(ext, ".nes") != 0) return 0;
+    return add_path(path);
+}
+
+static int cmp_path(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static void hex(char *dst, const uint8_t *p, int n) {
+    for (int i = 0; i < n; i++) sprintf(dst + i * 2, "%02x", p[i]);
+}
+
+/**
+ * @brief write the index as CSV, paths with a comma or a quote are quoted
+ *
+ * @param f output
+ */
+static void write_csv(FILE *f) {
+    fprintf(f, "path,size,status,crc32,sha1,mapper,mirroring,nes20,trainer,battery,prg_kb,chr_kb,fixes,frames,bad_ops,fb_hash\n");
+    for (size_t i = 0; i < npaths; i++) {
+        const romscan_rec_t *r = &recs[i];
+        char sha[41];
+        hex(sha, r->sha1, 20);
+        if (strpbrk(paths[i], ",\"\n") != NULL) {
+            fputc('"', f);
+            for (const char *c = paths[i]; *c; c++) {
+                if (*c == '"') fputc('"', f);
+                fputc(*c, f);
+            }
+            fputc('"', f);
+        } else fputs(paths[i], f);
+        fprintf(f, ",%u,%s,%08x,%s,%u,%s,%d,%d,%d,%u,%u,%u,%u,%u,%016llx\n", r->size, status_names[r->status],
+            r->crc32, sha, r->mapper, r->flags & ROMSCAN_FOURSCREEN ? "four" : r->flags & ROMSCAN_VERTICAL ? "vertical" : "horizontal",
+            !!(r->flags & ROMSCAN_NES20), !!(r->flags & ROMSCAN_TRAINER), !!(r->flags & ROMSCAN_BATTERY),
+            r->prgm_sz / 1024, r->chr_sz / 1024, r->fixes, r->frames, r->bad_ops, (unsigned long long) r->fb_hash);
+    }
+}
+
+/**
+ * @brief write the index as romscan.h describes
+ *
+ * @param f output
+ */
+static void write_bin(FILE *f) {
+    romscan_hdr_t hdr = { ROMSCAN_MAGIC, ROMSCAN_VERSION, npaths, sizeof(romscan_rec_t) };
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    uint32_t off = 0;
+    for (size_t i = 0; i < npaths; i++) {
+        recs[i].path = off;
+        off += strlen(paths[i]) + 1;
+    }
+    fwrite(recs, sizeof(romscan_rec_t), npaths, f);
+    for (size_t i = 0; i < npaths; i++) fwrite(paths[i], strlen(paths[i]) + 1, 1, f);
+}
+
+int main (int argc, char **argv) {
+    const char *out = NULL, *cachedir = NULL;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN), bin = 0, opt;
+
+    while ((opt = getopt(argc, argv, "bc:f:j:o:")) != -1) {
+        if (opt == 'b') bin = 1;
+        else if (opt == 'c') cachedir = optarg;
+        else if (opt == 'f') frames = atoi(optarg);
+        else if (opt == 'j') threads = atoi(optarg);
+        else if (opt == 'o') out = optarg;
+        else optind = argc + 1;
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-b] [-c cachedir] [-f frames] [-j threads] [-o index] dir|rom...\n", argv[0]);
+        fprintf(stderr, "  -b  binary index (romscan.h) instead of CSV\n");
+        fprintf(stderr, "  -c  add every image to the rom cache, as NES_ROMCACHE\n");
+        fprintf(stderr, "  -f  frames to boot each image for, 30 by default\n");
+        return 1;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    if (frames < 0) frames = 0;
+    if (frames > UINT16_MAX) frames = UINT16_MAX;
+    if (bin && out == NULL && isatty(STDOUT_FILENO)) {
+        log_fatal("not writing a binary index to a terminal, use -o.\n");
+        return 1;
+    }
+
+    log_init();
+    if (cachedir != NULL && romdb_open(cachedir) < 0) return 1;
+    for (int i = optind; i < argc; i++) {
+        struct stat st;
+        if (stat(argv[i], &st) == 0 && S_ISREG(st.st_mode)) add_path(argv[i]);
+        else if (nftw(argv[i], visit, 64, FTW_PHYS) != 0) log_error("can't walk '%s'.\n", argv[i]);
+    }
+    qsort(paths, npaths, sizeof(char *), cmp_path);
+    recs = calloc(npaths ? npaths : 1, sizeof(romscan_rec_t));
+    if (recs == NULL) {
+        log_fatal("out of memory.\n");
+        return 1;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_t pool[MAX_THREADS];
+    int started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&pool[started], NULL, worker, NULL) != 0) break;
+    }
+    if (started == 0) worker(NULL);
+    for (size_t last = 0; atomic_load(&done) < npaths && started > 0;) {
+        struct timespec nap = { 0, 100000000 };
+        nanosleep(&nap, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if ((size_t) t1.tv_sec != last) {
+            last = t1.tv_sec;
+            fprintf(stderr, "\r%zu/%zu", atomic_load(&done), npaths);
+        }
+    }
+    for (int i = 0; i < started; i++) pthread_join(pool[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    FILE *f = out != NULL ? fopen(out, "wb") : stdout;
+    if (f == NULL) {
+        log_fatal("can't open file: '%s'.\n", out);
+        return 1;
+    }
+    if (bin) write_bin(f);
+    else write_csv(f);
+    if (f != stdout) fclose(f);
+
+    size_t count[ROMSCAN_BAD_ROM + 1] = { 0 };
+    for (size_t i = 0; i < npaths; i++) count[recs[i].status]++;
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "\r\033[K%zu images in %.1fs with %d threads:", npaths, secs, threads);
+    for (int s = 0; s <= ROMSCAN_BAD_ROM; s++) fprintf(stderr, " %s %zu", status_names[s], count[s]);
+    fprintf(stderr, "\n");
+
+    for (size_t i = 0; i < npaths; i++) free(paths[i]);
+    free(paths);
+    free(recs);
+    romdb_close();
+    log_deinit();
+    return 0;
+}
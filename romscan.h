@@ -0,0 +1,53 @@
+#ifndef NES_ROMSCAN_H
+#define NES_ROMSCAN_H
+#include <stdint.h>
+
+/*
+ * binary index written by nes-romscan -b: a romscan_hdr_t, count records
+ * sorted by path, then the paths as NUL terminated strings.
+ */
+#define ROMSCAN_MAGIC "NRSC"
+#define ROMSCAN_VERSION 1
+
+/* what happened to an image, worst first */
+typedef enum romscan_status {
+    ROMSCAN_OK, // booted and drew something
+    ROMSCAN_BLANK, // booted, but every pixel of the last frame is the same
+    ROMSCAN_BAD_OPCODE, // ran into opcodes the CPU does not know
+    ROMSCAN_HALTED, // the CPU stopped
+    ROMSCAN_UNSUPPORTED, // parsed, but the mapper is not implemented
+    ROMSCAN_BAD_ROM, // not an image, truncated or unreadable
+} romscan_status_t;
+
+// flags
+#define ROMSCAN_NES20 0x01
+#define ROMSCAN_TRAINER 0x02
+#define ROMSCAN_BATTERY 0x04
+#define ROMSCAN_FOURSCREEN 0x08
+#define ROMSCAN_VERTICAL 0x10 // vertical mirroring
+
+typedef struct romscan_hdr {
+    char magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t rec_sz; // sizeof(romscan_rec_t)
+} romscan_hdr_t;
+
+typedef struct romscan_rec {
+    uint32_t path; // offset of the path after the records
+    uint32_t size; // of the file
+    uint32_t crc32; // of PRG + CHR, of the whole file if it does not parse
+    uint8_t sha1[20]; // of the same
+    uint32_t prgm_sz;
+    uint32_t chr_sz;
+    uint32_t bad_ops; // unknown opcodes run
+    uint16_t frames; // frames run
+    uint8_t mapper;
+    uint8_t status; // romscan_status_t
+    uint8_t flags; // ROMSCAN_*
+    uint8_t fixes; // NES_FIX_* of the header
+    uint8_t pad[2];
+    uint64_t fb_hash; // fb_hash() of the last frame
+} romscan_rec_t;
+
+#endif // NES_ROMSCAN_H
@@ -0,0 +1,276 @@
+#include "runahead.h"
+#include "nes.h"
+#include "ppu.h"
+#include "apu.h"
+#include "fb.h"
+#include "input.h"
+#include "stats.h"
+#include "gdb.h"
+#include "cheat.h"
+#include "trace.h"
+#include "prof.h"
+#include "jit.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// longest wait for the other thread, half a frame
+#define WAIT_NS ((long) (1e9 * NES_FRAME_CYCLES / CPU_CLOCK / 2))
+
+static int runahead_initialized = 0;
+static int frames; // run ahead
+static int thread; // 1 if a second console runs them
+static uint8_t *state;
+static size_t state_sz;
+
+// second console: the state of the last real frame goes in, the frame
+// frames after it comes out
+static pthread_t worker;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t posted = PTHREAD_COND_INITIALIZER, done = PTHREAD_COND_INITIALIZER;
+static uint8_t *job, *job_cheats;
+static size_t cheats_sz;
+static uint8_t job_pads[2];
+static uint64_t job_seq, done_seq, shown_seq;
+static fb_t *out, *shown;
+static int quit;
+static const uint8_t *rom;
+static size_t rom_sz;
+
+/**
+ * @brief the second console: run ahead of each state posted
+ *
+ * @param arg unused
+ * @return void* NULL
+ */
+static void *work(void *arg) {
+    (void) arg;
+    nes_meta_t meta;
+    uint8_t *st = malloc(state_sz), *ch = malloc(cheats_sz);
+    if (st == NULL || ch == NULL || nes_init(&meta, rom, rom_sz) < 0) {
+        log_error("runahead: can't start the second console.\n");
+        free(st);
+        free(ch);
+        return NULL;
+    }
+    // the watches of the cheats copied belong to the other thread
+    cheat_mute(1);
+
+    uint64_t seq = 0;
+    pthread_mutex_lock(&lock);
+    while (!quit) {
+        if (job_seq == seq) {
+            pthread_cond_wait(&posted, &lock);
+            continue;
+        }
+        // states posted while busy are skipped, only the last one counts
+        seq = job_seq;
+        memcpy(st, job, state_sz);
+        memcpy(ch, job_cheats, cheats_sz);
+        uint8_t pads[2] = { job_pads[0], job_pads[1] };
+        pthread_mutex_unlock(&lock);
+
+        // cheats first, loading the state freezes what they freeze
+        cheat_load(ch);
+        nes_load(st, state_sz);
+        input_set(0, pads[0]);
+        input_set(1, pads[1]);
+        for (int i = 1; i <= frames; i++) {
+            ppu_set_draw(i == frames);
+            if (nes_frame() < 0) break;
+        }
+
+        pthread_mutex_lock(&lock);
+        memcpy(out, fb_frame(), sizeof(fb_t));
+        done_seq = seq;
+        pthread_cond_signal(&done);
+    }
+    pthread_mutex_unlock(&lock);
+    free(st);
+    free(ch);
+    return NULL;
+}
+
+/**
+ * @brief start running ahead, after nes_init()
+ *
+ * @param n frames to run ahead, up to RUNAHEAD_MAX
+ * @param second 1 to run them on a second console on its own thread
+ * @param image the ROM nes_init() was given, kept until runahead_deinit()
+ * @param sz size of image
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int runahead_init(int n, int second, const uint8_t *image, size_t sz) {
+    if (runahead_initialized) runahead_deinit();
+    if (n < 1 || n > RUNAHEAD_MAX) {
+        log_error("runahead: %d frames, can do 1 to %d.\n", n, RUNAHEAD_MAX);
+        return -1;
+    }
+#ifdef JIT_SINGLE_THREAD
+    if (second) log_warn("runahead: no second console with the recompiler, running ahead here.\n");
+    second = 0;
+#endif
+
+    frames = n;
+    thread = second;
+    state_sz = nes_state_size();
+    state = malloc(state_sz);
+    if (state == NULL) return -1;
+    if (!thread) {
+        runahead_initialized = 1;
+        return 0;
+    }
+
+    rom = image;
+    rom_sz = sz;
+    job = malloc(state_sz);
+    cheats_sz = cheat_save(NULL);
+    job_cheats = malloc(cheats_sz);
+    out = malloc(sizeof(fb_t));
+    shown = malloc(sizeof(fb_t));
+    quit = 0;
+    job_seq = done_seq = shown_seq = 0;
+    if (job == NULL || job_cheats == NULL || out == NULL || shown == NULL ||
+        pthread_create(&worker, NULL, work, NULL) != 0) {
+        log_error("runahead: can't start a thread.\n");
+        free(job);
+        free(job_cheats);
+        free(out);
+        free(shown);
+        free(state);
+        return -1;
+    }
+    runahead_initialized = 1;
+    return 0;
+}
+
+/**
+ * @brief stop running ahead
+ *
+ */
+void runahead_deinit() {
+    if (!runahead_initialized) return;
+    if (thread) {
+        pthread_mutex_lock(&lock);
+        quit = 1;
+        pthread_cond_signal(&posted);
+        pthread_mutex_unlock(&lock);
+        pthread_join(worker, NULL);
+        free(job);
+        free(job_cheats);
+        free(out);
+        free(shown);
+    }
+    free(state);
+    ppu_set_draw(1);
+    runahead_initialized = 0;
+}
+
+/**
+ * @brief run ahead on this console and go back
+ *
+ * @return int status
+ * @retval -1 CPU halted
+ * @retval 0 OK
+ */
+static int ahead_here() {
+    ppu_set_draw(0);
+    int ret = nes_frame();
+    ppu_set_draw(1);
+    if (ret < 0) return -1;
+
+    uint64_t t0 = stats_clock();
+    nes_save(state);
+    stats_t keep = stats_cur;
+    // what happens in frames thrown away is not seen by watches, the trace
+    // nor the profiler
+    int tracing = trace_on;
+    trace_enable(0);
+    cheat_mute(1);
+    prof_ahead = 1;
+    for (int i = 1; i <= frames; i++) {
+        ppu_set_draw(i == frames);
+        // halted ahead, the real frame gets there and says so
+        if (nes_frame() < 0) break;
+    }
+    ppu_set_draw(1);
+    nes_restore(state, state_sz);
+    prof_ahead = 0;
+    cheat_mute(0);
+    trace_enable(tracing);
+
+    // the counters are of the real frame, the time is of all of them
+    stats_t s = stats_cur;
+    stats_cur = keep;
+    stats_cur.dup_frames = s.dup_frames;
+    stats_cur.t_cpu = s.t_cpu;
+    stats_cur.t_render = s.t_render;
+    stats_cur.t_present = s.t_present;
+    stats_cur.ahead_frames += frames;
+    stats_cur.t_ahead += stats_clock() - t0;
+    return 0;
+}
+
+/**
+ * @brief post the state to the second console, show what it has made
+ *
+ * @return int status
+ * @retval -1 CPU halted
+ * @retval 0 OK
+ */
+static int ahead_there() {
+    ppu_set_draw(0);
+    if (nes_frame() < 0) return -1;
+
+    uint64_t t0 = stats_clock();
+    struct timespec dl;
+    clock_gettime(CLOCK_REALTIME, &dl);
+    dl.tv_nsec += WAIT_NS;
+    if (dl.tv_nsec >= 1000000000L) {
+        dl.tv_sec++;
+        dl.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&lock);
+    nes_save(job);
+    cheat_save(job_cheats);
+    job_pads[0] = input_get(0);
+    job_pads[1] = input_get(1);
+    job_seq++;
+    pthread_cond_signal(&posted);
+    while (done_seq != job_seq && pthread_cond_timedwait(&done, &lock, &dl) == 0) {}
+    int late = done_seq != job_seq, fresh = done_seq > shown_seq;
+    if (fresh) {
+        memcpy(shown, out, sizeof(fb_t));
+        shown_seq = done_seq;
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (fresh) stats_cur.ahead_frames += frames;
+    stats_cur.ahead_late += late;
+    stats_cur.t_ahead += stats_clock() - t0;
+    if (fresh) fb_put_frame(shown);
+    return 0;
+}
+
+/**
+ * @brief run a frame, showing one run ahead of it if started
+ *
+ * set the input before, as for nes_frame().
+ *
+ * @return int status
+ * @retval -1 CPU halted
+ * @retval 0 OK
+ */
+int runahead_frame() {
+    // breakpoints must not hit in frames that are thrown away
+    if (!runahead_initialized || gdb_armed) {
+        ppu_set_draw(1);
+        return nes_frame();
+    }
+    return thread ? ahead_there() : ahead_here();
+}
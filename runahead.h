@@ -0,0 +1,25 @@
+#ifndef NES_RUNAHEAD_H
+#define NES_RUNAHEAD_H
+#include <stdint.h>
+#include <unistd.h>
+
+/*
+ * run-ahead: each frame shown is the one n frames after the frame just
+ * emulated, as if the input held now had been held n frames earlier. this
+ * hides the frames of lag games have on purpose, as long as n is no more
+ * than that. the frame really emulated keeps the sound, the state goes back
+ * to it after the frames run ahead.
+ *
+ * on this thread it costs n + 1 frames of emulation per frame. with a
+ * second console on a thread of its own, this thread only runs the real
+ * frames and hands their state and cheats over, and a late frame shows a
+ * frame later instead of stalling. watches, the trace and the profiler
+ * don't see the frames run ahead.
+ */
+#define RUNAHEAD_MAX 8
+
+int runahead_init(int frames, int thread, const uint8_t *rom, size_t sz);
+void runahead_deinit();
+int runahead_frame();
+
+#endif // NES_RUNAHEAD_H
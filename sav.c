@@ -0,0 +1,191 @@
+#include "sav.h"
+#include "mem.h"
+#include "log.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static int sav_initialized = 0;
+static uint8_t *ram; // the mapped file
+static int fd = -1;
+static atomic_uint dirty = 0; // set by the emulation thread, see prgram_wrt
+
+/* the flusher: msyncs written blocks every interval, so the emulation
+ * thread never waits for the disk */
+static pthread_t flusher;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake;
+static int quit = 0;
+static int interval;
+static unsigned flushes = 0;
+
+/**
+ * @brief write back the host pages that have dirty blocks
+ *
+ * @param flags MS_SYNC to wait for the disk, MS_ASYNC to only start the writes
+ */
+static void flush(int flags) {
+    unsigned d = atomic_exchange_explicit(&dirty, 0, memory_order_acquire);
+    if (d == 0) return;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t per_page = page / PRG_RAM_BLOCK; // dirty bits per host page
+    for (size_t off = 0; off < PRG_RAM_SZ; off += page) {
+        unsigned mask = per_page >= 32 ? ~0u : ((1u << per_page) - 1) << (off / PRG_RAM_BLOCK);
+        if (!(d & mask)) continue;
+        size_t len = PRG_RAM_SZ - off < page ? PRG_RAM_SZ - off : page;
+        if (msync(ram + off, len, flags) < 0) {
+            log_warn("sav: msync failed, will retry.\n");
+            atomic_fetch_or_explicit(&dirty, d & mask, memory_order_relaxed);
+        }
+    }
+    flushes++;
+}
+
+/**
+ * @brief flusher thread
+ *
+ * @param p unused
+ * @return void* NULL
+ */
+static void *flusher_main(void *p) {
+    (void) p;
+    pthread_mutex_lock(&lock);
+    while (!quit) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += interval / 1000;
+        ts.tv_nsec += (interval % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wake, &lock, &ts);
+        if (quit) break;
+        pthread_mutex_unlock(&lock);
+        flush(MS_SYNC);
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/**
+ * @brief back PRG-RAM by a save file, call on the emulation thread
+ *
+ * the file is created, or extended with zeros, to PRG_RAM_SZ bytes and
+ * mapped shared: writes go to the page cache right away, and are flushed
+ * to the disk every sync_ms. a file another process holds is not used.
+ *
+ * @param path save file
+ * @param sync_ms time between flushes, 0 for SAV_SYNC_MS
+ * @return int status
+ * @retval -1 failed, PRG-RAM is not saved
+ * @retval 0 OK
+ */
+int sav_init(const char *path, int sync_ms) {
+    if (sav_initialized) {
+        log_warn("sav already initialized.\n");
+        return 0;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        log_error("can't open save file: '%s'.\n", path);
+        return -1;
+    }
+    // a second emulator on the same file would overwrite the saves of this one
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        log_error("'%s' is in use by another process, PRG-RAM is not saved.\n", path);
+        close(fd);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (st.st_size < PRG_RAM_SZ && ftruncate(fd, PRG_RAM_SZ) < 0)) {
+        log_error("can't size save file: '%s'.\n", path);
+        close(fd);
+        return -1;
+    }
+    void *p = mmap(NULL, PRG_RAM_SZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        log_error("can't map save file: '%s'.\n", path);
+        close(fd);
+        return -1;
+    }
+    ram = (uint8_t *) p;
+
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&wake, &ca);
+    pthread_condattr_destroy(&ca);
+    interval = sync_ms > 0 ? sync_ms : SAV_SYNC_MS;
+    quit = 0;
+    flushes = 0;
+    atomic_store(&dirty, 0);
+    if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+        log_error("sav: can't start the flusher.\n");
+        pthread_cond_destroy(&wake);
+        munmap(ram, PRG_RAM_SZ);
+        close(fd);
+        return -1;
+    }
+
+    prgram_map(ram, &dirty);
+    sav_initialized = 1;
+    log_info("PRG-RAM saved to '%s'.\n", path);
+    return 0;
+}
+
+/**
+ * @brief stop saving PRG-RAM, call on the emulation thread
+ *
+ * what is left dirty is handed to the kernel with MS_ASYNC rather than
+ * waited for, it is in the page cache already and survives the process.
+ */
+void sav_deinit() {
+    if (!sav_initialized) return;
+    prgram_map(NULL, NULL);
+
+    pthread_mutex_lock(&lock);
+    quit = 1;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(flusher, NULL);
+    pthread_cond_destroy(&wake);
+
+    flush(MS_ASYNC);
+    munmap(ram, PRG_RAM_SZ);
+    close(fd);
+    ram = NULL;
+    fd = -1;
+    sav_initialized = 0;
+    log_info("sav: %u flushes.\n", flushes);
+}
+
+/**
+ * @brief get the save file of a ROM: the same path, with .sav in place of
+ * the extension
+ *
+ * @param dst output
+ * @param sz size of dst
+ * @param rom path of the ROM
+ * @return int status
+ * @retval -1 path too long
+ * @retval 0 OK
+ */
+int sav_path(char *dst, size_t sz, const char *rom) {
+    const char *slash = strrchr(rom, '/'), *dot = strrchr(rom, '.');
+    size_t len = (dot != NULL && (slash == NULL || dot > slash)) ? (size_t) (dot - rom) : strlen(rom);
+    if (len + sizeof(".sav") > sz) return -1;
+    memcpy(dst, rom, len);
+    strcpy(dst + len, ".sav");
+    return 0;
+}
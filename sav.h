@@ -0,0 +1,12 @@
+#ifndef NES_SAV_H
+#define NES_SAV_H
+#include <stdint.h>
+#include <unistd.h>
+
+#define SAV_SYNC_MS 1000 // default time between flushes of written PRG-RAM
+
+int sav_init(const char *path, int sync_ms);
+void sav_deinit();
+int sav_path(char *dst, size_t sz, const char *rom);
+
+#endif // NES_SAV_H
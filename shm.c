@@ -0,0 +1,114 @@
+#include "shm.h"
+#include "pal.h"
+#include "log.h"
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static int shm_initialized = 0;
+static shm_region_t *region;
+static char path[256];
+static uint64_t last_n; // frame number last published, + 1
+
+/**
+ * @brief create the shared-memory region that frames are published to
+ *
+ * @param name POSIX shm name, e.g. "/nes"
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int shm_init(const char *name) {
+    if (shm_initialized) shm_deinit();
+    if (name[0] != '/' || strlen(name) >= sizeof(path)) {
+        log_error("bad shm name: '%s'.\n", name);
+        return -1;
+    }
+
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+    if (fd < 0) {
+        log_error("can't open shm '%s'.\n", name);
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(shm_region_t)) < 0) {
+        log_error("can't size shm '%s'.\n", name);
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    void *p = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        log_error("can't map shm '%s'.\n", name);
+        shm_unlink(name);
+        return -1;
+    }
+
+    region = (shm_region_t *) p;
+    memset(region, 0, sizeof(shm_region_t));
+    region->version = SHM_VERSION;
+    region->slot_sz = sizeof(shm_slot_t);
+    region->nslots = SHM_SLOTS;
+    pal_init();
+    for (int e = 0; e < 8; e++) {
+        uint8_t idx[64];
+        for (int i = 0; i < 64; i++) idx[i] = i;
+        pal_argb8888(region->argb[e], idx, e, 64);
+    }
+    // readers check the magic last
+    atomic_thread_fence(memory_order_release);
+    memcpy(region->magic, SHM_MAGIC, 4);
+
+    strcpy(path, name);
+    last_n = 0;
+    shm_initialized = 1;
+    log_info("publishing frames to shm '%s'.\n", name);
+    return 0;
+}
+
+/**
+ * @brief unmap and remove the region, readers keep what they mapped
+ *
+ */
+void shm_deinit() {
+    if (!shm_initialized) return;
+    munmap(region, sizeof(shm_region_t));
+    shm_unlink(path);
+    region = NULL;
+    shm_initialized = 0;
+}
+
+/**
+ * @brief publish a completed frame, never waits for readers
+ *
+ * call after nes_frame(): a frame the PPU is still drawing would tear. a
+ * frame number already published is skipped.
+ *
+ * @param frame the frame
+ * @param ram work RAM, SHM_RAM_SZ bytes
+ * @param n frame number, ppu_frames()
+ */
+void shm_publish(const fb_t *frame, const uint8_t *ram, uint64_t n) {
+    if (!shm_initialized || n + 1 == last_n) return;
+    last_n = n + 1;
+
+    uint64_t latest = atomic_load_explicit(&region->latest, memory_order_relaxed);
+    shm_slot_t *s = &region->slot[latest % SHM_SLOTS];
+    uint32_t seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&s->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(s->idx, frame->idx, sizeof(s->idx));
+    memcpy(s->emph, frame->emph, sizeof(s->emph));
+    memcpy(s->ram, ram, SHM_RAM_SZ);
+    s->frame = n;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    s->t_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+    atomic_store_explicit(&s->seq, seq + 2, memory_order_release);
+    atomic_store_explicit(&region->latest, latest + 1, memory_order_release);
+}
@@ -0,0 +1,64 @@
+#ifndef NES_SHM_H
+#define NES_SHM_H
+#include <stdint.h>
+#include <stdatomic.h>
+#include "fb.h"
+
+#define SHM_MAGIC "NSHM"
+#define SHM_VERSION 1
+#define SHM_SLOTS 4 // frames a reader may hold in place before they are reused
+#define SHM_RAM_SZ 0x800
+
+/*
+ * one published frame. seq is a seqlock: odd while the emulator writes the
+ * slot, bumped by 2 when done. a reader takes seq, reads the slot in place
+ * and then takes seq again; the data is good if both are the same and even.
+ */
+typedef struct shm_slot {
+    _Atomic uint32_t seq;
+    uint32_t pad;
+    uint64_t frame; // frame number
+    uint64_t t_ns; // CLOCK_MONOTONIC when the frame was published
+    uint8_t idx[NES_H][NES_W]; // 6-bit palette index of every pixel
+    uint8_t emph[NES_H]; // color emphasis bits of every row
+    uint8_t ram[SHM_RAM_SZ]; // work RAM at the end of the frame
+} shm_slot_t;
+
+/* the shared-memory region, slots are written round robin */
+typedef struct shm_region {
+    char magic[4];
+    uint32_t version;
+    uint32_t slot_sz; // sizeof(shm_slot_t)
+    uint32_t nslots;
+    _Atomic uint64_t latest; // frames published so far, the newest is in slot (latest - 1) % nslots
+    uint32_t argb[8][64]; // palette for every emphasis, ARGB8888
+    shm_slot_t slot[SHM_SLOTS];
+} shm_region_t;
+
+/**
+ * @brief start reading a slot
+ *
+ * @param s the slot
+ * @return uint32_t sequence to pass to shm_read_retry
+ */
+static inline uint32_t shm_read_begin(const shm_slot_t *s) {
+    return atomic_load_explicit(&s->seq, memory_order_acquire);
+}
+
+/**
+ * @brief check that a slot was not written while it was read
+ *
+ * @param s the slot
+ * @param seq from shm_read_begin
+ * @return int 1 if what was read is torn and must be read again
+ */
+static inline int shm_read_retry(const shm_slot_t *s, uint32_t seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return (seq & 1) || atomic_load_explicit(&s->seq, memory_order_relaxed) != seq;
+}
+
+int shm_init(const char *name);
+void shm_deinit();
+void shm_publish(const fb_t *frame, const uint8_t *ram, uint64_t n);
+
+#endif // NES_SHM_H
@@ -0,0 +1,140 @@
+#include "shm.h"
+#include "log.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* reads the frames an emulator started with NES_SHM=<name> publishes */
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief write a slot as a binary PPM
+ *
+ * @param r the region
+ * @param s the slot, already read
+ * @param path output
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+static int save_ppm(const shm_region_t *r, const shm_slot_t *s, const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        log_error("can't open file: '%s'.\n", path);
+        return -1;
+    }
+    fprintf(f, "P6\n%d %d\n255\n", NES_W, NES_H);
+    for (int y = 0; y < NES_H; y++) {
+        uint8_t line[NES_W * 3];
+        for (int x = 0; x < NES_W; x++) {
+            uint32_t c = r->argb[s->emph[y] & 7][s->idx[y][x] & 0x3F];
+            line[x * 3] = c >> 16;
+            line[x * 3 + 1] = c >> 8;
+            line[x * 3 + 2] = c;
+        }
+        fwrite(line, sizeof(line), 1, f);
+    }
+    fclose(f);
+    return 0;
+}
+
+int main (int argc, char **argv) {
+    const char *name = NULL, *ppm = NULL;
+    double secs = 0;
+    long poll_us = 100;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:o:p:")) != -1) {
+        if (opt == 'b') secs = atof(optarg);
+        else if (opt == 'o') ppm = optarg;
+        else if (opt == 'p') poll_us = atol(optarg);
+        else optind = argc + 1;
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-b seconds] [-o frame.ppm] [-p poll_us] /name\n", argv[0]);
+        fprintf(stderr, "  -b  measure publish-to-read latency for a while and print JSON\n");
+        fprintf(stderr, "  -o  save the next frame and exit\n");
+        return 1;
+    }
+    name = argv[optind];
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        log_fatal("can't open shm '%s', is the emulator running with NES_SHM?\n", name);
+        return 1;
+    }
+    const shm_region_t *r = mmap(NULL, sizeof(shm_region_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r == MAP_FAILED || memcmp(r->magic, SHM_MAGIC, 4) || r->version != SHM_VERSION || r->slot_sz != sizeof(shm_slot_t)) {
+        log_fatal("'%s' is not a frame export.\n", name);
+        return 1;
+    }
+
+    size_t nlat = 0, cap = 4096;
+    uint64_t *lat = malloc(cap * sizeof(uint64_t));
+    uint64_t seen = atomic_load_explicit(&r->latest, memory_order_acquire);
+    uint64_t missed = 0, torn = 0, t_end = now_ns() + secs * 1e9;
+    struct timespec nap = { poll_us / 1000000, poll_us % 1000000 * 1000 };
+
+    for (;;) {
+        uint64_t latest = atomic_load_explicit(&r->latest, memory_order_acquire);
+        if (latest == seen) {
+            if (secs > 0 && now_ns() > t_end) break;
+            if (poll_us > 0) nanosleep(&nap, NULL);
+            continue;
+        }
+        missed += latest - seen - 1;
+        seen = latest;
+
+        // read in place; retry if the emulator lapped us
+        const shm_slot_t *s = &r->slot[(latest - 1) % r->nslots];
+        uint32_t seq;
+        uint64_t frame, t_ns, sum;
+        do {
+            seq = shm_read_begin(s);
+            frame = s->frame;
+            t_ns = s->t_ns;
+            sum = 0;
+            for (int i = 0; i < SHM_RAM_SZ; i++) sum += s->ram[i];
+            if (ppm != NULL && save_ppm(r, s, ppm) < 0) return 1;
+        } while (shm_read_retry(s, seq) && ++torn);
+        uint64_t d = now_ns() - t_ns;
+
+        if (ppm != NULL) {
+            printf("frame %llu saved to '%s'.\n", (unsigned long long) frame, ppm);
+            return 0;
+        } else if (secs > 0) {
+            if (nlat == cap) lat = realloc(lat, (cap *= 2) * sizeof(uint64_t));
+            lat[nlat++] = d;
+            if (now_ns() > t_end) break;
+        } else {
+            printf("frame %llu: %.1f us, ram sum %llu\n", (unsigned long long) frame, d / 1e3, (unsigned long long) sum);
+        }
+    }
+
+    if (nlat == 0) {
+        log_error("no frames in %.1fs.\n", secs);
+        return 1;
+    }
+    qsort(lat, nlat, sizeof(uint64_t), cmp_u64);
+    printf("{ \"frames\": %zu, \"missed\": %llu, \"torn\": %llu, \"poll_us\": %ld, "
+        "\"latency_us\": { \"min\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f } }\n",
+        nlat, (unsigned long long) missed, (unsigned long long) torn, poll_us,
+        lat[0] / 1e3, lat[nlat / 2] / 1e3, lat[nlat * 99 / 100] / 1e3, lat[nlat - 1] / 1e3);
+    free(lat);
+    return 0;
+}
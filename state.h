@@ -0,0 +1,15 @@
+#ifndef NES_STATE_H
+#define NES_STATE_H
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * save-state helpers. a module lists its state as an X-macro, e.g.
+ * #define CPU_STATE(X) X(acc) X(x) X(pc), and expands it with these in
+ * functions that declare size_t n = 0 and a buffer p. a NULL p only
+ * counts the size.
+ */
+#define STATE_SAVE(v) { if (p) memcpy(p + n, &(v), sizeof(v)); n += sizeof(v); }
+#define STATE_LOAD(v) { memcpy(&(v), p + n, sizeof(v)); n += sizeof(v); }
+
+#endif // NES_STATE_H
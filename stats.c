@@ -0,0 +1,220 @@
+#include "stats.h"
+#include "6502.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define UNIX_PREFIX "unix:"
+
+NES_TLS stats_t stats_cur;
+
+static NES_TLS stats_t last; // the last complete frame, in ns
+static NES_TLS stats_t acc; // the dump interval so far, in ns
+static NES_TLS uint64_t frames; // frames completed in total
+static NES_TLS uint64_t last_cycles, last_idle; // CPU counters at the last frame end
+static double ns_per_tick = 0;
+
+static int fd = -1;
+static int sock = 0;
+static uint32_t every = 60; // frames per dump
+static uint64_t dropped; // records a busy reader made us drop
+
+/**
+ * @brief measure stats_clock() against the monotonic clock
+ *
+ */
+static void calibrate() {
+    struct timespec a, b;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    uint64_t t0 = stats_clock(), t1;
+    double ns;
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &b);
+        t1 = stats_clock();
+        ns = (b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec);
+    } while (ns < 2e6);
+    ns_per_tick = t1 > t0 ? ns / (t1 - t0) : 1;
+}
+
+/**
+ * @brief start dumping counters as JSON lines
+ *
+ * @param dst file to append to, or "unix:<path>" for a listening socket
+ * @param n frames per record, 0 for 60
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int stats_open(const char *dst, uint32_t n) {
+    stats_close();
+    every = n ? n : 60;
+
+    if (strncmp(dst, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0) {
+        struct sockaddr_un sa;
+        const char *path = dst + strlen(UNIX_PREFIX);
+        if (strlen(path) >= sizeof(sa.sun_path)) {
+            log_error("stats: socket path too long: '%s'.\n", path);
+            return -1;
+        }
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strcpy(sa.sun_path, path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+            log_error("stats: can't connect to '%s': %s.\n", path, strerror(errno));
+            stats_close();
+            return -1;
+        }
+        sock = 1;
+    } else {
+        fd = open(dst, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            log_error("stats: can't open '%s': %s.\n", dst, strerror(errno));
+            return -1;
+        }
+        sock = 0;
+    }
+
+    memset(&acc, 0, sizeof(acc));
+    return 0;
+}
+
+/**
+ * @brief stop dumping counters
+ *
+ */
+void stats_close() {
+    if (fd >= 0) close(fd);
+    fd = -1;
+}
+
+/**
+ * @brief format counters as a single-line JSON object
+ *
+ * @param s counters
+ * @param out output
+ * @param sz size of out
+ * @return int length, -1 if out is too small
+ */
+int stats_json(const stats_t *s, char *out, size_t sz) {
+    char ppu[2][160];
+    const uint64_t *regs[2] = { s->ppu_reads, s->ppu_writes };
+    for (int i = 0; i < 2; i++) {
+        const uint64_t *r = regs[i];
+        snprintf(ppu[i], sizeof(ppu[i]), "[%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu]",
+            (unsigned long long) r[0], (unsigned long long) r[1], (unsigned long long) r[2],
+            (unsigned long long) r[3], (unsigned long long) r[4], (unsigned long long) r[5],
+            (unsigned long long) r[6], (unsigned long long) r[7]);
+    }
+
+    #define REGIONS(r) (unsigned long long) r[0], (unsigned long long) r[1], (unsigned long long) r[2], \
+        (unsigned long long) r[3], (unsigned long long) (r[4] + r[5] + r[6] + r[7])
+    int n = snprintf(out, sz, "{\"frame\":%llu,\"frames\":%u,\"insns\":%llu,\"cycles\":%llu,"
+        "\"idle_cycles\":%llu,\"jit\":{\"blocks\":%llu,\"cycles\":%llu},"
+        "\"reads\":{\"ram\":%llu,\"ppu\":%llu,\"io\":%llu,\"sram\":%llu,\"rom\":%llu},"
+        "\"writes\":{\"ram\":%llu,\"ppu\":%llu,\"io\":%llu,\"sram\":%llu,\"rom\":%llu},"
+        "\"ppu_reads\":%s,\"ppu_writes\":%s,\"lines\":{\"rendered\":%u,\"blank\":%u},\"dup_frames\":%u,"
+        "\"ns\":{\"cpu\":%llu,\"render\":%llu,\"present\":%llu,\"max_frame\":%llu},"
+        "\"ahead\":{\"frames\":%u,\"late\":%u,\"ns\":%llu},"
+        "\"audio\":{\"fill\":%u,\"underruns\":%u,\"overruns\":%u},\"dropped\":%llu}\n",
+        (unsigned long long) frames, s->frames, (unsigned long long) s->insns,
+        (unsigned long long) s->cycles, (unsigned long long) s->idle_cycles,
+        (unsigned long long) s->jit_blocks, (unsigned long long) s->jit_cycles,
+        REGIONS(s->reads), REGIONS(s->writes), ppu[0], ppu[1], s->lines_rendered, s->lines_blank,
+        s->dup_frames, (unsigned long long) s->t_cpu, (unsigned long long) s->t_render,
+        (unsigned long long) s->t_present, (unsigned long long) s->t_max,
+        s->ahead_frames, s->ahead_late, (unsigned long long) s->t_ahead,
+        s->audio_fill, s->audio_underruns, s->audio_overruns, (unsigned long long) dropped);
+    #undef REGIONS
+
+    return (n < 0 || (size_t) n >= sz) ? -1 : n;
+}
+
+/**
+ * @brief write the interval record, never blocks on a socket
+ *
+ */
+static void dump() {
+    char buf[1024];
+    int n = stats_json(&acc, buf, sizeof(buf));
+    if (n < 0) return;
+
+    ssize_t w = sock ? send(fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL) : write(fd, buf, n);
+    if (w == n) return;
+    if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        dropped++;
+        return;
+    }
+
+    // a partial record would corrupt the stream, give up on it
+    log_warn("stats: write failed, stopping: %s.\n", w < 0 ? strerror(errno) : "short write");
+    stats_close();
+}
+
+/**
+ * @brief close the current frame: convert, aggregate and maybe dump it
+ *
+ * call once per frame, after setting the audio fields of stats_cur.
+ */
+void stats_end_frame() {
+    if (ns_per_tick == 0) calibrate();
+
+    uint64_t c = cycles_6502(), i = idle_cycles_6502();
+    stats_t *s = &stats_cur;
+    s->frames = 1;
+    s->cycles = c - last_cycles;
+    s->idle_cycles = i - last_idle;
+    last_cycles = c;
+    last_idle = i;
+
+    // presentation runs inside the PPU's end of frame
+    s->t_render = s->t_render > s->t_present ? s->t_render - s->t_present : 0;
+    s->t_cpu *= ns_per_tick;
+    s->t_render *= ns_per_tick;
+    s->t_present *= ns_per_tick;
+    s->t_ahead *= ns_per_tick;
+    s->t_max = s->t_cpu + s->t_render + s->t_present;
+    last = *s;
+    frames++;
+
+    if (fd >= 0) {
+        uint64_t *a = (uint64_t *) &acc.insns, *b = (uint64_t *) &s->insns;
+        for (; b <= &s->ppu_writes[7]; a++, b++) *a += *b;
+        acc.frames++;
+        acc.lines_rendered += s->lines_rendered;
+        acc.lines_blank += s->lines_blank;
+        acc.dup_frames += s->dup_frames;
+        acc.t_cpu += s->t_cpu;
+        acc.t_render += s->t_render;
+        acc.t_present += s->t_present;
+        if (s->t_max > acc.t_max) acc.t_max = s->t_max;
+        acc.ahead_frames += s->ahead_frames;
+        acc.ahead_late += s->ahead_late;
+        acc.t_ahead += s->t_ahead;
+        acc.audio_fill = s->audio_fill;
+        acc.audio_underruns = s->audio_underruns;
+        acc.audio_overruns = s->audio_overruns;
+
+        if (acc.frames >= every) {
+            dump();
+            memset(&acc, 0, sizeof(acc));
+        }
+    }
+
+    memset(s, 0, sizeof(*s));
+}
+
+/**
+ * @brief get the counters of the last complete frame, times in ns
+ *
+ * @return const stats_t* counters
+ */
+const stats_t *stats_last() {
+    return &last;
+}
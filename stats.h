@@ -0,0 +1,97 @@
+#ifndef NES_STATS_H
+#define NES_STATS_H
+#include <stdint.h>
+#include <time.h>
+#include "types.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* CPU address space regions, as counted (addr >> 13) */
+#define STATS_REGIONS 8
+
+/**
+ * @brief counters of one frame, or of a dump interval
+ *
+ */
+typedef struct stats stats_t;
+struct stats {
+    // frames covered
+    uint32_t frames;
+
+    // instructions run by the interpreter. insns to ppu_writes are all
+    // uint64_t, stats_end_frame sums them as an array
+    uint64_t insns;
+
+    // CPU cycles, including the ones skipped
+    uint64_t cycles;
+
+    // cycles skipped by the idle loop detection
+    uint64_t idle_cycles;
+
+    // blocks and cycles run by the recompiler
+    uint64_t jit_blocks;
+    uint64_t jit_cycles;
+
+    // interpreter bus accesses by region: $0000 RAM, $2000 PPU, $4000 I/O,
+    // $6000 SRAM, $8000-$E000 ROM
+    uint64_t reads[STATS_REGIONS];
+    uint64_t writes[STATS_REGIONS];
+
+    // PPU register accesses by register
+    uint64_t ppu_reads[8];
+    uint64_t ppu_writes[8];
+
+    // visible scanlines with rendering on, and with both layers off
+    uint32_t lines_rendered;
+    uint32_t lines_blank;
+
+    // frames identical to the one before, by hash
+    uint32_t dup_frames;
+
+    // host time in ns: CPU, PPU rendering, presentation
+    uint64_t t_cpu;
+    uint64_t t_render;
+    uint64_t t_present;
+
+    // worst frame of the interval, t_cpu + t_render + t_present
+    uint64_t t_max;
+
+    // frames run ahead and thrown away, frames shown without a fresh one,
+    // and host time in ns on them (also in t_cpu and t_render when run on
+    // this thread, the wait for the other one otherwise), see runahead.h
+    uint32_t ahead_frames;
+    uint32_t ahead_late;
+    uint64_t t_ahead;
+
+    // audio ring fill and its total counters at the end of the frame
+    uint32_t audio_fill;
+    uint32_t audio_underruns;
+    uint32_t audio_overruns;
+};
+
+/* counters of the frame in progress, times in stats_clock() ticks */
+extern NES_TLS stats_t stats_cur;
+
+/**
+ * @brief cheap timestamp, in ticks
+ *
+ * @return uint64_t ticks
+ */
+static inline uint64_t stats_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+int stats_open(const char *dst, uint32_t every);
+void stats_close();
+void stats_end_frame();
+const stats_t *stats_last();
+int stats_json(const stats_t *s, char *out, size_t sz);
+
+#endif // NES_STATS_H
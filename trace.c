@@ -0,0 +1,235 @@
+#include "trace.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+
+NES_TLS uint8_t trace_on = 0; // checked by the CPU before every instruction
+
+static NES_TLS int trace_initialized = 0;
+static NES_TLS trace_rec_t *ring;
+static NES_TLS size_t mask;
+static NES_TLS uint64_t count; // records written in total
+
+/* addressing modes, for the disassembly */
+enum { T_IMP, T_ACC, T_IMM, T_ZPG, T_ZPX, T_ZPY, T_ABS, T_ABX, T_ABY, T_IND, T_INX, T_INY, T_REL };
+
+static const uint8_t t_len[] = {
+    [T_IMP] = 1, [T_ACC] = 1, [T_IMM] = 2, [T_ZPG] = 2, [T_ZPX] = 2, [T_ZPY] = 2, [T_ABS] = 3,
+    [T_ABX] = 3, [T_ABY] = 3, [T_IND] = 3, [T_INX] = 2, [T_INY] = 2, [T_REL] = 2
+};
+
+/* mnemonics as in nestest.log, unofficial opcodes marked with '*' */
+static const char *t_name[0x100] = {
+    "BRK", "ORA", "???", "*SLO", "*NOP", "ORA", "ASL", "*SLO", "PHP", "ORA", "ASL", "*ANC", "*NOP", "ORA", "ASL", "*SLO",
+    "BPL", "ORA", "???", "*SLO", "*NOP", "ORA", "ASL", "*SLO", "CLC", "ORA", "*NOP", "*SLO", "*NOP", "ORA", "ASL", "*SLO",
+    "JSR", "AND", "???", "*RLA", "BIT", "AND", "ROL", "*RLA", "PLP", "AND", "ROL", "*ANC", "BIT", "AND", "ROL", "*RLA",
+    "BMI", "AND", "???", "*RLA", "*NOP", "AND", "ROL", "*RLA", "SEC", "AND", "*NOP", "*RLA", "*NOP", "AND", "ROL", "*RLA",
+    "RTI", "EOR", "???", "*SRE", "*NOP", "EOR", "LSR", "*SRE", "PHA", "EOR", "LSR", "*ASR", "JMP", "EOR", "LSR", "*SRE",
+    "BVC", "EOR", "???", "*SRE", "*NOP", "EOR", "LSR", "*SRE", "CLI", "EOR", "*NOP", "*SRE", "*NOP", "EOR", "LSR", "*SRE",
+    "RTS", "ADC", "???", "*RRA", "*NOP", "ADC", "ROR", "*RRA", "PLA", "ADC", "ROR", "*ARR", "JMP", "ADC", "ROR", "*RRA",
+    "BVS", "ADC", "???", "*RRA", "*NOP", "ADC", "ROR", "*RRA", "SEI", "ADC", "*NOP", "*RRA", "*NOP", "ADC", "ROR", "*RRA",
+    "*NOP", "STA", "*NOP", "*SAX", "STY", "STA", "STX", "*SAX", "DEY", "*NOP", "TXA", "*XAA", "STY", "STA", "STX", "*SAX",
+    "BCC", "STA", "???", "*AHX", "STY", "STA", "STX", "*SAX", "TYA", "STA", "TXS", "*TAS", "*SHY", "STA", "*SHX", "*AHX",
+    "LDY", "LDA", "LDX", "*LAX", "LDY", "LDA", "LDX", "*LAX", "TAY", "LDA", "TAX", "*LAX", "LDY", "LDA", "LDX", "*LAX",
+    "BCS", "LDA", "???", "*LAX", "LDY", "LDA", "LDX", "*LAX", "CLV", "LDA", "TSX", "*LAS", "LDY", "LDA", "LDX", "*LAX",
+    "CPY", "CMP", "*NOP", "*DCP", "CPY", "CMP", "DEC", "*DCP", "INY", "CMP", "DEX", "*AXS", "CPY", "CMP", "DEC", "*DCP",
+    "BNE", "CMP", "???", "*DCP", "*NOP", "CMP", "DEC", "*DCP", "CLD", "CMP", "*NOP", "*DCP", "*NOP", "CMP", "DEC", "*DCP",
+    "CPX", "SBC", "*NOP", "*ISB", "CPX", "SBC", "INC", "*ISB", "INX", "SBC", "NOP", "*SBC", "CPX", "SBC", "INC", "*ISB",
+    "BEQ", "SBC", "???", "*ISB", "*NOP", "SBC", "INC", "*ISB", "SED", "SBC", "*NOP", "*ISB", "*NOP", "SBC", "INC", "*ISB",
+};
+
+static const uint8_t t_am[0x100] = {
+    T_IMP, T_INX, T_IMP, T_INX, T_ZPG, T_ZPG, T_ZPG, T_ZPG, T_IMP, T_IMM, T_ACC, T_IMM, T_ABS, T_ABS, T_ABS, T_ABS,
+    T_REL, T_INY, T_IMP, T_INY, T_ZPX, T_ZPX, T_ZPX, T_ZPX, T_IMP, T_ABY, T_IMP, T_ABY, T_ABX, T_ABX, T_ABX, T_ABX,
+    T_ABS, T_INX, T_IMP, T_INX, T_ZPG, T_ZPG, T_ZPG, T_ZPG, T_IMP, T_IMM, T_ACC, T_IMM, T_ABS, T_ABS, T_ABS, T_ABS,
+    T_REL, T_INY, T_IMP, T_INY, T_ZPX, T_ZPX, T_ZPX, T_ZPX, T_IMP, T_ABY, T_IMP, T_ABY, T_ABX, T_ABX, T_ABX, T_ABX,
+    T_IMP, T_INX, T_IMP, T_INX, T_ZPG, T_ZPG, T_ZPG, T_ZPG, T_IMP, T_IMM, T_ACC, T_IMM, T_ABS, T_ABS, T_ABS, T_ABS,
+    T_REL, T_INY, T_IMP, T_INY, T_ZPX, T_ZPX, T_ZPX, T_ZPX, T_IMP, T_ABY, T_IMP, T_ABY, T_ABX, T_ABX, T_ABX, T_ABX,
+    T_IMP, T_INX, T_IMP, T_INX, T_ZPG, T_ZPG, T_ZPG, T_ZPG, T_IMP, T_IMM, T_ACC, T_IMM, T_IND, T_ABS, T_ABS, T_ABS,
+    T_REL, T_INY, T_IMP, T_INY, T_ZPX, T_ZPX, T_ZPX, T_ZPX, T_IMP, T_ABY, T_IMP, T_ABY, T_ABX, T_ABX, T_ABX, T_ABX,
+    T_IMM, T_INX, T_IMM, T_INX, T_ZPG, T_ZPG, T_ZPG, T_ZPG, T_IMP, T_IMM, T_IMP, T_IMM, T_ABS, T_ABS, T_ABS, T_ABS,
+    T_REL, T_INY, T_IMP, T_INY, T_ZPX, T_ZPX, T_ZPY, T_ZPY, T_IMP, T_ABY, T_IMP, T_ABY, T_ABX, T_ABX, T_ABY, T_ABY,
+    T_IMM, T_INX, T_IMM, T_INX, T_ZPG, T_ZPG, T_ZPG, T_ZPG, T_IMP, T_IMM, T_IMP, T_IMM, T_ABS, T_ABS, T_ABS, T_ABS,
+    T_REL, T_INY, T_IMP, T_INY, T_ZPX, T_ZPX, T_ZPY, T_ZPY, T_IMP, T_ABY, T_IMP, T_ABY, T_ABX, T_ABX, T_ABY, T_ABY,
+    T_IMM, T_INX, T_IMM, T_INX, T_ZPG, T_ZPG, T_ZPG, T_ZPG, T_IMP, T_IMM, T_IMP, T_IMM, T_ABS, T_ABS, T_ABS, T_ABS,
+    T_REL, T_INY, T_IMP, T_INY, T_ZPX, T_ZPX, T_ZPX, T_ZPX, T_IMP, T_ABY, T_IMP, T_ABY, T_ABX, T_ABX, T_ABX, T_ABX,
+    T_IMM, T_INX, T_IMM, T_INX, T_ZPG, T_ZPG, T_ZPG, T_ZPG, T_IMP, T_IMM, T_IMP, T_IMM, T_ABS, T_ABS, T_ABS, T_ABS,
+    T_REL, T_INY, T_IMP, T_INY, T_ZPX, T_ZPX, T_ZPX, T_ZPX, T_IMP, T_ABY, T_IMP, T_ABY, T_ABX, T_ABX, T_ABX, T_ABX,
+};
+
+/**
+ * @brief allocate the trace ring
+ * 
+ * @param n num of records, rounded up to a power of 2
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int trace_init(size_t n) {
+    if (trace_initialized == 1) {
+        log_warn("trace already initialized.\n");
+        return 0;
+    }
+
+    size_t sz = 1;
+    while (sz < n) sz <<= 1;
+
+    ring = calloc(sz, sizeof(trace_rec_t));
+    if (ring == NULL) {
+        log_error("can't allocate %zu trace records.\n", sz);
+        return -1;
+    }
+
+    mask = sz - 1;
+    count = 0;
+    trace_initialized = 1;
+
+    return 0;
+}
+
+/**
+ * @brief free the trace ring
+ * 
+ */
+void trace_deinit() {
+    trace_on = 0;
+    free(ring);
+    ring = NULL;
+    trace_initialized = 0;
+}
+
+/**
+ * @brief start or stop recording
+ * 
+ * @param on 1 to record
+ */
+void trace_enable(int on) {
+    trace_on = on && trace_initialized == 1;
+}
+
+/**
+ * @brief get the next record to fill, overwriting the oldest
+ * 
+ * @return trace_rec_t* record
+ */
+inline trace_rec_t *trace_next() {
+    return &ring[count++ & mask];
+}
+
+/**
+ * @brief get num of records written in total
+ * 
+ * @return uint64_t count
+ */
+uint64_t trace_count() {
+    return count;
+}
+
+/**
+ * @brief get a record by its sequence number
+ * 
+ * @param i sequence number
+ * @return const trace_rec_t* record, NULL if not (or no longer) in the ring
+ */
+const trace_rec_t *trace_get(uint64_t i) {
+    if (trace_initialized != 1 || i >= count || count - i > mask + 1) return NULL;
+    return &ring[i & mask];
+}
+
+/**
+ * @brief write the ring to a file, oldest record first
+ * 
+ * @param path file
+ * @return int status
+ * @retval -1 failed
+ * @retval 0 OK
+ */
+int trace_save(const char *path) {
+    if (trace_initialized != 1) return -1;
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        log_error("can't open '%s'.\n", path);
+        return -1;
+    }
+
+    uint64_t first = count > mask + 1 ? count - (mask + 1) : 0;
+    trace_hdr_t hdr = { TRACE_MAGIC, TRACE_VERSION, count - first };
+    memcpy(hdr.magic, TRACE_MAGIC, 4);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    // at most two runs, split where the ring wraps
+    size_t start = first & mask, n = count - first;
+    size_t n1 = n < mask + 1 - start ? n : mask + 1 - start;
+    fwrite(ring + start, sizeof(trace_rec_t), n1, f);
+    fwrite(ring, sizeof(trace_rec_t), n - n1, f);
+
+    if (fclose(f) != 0) {
+        log_error("failed to write '%s'.\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief format a record as a nestest.log line
+ * 
+ * memory operands are not part of the record, so the "= xx" annotations of
+ * nestest.log are left out.
+ * 
+ * @param r record
+ * @param out output
+ * @param sz size of output
+ * @return int length, as snprintf
+ */
+int trace_format(const trace_rec_t *r, char *out, size_t sz) {
+    uint8_t am = t_am[r->op];
+    const char *name = t_name[r->op];
+    uint16_t w = r->b1 | (uint16_t) r->b2 << 8;
+    char bytes[12], dis[40], field[48];
+
+    switch (t_len[am]) {
+        case 1: snprintf(bytes, sizeof(bytes), "%02X", r->op); break;
+        case 2: snprintf(bytes, sizeof(bytes), "%02X %02X", r->op, r->b1); break;
+        default: snprintf(bytes, sizeof(bytes), "%02X %02X %02X", r->op, r->b1, r->b2); break;
+    }
+
+    switch (am) {
+        case T_ACC: snprintf(dis, sizeof(dis), "%s A", name); break;
+        case T_IMM: snprintf(dis, sizeof(dis), "%s #$%02X", name, r->b1); break;
+        case T_ZPG: snprintf(dis, sizeof(dis), "%s $%02X", name, r->b1); break;
+        case T_ZPX: snprintf(dis, sizeof(dis), "%s $%02X,X", name, r->b1); break;
+        case T_ZPY: snprintf(dis, sizeof(dis), "%s $%02X,Y", name, r->b1); break;
+        case T_ABS: snprintf(dis, sizeof(dis), "%s $%04X", name, w); break;
+        case T_ABX: snprintf(dis, sizeof(dis), "%s $%04X,X", name, w); break;
+        case T_ABY: snprintf(dis, sizeof(dis), "%s $%04X,Y", name, w); break;
+        case T_IND: snprintf(dis, sizeof(dis), "%s ($%04X)", name, w); break;
+        case T_INX: snprintf(dis, sizeof(dis), "%s ($%02X,X)", name, r->b1); break;
+        case T_INY: snprintf(dis, sizeof(dis), "%s ($%02X),Y", name, r->b1); break;
+        case T_REL: snprintf(dis, sizeof(dis), "%s $%04X", name, (uint16_t) (r->pc + 2 + (int8_t) r->b1)); break;
+        default: snprintf(dis, sizeof(dis), "%s", name); break;
+    }
+
+    // unofficial opcodes start one column early
+    snprintf(field, sizeof(field), "%s%s", dis[0] == '*' ? "" : " ", dis);
+    return snprintf(out, sz, "%04X  %-8s %-32s A:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3u,%3u CYC:%llu",
+        r->pc, bytes, field, r->a, r->x, r->y, r->p, r->sp, r->line, r->dot, (unsigned long long) r->cycle);
+}
+
+/**
+ * @brief print records as nestest.log lines
+ * 
+ * @param f output
+ * @param from first sequence number
+ * @param to end sequence number, exclusive
+ */
+void trace_print(FILE *f, uint64_t from, uint64_t to) {
+    char line[128];
+    for (uint64_t i = from; i < to; i++) {
+        const trace_rec_t *r = trace_get(i);
+        if (r == NULL) continue;
+        trace_format(r, line, sizeof(line));
+        fprintf(f, "%s\n", line);
+    }
+}
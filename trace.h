@@ -0,0 +1,41 @@
+#ifndef NES_TRACE_H
+#define NES_TRACE_H
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "types.h"
+
+#define TRACE_MAGIC "NTRC"
+#define TRACE_VERSION 1
+
+/* state before an instruction executes */
+typedef struct trace_rec {
+    uint64_t cycle;
+    uint16_t pc;
+    uint16_t line; // PPU scanline
+    uint16_t dot; // PPU dot
+    uint8_t op, b1, b2; // opcode and operand bytes
+    uint8_t a, x, y, p, sp;
+    uint8_t pad[3];
+} trace_rec_t;
+
+/* file header, followed by count records, oldest first */
+typedef struct trace_hdr {
+    char magic[4];
+    uint32_t version;
+    uint64_t count;
+} trace_hdr_t;
+
+extern NES_TLS uint8_t trace_on;
+
+int trace_init(size_t n);
+void trace_deinit();
+void trace_enable(int on);
+trace_rec_t *trace_next();
+uint64_t trace_count();
+const trace_rec_t *trace_get(uint64_t i);
+int trace_save(const char *path);
+int trace_format(const trace_rec_t *r, char *out, size_t sz);
+void trace_print(FILE *f, uint64_t from, uint64_t to);
+
+#endif // NES_TRACE_H
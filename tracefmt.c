@@ -0,0 +1,42 @@
+#include "trace.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+
+/* convert a binary trace (NES_TRACE) to nestest.log text */
+int main (int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace.bin [out.log]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        log_fatal("can't open file: '%s'.\n", argv[1]);
+        return 1;
+    }
+
+    FILE *out = argc > 2 ? fopen(argv[2], "w") : stdout;
+    if (out == NULL) {
+        log_fatal("can't open file: '%s'.\n", argv[2]);
+        return 1;
+    }
+
+    trace_hdr_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, TRACE_MAGIC, 4) || hdr.version != TRACE_VERSION) {
+        log_fatal("'%s' is not a trace.\n", argv[1]);
+        return 1;
+    }
+
+    trace_rec_t r;
+    char line[128];
+    for (uint64_t i = 0; i < hdr.count && fread(&r, sizeof(r), 1, in) == 1; i++) {
+        trace_format(&r, line, sizeof(line));
+        fprintf(out, "%s\n", line);
+    }
+
+    fclose(in);
+    if (out != stdout) fclose(out);
+
+    return 0;
+}
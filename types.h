@@ -3,6 +3,9 @@
 #include <stdint.h>
 #define NES_MAGIC "NES\x1a"
 
+/* console state is per thread, so each thread can run its own console */
+#define NES_TLS _Thread_local
+
 /**
  * @brief raw nes file header
  * 
@@ -72,6 +75,12 @@ struct nes_meta {
 
     // nes2.0
     uint8_t nes20;
+
+    // NES_FIX_* done to the header
+    uint8_t fixes;
 };
 
+#define NES_FIX_PADDING 1 // junk in bytes 7-15 (e.g. "DiskDude!"), byte 7 ignored
+#define NES_FIX_GAMEDB 2 // mapper or mirroring from the game database
+
 #endif // NES_TYPES_H
\ No newline at end of file